@@ -0,0 +1,131 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @file client_list_bench.c
+  @brief Measures client list lookup and counter sweep cost
+
+  Builds a client list of increasing size and times the lookups done by
+  the auth, wdctl and counter update paths. The "sweep" figure is the cost
+  of one iptables_fw_counters_update() pass over the list, i.e. one lookup
+  by IP per client.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o client_list_bench client_list_bench.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "client_list.h"
+
+#define LOOKUPS 100000
+
+static double
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void
+make_keys(int i, uint32_t * ip, t_mac * mac, char *token)
+{
+    *ip = htonl(0x0a000000 | i);
+    mac->addr[0] = 0x02;
+    mac->addr[1] = mac->addr[2] = 0;
+    mac->addr[3] = (i >> 16) & 0xff;
+    mac->addr[4] = (i >> 8) & 0xff;
+    mac->addr[5] = i & 0xff;
+    sprintf(token, "%032x", i * 2654435761u);
+}
+
+static void
+bench(int n)
+{
+    uint32_t ip;
+    t_mac mac;
+    char token[33];
+    double start, by_ip, by_mac, by_token, sweep;
+    int i, k, found = 0;
+
+    client_list_init();
+    for (i = 0; i < n; i++) {
+        make_keys(i, &ip, &mac, token);
+        client_list_add(ip, &mac, token);
+    }
+
+    start = now_us();
+    for (k = 0; k < LOOKUPS; k++) {
+        make_keys(k % n, &ip, &mac, token);
+        found += client_list_find_by_ip(ip) != NULL;
+    }
+    by_ip = (now_us() - start) / LOOKUPS;
+
+    start = now_us();
+    for (k = 0; k < LOOKUPS; k++) {
+        make_keys(k % n, &ip, &mac, token);
+        found += client_list_find_by_mac(&mac) != NULL;
+    }
+    by_mac = (now_us() - start) / LOOKUPS;
+
+    start = now_us();
+    for (k = 0; k < LOOKUPS; k++) {
+        make_keys(k % n, &ip, &mac, token);
+        found += client_list_find_by_token(token) != NULL;
+    }
+    by_token = (now_us() - start) / LOOKUPS;
+
+    start = now_us();
+    for (i = 0; i < n; i++) {
+        make_keys(i, &ip, &mac, token);
+        found += client_list_find_by_ip(ip) != NULL;
+    }
+    sweep = (now_us() - start) / 1000.0;
+
+    printf("%7d clients: by_ip %8.3f us  by_mac %8.3f us  by_token %8.3f us  sweep %10.3f ms  (%d hits)\n",
+           n, by_ip, by_mac, by_token, sweep, found);
+
+    while (client_get_first_client() != NULL)
+        client_list_delete(client_get_first_client());
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int sizes[] = { 100, 1000, 10000, 50000 };
+    unsigned int i;
+
+    debugconf.debuglevel = LOG_ERR;
+
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+        bench(sizes[i]);
+
+    return 0;
+}
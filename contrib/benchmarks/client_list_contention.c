@@ -0,0 +1,179 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @file client_list_contention.c
+  @brief Measures client list lock contention during a login burst
+
+  Many threads log clients in, read the status and log them out again, the
+  way http_callback_auth, wdctl status and logout do. Each login and logout
+  also pays a simulated firewall update (default 1000us, roughly one fork and
+  exec of iptables).
+
+  Two modes are timed with the same threads:
+  - global: the firewall update is done while holding LOCK_CLIENT_LIST, as
+    when a single mutex protected the list;
+  - sharded: only the client's shard is locked, and the firewall update is
+    done after releasing it.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o client_list_contention client_list_contention.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+
+  Usage: ./client_list_contention [firewall_us]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "client_list.h"
+
+#define ROUNDS 10
+
+static int firewall_us = 1000;
+static int global_mode;
+
+static double
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void
+firewall_update(void)
+{
+    if (firewall_us > 0)
+        usleep(firewall_us);
+}
+
+static void *
+worker(void *arg)
+{
+    int n = (int)(long)arg;
+    uint32_t ip;
+    t_mac mac;
+    char token[33];
+    t_client *client;
+    t_client_snapshot *snapshot;
+    int round;
+
+    ip = htonl(0x0a000000 | n);
+    mac.addr[0] = 0x02;
+    mac.addr[1] = mac.addr[2] = 0;
+    mac.addr[3] = (n >> 16) & 0xff;
+    mac.addr[4] = (n >> 8) & 0xff;
+    mac.addr[5] = n & 0xff;
+    sprintf(token, "%032x", n * 2654435761u);
+
+    for (round = 0; round < ROUNDS; round++) {
+        /* Login */
+        if (global_mode) {
+            LOCK_CLIENT_LIST();
+            if (NULL == client_list_find(ip, &mac))
+                client_list_add(ip, &mac, token);
+            firewall_update();
+            UNLOCK_CLIENT_LIST();
+        } else {
+            LOCK_CLIENT_SHARD(&mac);
+            if (NULL == client_list_find(ip, &mac))
+                client_list_add(ip, &mac, token);
+            UNLOCK_CLIENT_SHARD(&mac);
+            firewall_update();
+        }
+
+        /* Status */
+        snapshot = client_list_snapshot();
+        client_list_snapshot_release(snapshot);
+
+        /* Logout */
+        if (global_mode) {
+            LOCK_CLIENT_LIST();
+            if (NULL != (client = client_list_find_by_mac(&mac))) {
+                client_list_remove(client);
+                firewall_update();
+                client_free_node(client);
+            }
+            UNLOCK_CLIENT_LIST();
+        } else {
+            LOCK_CLIENT_SHARD(&mac);
+            if (NULL != (client = client_list_find_by_mac(&mac)))
+                client_list_remove(client);
+            UNLOCK_CLIENT_SHARD(&mac);
+            if (NULL != client) {
+                firewall_update();
+                client_free_node(client);
+            }
+        }
+    }
+    return NULL;
+}
+
+static double
+run(int threads)
+{
+    pthread_t *tids = malloc(threads * sizeof(pthread_t));
+    double start;
+    int i;
+
+    start = now_us();
+    for (i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, worker, (void *)(long)i);
+    for (i = 0; i < threads; i++)
+        pthread_join(tids[i], NULL);
+    free(tids);
+    return (now_us() - start) / 1000.0;
+}
+
+int
+main(int argc, char **argv)
+{
+    static const int threads[] = { 1, 8, 32, 200 };
+    double global_ms, sharded_ms;
+    unsigned int i;
+
+    if (argc > 1)
+        firewall_us = atoi(argv[1]);
+
+    debugconf.debuglevel = LOG_ERR;
+    client_list_init();
+
+    printf("%d login/status/logout rounds per thread, firewall update %d us\n", ROUNDS, firewall_us);
+    for (i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        global_mode = 1;
+        global_ms = run(threads[i]);
+        global_mode = 0;
+        sharded_ms = run(threads[i]);
+        printf("%4d threads: global %9.1f ms (%8.0f logins/s)  sharded %9.1f ms (%8.0f logins/s)\n",
+               threads[i], global_ms, threads[i] * ROUNDS * 1000.0 / global_ms,
+               sharded_ms, threads[i] * ROUNDS * 1000.0 / sharded_ms);
+    }
+
+    return 0;
+}
@@ -0,0 +1,284 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+
+/** @file client_pool_bench.c
+  @brief Measures the memory the client list costs, before and after the
+  client pool
+
+  Runs the same workload, each in a process of its own, with two client
+  layouts:
+
+  - strdup: a malloc'ed client plus strdup() of its IP, MAC and token, as
+    client_list_add() and client_dup() did before the client pool.
+  - pool: t_client from the client pool with its fields inline, through
+    client_get_new(), client_dup() and client_free_node().
+
+  Neither puts the clients on the client list, whose indexes cost the same
+  with both layouts.
+
+  The workload adds the clients, then does 20 rounds of a copy of the whole
+  list, as a sync cycle or status request did, and of churn: 10% of the
+  clients leave and as many new ones log in. It prints the calls to the
+  allocator, the heap in use and the resident set size once the clients
+  are added and after the rounds.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o client_pool_bench client_pool_bench.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+
+  Allocations are counted by wrapping the glibc allocator.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <malloc.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "safe.h"
+#include "util.h"
+#include "client_list.h"
+
+#define ROUNDS 20
+
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+extern void __libc_free(void *);
+
+static unsigned long allocations = 0;
+
+void *
+malloc(size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t n, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+/* The client before the client pool */
+typedef struct _old_client {
+    struct _old_client *next;
+    unsigned long long id;
+    int fw_connection_state;
+    int fd;
+    char *ip;
+    char *mac;
+    t_counters counters;
+    char *token;
+} old_client;
+
+static void
+make_keys(int i, uint32_t * ip, t_mac * mac, char *token)
+{
+    *ip = htonl(0x0a000000 | i);
+    mac->addr[0] = 0x02;
+    mac->addr[1] = mac->addr[2] = 0;
+    mac->addr[3] = (i >> 16) & 0xff;
+    mac->addr[4] = (i >> 8) & 0xff;
+    mac->addr[5] = i & 0xff;
+    sprintf(token, "%032x", i * 2654435761u);
+}
+
+static long
+rss_kb(void)
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+
+    if (NULL != f) {
+        if (fscanf(f, "%ld %ld", &pages, &resident) != 2)
+            resident = 0;
+        fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void
+report(const char *layout, const char *when, int n)
+{
+    struct mallinfo2 mi = mallinfo2();
+
+    printf("%7d %8s %12s %12lu %12zu %10ld\n", n, layout, when, allocations, mi.uordblks / 1024, rss_kb());
+}
+
+static old_client *
+old_new(int i)
+{
+    old_client *client = safe_malloc(sizeof(old_client));
+    char ipstr[IP_STR_LEN], macstr[MAC_STR_LEN], token[33];
+    uint32_t ip;
+    t_mac mac;
+
+    make_keys(i, &ip, &mac, token);
+    memset(client, 0, sizeof(old_client));
+    client->id = i;
+    client->ip = safe_strdup(format_ip(ip, ipstr));
+    client->mac = safe_strdup(format_mac(&mac, macstr));
+    client->token = safe_strdup(token);
+    return client;
+}
+
+static old_client *
+old_dup(const old_client * src)
+{
+    old_client *client = safe_malloc(sizeof(old_client));
+
+    *client = *src;
+    client->next = NULL;
+    client->ip = safe_strdup(src->ip);
+    client->mac = safe_strdup(src->mac);
+    client->token = safe_strdup(src->token);
+    return client;
+}
+
+static void
+old_free(old_client * client)
+{
+    free(client->ip);
+    free(client->mac);
+    free(client->token);
+    free(client);
+}
+
+static void
+run_strdup(int n)
+{
+    old_client **clients = safe_malloc(n * sizeof(old_client *));
+    old_client *copy, *next;
+    int i, r, next_id = n;
+
+    for (i = 0; i < n; i++)
+        clients[i] = old_new(i);
+    report("strdup", "added", n);
+
+    for (r = 0; r < ROUNDS; r++) {
+        copy = NULL;
+        for (i = 0; i < n; i++) {
+            next = old_dup(clients[i]);
+            next->next = copy;
+            copy = next;
+        }
+        for (; NULL != copy; copy = next) {
+            next = copy->next;
+            old_free(copy);
+        }
+        for (i = r % 10; i < n; i += 10) {
+            old_free(clients[i]);
+            clients[i] = old_new(next_id++);
+        }
+    }
+    report("strdup", "after rounds", n);
+}
+
+static t_client *
+pool_new(int i)
+{
+    t_client *client = client_get_new();
+    char token[33];
+
+    make_keys(i, &client->ip, &client->mac, token);
+    client->id = i;
+    client_set_token(client, token);
+    return client;
+}
+
+static void
+run_pool(int n)
+{
+    t_client **clients = safe_malloc(n * sizeof(t_client *));
+    t_client *copy, *next;
+    int i, r, next_id = n;
+
+    for (i = 0; i < n; i++)
+        clients[i] = pool_new(i);
+    report("pool", "added", n);
+
+    for (r = 0; r < ROUNDS; r++) {
+        copy = NULL;
+        for (i = 0; i < n; i++) {
+            next = client_dup(clients[i]);
+            next->next = copy;
+            copy = next;
+        }
+        client_list_destroy(copy);
+        for (i = r % 10; i < n; i += 10) {
+            client_free_node(clients[i]);
+            clients[i] = pool_new(next_id++);
+        }
+    }
+    report("pool", "after rounds", n);
+}
+
+int
+main(void)
+{
+    static const int sizes[] = { 1000, 10000, 50000 };
+    unsigned int i;
+
+    debugconf.debuglevel = LOG_ERR;
+
+    printf("sizeof(old_client) %zu, sizeof(t_client) %zu\n", sizeof(old_client), sizeof(t_client));
+    printf("%7s %8s %12s %12s %12s %10s\n", "clients", "layout", "", "allocations", "heap KB", "RSS KB");
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+        fflush(stdout);
+        if (0 == fork()) {
+            run_strdup(sizes[i]);
+            fflush(stdout);
+            _exit(0);
+        }
+        wait(NULL);
+        if (0 == fork()) {
+            run_pool(sizes[i]);
+            fflush(stdout);
+            _exit(0);
+        }
+        wait(NULL);
+    }
+
+    return 0;
+}
@@ -0,0 +1,292 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @file counters_sweep_bench.c
+  @brief Measures one counter update sweep at 5k clients
+
+  Compares the ways the iptables backend reads the traffic of its clients:
+
+  - rules: the output of iptables -v -n -x -L for both client chains is
+    read through popen() and parsed line by line, locking the client list
+    once per line, as iptables_fw_counters_update() originally did.
+  - save: iptables_fw_counters_update() itself, reading one iptables-save
+    -c snapshot of the mangle table, joining both directions by IP and
+    locking the client list once.
+  - nfacct: one nfnetlink_acct object per client and direction, created in
+    the kernel, read in one netlink dump and recorded with
+    fw_counters_record(), locking the client list once.
+
+  The listings and the snapshot are produced by cat from a file, so the
+  cost of iptables itself walking 5k rules is not included in the first
+  two figures.
+
+  Needs root and kernel nfnetlink_acct support for the second figure.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o counters_sweep_bench counters_sweep_bench.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "safe.h"
+#include "util.h"
+#include "client_list.h"
+#include "conf.h"
+#include "firewall.h"
+#include "fw_iptables.h"
+#include "fw_netlink.h"
+
+#define CLIENTS 5000
+#define SWEEPS 20
+#define PREFIX "WDbench_"
+
+static double
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+static void
+make_keys(int i, uint32_t * ip, t_mac * mac, char *token)
+{
+    *ip = htonl(0x0a000000 | i);
+    mac->addr[0] = 0x02;
+    mac->addr[1] = mac->addr[2] = 0;
+    mac->addr[3] = (i >> 16) & 0xff;
+    mac->addr[4] = (i >> 8) & 0xff;
+    mac->addr[5] = i & 0xff;
+    sprintf(token, "%032x", i * 2654435761u);
+}
+
+/* The listing iptables -v -n -x -L gives for one client chain */
+static void
+write_listing(const char *path, int incoming)
+{
+    FILE *f = fopen(path, "w");
+    uint32_t ip;
+    t_mac mac;
+    char token[33], ipstr[IP_STR_LEN], macstr[18];
+    int i;
+
+    fprintf(f, "Chain WD_br0_%s (1 references)\n", incoming ? "Incoming" : "Outgoing");
+    fprintf(f, "    pkts      bytes target     prot opt in     out     source               destination\n");
+    for (i = 0; i < CLIENTS; i++) {
+        make_keys(i, &ip, &mac, token);
+        format_ip(ip, ipstr);
+        format_mac(&mac, macstr);
+        if (incoming)
+            fprintf(f, "%8d %8d ACCEPT     all  --  *      *       0.0.0.0/0            %-20s\n", i, i * 100, ipstr);
+        else
+            fprintf(f, "%8d %8d MARK       all  --  *      *       %-20s 0.0.0.0/0            MAC %s MARK set 0x2\n",
+                    i, i * 100, ipstr, macstr);
+    }
+    fclose(f);
+}
+
+/* The snapshot iptables-save -c -t mangle gives */
+static void
+write_snapshot(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    uint32_t ip;
+    t_mac mac;
+    char token[33], ipstr[IP_STR_LEN], macstr[18];
+    int i;
+
+    fprintf(f, "*mangle\n:PREROUTING ACCEPT [0:0]\n:WD_br0_Outgoing - [0:0]\n:WD_br0_Incoming - [0:0]\n");
+    for (i = 0; i < CLIENTS; i++) {
+        make_keys(i, &ip, &mac, token);
+        format_ip(ip, ipstr);
+        format_mac(&mac, macstr);
+        fprintf(f, "[%d:%d] -A WD_br0_Outgoing -s %s/32 -m mac --mac-source %s -j MARK --set-xmark 0x2/0xffffffff\n",
+                i, i * 100, ipstr, macstr);
+    }
+    for (i = 0; i < CLIENTS; i++) {
+        make_keys(i, &ip, &mac, token);
+        format_ip(ip, ipstr);
+        fprintf(f, "[%d:%d] -A WD_br0_Incoming -d %s/32 -j ACCEPT\n", i, i * 100, ipstr);
+    }
+    fprintf(f, "COMMIT\n");
+    fclose(f);
+}
+
+/* One direction the way iptables_fw_counters_update() used to read it */
+static int
+sweep_rules(const char *path, int incoming)
+{
+    FILE *output;
+    char *script, ip[16];
+    unsigned long long int counter;
+    struct in_addr addr;
+    t_client *p1;
+    int rc, locks = 0;
+
+    safe_asprintf(&script, "cat %s", path);
+    output = popen(script, "r");
+    free(script);
+
+    while (('\n' != fgetc(output)) && !feof(output)) ;
+    while (('\n' != fgetc(output)) && !feof(output)) ;
+    while (!feof(output)) {
+        if (incoming)
+            rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %*s %15[0-9.]", &counter, ip);
+        else
+            rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %15[0-9.] %*s %*s %*s %*s %*s %*s", &counter, ip);
+        if (2 == rc && inet_aton(ip, &addr)) {
+            LOCK_CLIENT_LIST();
+            locks++;
+            if ((p1 = client_list_find_by_ip(addr.s_addr))) {
+                if (incoming)
+                    p1->counters.incoming = p1->counters.incoming_history + counter;
+                else
+                    p1->counters.outgoing = p1->counters.outgoing_history + counter;
+                client_list_publish(p1);
+            }
+            UNLOCK_CLIENT_LIST();
+        }
+    }
+    pclose(output);
+    return locks;
+}
+
+/* Both directions from one dump of the accounting objects */
+static int
+sweep_nfacct(void)
+{
+    t_nl_acct *accts;
+    t_fw_counters sweep;
+    unsigned int hostip;
+    char dir;
+    int total, i;
+
+    if ((total = nl_acct_list(PREFIX, &accts)) < 0)
+        return total;
+    memset(&sweep, 0, sizeof(sweep));
+    for (i = 0; i < total; i++) {
+        if (sscanf(accts[i].name + strlen(PREFIX), "%c_%8x", &dir, &hostip) != 2)
+            continue;
+        fw_counters_add(&sweep, htonl(hostip), 'i' == dir ? FW_COUNTER_INCOMING : FW_COUNTER_OUTGOING,
+                        accts[i].bytes, NULL);
+    }
+    free(accts);
+    fw_counters_record(&sweep);
+    fw_counters_free(&sweep);
+    return 1;
+}
+
+int
+main(void)
+{
+    char out_path[] = "/tmp/wdbench_out.XXXXXX", in_path[] = "/tmp/wdbench_in.XXXXXX";
+    char bin_path[] = "/tmp/wdbench_bin.XXXXXX";
+    char token[33], name[NL_ACCT_NAME_MAX], *save_path, *path;
+    uint32_t ip;
+    t_mac mac;
+    double start, rules, save, nfacct;
+    int i, locks = 0, rc;
+    FILE *f;
+
+    config_init();
+    config_get_config()->gw_interface = "br0";
+    debugconf.debuglevel = LOG_ERR;
+
+    client_list_init();
+    for (i = 0; i < CLIENTS; i++) {
+        make_keys(i, &ip, &mac, token);
+        client_list_add(ip, &mac, token);
+    }
+
+    close(mkstemp(out_path));
+    close(mkstemp(in_path));
+    write_listing(out_path, 0);
+    write_listing(in_path, 1);
+
+    start = now_us();
+    for (i = 0; i < SWEEPS; i++)
+        locks = sweep_rules(out_path, 0) + sweep_rules(in_path, 1);
+    rules = (now_us() - start) / SWEEPS;
+    printf("%d clients, rules:  %8.2f ms per sweep, %d locks\n", CLIENTS, rules / 1000, locks);
+    unlink(out_path);
+    unlink(in_path);
+
+    /* An iptables-save printing the snapshot, first in the PATH */
+    mkdtemp(bin_path);
+    safe_asprintf(&save_path, "%s/iptables-save", bin_path);
+    f = fopen(save_path, "w");
+    fprintf(f, "#!/bin/sh\nexec cat %s/snapshot\n", bin_path);
+    fclose(f);
+    chmod(save_path, 0755);
+    safe_asprintf(&path, "%s/snapshot", bin_path);
+    write_snapshot(path);
+    safe_asprintf(&path, "%s:%s", bin_path, getenv("PATH"));
+    setenv("PATH", path, 1);
+
+    start = now_us();
+    for (i = 0; i < SWEEPS; i++)
+        iptables_fw_counters_update();
+    save = (now_us() - start) / SWEEPS;
+    printf("%d clients, save:   %8.2f ms per sweep, 1 lock\n", CLIENTS, save / 1000);
+    unlink(save_path);
+    safe_asprintf(&path, "%s/snapshot", bin_path);
+    unlink(path);
+    rmdir(bin_path);
+
+    for (i = 0; i < CLIENTS; i++) {
+        make_keys(i, &ip, &mac, token);
+        snprintf(name, sizeof(name), PREFIX "o_%08x", ntohl(ip));
+        if ((rc = nl_acct_new(name)) != 0) {
+            printf("nfacct: could not create %s (error %d), skipped\n", name, rc);
+            return 0;
+        }
+        snprintf(name, sizeof(name), PREFIX "i_%08x", ntohl(ip));
+        nl_acct_new(name);
+    }
+
+    start = now_us();
+    for (i = 0; i < SWEEPS; i++)
+        sweep_nfacct();
+    nfacct = (now_us() - start) / SWEEPS;
+    printf("%d clients, nfacct: %8.2f ms per sweep, 1 lock\n", CLIENTS, nfacct / 1000);
+
+    for (i = 0; i < CLIENTS; i++) {
+        make_keys(i, &ip, &mac, token);
+        snprintf(name, sizeof(name), PREFIX "o_%08x", ntohl(ip));
+        nl_acct_del(name);
+        snprintf(name, sizeof(name), PREFIX "i_%08x", ntohl(ip));
+        nl_acct_del(name);
+    }
+
+    return 0;
+}
@@ -0,0 +1,183 @@
+#!/bin/sh
+#
+# Per-packet cost of the client firewall rules without ipset, all in
+# CHAIN_OUTGOING and CHAIN_INCOMING (FirewallFanoutBits 0) against the same
+# rules spread over trees of sub-chains by the lowest bits of the client
+# address (FirewallFanoutBits 2, 4, 6 and 8). With CONNMARK="no yes", each
+# layout is also measured with the marks kept with the connections
+# (FirewallConnmark yes), where only the first packets of the flow go
+# through the client rules.
+#
+# Builds client <-> gateway <-> server network namespaces, loads the
+# mangle rules wifidog would install for N clients on the gateway, with the
+# measured client added last to its chain (the worst case), and floods
+# small UDP packets through the gateway in both directions with iperf3.
+# The single flow is handled by one CPU, so the packet rate it reaches is
+# bounded by the per-packet cost of the forwarding path.
+#
+# Needs root, ip, iptables-restore and iperf3.
+#
+# Usage: ./fanout_packet_path.sh [seconds] [client counts...]
+# Default: 5 seconds, 100 1000 5000 clients. BITS="0 2 4 6 8" and
+# CONNMARK=no by default.
+
+set -e
+
+SECONDS_PER_RUN=${1:-5}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-"100 1000 5000"}
+BITS=${BITS:-"0 2 4 6 8"}
+CONNMARK=${CONNMARK:-no}
+
+CLI=wdbench_cli
+GW=wdbench_gw
+SRV=wdbench_srv
+
+for tool in ip iptables-restore iperf3; do
+    command -v $tool >/dev/null || { echo "$tool is required" >&2; exit 1; }
+done
+
+cleanup() {
+    ip netns del $CLI 2>/dev/null || true
+    ip netns del $GW 2>/dev/null || true
+    ip netns del $SRV 2>/dev/null || true
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add $CLI
+ip netns add $GW
+ip netns add $SRV
+ip link add c0 netns $CLI type veth peer name g0 netns $GW
+ip link add s0 netns $SRV type veth peer name g1 netns $GW
+ip -n $CLI addr add 10.10.0.2/16 dev c0
+ip -n $GW addr add 10.10.0.1/16 dev g0
+ip -n $GW addr add 10.20.0.1/24 dev g1
+ip -n $SRV addr add 10.20.0.2/24 dev s0
+for ns in $CLI $GW $SRV; do
+    ip -n $ns link set lo up
+done
+ip -n $CLI link set c0 up
+ip -n $GW link set g0 up
+ip -n $GW link set g1 up
+ip -n $SRV link set s0 up
+ip -n $CLI route add default via 10.10.0.1
+ip -n $SRV route add default via 10.20.0.1
+ip netns exec $GW sysctl -qw net.ipv4.ip_forward=1
+
+CLIENT_MAC=$(ip -n $CLI -o link show c0 | sed 's/.*link\/ether \([^ ]*\).*/\1/')
+
+# Fake client i gets 10.10.x.y and 02:00:00:00:x:y, skipping 10.10.0.2
+fake_x() {
+    echo $(( ($1 + 2) / 256 ))
+}
+fake_y() {
+    echo $(( ($1 + 2) % 256 ))
+}
+
+# Chain of the tree holding the rules of an address whose last two octets
+# are x.y, as fanout_leaf() picks it: 1 is the root, then 2i for a clear
+# bit and 2i + 1 for a set one, from the lowest bit up
+leaf() {
+    addr=$(( $1 * 256 + $2 ))
+    index=1
+    d=0
+    while [ $d -lt $bits ]; do
+        index=$(( index * 2 + ((addr >> d) & 1) ))
+        d=$((d + 1))
+    done
+    echo $index
+}
+
+chain() {
+    if [ $2 -gt 1 ]; then
+        echo WD_$1$2
+    elif [ $1 = Out ]; then
+        echo WD_Outgoing
+    else
+        echo WD_Incoming
+    fi
+}
+
+load_rules() {
+    bits=$1
+    n=$2
+    connmark=$3
+    {
+        echo "*mangle"
+        echo ":WD_Outgoing - [0:0]"
+        echo ":WD_Incoming - [0:0]"
+        echo ":WD_CtRestore - [0:0]"
+        echo ":WD_CtSave - [0:0]"
+        index=2
+        while [ $index -lt $(( 2 << bits )) ]; do
+            echo ":WD_Out$index - [0:0]"
+            echo ":WD_In$index - [0:0]"
+            index=$((index + 1))
+        done
+        if [ $connmark = yes ]; then
+            echo "-A PREROUTING -i g0 -j WD_CtRestore"
+            echo "-A PREROUTING -i g0 -m connmark --mark 0 -j WD_Outgoing"
+            echo "-A PREROUTING -i g0 -m connmark --mark 0 -j WD_CtSave"
+            echo "-A WD_CtRestore -j CONNMARK --restore-mark"
+            echo "-A WD_CtSave -j CONNMARK --save-mark"
+        else
+            echo "-A PREROUTING -i g0 -j WD_Outgoing"
+        fi
+        echo "-A POSTROUTING -o g0 -j WD_Incoming"
+        index=1
+        while [ $index -lt $(( 1 << bits )) ]; do
+            depth=0
+            while [ $(( index >> (depth + 1) )) -gt 0 ]; do
+                depth=$((depth + 1))
+            done
+            mask=$(( 1 << depth ))
+            mask="0.0.$(( mask >> 8 )).$(( mask & 255 ))"
+            echo "-A $(chain Out $index) -s $mask/$mask -g WD_Out$(( 2 * index + 1 ))"
+            echo "-A $(chain Out $index) -g WD_Out$(( 2 * index ))"
+            echo "-A $(chain In $index) -d $mask/$mask -g WD_In$(( 2 * index + 1 ))"
+            echo "-A $(chain In $index) -g WD_In$(( 2 * index ))"
+            index=$((index + 1))
+        done
+        i=1
+        while [ $i -lt $n ]; do
+            x=$(fake_x $i)
+            y=$(fake_y $i)
+            index=$(leaf $x $y)
+            printf -- "-A %s -s 10.10.%d.%d -m mac --mac-source 02:00:00:00:%02x:%02x -j MARK --set-mark 2\n" \
+                $(chain Out $index) $x $y $x $y
+            echo "-A $(chain In $index) -d 10.10.$x.$y -j ACCEPT"
+            i=$((i + 1))
+        done
+        index=$(leaf 0 2)
+        echo "-A $(chain Out $index) -s 10.10.0.2 -m mac --mac-source $CLIENT_MAC -j MARK --set-mark 2"
+        echo "-A $(chain In $index) -d 10.10.0.2 -j ACCEPT"
+        echo "COMMIT"
+    } > /tmp/wdbench.rules
+    ip netns exec $GW iptables-restore < /tmp/wdbench.rules
+    rm -f /tmp/wdbench.rules
+}
+
+# Prints the packet rate the receiver saw
+measure() {
+    direction=$1
+    ip netns exec $CLI iperf3 -c 10.20.0.2 -u -l 64 -b 0 -t $SECONDS_PER_RUN $direction -J 2>/dev/null |
+        sed -n 's/.*"packets":[[:space:]]*\([0-9]*\).*/\1/p' | tail -1 |
+        awk -v t=$SECONDS_PER_RUN '{ printf "%10.0f", $1 / t }'
+}
+
+printf "%8s %8s %8s %18s %18s\n" clients bits connmark "to internet pps" "to client pps"
+for n in $COUNTS; do
+    for bits in $BITS; do
+        for connmark in $CONNMARK; do
+            load_rules $bits $n $connmark
+            ip netns exec $SRV iperf3 -s -D -1 >/dev/null 2>&1
+            sleep 0.2
+            up=$(measure "")
+            ip netns exec $SRV iperf3 -s -D -1 >/dev/null 2>&1
+            sleep 0.2
+            down=$(measure -R)
+            printf "%8d %8d %8s %18s %18s\n" $n $bits $connmark "$up" "$down"
+        done
+    done
+done
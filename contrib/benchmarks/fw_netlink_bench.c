@@ -0,0 +1,100 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @file fw_netlink_bench.c
+  @brief Measures the cost of a firewall change over netlink against a process
+
+  Adds and deletes set members over netlink, the way the ipset backend
+  lets a client in and out, and compares them with running "true" through
+  execute(), which is a lower bound for every iptables or ipset command the
+  other paths start. Needs root and kernel ipset support. The set is
+  hash:ip so that it also runs on kernels without hash:ip,mac.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o fw_netlink_bench fw_netlink_bench.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "debug.h"
+#include "util.h"
+#include "fw_netlink.h"
+
+#define SET "wdbench_netlink"
+#define MEMBERS 10000
+#define PROCESSES 200
+
+static double
+now_us(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec * 1e6 + tv.tv_usec;
+}
+
+int
+main(void)
+{
+    t_nl_ipset_entry *entries;
+    double start, add, del, list, proc;
+    int i, count;
+
+    debugconf.debuglevel = LOG_WARNING;
+    if (nl_ipset_create(SET, "hash:ip", 1, 0) != 0) {
+        fprintf(stderr, "Could not create set " SET ", is this root with ipset support?\n");
+        return 1;
+    }
+
+    start = now_us();
+    for (i = 0; i < MEMBERS; i++)
+        nl_ipset_add(SET, htonl(0x0a000000 | i), NULL);
+    add = (now_us() - start) / MEMBERS;
+
+    start = now_us();
+    count = nl_ipset_list(SET, &entries);
+    list = now_us() - start;
+    free(entries);
+
+    start = now_us();
+    for (i = 0; i < MEMBERS; i++)
+        nl_ipset_del(SET, htonl(0x0a000000 | i), NULL);
+    del = (now_us() - start) / MEMBERS;
+    nl_ipset_destroy(SET);
+
+    start = now_us();
+    for (i = 0; i < PROCESSES; i++)
+        execute("true", 1);
+    proc = (now_us() - start) / PROCESSES;
+
+    printf("netlink add      %10.1f us\n", add);
+    printf("netlink del      %10.1f us\n", del);
+    printf("netlink list     %10.1f us for %d members\n", list, count);
+    printf("execute(\"true\")  %10.1f us\n", proc);
+    return 0;
+}
@@ -0,0 +1,136 @@
+#!/bin/sh
+#
+# Per-packet cost of the client firewall rules, one rule per client
+# (FirewallBackend iptables) against set membership (FirewallBackend ipset).
+#
+# Builds client <-> gateway <-> server network namespaces, loads the
+# mangle rules wifidog would install for N clients on the gateway, with the
+# measured client added last (the worst case for the rules backend), and
+# floods small UDP packets through the gateway in both directions with
+# iperf3. The single flow is handled by one CPU, so the packet rate it
+# reaches is bounded by the per-packet cost of the forwarding path.
+#
+# Needs root, ip, iptables-restore, ipset and iperf3.
+#
+# Usage: ./ipset_packet_path.sh [seconds] [client counts...]
+# Default: 5 seconds, 100 1000 5000 clients.
+
+set -e
+
+SECONDS_PER_RUN=${1:-5}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-"100 1000 5000"}
+
+CLI=wdbench_cli
+GW=wdbench_gw
+SRV=wdbench_srv
+
+for tool in ip iptables-restore ipset iperf3; do
+    command -v $tool >/dev/null || { echo "$tool is required" >&2; exit 1; }
+done
+
+cleanup() {
+    ip netns del $CLI 2>/dev/null || true
+    ip netns del $GW 2>/dev/null || true
+    ip netns del $SRV 2>/dev/null || true
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add $CLI
+ip netns add $GW
+ip netns add $SRV
+ip link add c0 netns $CLI type veth peer name g0 netns $GW
+ip link add s0 netns $SRV type veth peer name g1 netns $GW
+ip -n $CLI addr add 10.10.0.2/16 dev c0
+ip -n $GW addr add 10.10.0.1/16 dev g0
+ip -n $GW addr add 10.20.0.1/24 dev g1
+ip -n $SRV addr add 10.20.0.2/24 dev s0
+for ns in $CLI $GW $SRV; do
+    ip -n $ns link set lo up
+done
+ip -n $CLI link set c0 up
+ip -n $GW link set g0 up
+ip -n $GW link set g1 up
+ip -n $SRV link set s0 up
+ip -n $CLI route add default via 10.10.0.1
+ip -n $SRV route add default via 10.20.0.1
+ip netns exec $GW sysctl -qw net.ipv4.ip_forward=1
+
+CLIENT_MAC=$(ip -n $CLI -o link show c0 | sed 's/.*link\/ether \([^ ]*\).*/\1/')
+
+# Backend "none" loads the chains without any client, as a baseline.
+# Fake client i gets 10.10.x.y and 02:00:00:00:x:y
+fake_ip() {
+    echo "10.10.$(( ($1 + 256) / 256 )).$(( $1 % 256 ))"
+}
+fake_mac() {
+    printf '02:00:00:00:%02x:%02x' $(( ($1 + 256) / 256 )) $(( $1 % 256 ))
+}
+
+load_rules() {
+    backend=$1
+    n=$2
+    ip netns exec $GW ipset destroy 2>/dev/null || true
+    {
+        echo "*mangle"
+        echo ":WD_Outgoing - [0:0]"
+        echo ":WD_Incoming - [0:0]"
+        echo "-A PREROUTING -i g0 -j WD_Outgoing"
+        echo "-A POSTROUTING -o g0 -j WD_Incoming"
+        if [ "$backend" = rules ]; then
+            i=1
+            while [ $i -lt $n ]; do
+                echo "-A WD_Outgoing -s $(fake_ip $i) -m mac --mac-source $(fake_mac $i) -j MARK --set-mark 2"
+                echo "-A WD_Incoming -d $(fake_ip $i) -j ACCEPT"
+                i=$((i + 1))
+            done
+            echo "-A WD_Outgoing -s 10.10.0.2 -m mac --mac-source $CLIENT_MAC -j MARK --set-mark 2"
+            echo "-A WD_Incoming -d 10.10.0.2 -j ACCEPT"
+        elif [ "$backend" = ipset ]; then
+            echo "-A WD_Outgoing -m set --match-set WD_KnownOut src,src -j MARK --set-mark 2"
+            echo "-A WD_Incoming -m set --match-set WD_KnownIn dst -j ACCEPT"
+        fi
+        echo "COMMIT"
+    } > /tmp/wdbench.rules
+    if [ "$backend" = ipset ]; then
+        {
+            echo "create WD_KnownOut hash:ip,mac counters"
+            echo "create WD_KnownIn hash:ip counters"
+            i=1
+            while [ $i -lt $n ]; do
+                echo "add WD_KnownOut $(fake_ip $i),$(fake_mac $i)"
+                echo "add WD_KnownIn $(fake_ip $i)"
+                i=$((i + 1))
+            done
+            echo "add WD_KnownOut 10.10.0.2,$CLIENT_MAC"
+            echo "add WD_KnownIn 10.10.0.2"
+        } | ip netns exec $GW ipset restore
+    fi
+    ip netns exec $GW iptables-restore < /tmp/wdbench.rules
+    rm -f /tmp/wdbench.rules
+}
+
+# Prints the packet rate the receiver saw
+measure() {
+    direction=$1
+    ip netns exec $CLI iperf3 -c 10.20.0.2 -u -l 64 -b 0 -t $SECONDS_PER_RUN $direction -J 2>/dev/null |
+        sed -n 's/.*"packets":[[:space:]]*\([0-9]*\).*/\1/p' | tail -1 |
+        awk -v t=$SECONDS_PER_RUN '{ printf "%10.0f", $1 / t }'
+}
+
+printf "%8s %8s %18s %18s\n" clients backend "to internet pps" "to client pps"
+for n in 0 $COUNTS; do
+    backends="rules ipset"
+    [ $n -eq 0 ] && backends=none
+    for backend in $backends; do
+        load_rules $backend $n
+        ip netns exec $SRV iperf3 -s -D -1 >/dev/null 2>&1
+        sleep 0.2
+        up=$(measure "")
+        ip netns exec $SRV iperf3 -s -D -1 >/dev/null 2>&1
+        sleep 0.2
+        down=$(measure -R)
+        printf "%8d %8s %18s %18s\n" $n $backend "$up" "$down"
+    done
+done
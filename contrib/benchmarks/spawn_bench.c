@@ -0,0 +1,152 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @file spawn_bench.c
+  @brief Measures how many commands per second wifidog can start
+
+  Runs "true" over and over with 1, 50 and 200 live threads, each thread
+  holding some touched memory like an httpd thread with its buffers:
+
+  - fork+sh: fork() then /bin/sh -c, as execute() originally did.
+  - execute: execute() itself, posix_spawn() of the program without the
+    shell.
+  - helper: fw_helper_run(), the helper forked before any thread started
+    forking and exec'ing the program.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o spawn_bench spawn_bench.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "fw_helper.h"
+
+#define SECONDS 2
+#define THREAD_MEMORY (256 * 1024)
+
+static pthread_mutex_t idle_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* A thread waiting for a connection, with its buffers */
+static void *
+idle_thread(void *arg)
+{
+    char *memory = malloc(THREAD_MEMORY);
+
+    memset(memory, 1, THREAD_MEMORY);
+    pthread_mutex_lock(&idle_mutex);
+    while (1)
+        pthread_cond_wait(&idle_cond, &idle_mutex);
+    return memory;
+}
+
+/* What execute() used to do */
+static int
+fork_sh(const char *cmd)
+{
+    int status;
+    pid_t pid = fork();
+
+    if (0 == pid) {
+        execl("/bin/sh", "/bin/sh", "-c", cmd, (char *)NULL);
+        _exit(127);
+    }
+    waitpid(pid, &status, 0);
+    return WEXITSTATUS(status);
+}
+
+static int
+run_execute(const char *cmd)
+{
+    return execute(cmd, 0);
+}
+
+static int
+run_helper(const char *cmd)
+{
+    return fw_helper_run(cmd, NULL, 0, 0);
+}
+
+static double
+rate(int (*run)(const char *))
+{
+    double start = now(), elapsed;
+    int n = 0;
+
+    do {
+        if (run("true") != 0) {
+            printf("command failed\n");
+            exit(1);
+        }
+        n++;
+    } while ((elapsed = now() - start) < SECONDS);
+    return n / elapsed;
+}
+
+int
+main(void)
+{
+    static const int counts[] = { 1, 50, 200 };
+    pthread_t tid;
+    int live = 1, i;
+
+    config_init();
+    debugconf.debuglevel = LOG_ERR;
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Like main_loop(), before any thread */
+    if (fw_helper_start() != 0) {
+        printf("Could not start the helper\n");
+        return 1;
+    }
+
+    printf("threads   fork+sh/s   execute/s    helper/s\n");
+    for (i = 0; i < 3; i++) {
+        for (; live < counts[i]; live++)
+            pthread_create(&tid, NULL, idle_thread, NULL);
+        usleep(100000);
+        printf("%7d %11.0f %11.0f %11.0f\n", live, rate(fork_sh), rate(run_execute), rate(run_helper));
+    }
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+#!/bin/sh
+#
+# Per-packet cost of the trusted MAC list, one mac rule per trusted MAC
+# address against a single rule matching a hash:mac ipset.
+#
+# Builds client <-> gateway <-> server network namespaces, loads the
+# mangle rules wifidog would install for N trusted MAC addresses on the
+# gateway, with the MAC address of the measured client last (the worst
+# case for the rules), and floods small UDP packets from the client through
+# the gateway with iperf3. Only traffic from the clients goes through the
+# trusted chain. The single flow is handled by one CPU, so the packet rate
+# it reaches is bounded by the per-packet cost of the forwarding path: it
+# drops as the list grows with the rules, and stays flat with the set.
+#
+# Needs root, ip, iptables-restore, ipset with hash:mac support and iperf3.
+#
+# Usage: ./trusted_packet_path.sh [seconds] [trusted MAC counts...]
+# Default: 5 seconds, 10 100 1000 5000 trusted MAC addresses.
+
+set -e
+
+SECONDS_PER_RUN=${1:-5}
+[ $# -gt 0 ] && shift
+COUNTS=${*:-"10 100 1000 5000"}
+
+CLI=wdbench_cli
+GW=wdbench_gw
+SRV=wdbench_srv
+
+for tool in ip iptables-restore ipset iperf3; do
+    command -v $tool >/dev/null || { echo "$tool is required" >&2; exit 1; }
+done
+
+cleanup() {
+    ip netns del $CLI 2>/dev/null || true
+    ip netns del $GW 2>/dev/null || true
+    ip netns del $SRV 2>/dev/null || true
+}
+trap cleanup EXIT
+cleanup
+
+ip netns add $CLI
+ip netns add $GW
+ip netns add $SRV
+ip link add c0 netns $CLI type veth peer name g0 netns $GW
+ip link add s0 netns $SRV type veth peer name g1 netns $GW
+ip -n $CLI addr add 10.10.0.2/16 dev c0
+ip -n $GW addr add 10.10.0.1/16 dev g0
+ip -n $GW addr add 10.20.0.1/24 dev g1
+ip -n $SRV addr add 10.20.0.2/24 dev s0
+for ns in $CLI $GW $SRV; do
+    ip -n $ns link set lo up
+done
+ip -n $CLI link set c0 up
+ip -n $GW link set g0 up
+ip -n $GW link set g1 up
+ip -n $SRV link set s0 up
+ip -n $CLI route add default via 10.10.0.1
+ip -n $SRV route add default via 10.20.0.1
+ip netns exec $GW sysctl -qw net.ipv4.ip_forward=1
+
+CLIENT_MAC=$(ip -n $CLI -o link show c0 | sed 's/.*link\/ether \([^ ]*\).*/\1/')
+
+if ! ip netns exec $GW ipset create WD_TrustedMACs hash:mac 2>/dev/null; then
+    echo "The kernel has no hash:mac ipset support" >&2
+    exit 1
+fi
+ip netns exec $GW ipset destroy WD_TrustedMACs
+
+# Trusted MAC address i is 02:00:00:00:x:y
+fake_mac() {
+    printf '02:00:00:00:%02x:%02x' $(( $1 / 256 )) $(( $1 % 256 ))
+}
+
+# Mode "none" loads the chain empty, as a baseline
+load_rules() {
+    mode=$1
+    n=$2
+    # The set can only go once no rule refers to it
+    printf '*mangle\nCOMMIT\n' | ip netns exec $GW iptables-restore
+    ip netns exec $GW ipset destroy 2>/dev/null || true
+    {
+        echo "*mangle"
+        echo ":WD_Trusted - [0:0]"
+        echo "-A PREROUTING -i g0 -j WD_Trusted"
+        if [ "$mode" = rules ]; then
+            i=1
+            while [ $i -lt $n ]; do
+                echo "-A WD_Trusted -m mac --mac-source $(fake_mac $i) -j MARK --set-mark 2"
+                i=$((i + 1))
+            done
+            echo "-A WD_Trusted -m mac --mac-source $CLIENT_MAC -j MARK --set-mark 2"
+        elif [ "$mode" = ipset ]; then
+            echo "-A WD_Trusted -m set --match-set WD_TrustedMACs src -j MARK --set-mark 2"
+        fi
+        echo "COMMIT"
+    } > /tmp/wdbench.rules
+    if [ "$mode" = ipset ]; then
+        {
+            echo "create WD_TrustedMACs hash:mac"
+            i=1
+            while [ $i -lt $n ]; do
+                echo "add WD_TrustedMACs $(fake_mac $i)"
+                i=$((i + 1))
+            done
+            echo "add WD_TrustedMACs $CLIENT_MAC"
+        } | ip netns exec $GW ipset restore
+    fi
+    ip netns exec $GW iptables-restore < /tmp/wdbench.rules
+    rm -f /tmp/wdbench.rules
+}
+
+# Prints the packet rate the receiver saw
+measure() {
+    ip netns exec $CLI iperf3 -c 10.20.0.2 -u -l 64 -b 0 -t $SECONDS_PER_RUN -J 2>/dev/null |
+        sed -n 's/.*"packets":[[:space:]]*\([0-9]*\).*/\1/p' | tail -1 |
+        awk -v t=$SECONDS_PER_RUN '{ printf "%10.0f", $1 / t }'
+}
+
+printf "%8s %8s %18s\n" trusted mode "to internet pps"
+for n in 0 $COUNTS; do
+    modes="rules ipset"
+    [ $n -eq 0 ] && modes=none
+    for mode in $modes; do
+        load_rules $mode $n
+        ip netns exec $SRV iperf3 -s -D -1 >/dev/null 2>&1
+        sleep 0.2
+        printf "%8d %8s %18s\n" $n $mode "$(measure)"
+    done
+done
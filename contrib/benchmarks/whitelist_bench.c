@@ -0,0 +1,147 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @file whitelist_bench.c
+  @brief Measures how long the captive portal takes to tell whether a host
+  is whitelisted
+
+  Builds a global rule set of 1000 domains and classifies an exact
+  domain, a subdomain and a host that is not whitelisted, each with the
+  last domain of the rule set as the closest match:
+
+  - rules: the loop http_callback_404() used to run, strstr() on each
+    rule then a prefix built in a buffer for subdomains.
+  - whitelist: whitelist_match(), one pass over the host.
+
+  Build from this directory after building wifidog:
+
+    gcc -O2 -I../../src -I../.. -o whitelist_bench whitelist_bench.c \
+        ../../src/libgateway.a ../../libhttpd/.libs/libhttpd.a -lpthread
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/time.h>
+
+#include "debug.h"
+#include "conf.h"
+#include "safe.h"
+#include "whitelist.h"
+
+#define DOMAINS 1000
+#define LOOKUPS 200000
+
+static double
+now(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+/* What http_callback_404() used to do */
+static t_whitelist_match
+match_rules(const t_firewall_rule * rules, const char *host)
+{
+    const t_firewall_rule *rule;
+
+    for (rule = rules; rule != NULL; rule = rule->next) {
+        if (strstr(host, rule->mask) == NULL)
+            continue;
+        int host_length = strlen(host);
+        int mask_length = strlen(rule->mask);
+        if (host_length != mask_length) {
+            char prefix[1024] = { 0 };
+            memcpy(prefix, host, host_length - mask_length - 1);
+            strcat(prefix, ".");
+            strcat(prefix, rule->mask);
+            if (strcasecmp(host, prefix) == 0)
+                return WHITELIST_SUBDOMAIN;
+        } else {
+            return WHITELIST_DOMAIN;
+        }
+    }
+    return WHITELIST_NONE;
+}
+
+static t_whitelist_match
+match_whitelist(const t_firewall_rule * rules, const char *host)
+{
+    return whitelist_match(host);
+}
+
+static double
+ns_per_lookup(t_whitelist_match (*match)(const t_firewall_rule *, const char *), const t_firewall_rule * rules,
+              const char *host, t_whitelist_match expected)
+{
+    double start = now();
+    int i;
+
+    for (i = 0; i < LOOKUPS; i++) {
+        if (match(rules, host) != expected) {
+            printf("%s misclassified\n", host);
+            exit(1);
+        }
+    }
+    return (now() - start) * 1e9 / LOOKUPS;
+}
+
+int
+main(void)
+{
+    static const struct {
+        const char *label;
+        const char *host;
+        t_whitelist_match expected;
+    } hosts[] = {
+        {"domain", "portal999.example.com", WHITELIST_DOMAIN},
+        {"subdomain", "www.cdn.portal999.example.com", WHITELIST_SUBDOMAIN},
+        {"none", "www.portal999.example.org", WHITELIST_NONE},
+    };
+    t_firewall_rule *rules = NULL, *rule;
+    char name[64];
+    unsigned int i;
+
+    config_init();
+    debugconf.debuglevel = LOG_ERR;
+
+    /* Built backwards, so that portal999 comes last */
+    for (i = DOMAINS; i > 0; i--) {
+        rule = safe_malloc(sizeof(t_firewall_rule));
+        snprintf(name, sizeof(name), "portal%u.example.com", i - 1);
+        rule->mask = safe_strdup(name);
+        rule->next = rules;
+        rules = rule;
+    }
+    whitelist_load(rules);
+
+    printf("%d domains, ns per lookup\n", DOMAINS);
+    printf("%-10s %10s %10s\n", "host", "rules", "whitelist");
+    for (i = 0; i < sizeof(hosts) / sizeof(hosts[0]); i++)
+        printf("%-10s %10.0f %10.1f\n", hosts[i].label,
+               ns_per_lookup(match_rules, rules, hosts[i].host, hosts[i].expected),
+               ns_per_lookup(match_whitelist, rules, hosts[i].host, hosts[i].expected));
+
+    return 0;
+}
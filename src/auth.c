@@ -46,6 +46,8 @@
 #include "centralserver.h"
 #include "fw_iptables.h"
 #include "firewall.h"
+#include "fw_queue.h"
+#include "fw_shaping.h"
 #include "client_list.h"
 #include "util.h"
 #include "wd_util.h"
@@ -82,12 +84,72 @@ thread_client_timeout_check(const void *arg)
     }
 }
 
+/** Protects served_this_session, logins of different clients run concurrently */
+static pthread_mutex_t served_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Logs out clients whose inactivity deadline has passed. The deadlines are
+ * kept in a heap by the client list, so each wakeup only looks at the
+ * clients that actually expired, and the thread sleeps until the next
+ * deadline rather than until the next counter update.
+@param arg Unused
+*/
+void
+thread_client_expiry(const void *arg)
+{
+    pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+    pthread_mutex_t cond_mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct timespec timeout;
+    t_client expired, *client;
+    char ip[IP_STR_LEN];
+    time_t now, next;
+    s_config *config = config_get_config();
+
+    while (1) {
+        now = time(NULL);
+        while (client_list_pop_expired(now, &expired)) {
+            LOCK_CLIENT_SHARD(&expired.mac);
+            client = client_list_find_by_client(&expired);
+            if (NULL != client) {
+                if (client->counters.last_updated + config->checkinterval * config->clienttimeout <= now) {
+                    client_list_remove(client);
+                    fw_deny(client);
+                } else {
+                    /* Active again since it was popped */
+                    client_list_reschedule(client);
+                    client = NULL;
+                }
+            }
+            UNLOCK_CLIENT_SHARD(&expired.mac);
+
+            if (NULL != client) {
+                debug(LOG_INFO, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
+                      format_ip(expired.ip, ip), config->checkinterval * config->clienttimeout);
+                logout_client(client);
+            }
+        }
+
+        /* Sleep until the next deadline, but wake up at least every
+         * checkinterval to pick up clients added with an earlier one. */
+        next = client_list_next_expiry();
+        if (0 == next || next > now + config->checkinterval)
+            next = now + config->checkinterval;
+        timeout.tv_sec = next;
+        timeout.tv_nsec = 0;
+
+        pthread_mutex_lock(&cond_mutex);
+        pthread_cond_timedwait(&cond, &cond_mutex, &timeout);
+        pthread_mutex_unlock(&cond_mutex);
+    }
+}
+
 /**
  * @brief Logout a client and report to auth server.
  *
- * This function assumes it is being called with the client lock held! This
- * function remove the client from the client list and free its memory, so
- * client is no langer valid when this method returns.
+ * The client must already have been taken off the client list with
+ * client_list_remove() and denied with fw_deny(), both under its shard
+ * lock, and no client list lock may be held: this talks to the auth
+ * server. The client's memory is freed, so client is no langer valid when
+ * this method returns.
  *
  * @param client Points to the client to be logged out
  */
@@ -95,20 +157,17 @@ void
 logout_client(t_client * client)
 {
     t_authresponse authresponse;
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
     const s_config *config = config_get_config();
-    fw_deny(client);
-    client_list_remove(client);
 
     /* Advertise the logout if we have an auth server */
     if (config->auth_servers != NULL) {
-        UNLOCK_CLIENT_LIST();
         auth_server_request(&authresponse, REQUEST_TYPE_LOGOUT,
-                            client->ip, client->mac, client->token,
+                            format_ip(client->ip, ip), format_mac(&client->mac, mac), client->token,
                             client->counters.incoming, client->counters.outgoing, client->counters.incoming_delta, client->counters.outgoing_delta);
 
         if (authresponse.authcode == AUTH_ERROR)
             debug(LOG_WARNING, "Auth server error when reporting logout");
-        LOCK_CLIENT_LIST();
     }
 
     client_free_node(client);
@@ -117,28 +176,33 @@ logout_client(t_client * client)
 /** Authenticates a single client against the central server and returns when done
  * Alters the firewall rules depending on what the auth server says
 @param r httpd request struct
+@param ip IP address of the client making the request, network byte order
+@param mac MAC address of the client making the request
 */
 void
-authenticate_client(request * r)
+authenticate_client(request * r, uint32_t ip, const t_mac * mac)
 {
     t_client *client, *tmp;
     t_authresponse auth_response;
+    char ipstr[IP_STR_LEN], macstr[MAC_STR_LEN];
     char *token;
     httpVar *var;
     char *urlFragment = NULL;
     s_config *config = NULL;
     t_auth_serv *auth_server = NULL;
 
-    LOCK_CLIENT_LIST();
+    LOCK_CLIENT_SHARD(mac);
 
-    client = client_dup(client_list_find_by_ip(r->clientAddr));
+    client = client_dup(client_list_find(ip, mac));
 
-    UNLOCK_CLIENT_LIST();
+    UNLOCK_CLIENT_SHARD(mac);
 
     if (client == NULL) {
         debug(LOG_ERR, "authenticate_client(): Could not find client for %s", r->clientAddr);
         return;
     }
+    format_ip(ip, ipstr);
+    format_mac(mac, macstr);
 
     /* Users could try to log in(so there is a valid token in
      * request) even after they have logged in, try to deal with
@@ -154,31 +218,54 @@ authenticate_client(request * r)
      * take multiple seconds to do and the gateway would effectively be frozen if we
      * kept the lock.
      */
-    auth_server_request(&auth_response, REQUEST_TYPE_LOGIN, client->ip, client->mac, token, 0, 0, 0, 0);
+    auth_server_request(&auth_response, REQUEST_TYPE_LOGIN, ipstr, macstr, token, 0, 0, 0, 0);
+
+    /* Before the client is allowed, so that it gets its rates right away */
+    if (AUTH_VALIDATION == auth_response.authcode || AUTH_ALLOWED == auth_response.authcode)
+        fw_shaping_set_rates(ip, auth_response.download_rate, auth_response.upload_rate);
 
-    LOCK_CLIENT_LIST();
+    LOCK_CLIENT_SHARD(mac);
 
     /* can't trust the client to still exist after n seconds have passed */
     tmp = client_list_find_by_client(client);
 
     if (NULL == tmp) {
-        debug(LOG_ERR, "authenticate_client(): Could not find client node for %s (%s)", client->ip, client->mac);
-        UNLOCK_CLIENT_LIST();
+        debug(LOG_ERR, "authenticate_client(): Could not find client node for %s (%s)", ipstr, macstr);
+        UNLOCK_CLIENT_SHARD(mac);
         client_list_destroy(client);    /* Free the cloned client */
         free(token);
         return;
     }
 
     client_list_destroy(client);        /* Free the cloned client */
-    client = tmp;
 
-    if (strcmp(token, client->token) != 0) {
+    if (strcmp(token, tmp->token) != 0) {
         /* If token changed, save it. */
-        free(client->token);
-        client->token = token;
-    } else {
-        free(token);
+        client_list_update_token(tmp, token);
+    }
+    free(token);
+
+    /* Record the outcome on the list and queue the firewall change now, in
+     * the same order as any other change of this client, but apply it and
+     * answer the client from a copy once the lock is released: a login
+     * waits for the firewall and writes to the network. */
+    switch (auth_response.authcode) {
+    case AUTH_DENIED:
+        fw_deny(tmp);
+        break;
+    case AUTH_VALIDATION:
+        fw_allow(tmp, FW_MARK_PROBATION);
+        break;
+    case AUTH_ALLOWED:
+        fw_allow(tmp, FW_MARK_KNOWN);
+        break;
+    default:
+        break;
     }
+    client_list_publish(tmp);
+    client = client_dup(tmp);
+
+    UNLOCK_CLIENT_SHARD(mac);
 
     /* Prepare some variables we'll need below */
     config = config_get_config();
@@ -188,8 +275,8 @@ authenticate_client(request * r)
 
     case AUTH_ERROR:
         /* Error talking to central server */
-        debug(LOG_ERR, "Got ERROR from central server authenticating token %s from %s at %s", client->token, client->ip,
-              client->mac);
+        debug(LOG_ERR, "Got ERROR from central server authenticating token %s from %s at %s", client->token, ipstr,
+              macstr);
         send_http_page(r, "Error!", "Error: We did not get a valid answer from the central server");
         break;
 
@@ -197,8 +284,7 @@ authenticate_client(request * r)
         /* Central server said invalid token */
         debug(LOG_INFO,
               "Got DENIED from central server authenticating token %s from %s at %s - deleting from firewall and redirecting them to denied message",
-              client->token, client->ip, client->mac);
-        fw_deny(client);
+              client->token, ipstr, macstr);
         safe_asprintf(&urlFragment, "%smessage=%s&token=%s",
                       auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_DENIED, client->token);
         http_send_redirect_to_auth(r, urlFragment, "Redirect to denied message");
@@ -208,8 +294,9 @@ authenticate_client(request * r)
     case AUTH_VALIDATION:
         /* They just got validated for X minutes to check their email */
         debug(LOG_INFO, "Got VALIDATION from central server authenticating token %s from %s at %s"
-              "- adding to firewall and redirecting them to activate message", client->token, client->ip, client->mac);
-        fw_allow(client, FW_MARK_PROBATION);
+              "- adding to firewall and redirecting them to activate message", client->token, ipstr, macstr);
+        /* Let them through before they follow the redirect */
+        fw_queue_flush();
         safe_asprintf(&urlFragment, "%smessage=%s&token=%s",
                       auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_ACTIVATE_ACCOUNT, client->token);
         http_send_redirect_to_auth(r, urlFragment, "Redirect to activate message");
@@ -219,9 +306,11 @@ authenticate_client(request * r)
     case AUTH_ALLOWED:
         /* Logged in successfully as a regular account */
         debug(LOG_INFO, "Got ALLOWED from central server authenticating token %s from %s at %s - "
-              "adding to firewall and redirecting them to portal", client->token, client->ip, client->mac);
-        fw_allow(client, FW_MARK_KNOWN);
+              "adding to firewall and redirecting them to portal", client->token, ipstr, macstr);
+        fw_queue_flush();
+        pthread_mutex_lock(&served_mutex);
         served_this_session++;
+        pthread_mutex_unlock(&served_mutex);
         safe_asprintf(&urlFragment, "%sgw_id=%s&token=%s", auth_server->authserv_portal_script_path_fragment,
                       config->gw_id, client->token);
         http_send_redirect_to_auth(r, urlFragment, "Redirect to portal");
@@ -231,7 +320,7 @@ authenticate_client(request * r)
     case AUTH_VALIDATION_FAILED:
         /* Client had X minutes to validate account by email and didn't = too late */
         debug(LOG_INFO, "Got VALIDATION_FAILED from central server authenticating token %s from %s at %s "
-              "- redirecting them to failed_validation message", client->token, client->ip, client->mac);
+              "- redirecting them to failed_validation message", client->token, ipstr, macstr);
         safe_asprintf(&urlFragment, "%smessage=%s&token=%s",
                       auth_server->authserv_msg_script_path_fragment, GATEWAY_MESSAGE_ACCOUNT_VALIDATION_FAILED,
                       client->token);
@@ -242,12 +331,12 @@ authenticate_client(request * r)
     default:
         debug(LOG_WARNING,
               "I don't know what the validation code %d means for token %s from %s at %s - sending error message",
-              auth_response.authcode, client->token, client->ip, client->mac);
+              auth_response.authcode, client->token, ipstr, macstr);
         send_http_page(r, "Internal Error", "We can not validate your request at this time");
         break;
 
     }
 
-    UNLOCK_CLIENT_LIST();
+    client_list_destroy(client);        /* Free the copy */
     return;
 }
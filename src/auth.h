@@ -51,15 +51,20 @@ typedef enum {
  */
 typedef struct _t_authresponse {
     t_authcode authcode; /**< Authentication code returned by the server */
+    unsigned int download_rate; /**< kbit/s the client may download at, from a "DownloadRate: " line, 0 if none */
+    unsigned int upload_rate; /**< kbit/s the client may upload at, from an "UploadRate: " line, 0 if none */
 } t_authresponse;
 
 /** @brief Logout a client and report to auth server. */
 void logout_client(t_client *);
 
 /** @brief Authenticate a single client against the central server */
-void authenticate_client(request *);
+void authenticate_client(request *, uint32_t, const t_mac *);
 
 /** @brief Periodically check if connections expired */
 void thread_client_timeout_check(const void *arg);
 
+/** @brief Log out clients as soon as their inactivity deadline passes */
+void thread_client_expiry(const void *arg);
+
 #endif
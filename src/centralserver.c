@@ -77,6 +77,8 @@ auth_server_request(t_authresponse * authresponse, const char *request_type, con
 
     /* Blanket default is error. */
     authresponse->authcode = AUTH_ERROR;
+    authresponse->download_rate = 0;
+    authresponse->upload_rate = 0;
 
     sockfd = connect_auth_server();
 
@@ -134,6 +136,11 @@ auth_server_request(t_authresponse * authresponse, const char *request_type, con
     if ((tmp = strstr(res, "Auth: "))) {
         if (sscanf(tmp, "Auth: %d", (int *)&authresponse->authcode) == 1) {
             debug(LOG_INFO, "Auth server returned authentication code %d", authresponse->authcode);
+            /* Optional rates for traffic shaping, in kbit/s */
+            if ((tmp = strstr(res, "DownloadRate: ")))
+                sscanf(tmp, "DownloadRate: %u", &authresponse->download_rate);
+            if ((tmp = strstr(res, "UploadRate: ")))
+                sscanf(tmp, "UploadRate: %u", &authresponse->upload_rate);
             free(res);
             return (authresponse->authcode);
         } else {
@@ -34,6 +34,7 @@
 #include <unistd.h>
 #include <sys/wait.h>
 #include <sys/types.h>
+#include <stddef.h>
 
 #include <string.h>
 
@@ -41,11 +42,96 @@
 #include "debug.h"
 #include "conf.h"
 #include "client_list.h"
+#include "client_state.h"
+
+/** Number of clients carved out of each slab of the client pool */
+#define CLIENT_SLAB_SIZE 64
+
+/** Number of shards of the client list, must be a power of two */
+#define CLIENT_LIST_SHARDS 16
+
+/** Initial capacity of the expiry heap */
+#define CLIENT_EXPIRY_MIN_SIZE 64
+
+/** Initial number of slots in each client index, must be a power of two */
+#define CLIENT_INDEX_MIN_SIZE 64
+
+/** @internal
+ * Marks a slot whose client was removed, so that probing continues past it.
+ */
+#define CLIENT_INDEX_TOMBSTONE ((t_client *)-1)
+
+/** @internal
+ * Open-addressed (linear probing) hash index over the client list.
+ * The slots only reference clients, the list itself still owns them.
+ */
+typedef struct _t_client_index {
+    unsigned long (*hash)(const t_client *);    /**< @brief Hash of the indexed key of a client */
+    t_client **slots;           /**< @brief NULL (empty), CLIENT_INDEX_TOMBSTONE or a client */
+    size_t size;                /**< @brief Number of slots, a power of two */
+    size_t used;                /**< @brief Number of clients in the index */
+    size_t filled;              /**< @brief Number of clients and tombstones in the index */
+} t_client_index;
+
+/** @internal
+ * One partition of the client list. Clients are spread over the shards by a
+ * hash of their MAC address; each shard has its own lock, list and indexes so
+ * that logins of different clients do not contend.
+ */
+typedef struct _t_client_shard {
+    pthread_mutex_t mutex;      /**< @brief Protects everything below */
+    t_client *first;            /**< @brief First client of this shard */
+    t_client_index ip_index;
+    t_client_index mac_index;
+    t_client_index token_index;
+    t_client_index id_index;
+    unsigned long generation;   /**< @brief Bumped whenever a client of this shard changes, with __atomic builtins
+                                   as client_list_snapshot() reads it without the lock */
+} t_client_shard;
+
+/** @internal
+ * A block of clients allocated in one go by the client pool. A slab is
+ * freed once none of its clients is in use, except for one kept spare so
+ * that a client coming and going does not allocate and free it each time.
+ */
+typedef struct _t_client_slab {
+    struct _t_client_slab *next;        /**< @brief Next slab with free clients */
+    struct _t_client_slab *prev;        /**< @brief Previous slab with free clients */
+    t_client *free_list;                /**< @brief Free clients of this slab, threaded through next */
+    unsigned int in_use;                /**< @brief Clients of this slab handed out */
+    t_client clients[CLIENT_SLAB_SIZE];
+} t_client_slab;
+
+/** @internal
+ * Slab a client of the pool was carved out of
+ */
+#define CLIENT_SLAB_OF(client) \
+    ((t_client_slab *)((char *)((client) - (client)->slab_index) - offsetof(t_client_slab, clients)))
+
+static unsigned long hash_string(const char *);
+static unsigned long hash_id(unsigned long long);
+static unsigned long hash_mac(const t_mac *);
+static unsigned long client_hash_ip(const t_client *);
+static unsigned long client_hash_mac(const t_client *);
+static unsigned long client_hash_token(const t_client *);
+static unsigned long client_hash_id(const t_client *);
+static unsigned int client_shard_of_mac(const t_mac *);
+static void client_index_init(t_client_index *, unsigned long (*)(const t_client *));
+static void client_index_resize(t_client_index *, size_t);
+static void client_index_insert(t_client_index *, t_client *);
+static void client_index_remove(t_client_index *, t_client *);
+static t_client *client_index_next(const t_client_index *, unsigned long, size_t *);
+static void client_expiry_swap(unsigned int, unsigned int);
+static void client_expiry_up(unsigned int);
+static void client_expiry_down(unsigned int);
+static void client_expiry_remove(t_client *);
+static void client_slab_link(t_client_slab *);
+static void client_slab_unlink(t_client_slab *);
 
 /** @internal
- * Holds a pointer to the first element of the list 
+ * The shards of the client list, set up by client_list_init()
  */
-static t_client *firstclient = NULL;
+static t_client_shard shards[CLIENT_LIST_SHARDS];
 
 /** @internal
  * Client ID
@@ -57,26 +143,515 @@ static volatile unsigned long long client_id = 1;
  */
 static pthread_mutex_t client_id_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/** Global mutex to protect access to the client list */
-pthread_mutex_t client_list_mutex = PTHREAD_MUTEX_INITIALIZER;
+/** @internal
+ * Binary min-heap of the clients ordered by inactivity deadline (expires),
+ * 1-based so that client->expiry_slot == 0 means "not scheduled". It spans
+ * all shards and has its own mutex, taken inside the shard locks.
+ */
+static t_client **expiry_heap = NULL;
+static unsigned int expiry_heap_count = 0;
+static unsigned int expiry_heap_size = 0;
+static pthread_mutex_t expiry_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Most recent snapshot of the client list, protected by snapshot_mutex.
+ * Building a snapshot needs all the shard locks, handing out a reference
+ * to an up-to-date one does not.
+ */
+static t_client_snapshot *current_snapshot = NULL;
+static pthread_mutex_t snapshot_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Client pool: the slabs with free clients, the spare empty slab and the
+ * number of slabs allocated. Clients on the list and copies of clients are
+ * both allocated from the pool, so it has its own mutex.
+ */
+static t_client_slab *client_partial_slabs = NULL;
+static t_client_slab *client_spare_slab = NULL;
+static unsigned long client_pool_slabs = 0;
+static unsigned long client_pool_in_use = 0;
+static pthread_mutex_t client_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * FNV-1a hash of a string
+ */
+static unsigned long
+hash_string(const char *s)
+{
+    unsigned long h = 2166136261UL;
+
+    while (*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+/** @internal
+ * Mixes the bits of a client id, consecutive ids would otherwise cluster
+ */
+static unsigned long
+hash_id(unsigned long long id)
+{
+    id ^= id >> 33;
+    id *= 0xff51afd7ed558ccdULL;
+    id ^= id >> 33;
+    return (unsigned long)id;
+}
+
+/** @internal
+ * Hash of a binary MAC address
+ */
+static unsigned long
+hash_mac(const t_mac * mac)
+{
+    unsigned long long v = 0;
+    int i;
+
+    for (i = 0; i < 6; i++)
+        v = (v << 8) | mac->addr[i];
+    return hash_id(v);
+}
+
+/** @internal
+ * Shard a MAC address belongs to. The hash is mixed again so that the shard
+ * does not correlate with the slot of the client in the shard's own indexes.
+ */
+static unsigned int
+client_shard_of_mac(const t_mac * mac)
+{
+    return hash_id(hash_mac(mac)) & (CLIENT_LIST_SHARDS - 1);
+}
+
+static unsigned long
+client_hash_ip(const t_client * client)
+{
+    return hash_id(client->ip);
+}
+
+static unsigned long
+client_hash_mac(const t_client * client)
+{
+    return hash_mac(&client->mac);
+}
+
+static unsigned long
+client_hash_token(const t_client * client)
+{
+    return hash_string(client->token);
+}
+
+static unsigned long
+client_hash_id(const t_client * client)
+{
+    return hash_id(client->id);
+}
+
+/** @internal
+ * Empties an index, allocating its slots the first time.
+ */
+static void
+client_index_init(t_client_index * index, unsigned long (*hash)(const t_client *))
+{
+    index->hash = hash;
+    if (NULL == index->slots) {
+        index->size = CLIENT_INDEX_MIN_SIZE;
+        index->slots = safe_malloc(index->size * sizeof(t_client *));
+    } else {
+        memset(index->slots, 0, index->size * sizeof(t_client *));
+    }
+    index->used = index->filled = 0;
+}
+
+/** @internal
+ * Rehashes all clients of an index into a new slot array, dropping tombstones.
+ * @param index Index to rebuild
+ * @param size New number of slots, a power of two
+ */
+static void
+client_index_resize(t_client_index * index, size_t size)
+{
+    t_client **old = index->slots;
+    size_t old_size = index->size;
+    size_t i;
+
+    index->slots = safe_malloc(size * sizeof(t_client *));
+    index->size = size;
+    index->used = index->filled = 0;
+
+    for (i = 0; i < old_size; i++) {
+        if (NULL != old[i] && CLIENT_INDEX_TOMBSTONE != old[i])
+            client_index_insert(index, old[i]);
+    }
+    free(old);
+}
+
+/** @internal
+ * Adds a client to an index, growing it to keep the load factor under 3/4.
+ */
+static void
+client_index_insert(t_client_index * index, t_client * client)
+{
+    size_t pos;
+
+    if ((index->filled + 1) * 4 > index->size * 3) {
+        /* Only grow if the slots are really in use, otherwise just purge tombstones */
+        client_index_resize(index, (index->used + 1) * 2 > index->size ? index->size * 2 : index->size);
+    }
+
+    pos = index->hash(client) & (index->size - 1);
+    while (NULL != index->slots[pos] && CLIENT_INDEX_TOMBSTONE != index->slots[pos])
+        pos = (pos + 1) & (index->size - 1);
+
+    if (NULL == index->slots[pos])
+        index->filled++;
+    index->slots[pos] = client;
+    index->used++;
+}
+
+/** @internal
+ * Removes a client from an index. The key of the client must not have
+ * changed since it was inserted.
+ */
+static void
+client_index_remove(t_client_index * index, t_client * client)
+{
+    size_t pos, probe;
+
+    pos = index->hash(client) & (index->size - 1);
+    for (probe = 0; probe < index->size && NULL != index->slots[pos]; probe++) {
+        if (index->slots[pos] == client) {
+            index->slots[pos] = CLIENT_INDEX_TOMBSTONE;
+            index->used--;
+            return;
+        }
+        pos = (pos + 1) & (index->size - 1);
+    }
+    debug(LOG_ERR, "Client %llu not found in index", client->id);
+}
+
+/** @internal
+ * Walks the probe sequence of a hash value. Returns every client found along
+ * the way, the caller checks whether its key actually matches.
+ * @param index Index to search
+ * @param hash Hash of the key being looked up
+ * @param probe Position in the probe sequence, must be 0 on the first call
+ * @return The next candidate client, or NULL when the sequence is exhausted
+ */
+static t_client *
+client_index_next(const t_client_index * index, unsigned long hash, size_t * probe)
+{
+    t_client *client;
+
+    while (*probe < index->size) {
+        client = index->slots[(hash + *probe) & (index->size - 1)];
+        (*probe)++;
+        if (NULL == client)
+            return NULL;
+        if (CLIENT_INDEX_TOMBSTONE != client)
+            return client;
+    }
+    return NULL;
+}
+
+/** @internal
+ * Exchanges two entries of the expiry heap. expiry_mutex must be held.
+ */
+static void
+client_expiry_swap(unsigned int a, unsigned int b)
+{
+    t_client *tmp = expiry_heap[a];
+
+    expiry_heap[a] = expiry_heap[b];
+    expiry_heap[b] = tmp;
+    expiry_heap[a]->expiry_slot = a;
+    expiry_heap[b]->expiry_slot = b;
+}
+
+/** @internal
+ * Moves an entry of the expiry heap towards the root while it expires
+ * earlier than its parent. expiry_mutex must be held.
+ */
+static void
+client_expiry_up(unsigned int slot)
+{
+    while (slot > 1 && expiry_heap[slot]->expires < expiry_heap[slot / 2]->expires) {
+        client_expiry_swap(slot, slot / 2);
+        slot /= 2;
+    }
+}
+
+/** @internal
+ * Moves an entry of the expiry heap towards the leaves while one of its
+ * children expires earlier. expiry_mutex must be held.
+ */
+static void
+client_expiry_down(unsigned int slot)
+{
+    unsigned int child;
+
+    while ((child = slot * 2) <= expiry_heap_count) {
+        if (child < expiry_heap_count && expiry_heap[child + 1]->expires < expiry_heap[child]->expires)
+            child++;
+        if (expiry_heap[slot]->expires <= expiry_heap[child]->expires)
+            break;
+        client_expiry_swap(slot, child);
+        slot = child;
+    }
+}
+
+/** @internal
+ * Takes a client off the expiry heap, if it is on it. expiry_mutex must be held.
+ */
+static void
+client_expiry_remove(t_client * client)
+{
+    unsigned int slot = client->expiry_slot;
+
+    if (0 == slot)
+        return;
+
+    client->expiry_slot = 0;
+    if (slot != expiry_heap_count) {
+        expiry_heap[slot] = expiry_heap[expiry_heap_count];
+        expiry_heap[slot]->expiry_slot = slot;
+        expiry_heap_count--;
+        client_expiry_up(slot);
+        client_expiry_down(expiry_heap[slot]->expiry_slot);
+    } else {
+        expiry_heap_count--;
+    }
+}
+
+/** Recompute the inactivity deadline of a client, counters.last_updated plus
+ * checkinterval * clienttimeout, and put it at its place in the expiry
+ * schedule. Clients are scheduled when inserted in the list; this must be
+ * called whenever counters.last_updated changes afterwards.
+ * The shard lock of the client should be held when calling this!
+ * @param client Client on the list
+ */
+void
+client_list_reschedule(t_client * client)
+{
+    s_config *config = config_get_config();
+
+    pthread_mutex_lock(&expiry_mutex);
+    client->expires = client->counters.last_updated + config->checkinterval * config->clienttimeout;
+    if (0 == client->expiry_slot) {
+        if (expiry_heap_count + 1 >= expiry_heap_size) {
+            expiry_heap_size = expiry_heap_size ? expiry_heap_size * 2 : CLIENT_EXPIRY_MIN_SIZE;
+            expiry_heap = safe_realloc(expiry_heap, expiry_heap_size * sizeof(t_client *));
+        }
+        expiry_heap[++expiry_heap_count] = client;
+        client->expiry_slot = expiry_heap_count;
+        client_expiry_up(client->expiry_slot);
+    } else {
+        client_expiry_up(client->expiry_slot);
+        client_expiry_down(client->expiry_slot);
+    }
+    pthread_mutex_unlock(&expiry_mutex);
+}
+
+/** Earliest inactivity deadline of all clients
+ * @return The deadline, or 0 if no client is scheduled
+ */
+time_t
+client_list_next_expiry(void)
+{
+    time_t expires = 0;
+
+    pthread_mutex_lock(&expiry_mutex);
+    if (expiry_heap_count > 0)
+        expires = expiry_heap[1]->expires;
+    pthread_mutex_unlock(&expiry_mutex);
+    return expires;
+}
+
+/** Take the client with the earliest inactivity deadline off the expiry
+ * schedule if that deadline has passed. Only the id, shard, MAC and
+ * deadline of the client are copied out: the caller then locks the shard of
+ * that MAC, finds the client with client_list_find_by_client() and checks
+ * counters.last_updated again, as the client may have been active since.
+ * @param now Current time
+ * @param expired Receives the identifying fields of the client
+ * @return 1 if a client was taken off the schedule, 0 if none has expired
+ */
+int
+client_list_pop_expired(time_t now, t_client * expired)
+{
+    t_client *client;
+
+    pthread_mutex_lock(&expiry_mutex);
+    if (0 == expiry_heap_count || expiry_heap[1]->expires > now) {
+        pthread_mutex_unlock(&expiry_mutex);
+        return 0;
+    }
+    client = expiry_heap[1];
+    memset(expired, 0, sizeof(t_client));
+    expired->token = expired->token_buf;
+    expired->id = client->id;
+    expired->shard = client->shard;
+    expired->ip = client->ip;
+    expired->mac = client->mac;
+    expired->expires = client->expires;
+    client_expiry_remove(client);
+    pthread_mutex_unlock(&expiry_mutex);
+
+    return 1;
+}
+
+/** @internal
+ * Takes a slab off the list of slabs with free clients. client_pool_mutex
+ * must be held.
+ */
+static void
+client_slab_unlink(t_client_slab * slab)
+{
+    if (NULL != slab->prev)
+        slab->prev->next = slab->next;
+    else
+        client_partial_slabs = slab->next;
+    if (NULL != slab->next)
+        slab->next->prev = slab->prev;
+    slab->next = slab->prev = NULL;
+}
+
+/** @internal
+ * Puts a slab at the head of the list of slabs with free clients.
+ * client_pool_mutex must be held.
+ */
+static void
+client_slab_link(t_client_slab * slab)
+{
+    slab->prev = NULL;
+    slab->next = client_partial_slabs;
+    if (NULL != client_partial_slabs)
+        client_partial_slabs->prev = slab;
+    client_partial_slabs = slab;
+}
 
 /** Get a new client struct, not added to the list yet
+ * The client comes from the client pool, a new slab is allocated only when
+ * no slab has a free client.
  * @return Pointer to newly created client object not on the list yet.
  */
 t_client *
 client_get_new(void)
 {
     t_client *client;
-    client = safe_malloc(sizeof(t_client));
+    t_client_slab *slab;
+    unsigned short index;
+    int i;
+
+    pthread_mutex_lock(&client_pool_mutex);
+    if (NULL == (slab = client_partial_slabs)) {
+        if (NULL != (slab = client_spare_slab)) {
+            client_spare_slab = NULL;
+        } else {
+            slab = safe_malloc(sizeof(t_client_slab));
+            slab->free_list = NULL;
+            slab->in_use = 0;
+            client_pool_slabs++;
+            for (i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+                slab->clients[i].next = slab->free_list;
+                slab->free_list = &slab->clients[i];
+            }
+        }
+        client_slab_link(slab);
+    }
+    client = slab->free_list;
+    slab->free_list = client->next;
+    if (NULL == slab->free_list)
+        client_slab_unlink(slab);
+    slab->in_use++;
+    client_pool_in_use++;
+    pthread_mutex_unlock(&client_pool_mutex);
+
+    index = client - slab->clients;
+    memset(client, 0, sizeof(t_client));
+    client->slab_index = index;
+    client->token = client->token_buf;
     return client;
 }
 
+/** Get usage statistics of the client pool
+ * @param stats Filled with the current statistics
+ */
+void
+client_pool_get_stats(t_client_pool_stats * stats)
+{
+    pthread_mutex_lock(&client_pool_mutex);
+    stats->slabs = client_pool_slabs;
+    stats->in_use = client_pool_in_use;
+    stats->free = client_pool_slabs * CLIENT_SLAB_SIZE - client_pool_in_use;
+    stats->bytes = client_pool_slabs * sizeof(t_client_slab);
+    pthread_mutex_unlock(&client_pool_mutex);
+}
+
+/** Sets the token of a client, in its inline buffer if it fits and in a
+ * heap copy otherwise. The client must not be on the list, or be taken out
+ * of the token index around the change, see client_list_update_token().
+ * @param client Client
+ * @param token New token
+ */
+void
+client_set_token(t_client * client, const char *token)
+{
+    size_t len = strlen(token);
+
+    if (client->token != client->token_buf)
+        free(client->token);
+    if (len < sizeof(client->token_buf)) {
+        memcpy(client->token_buf, token, len + 1);
+        client->token = client->token_buf;
+    } else {
+        client->token = safe_strdup(token);
+    }
+}
+
+/** @internal
+ * Gives a copy of a client its own token, after a struct assignment left it
+ * pointing at the token of the original.
+ */
+static void
+client_own_token(t_client * copy, const t_client * src)
+{
+    if (src->token == src->token_buf)
+        copy->token = copy->token_buf;
+    else
+        copy->token = safe_strdup(src->token);
+}
+
 /** Get the first element of the list of connected clients
+ * All shards must be locked (LOCK_CLIENT_LIST) while walking the list.
  */
 t_client *
 client_get_first_client(void)
 {
-    return firstclient;
+    return client_get_next_client(NULL);
+}
+
+/** Get the client following another one when walking the whole list,
+ * moving on to the next shard at the end of each shard.
+ * All shards must be locked (LOCK_CLIENT_LIST) while walking the list.
+ * @param client Current client, or NULL to start from the beginning
+ * @return The next client, or NULL at the end of the list
+ */
+t_client *
+client_get_next_client(t_client * client)
+{
+    unsigned int i = 0;
+
+    if (NULL != client) {
+        if (NULL != client->next)
+            return client->next;
+        i = client->shard + 1;
+    }
+    for (; i < CLIENT_LIST_SHARDS; i++) {
+        if (NULL != shards[i].first)
+            return shards[i].first;
+    }
+    return NULL;
 }
 
 /**
@@ -85,43 +660,128 @@ client_get_first_client(void)
 void
 client_list_init(void)
 {
-    firstclient = NULL;
+    t_client_shard *shard;
+    unsigned int i;
+
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++) {
+        shard = &shards[i];
+        if (NULL == shard->id_index.slots)
+            pthread_mutex_init(&shard->mutex, NULL);
+        shard->first = NULL;
+        client_index_init(&shard->ip_index, client_hash_ip);
+        client_index_init(&shard->mac_index, client_hash_mac);
+        client_index_init(&shard->token_index, client_hash_token);
+        client_index_init(&shard->id_index, client_hash_id);
+        __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+    }
+
+    pthread_mutex_lock(&expiry_mutex);
+    expiry_heap_count = 0;
+    pthread_mutex_unlock(&expiry_mutex);
+}
+
+/** Locks every shard of the client list, in order.
+ * Use LOCK_CLIENT_LIST() rather than calling this directly.
+ */
+void
+client_list_lock_all(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++)
+        pthread_mutex_lock(&shards[i].mutex);
+}
+
+/** Unlocks every shard of the client list.
+ * Use UNLOCK_CLIENT_LIST() rather than calling this directly.
+ */
+void
+client_list_unlock_all(void)
+{
+    unsigned int i;
+
+    for (i = CLIENT_LIST_SHARDS; i > 0; i--)
+        pthread_mutex_unlock(&shards[i - 1].mutex);
+}
+
+/** Locks the shard a MAC address belongs to.
+ * Use LOCK_CLIENT_SHARD() rather than calling this directly. A thread must
+ * not hold more than one shard lock, or a shard lock and LOCK_CLIENT_LIST.
+ * @param mac MAC address of the client about to be looked up or changed
+ */
+void
+client_list_lock_shard(const t_mac * mac)
+{
+    pthread_mutex_lock(&shards[client_shard_of_mac(mac)].mutex);
 }
 
-/** Insert client at head of list. Lock should be held when calling this!
+/** Unlocks the shard a MAC address belongs to.
+ * @param mac MAC address given to client_list_lock_shard()
+ */
+void
+client_list_unlock_shard(const t_mac * mac)
+{
+    pthread_mutex_unlock(&shards[client_shard_of_mac(mac)].mutex);
+}
+
+/** Insert client at head of its shard. The IP and MAC address of the client
+ * must be set. The shard lock for that MAC should be held when calling this!
  * @param Pointer to t_client object.
  */
 void
 client_list_insert_client(t_client * client)
 {
-    t_client *prev_head;
+    t_client_shard *shard;
 
     pthread_mutex_lock(&client_id_mutex);
     client->id = client_id++;
     pthread_mutex_unlock(&client_id_mutex);
-    prev_head = firstclient;
-    client->next = prev_head;
-    firstclient = client;
+
+    client->shard = client_shard_of_mac(&client->mac);
+    shard = &shards[client->shard];
+
+    client->prev = NULL;
+    client->next = shard->first;
+    if (NULL != shard->first)
+        shard->first->prev = client;
+    shard->first = client;
+
+    client_index_insert(&shard->ip_index, client);
+    client_index_insert(&shard->mac_index, client);
+    client_index_insert(&shard->token_index, client);
+    client_index_insert(&shard->id_index, client);
+
+    client->expiry_slot = 0;
+    client_list_reschedule(client);
+
+    client->state_slot = 0;
+    client_state_store(client);
+
+    __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
 }
 
 /** Based on the parameters it receives, this function creates a new entry
  * in the connections list. All the memory allocation is done here.
- * Client is inserted at the head of the list.
- * @param ip IP address
+ * Client is inserted at the head of its shard, whose lock should be held.
+ * @param ip IP address, network byte order
  * @param mac MAC address
  * @param token Token
  * @return Pointer to the client we just created
  */
 t_client *
-client_list_add(const char *ip, const char *mac, const char *token)
+client_list_add(uint32_t ip, const t_mac * mac, const char *token)
 {
     t_client *curclient;
+    char ipstr[IP_STR_LEN];
 
     curclient = client_get_new();
 
-    curclient->ip = safe_strdup(ip);
-    curclient->mac = safe_strdup(mac);
-    curclient->token = safe_strdup(token);
+    curclient->ip = ip;
+    curclient->mac = *mac;
+    client_set_token(curclient, token);
+    if (strlen(token) >= CLIENT_STATE_TOKEN_LEN)
+        debug(LOG_INFO, "Token of the client at %s is longer than %d characters, the client will not be kept in the "
+              "client state file", format_ip(ip, ipstr), CLIENT_STATE_TOKEN_LEN - 1);
     curclient->counters.incoming_delta = curclient->counters.outgoing_delta = 
             curclient->counters.incoming = curclient->counters.incoming_history = curclient->counters.outgoing =
         curclient->counters.outgoing_history = 0;
@@ -129,45 +789,145 @@ client_list_add(const char *ip, const char *mac, const char *token)
 
     client_list_insert_client(curclient);
 
-    debug(LOG_INFO, "Added a new client to linked list: IP: %s Token: %s", ip, token);
+    debug(LOG_INFO, "Added a new client to linked list: IP: %s Token: %s", format_ip(ip, ipstr), token);
 
     return curclient;
 }
 
-/** Duplicate the whole client list to process in a thread safe way
- * MUTEX MUST BE HELD.
- * @param dest pointer TO A POINTER to a t_client (i.e.: t_client **ptr)
- * @return int Number of clients copied
+/** Replaces the token of a client in the list, keeping the token index
+ * consistent. The shard lock of the client should be held when calling this!
+ * @param client Client on the list
+ * @param token New token
  */
-int
-client_list_dup(t_client ** dest)
+void
+client_list_update_token(t_client * client, const char *token)
+{
+    t_client_shard *shard = &shards[client->shard];
+
+    client_index_remove(&shard->token_index, client);
+    client_set_token(client, token);
+    client_index_insert(&shard->token_index, client);
+
+    client_state_store(client);
+
+    __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
+}
+
+/** Make in-place changes to a client visible to readers and write them to
+ * the state file.
+ * Adding, removing and re-keying clients publish on their own, but callers
+ * that modify the state or counters of a client on the list must call this.
+ * The shard lock of the client should be held when calling this!
+ * @param client Client on the list that was changed
+ */
+void
+client_list_publish(t_client * client)
+{
+    client_state_store(client);
+    __atomic_add_fetch(&shards[client->shard].generation, 1, __ATOMIC_RELEASE);
+}
+
+/** @internal
+ * Generation of the whole list: the sum of the shard generations, which
+ * changes whenever any of them does. No lock is needed: each generation is
+ * read atomically and only grows, so the sum only equals an earlier one if
+ * no shard changed in between.
+ */
+static unsigned long
+client_list_generation(void)
 {
-    t_client *new, *cur, *top, *prev;
-    int copied = 0;
+    unsigned long generation = 0;
+    unsigned int i;
 
-    cur = firstclient;
-    new = top = prev = NULL;
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++)
+        generation += __atomic_load_n(&shards[i].generation, __ATOMIC_ACQUIRE);
+    return generation;
+}
 
-    if (NULL == cur) {
-        *dest = new;            /* NULL */
-        return copied;
+/** @internal
+ * Drops a reference to a snapshot. snapshot_mutex must be held.
+ */
+static void
+_client_list_snapshot_unref(t_client_snapshot * snapshot)
+{
+    int i;
+
+    if (--snapshot->refcount == 0) {
+        for (i = 0; i < snapshot->count; i++)
+            if (snapshot->clients[i].token != snapshot->clients[i].token_buf)
+                free(snapshot->clients[i].token);
+        free(snapshot->clients);
+        free(snapshot);
     }
+}
 
-    while (NULL != cur) {
-        new = client_dup(cur);
-        if (NULL == top) {
-            /* first item */
-            top = new;
-        } else {
-            prev->next = new;
-        }
-        prev = new;
-        copied++;
-        cur = cur->next;
+/** Get a reference to a read-only snapshot of the client list.
+ * If the list has not changed since the last snapshot was built, that one is
+ * shared and no shard lock is taken at all. Otherwise a new one is built with
+ * a single flat copy of the list.
+ * NO SHARD LOCK MAY BE HELD.
+ * @return The snapshot, to be given back with client_list_snapshot_release()
+ */
+t_client_snapshot *
+client_list_snapshot(void)
+{
+    t_client_snapshot *snapshot;
+    t_client *cur;
+    int size;
+
+    pthread_mutex_lock(&snapshot_mutex);
+    snapshot = current_snapshot;
+    if (NULL != snapshot && snapshot->generation == client_list_generation()) {
+        snapshot->refcount++;
+        pthread_mutex_unlock(&snapshot_mutex);
+        return snapshot;
+    }
+    pthread_mutex_unlock(&snapshot_mutex);
+
+    snapshot = safe_malloc(sizeof(t_client_snapshot));
+
+    LOCK_CLIENT_LIST();
+    snapshot->generation = client_list_generation();
+    for (size = 0, cur = client_get_first_client(); NULL != cur; cur = client_get_next_client(cur))
+        size++;
+    snapshot->clients = safe_malloc((size > 0 ? size : 1) * sizeof(t_client));
+    for (cur = client_get_first_client(); NULL != cur; cur = client_get_next_client(cur)) {
+        snapshot->clients[snapshot->count] = *cur;
+        client_own_token(&snapshot->clients[snapshot->count], cur);
+        snapshot->clients[snapshot->count].next = NULL;
+        snapshot->clients[snapshot->count].prev = NULL;
+        snapshot->clients[snapshot->count].expiry_slot = 0;
+        snapshot->clients[snapshot->count].state_slot = 0;
+        snapshot->count++;
+    }
+    UNLOCK_CLIENT_LIST();
+
+    /* One reference for the caller, one for being current */
+    snapshot->refcount = 2;
+
+    pthread_mutex_lock(&snapshot_mutex);
+    if (NULL != current_snapshot && current_snapshot->generation > snapshot->generation) {
+        /* Someone else built a newer one meanwhile, ours is only for us */
+        snapshot->refcount--;
+    } else {
+        if (NULL != current_snapshot)
+            _client_list_snapshot_unref(current_snapshot);
+        current_snapshot = snapshot;
     }
+    pthread_mutex_unlock(&snapshot_mutex);
 
-    *dest = top;
-    return copied;
+    return snapshot;
+}
+
+/** Drop a reference obtained from client_list_snapshot()
+ * @param snapshot Snapshot to release, must not be used afterwards
+ */
+void
+client_list_snapshot_release(t_client_snapshot * snapshot)
+{
+    pthread_mutex_lock(&snapshot_mutex);
+    _client_list_snapshot_unref(snapshot);
+    pthread_mutex_unlock(&snapshot_mutex);
 }
 
 /** Create a duplicate of a client.
@@ -178,6 +938,7 @@ t_client *
 client_dup(const t_client * src)
 {
     t_client *new = NULL;
+    unsigned short slab_index;
     
     if (NULL == src) {
         return NULL;
@@ -185,57 +946,56 @@ client_dup(const t_client * src)
     
     new = client_get_new();
 
-    new->id = src->id;
-    new->ip = safe_strdup(src->ip);
-    new->mac = safe_strdup(src->mac);
-    new->token = safe_strdup(src->token);
-    new->counters.incoming = src->counters.incoming;
-    new->counters.incoming_history = src->counters.incoming_history;
-    new->counters.incoming_delta = src->counters.incoming_delta;
-    new->counters.outgoing = src->counters.outgoing;
-    new->counters.outgoing_history = src->counters.outgoing_history;
-    new->counters.outgoing_delta = src->counters.outgoing_delta;
-    new->counters.last_updated = src->counters.last_updated;
+    slab_index = new->slab_index;
+    *new = *src;
+    new->slab_index = slab_index;
+    client_own_token(new, src);
     new->next = NULL;
+    new->prev = NULL;
+    new->expiry_slot = 0;
+    new->state_slot = 0;
 
     return new;
 }
 
 /** Find a client in the list from a client struct, matching operates by id.
  * This is useful from a copy of client to find the original.
+ * Only the shard lock of the client's MAC needs to be held.
  * @param client Client to find
  * @return pointer to the client in the list.
  */
 t_client *
 client_list_find_by_client(t_client * client)
 {
-    t_client *c = firstclient;
+    t_client *c;
+    size_t probe = 0;
+    unsigned long hash = hash_id(client->id);
 
-    while (NULL != c) {
+    while (NULL != (c = client_index_next(&shards[client->shard].id_index, hash, &probe))) {
         if (c->id == client->id) {
             return c;
         }
-        c = c->next;
     }
     return NULL;
 }
 
 /** Finds a  client by its IP and MAC, returns NULL if the client could not
- * be found
+ * be found. Only the shard lock of the MAC needs to be held.
  * @param ip IP we are looking for in the linked list
  * @param mac MAC we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
 t_client *
-client_list_find(const char *ip, const char *mac)
+client_list_find(uint32_t ip, const t_mac * mac)
 {
     t_client *ptr;
+    size_t probe = 0;
+    unsigned long hash = hash_id(ip);
+    const t_client_index *index = &shards[client_shard_of_mac(mac)].ip_index;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->ip, ip) && 0 == strcmp(ptr->mac, mac))
+    while (NULL != (ptr = client_index_next(index, hash, &probe))) {
+        if (ptr->ip == ip && 0 == memcmp(&ptr->mac, mac, sizeof(t_mac)))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
@@ -243,20 +1003,24 @@ client_list_find(const char *ip, const char *mac)
 
 /**
  * Finds a  client by its IP, returns NULL if the client could not
- * be found
+ * be found. Every shard is searched, so LOCK_CLIENT_LIST must be held.
  * @param ip IP we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
 t_client *
-client_list_find_by_ip(const char *ip)
+client_list_find_by_ip(uint32_t ip)
 {
     t_client *ptr;
+    size_t probe;
+    unsigned long hash = hash_id(ip);
+    unsigned int i;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->ip, ip))
-            return ptr;
-        ptr = ptr->next;
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++) {
+        probe = 0;
+        while (NULL != (ptr = client_index_next(&shards[i].ip_index, hash, &probe))) {
+            if (ptr->ip == ip)
+                return ptr;
+        }
     }
 
     return NULL;
@@ -264,26 +1028,28 @@ client_list_find_by_ip(const char *ip)
 
 /**
  * Finds a  client by its Mac, returns NULL if the client could not
- * be found
+ * be found. Only the shard lock of the MAC needs to be held.
  * @param mac Mac we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
 t_client *
-client_list_find_by_mac(const char *mac)
+client_list_find_by_mac(const t_mac * mac)
 {
     t_client *ptr;
+    size_t probe = 0;
+    unsigned long hash = hash_mac(mac);
+    const t_client_index *index = &shards[client_shard_of_mac(mac)].mac_index;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->mac, mac))
+    while (NULL != (ptr = client_index_next(index, hash, &probe))) {
+        if (0 == memcmp(&ptr->mac, mac, sizeof(t_mac)))
             return ptr;
-        ptr = ptr->next;
     }
 
     return NULL;
 }
 
 /** Finds a client by its token
+ * Every shard is searched, so LOCK_CLIENT_LIST must be held.
  * @param token Token we are looking for in the linked list
  * @return Pointer to the client, or NULL if not found
  */
@@ -291,12 +1057,16 @@ t_client *
 client_list_find_by_token(const char *token)
 {
     t_client *ptr;
+    size_t probe;
+    unsigned long hash = hash_string(token);
+    unsigned int i;
 
-    ptr = firstclient;
-    while (NULL != ptr) {
-        if (0 == strcmp(ptr->token, token))
-            return ptr;
-        ptr = ptr->next;
+    for (i = 0; i < CLIENT_LIST_SHARDS; i++) {
+        probe = 0;
+        while (NULL != (ptr = client_index_next(&shards[i].token_index, hash, &probe))) {
+            if (0 == strcmp(ptr->token, token))
+                return ptr;
+        }
     }
 
     return NULL;
@@ -320,24 +1090,34 @@ client_list_destroy(t_client * list)
 
 /** @internal
  * @brief Frees the memory used by a t_client structure
- * This function frees the memory used by the t_client structure in the
- * proper order.
+ * This function puts the client back on the free list of its slab, and
+ * frees the slab if none of its clients is in use any more.
  * @param client Points to the client to be freed
  */
 void
 client_free_node(t_client * client)
 {
+    t_client_slab *slab = CLIENT_SLAB_OF(client);
 
-    if (client->mac != NULL)
-        free(client->mac);
-
-    if (client->ip != NULL)
-        free(client->ip);
-
-    if (client->token != NULL)
+    if (client->token != client->token_buf)
         free(client->token);
-
-    free(client);
+    pthread_mutex_lock(&client_pool_mutex);
+    if (NULL == slab->free_list)
+        client_slab_link(slab);
+    client->next = slab->free_list;
+    slab->free_list = client;
+    slab->in_use--;
+    client_pool_in_use--;
+    if (0 == slab->in_use) {
+        client_slab_unlink(slab);
+        if (NULL == client_spare_slab) {
+            client_spare_slab = slab;
+        } else {
+            free(slab);
+            client_pool_slabs--;
+        }
+    }
+    pthread_mutex_unlock(&client_pool_mutex);
 }
 
 /**
@@ -357,29 +1137,41 @@ client_list_delete(t_client * client)
 /**
  * @brief Removes a client from the connections list
  *
+ * The shard lock of the client should be held when calling this!
  * @param client Points to the client to be deleted
  */
 void
 client_list_remove(t_client * client)
 {
-    t_client *ptr;
-
-    ptr = firstclient;
+    t_client_shard *shard = &shards[client->shard];
 
-    if (ptr == NULL) {
+    if (NULL == shard->first) {
         debug(LOG_ERR, "Node list empty!");
-    } else if (ptr == client) {
-        firstclient = ptr->next;
-    } else {
-        /* Loop forward until we reach our point in the list. */
-        while (ptr->next != NULL && ptr->next != client) {
-            ptr = ptr->next;
-        }
-        /* If we reach the end before finding out element, complain. */
-        if (ptr->next == NULL) {
-            debug(LOG_ERR, "Node to delete could not be found.");
-        } else {
-            ptr->next = client->next;
-        }
+        return;
+    } else if (client_list_find_by_client(client) != client) {
+        /* Not on the list, or a copy of a client that is. */
+        debug(LOG_ERR, "Node to delete could not be found.");
+        return;
     }
+
+    client_index_remove(&shard->ip_index, client);
+    client_index_remove(&shard->mac_index, client);
+    client_index_remove(&shard->token_index, client);
+    client_index_remove(&shard->id_index, client);
+
+    pthread_mutex_lock(&expiry_mutex);
+    client_expiry_remove(client);
+    pthread_mutex_unlock(&expiry_mutex);
+
+    client_state_forget(client);
+
+    if (NULL != client->prev)
+        client->prev->next = client->next;
+    else
+        shard->first = client->next;
+    if (NULL != client->next)
+        client->next->prev = client->prev;
+    client->next = client->prev = NULL;
+
+    __atomic_add_fetch(&shard->generation, 1, __ATOMIC_RELEASE);
 }
@@ -28,8 +28,7 @@
 #ifndef _CLIENT_LIST_H_
 #define _CLIENT_LIST_H_
 
-/** Global mutex to protect access to the client list */
-extern pthread_mutex_t client_list_mutex;
+#include "util.h"
 
 /** Counters struct for a client's bandwidth usage (in bytes)
  */
@@ -44,32 +43,82 @@ typedef struct _t_counters {
     time_t last_updated;        /**< @brief Last update of the counters */
 } t_counters;
 
+/** Size of the inline token buffer of a client, enough for the usual hex
+ * digests and UUIDs. Longer tokens are kept on the heap instead. */
+#define CLIENT_TOKEN_LEN 40
+
 /** Client node for the connected client linked list.
+ * Fields are stored inline so that a client is a single fixed size record,
+ * allocated from the client pool. Addresses are kept in binary form and only
+ * formatted (format_ip(), format_mac()) for logs, URLs and commands.
  */
 typedef struct _t_client {
     struct _t_client *next;             /**< @brief Pointer to the next client */
+    struct _t_client *prev;             /**< @brief Pointer to the previous client */
     unsigned long long id;           /**< @brief Unique ID per client */
-    char *ip;                           /**< @brief Client Ip address */
-    char *mac;                          /**< @brief Client Mac address */
-    char *token;                        /**< @brief Client token */
+    unsigned int shard;                 /**< @brief Shard of the client list, from the MAC */
     int fw_connection_state;     /**< @brief Connection state in the
 						     firewall */
     int fd;                             /**< @brief Client HTTP socket (valid only
 					     during login before one of the
 					     _http_* function is called */
+    uint32_t ip;                        /**< @brief Client Ip address, network byte order */
+    t_mac mac;                          /**< @brief Client Mac address */
+    unsigned short slab_index;          /**< @brief @internal Position in its slab of the client pool */
     t_counters counters;                /**< @brief Counters for input/output of
 					     the client. */
+    char *token;                        /**< @brief Client token, token_buf or a heap copy if it does not fit,
+                                             set with client_set_token() */
+    time_t expires;                     /**< @brief @internal Inactivity deadline, see client_list_reschedule() */
+    unsigned int expiry_slot;           /**< @brief @internal Position in the expiry heap, 0 when not in it */
+    unsigned int state_slot;            /**< @brief @internal Slot in the state file, 0 when not in it */
+    char token_buf[CLIENT_TOKEN_LEN];   /**< @brief @internal Inline storage of the token */
 } t_client;
 
+/** Usage statistics of the client pool */
+typedef struct _t_client_pool_stats {
+    unsigned long slabs;        /**< @brief Slabs allocated from the heap */
+    unsigned long in_use;       /**< @brief Clients currently handed out */
+    unsigned long free;         /**< @brief Clients waiting on the free list */
+    unsigned long bytes;        /**< @brief Heap used by the pool */
+} t_client_pool_stats;
+
+/** Read-only copy of the client list at a given generation.
+ * Readers iterate clients[0..count-1] without holding any lock; the
+ * copies are flat (no list pointers to follow, next/prev are NULL). A snapshot is
+ * shared by all readers until the list changes.
+ */
+typedef struct _t_client_snapshot {
+    unsigned long generation;   /**< @brief Generation of the list this is a copy of */
+    int count;                  /**< @brief Number of clients */
+    t_client *clients;          /**< @brief Copies of the clients */
+    int refcount;               /**< @brief @internal Readers holding this snapshot, plus one while current */
+} t_client_snapshot;
+
 /** @brief Get a new client struct, not added to the list yet */
 t_client *client_get_new(void);
 
 /** @brief Get the first element of the list of connected clients */
 t_client *client_get_first_client(void);
 
+/** @brief Get the next element of the list of connected clients */
+t_client *client_get_next_client(t_client *);
+
 /** @brief Initializes the client list */
 void client_list_init(void);
 
+/** @brief Locks all shards of the client list */
+void client_list_lock_all(void);
+
+/** @brief Unlocks all shards of the client list */
+void client_list_unlock_all(void);
+
+/** @brief Locks the shard of the client list a MAC belongs to */
+void client_list_lock_shard(const t_mac *);
+
+/** @brief Unlocks the shard of the client list a MAC belongs to */
+void client_list_unlock_shard(const t_mac *);
+
 /** @brief Insert client at head of list */
 void client_list_insert_client(t_client *);
 
@@ -77,26 +126,44 @@ void client_list_insert_client(t_client *);
 void client_list_destroy(t_client *);
 
 /** @brief Adds a new client to the connections list */
-t_client *client_list_add(const char *, const char *, const char *);
+t_client *client_list_add(uint32_t, const t_mac *, const char *);
+
+/** @brief Replaces the token of a client on the list */
+void client_list_update_token(t_client *, const char *);
+
+/** @brief Get a reference to a read-only snapshot of the client list */
+t_client_snapshot *client_list_snapshot(void);
 
-/** Duplicate the whole client list to process in a thread safe way */
-int client_list_dup(t_client **);
+/** @brief Drop a reference obtained from client_list_snapshot() */
+void client_list_snapshot_release(t_client_snapshot *);
+
+/** @brief Recompute the inactivity deadline of a client after its counters.last_updated changed */
+void client_list_reschedule(t_client *);
+
+/** @brief Earliest inactivity deadline of all clients */
+time_t client_list_next_expiry(void);
+
+/** @brief Take the next client whose inactivity deadline has passed off the expiry schedule */
+int client_list_pop_expired(time_t, t_client *);
+
+/** @brief Make in-place changes to clients visible to the next snapshot */
+void client_list_publish(t_client *);
 
 /** @brief Create a duplicate of a client. */
 t_client *client_dup(const t_client *);
 
 /** @brief Finds a client by its IP and MAC */
-t_client *client_list_find(const char *, const char *);
+t_client *client_list_find(uint32_t, const t_mac *);
 
 /** @brief Find a client in the list from a client struct, matching operates by id. */
 t_client *client_list_find_by_client(t_client *);
 
 /** @brief Finds a client only by its IP */
-t_client *client_list_find_by_ip(const char *); /* needed by fw_iptables.c, auth.c 
-                                                 * and wdctl_thread.c */
+t_client *client_list_find_by_ip(uint32_t); /* needed by fw_iptables.c
+                                             * and wdctl_thread.c */
 
 /** @brief Finds a client only by its Mac */
-t_client *client_list_find_by_mac(const char *);        /* needed by wdctl_thread.c */
+t_client *client_list_find_by_mac(const t_mac *);        /* needed by wdctl_thread.c */
 
 /** @brief Finds a client by its token */
 t_client *client_list_find_by_token(const char *);
@@ -110,16 +177,38 @@ void client_list_remove(t_client *);
 /** @brief Free memory associated with a client */
 void client_free_node(t_client *);
 
+/** @brief Sets the token of a client that is not on the list */
+void client_set_token(t_client *, const char *);
+
+/** @brief Get usage statistics of the client pool */
+void client_pool_get_stats(t_client_pool_stats *);
+
+/** Locks the whole client list, needed to walk it or to look clients up by
+ * IP or token. */
 #define LOCK_CLIENT_LIST() do { \
 	debug(LOG_DEBUG, "Locking client list"); \
-	pthread_mutex_lock(&client_list_mutex); \
+	client_list_lock_all(); \
 	debug(LOG_DEBUG, "Client list locked"); \
 } while (0)
 
 #define UNLOCK_CLIENT_LIST() do { \
 	debug(LOG_DEBUG, "Unlocking client list"); \
-	pthread_mutex_unlock(&client_list_mutex); \
+	client_list_unlock_all(); \
 	debug(LOG_DEBUG, "Client list unlocked"); \
 } while (0)
 
+/** Locks the part of the client list a MAC belongs to, enough to look that
+ * client up by MAC (or IP and MAC), add it, change it or remove it. */
+#define LOCK_CLIENT_SHARD(mac) do { \
+	debug(LOG_DEBUG, "Locking client list shard"); \
+	client_list_lock_shard(mac); \
+	debug(LOG_DEBUG, "Client list shard locked"); \
+} while (0)
+
+#define UNLOCK_CLIENT_SHARD(mac) do { \
+	debug(LOG_DEBUG, "Unlocking client list shard"); \
+	client_list_unlock_shard(mac); \
+	debug(LOG_DEBUG, "Client list shard unlocked"); \
+} while (0)
+
 #endif                          /* _CLIENT_LIST_H_ */
@@ -0,0 +1,349 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file client_state.c
+    @brief Persistent copy of the client list in a memory-mapped file
+
+    Every client on the list owns a fixed size slot of the state file, which
+    is rewritten whenever the client list publishes a change to that client.
+    The file is mapped shared, so what was written survives a crash of
+    wifidog; on the next start the valid slots are loaded back into the client
+    list and fw_init() reinstalls their rules without asking the auth server.
+
+    Each slot carries its own checksum, so a slot torn by a crash in the
+    middle of a write is simply skipped. The header records a magic number,
+    a format version and the slot size; a file that does not match them is
+    discarded.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "client_list.h"
+#include "client_state.h"
+
+/** Identifies a wifidog client state file ("WDCS") */
+#define CLIENT_STATE_MAGIC 0x53434457
+/** Bump whenever t_client_state_record changes */
+#define CLIENT_STATE_VERSION 1
+/** Number of slots of a new state file, doubled as needed */
+#define CLIENT_STATE_MIN_SLOTS 256
+
+/** @internal
+ * Start of the state file
+ */
+typedef struct _t_client_state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t record_size;       /**< @brief sizeof(t_client_state_record) when written */
+    uint32_t slots;             /**< @brief Number of records following the header */
+} t_client_state_header;
+
+/** @internal
+ * One client in the state file
+ */
+typedef struct _t_client_state_record {
+    uint32_t checksum;          /**< @brief FNV-1a of the rest of the record */
+    uint32_t in_use;
+    uint32_t ip;
+    unsigned char mac[6];
+    unsigned char pad[2];
+    int32_t fw_connection_state;
+    uint64_t incoming;
+    uint64_t outgoing;
+    int64_t last_updated;
+    char token[CLIENT_STATE_TOKEN_LEN];
+} t_client_state_record;
+
+static uint32_t client_state_checksum(const t_client_state_record *);
+static int client_state_map(uint32_t);
+static int client_state_grow(void);
+
+/** @internal
+ * The mapped file and its free slots, protected by client_state_mutex.
+ * state_map is NULL when persistence is disabled or failed.
+ */
+static int state_fd = -1;
+static t_client_state_header *state_map = NULL;
+static uint32_t *state_free = NULL;
+static uint32_t state_free_count = 0;
+static pthread_mutex_t client_state_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define STATE_RECORDS() ((t_client_state_record *)(state_map + 1))
+#define STATE_FILE_SIZE(slots) (sizeof(t_client_state_header) + (size_t)(slots) * sizeof(t_client_state_record))
+
+/** @internal
+ * Checksum of a record, over everything but the checksum itself
+ */
+static uint32_t
+client_state_checksum(const t_client_state_record * record)
+{
+    const unsigned char *p = (const unsigned char *)record + sizeof(record->checksum);
+    const unsigned char *end = (const unsigned char *)record + sizeof(t_client_state_record);
+    uint32_t h = 2166136261U;
+
+    while (p < end) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/** @internal
+ * Sizes the state file for a number of slots and maps it, all slots from
+ * the previous mapping (if any) being kept. New slots are empty and added
+ * to the free list.
+ * @return 0 on success, -1 on error
+ */
+static int
+client_state_map(uint32_t slots)
+{
+    uint32_t old_slots = state_map ? state_map->slots : 0;
+    uint32_t i;
+    void *map;
+
+    if (state_map)
+        munmap(state_map, STATE_FILE_SIZE(old_slots));
+    state_map = NULL;
+
+    if (ftruncate(state_fd, STATE_FILE_SIZE(slots)) == -1) {
+        debug(LOG_ERR, "Could not resize client state file: %s", strerror(errno));
+        return -1;
+    }
+    map = mmap(NULL, STATE_FILE_SIZE(slots), PROT_READ | PROT_WRITE, MAP_SHARED, state_fd, 0);
+    if (MAP_FAILED == map) {
+        debug(LOG_ERR, "Could not map client state file: %s", strerror(errno));
+        return -1;
+    }
+    state_map = map;
+    state_map->magic = CLIENT_STATE_MAGIC;
+    state_map->version = CLIENT_STATE_VERSION;
+    state_map->record_size = sizeof(t_client_state_record);
+    state_map->slots = slots;
+
+    state_free = safe_realloc(state_free, slots * sizeof(uint32_t));
+    for (i = slots; i > old_slots; i--)
+        state_free[state_free_count++] = i;
+
+    return 0;
+}
+
+/** @internal
+ * Doubles the number of slots. On failure persistence is turned off.
+ * client_state_mutex must be held.
+ * @return 0 on success, -1 on error
+ */
+static int
+client_state_grow(void)
+{
+    if (client_state_map(state_map->slots * 2) == -1) {
+        debug(LOG_ERR, "Client state will not be persisted any more");
+        close(state_fd);
+        state_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+/** Maps the client state file. A new file is written next to it with
+ * every client currently on the list, plus, if asked to, the clients the
+ * old file held when wifidog last ran, which are added to the client list
+ * first. The new file then replaces the old one, so a crash in between
+ * leaves the old file in place. Must be called before any thread is started.
+ * @param path Path of the state file, NULL to disable persistence
+ * @param load Whether to load the clients found in the file
+ * @return Number of clients loaded from the file
+ */
+int
+client_state_init(const char *path, int load)
+{
+    t_client_state_header header;
+    t_client_state_record *records = NULL, *record;
+    t_client *client;
+    t_mac mac;
+    struct stat st;
+    char *tmp_path;
+    uint32_t i, count = 0;
+    int fd, loaded = 0;
+
+    if (NULL == path)
+        return 0;
+
+    /* Copy out the valid records of the previous run */
+    if (load && (fd = open(path, O_RDONLY)) != -1) {
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t) sizeof(header)
+            && read(fd, &header, sizeof(header)) == sizeof(header)) {
+            if (header.magic != CLIENT_STATE_MAGIC || header.version != CLIENT_STATE_VERSION
+                || header.record_size != sizeof(t_client_state_record)
+                || st.st_size < (off_t) STATE_FILE_SIZE(header.slots)) {
+                debug(LOG_WARNING, "Ignoring client state file %s: wrong format or truncated", path);
+            } else {
+                records = safe_malloc((header.slots ? header.slots : 1) * sizeof(t_client_state_record));
+                for (i = 0; i < header.slots; i++) {
+                    record = &records[count];
+                    if (read(fd, record, sizeof(t_client_state_record)) != sizeof(t_client_state_record))
+                        break;
+                    if (record->in_use && record->checksum == client_state_checksum(record))
+                        count++;
+                }
+            }
+        }
+        close(fd);
+    }
+
+    /* The clients are loaded even if the file cannot be rewritten */
+    for (i = 0; i < count; i++) {
+        record = &records[i];
+        record->token[CLIENT_STATE_TOKEN_LEN - 1] = '\0';
+        client = client_get_new();
+        client->ip = record->ip;
+        memcpy(client->mac.addr, record->mac, sizeof(client->mac.addr));
+        client_set_token(client, record->token);
+        client->fw_connection_state = record->fw_connection_state;
+        client->counters.incoming = client->counters.incoming_history = record->incoming;
+        client->counters.outgoing = client->counters.outgoing_history = record->outgoing;
+        client->counters.last_updated = record->last_updated;
+
+        memcpy(mac.addr, record->mac, sizeof(mac.addr));
+        LOCK_CLIENT_SHARD(&mac);
+        if (NULL == client_list_find(client->ip, &mac)) {
+            client_list_insert_client(client);
+            client = NULL;
+            loaded++;
+        }
+        UNLOCK_CLIENT_SHARD(&mac);
+        if (NULL != client)
+            client_free_node(client);
+    }
+    free(records);
+
+    /* Build the new file, large enough for everything */
+    safe_asprintf(&tmp_path, "%s.tmp", path);
+    if ((state_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+        debug(LOG_ERR, "Could not create client state file %s: %s", tmp_path, strerror(errno));
+        free(tmp_path);
+        return loaded;
+    }
+    if (client_state_map(count * 2 > CLIENT_STATE_MIN_SLOTS ? count * 2 : CLIENT_STATE_MIN_SLOTS) == -1) {
+        close(state_fd);
+        state_fd = -1;
+        unlink(tmp_path);
+        free(tmp_path);
+        return loaded;
+    }
+
+    /* Clients just loaded, and those inherited from a parent on restart */
+    LOCK_CLIENT_LIST();
+    for (client = client_get_first_client(); NULL != client; client = client_get_next_client(client))
+        client_state_store(client);
+    UNLOCK_CLIENT_LIST();
+
+    if (msync(state_map, STATE_FILE_SIZE(state_map->slots), MS_SYNC) == -1 || rename(tmp_path, path) == -1) {
+        debug(LOG_ERR, "Could not replace client state file %s: %s", path, strerror(errno));
+        debug(LOG_ERR, "Client state will not be persisted");
+        pthread_mutex_lock(&client_state_mutex);
+        munmap(state_map, STATE_FILE_SIZE(state_map->slots));
+        state_map = NULL;
+        close(state_fd);
+        state_fd = -1;
+        pthread_mutex_unlock(&client_state_mutex);
+        unlink(tmp_path);
+        free(tmp_path);
+        return loaded;
+    }
+    free(tmp_path);
+
+    debug(LOG_INFO, "Client state file %s mapped, %d clients loaded", path, loaded);
+    return loaded;
+}
+
+/** Writes a client to its slot of the state file, allocating one the first
+ * time. Called by the client list whenever a client changes.
+ * @param client Client on the list
+ */
+void
+client_state_store(t_client * client)
+{
+    t_client_state_record record;
+    size_t len = strlen(client->token);
+
+    /* Tokens that do not fit in a record are not kept, see client_list_add() */
+    if (len >= sizeof(record.token)) {
+        client_state_forget(client);
+        return;
+    }
+
+    pthread_mutex_lock(&client_state_mutex);
+    if (NULL == state_map) {
+        pthread_mutex_unlock(&client_state_mutex);
+        return;
+    }
+    if (0 == client->state_slot) {
+        if (0 == state_free_count && client_state_grow() == -1) {
+            pthread_mutex_unlock(&client_state_mutex);
+            return;
+        }
+        client->state_slot = state_free[--state_free_count];
+    }
+
+    memset(&record, 0, sizeof(record));
+    record.in_use = 1;
+    record.ip = client->ip;
+    memcpy(record.mac, client->mac.addr, sizeof(record.mac));
+    record.fw_connection_state = client->fw_connection_state;
+    record.incoming = client->counters.incoming;
+    record.outgoing = client->counters.outgoing;
+    record.last_updated = client->counters.last_updated;
+    memcpy(record.token, client->token, len + 1);
+    record.checksum = client_state_checksum(&record);
+
+    memcpy(&STATE_RECORDS()[client->state_slot - 1], &record, sizeof(record));
+    pthread_mutex_unlock(&client_state_mutex);
+}
+
+/** Frees the slot of a client that is leaving the list.
+ * @param client Client being removed from the list
+ */
+void
+client_state_forget(t_client * client)
+{
+    pthread_mutex_lock(&client_state_mutex);
+    if (NULL != state_map && 0 != client->state_slot) {
+        memset(&STATE_RECORDS()[client->state_slot - 1], 0, sizeof(t_client_state_record));
+        state_free[state_free_count++] = client->state_slot;
+    }
+    client->state_slot = 0;
+    pthread_mutex_unlock(&client_state_mutex);
+}
@@ -0,0 +1,44 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file client_state.h
+    @brief Persistent copy of the client list in a memory-mapped file
+*/
+
+#ifndef _CLIENT_STATE_H_
+#define _CLIENT_STATE_H_
+
+#include "client_list.h"
+
+/** Size of the token of a record of the state file: clients with a longer
+ * token are not kept in it */
+#define CLIENT_STATE_TOKEN_LEN 65
+
+/** @brief Map the state file, loading the clients it holds into the client list */
+int client_state_init(const char *, int);
+
+/** @brief Write a client to its slot of the state file */
+void client_state_store(t_client *);
+
+/** @brief Free the slot of a client in the state file */
+void client_state_forget(t_client *);
+
+#endif                          /* _CLIENT_STATE_H_ */
@@ -47,6 +47,7 @@
 #include "config.h"
 
 #include "util.h"
+#include "whitelist.h"
 
 /** @internal
  * Holds the current configuration of the gateway */
@@ -91,6 +92,7 @@ typedef enum {
     oHTTPDUsername,
     oHTTPDPassword,
     oClientTimeout,
+    oClientStateFile,
     oCheckInterval,
     oWdctlSocket,
     oSyslogFacility,
@@ -104,6 +106,18 @@ typedef enum {
     oSSLCertPath,
     oSSLAllowedCipherList,
     oSSLUseSNI,
+    oFirewallBackend,
+    oFirewallAccounting,
+    oFirewallQueueDelay,
+    oFirewallFanoutBits,
+    oFirewallConnmark,
+    oAllowedHostTimeout,
+    oDnsSnooping,
+    oDnsSnoopingGroup,
+    oDownloadBandwidth,
+    oUploadBandwidth,
+    oClientDownloadRate,
+    oClientUploadRate,
 } OpCodes;
 
 /** @internal
@@ -128,6 +142,7 @@ static const struct {
     "httpdusername", oHTTPDUsername}, {
     "httpdpassword", oHTTPDPassword}, {
     "clienttimeout", oClientTimeout}, {
+    "clientstatefile", oClientStateFile}, {
     "checkinterval", oCheckInterval}, {
     "syslogfacility", oSyslogFacility}, {
     "wdctlsocket", oWdctlSocket}, {
@@ -151,10 +166,23 @@ static const struct {
     "sslcertpath", oSSLCertPath}, {
     "sslallowedcipherlist", oSSLAllowedCipherList}, {
     "sslusesni", oSSLUseSNI}, {
+    "firewallbackend", oFirewallBackend}, {
+    "firewallaccounting", oFirewallAccounting}, {
+    "firewallqueuedelay", oFirewallQueueDelay}, {
+    "firewallfanoutbits", oFirewallFanoutBits}, {
+    "firewallconnmark", oFirewallConnmark}, {
+    "allowedhosttimeout", oAllowedHostTimeout}, {
+    "dnssnooping", oDnsSnooping}, {
+    "dnssnoopinggroup", oDnsSnoopingGroup}, {
+    "downloadbandwidth", oDownloadBandwidth}, {
+    "uploadbandwidth", oUploadBandwidth}, {
+    "clientdownloadrate", oClientDownloadRate}, {
+    "clientuploadrate", oClientUploadRate}, {
 NULL, oBadOption},};
 
 static void config_notnull(const void *, const char *);
 static int parse_boolean_value(char *);
+static int parse_rate(const char *, const char *, const char *, int);
 static void parse_auth_server(FILE *, const char *, int *);
 static int _parse_firewall_rule(const char *, char *);
 static void parse_firewall_ruleset(const char *, FILE *, const char *, int *);
@@ -193,11 +221,24 @@ config_init(void)
     config.httpdusername = NULL;
     config.httpdpassword = NULL;
     config.clienttimeout = DEFAULT_CLIENTTIMEOUT;
+    config.client_state_file = safe_strdup(DEFAULT_CLIENT_STATE_FILE);
     config.checkinterval = DEFAULT_CHECKINTERVAL;
     config.daemon = -1;
     config.pidfile = NULL;
     config.wdctl_sock = safe_strdup(DEFAULT_WDCTL_SOCK);
     config.internal_sock = safe_strdup(DEFAULT_INTERNAL_SOCK);
+    config.fw_backend = DEFAULT_FW_BACKEND;
+    config.fw_accounting = DEFAULT_FW_ACCOUNTING;
+    config.fw_queue_delay = DEFAULT_FW_QUEUE_DELAY;
+    config.fw_fanout_bits = DEFAULT_FW_FANOUT_BITS;
+    config.fw_connmark = DEFAULT_FW_CONNMARK;
+    config.allowed_host_timeout = DEFAULT_ALLOWED_HOST_TIMEOUT;
+    config.dns_snooping = DEFAULT_DNS_SNOOPING;
+    config.dns_snooping_group = DEFAULT_DNS_SNOOPING_GROUP;
+    config.download_bandwidth = 0;
+    config.upload_bandwidth = 0;
+    config.client_download_rate = 0;
+    config.client_upload_rate = 0;
     config.rulesets = NULL;
     config.trustedmaclist = NULL;
     config.popular_servers = NULL;
@@ -763,6 +804,10 @@ config_read(const char *filename)
                 case oClientTimeout:
                     sscanf(p1, "%d", &config.clienttimeout);
                     break;
+                case oClientStateFile:
+                    free(config.client_state_file);
+                    config.client_state_file = strcmp(p1, "none") == 0 ? NULL : safe_strdup(p1);
+                    break;
                 case oSyslogFacility:
                     sscanf(p1, "%d", &debugconf.syslog_facility);
                     break;
@@ -810,6 +855,88 @@ config_read(const char *filename)
 #endif
 #endif
                     break;
+                case oFirewallBackend:
+                    if (!strcasecmp(p1, "iptables")) {
+                        config.fw_backend = FW_BACKEND_IPTABLES;
+                    } else if (!strcasecmp(p1, "ipset")) {
+                        config.fw_backend = FW_BACKEND_IPSET;
+                    } else if (!strcasecmp(p1, "nftables")) {
+                        config.fw_backend = FW_BACKEND_NFTABLES;
+                    } else {
+                        debug(LOG_ERR, "Bad syntax for Parameter: FirewallBackend on line %d " "in %s."
+                              "The syntax is iptables, ipset or nftables.", linenum, filename);
+                        exit(-1);
+                    }
+                    break;
+                case oFirewallAccounting:
+                    if (!strcasecmp(p1, "rules")) {
+                        config.fw_accounting = FW_ACCOUNTING_RULES;
+                    } else if (!strcasecmp(p1, "nfacct")) {
+                        config.fw_accounting = FW_ACCOUNTING_NFACCT;
+                    } else {
+                        debug(LOG_ERR, "Bad syntax for Parameter: FirewallAccounting on line %d " "in %s."
+                              "The syntax is rules or nfacct.", linenum, filename);
+                        exit(-1);
+                    }
+                    break;
+                case oFirewallQueueDelay:
+                    if (sscanf(p1, "%d", &config.fw_queue_delay) != 1 || config.fw_queue_delay < 0) {
+                        debug(LOG_ERR, "Bad syntax for Parameter: FirewallQueueDelay on line %d " "in %s."
+                              "The syntax is a number of milliseconds.", linenum, filename);
+                        exit(-1);
+                    }
+                    break;
+                case oFirewallFanoutBits:
+                    if (sscanf(p1, "%d", &config.fw_fanout_bits) != 1 || config.fw_fanout_bits < 0
+                        || config.fw_fanout_bits > FW_FANOUT_MAX_BITS) {
+                        debug(LOG_ERR, "Bad syntax for Parameter: FirewallFanoutBits on line %d " "in %s."
+                              "The syntax is a number of bits from 0 to %d.", linenum, filename, FW_FANOUT_MAX_BITS);
+                        exit(-1);
+                    }
+                    break;
+                case oAllowedHostTimeout:
+                    if (sscanf(p1, "%d", &config.allowed_host_timeout) != 1 || config.allowed_host_timeout < 0) {
+                        debug(LOG_ERR, "Bad syntax for Parameter: AllowedHostTimeout on line %d " "in %s."
+                              "The syntax is a number of seconds.", linenum, filename);
+                        exit(-1);
+                    }
+                    break;
+                case oFirewallConnmark:
+                    if ((value = parse_boolean_value(p1)) == -1) {
+                        debug(LOG_ERR, "Bad syntax for Parameter: FirewallConnmark on line %d " "in %s."
+                              "The syntax is yes or no.", linenum, filename);
+                        exit(-1);
+                    }
+                    config.fw_connmark = value;
+                    break;
+                case oDnsSnooping:
+                    if ((value = parse_boolean_value(p1)) == -1) {
+                        debug(LOG_ERR, "Bad syntax for Parameter: DnsSnooping on line %d " "in %s."
+                              "The syntax is yes or no.", linenum, filename);
+                        exit(-1);
+                    }
+                    config.dns_snooping = value;
+                    break;
+                case oDnsSnoopingGroup:
+                    if (sscanf(p1, "%d", &config.dns_snooping_group) != 1 || config.dns_snooping_group < 0
+                        || config.dns_snooping_group > 65535) {
+                        debug(LOG_ERR, "Bad syntax for Parameter: DnsSnoopingGroup on line %d " "in %s."
+                              "The syntax is a number from 0 to 65535.", linenum, filename);
+                        exit(-1);
+                    }
+                    break;
+                case oDownloadBandwidth:
+                    config.download_bandwidth = parse_rate(s, p1, filename, linenum);
+                    break;
+                case oUploadBandwidth:
+                    config.upload_bandwidth = parse_rate(s, p1, filename, linenum);
+                    break;
+                case oClientDownloadRate:
+                    config.client_download_rate = parse_rate(s, p1, filename, linenum);
+                    break;
+                case oClientUploadRate:
+                    config.client_upload_rate = parse_rate(s, p1, filename, linenum);
+                    break;
                 case oBadOption:
                     /* FALL THROUGH */
                 default:
@@ -832,6 +959,8 @@ config_read(const char *filename)
     }
 
     fclose(fd);
+
+    whitelist_load(get_ruleset(FWRULESET_GLOBAL));
 }
 
 /** @internal
@@ -856,6 +985,22 @@ parse_boolean_value(char *line)
     return -1;
 }
 
+/** @internal
+Parses a rate in kbit/s from the config file, exiting if it is not one
+*/
+static int
+parse_rate(const char *token, const char *value, const char *filename, int linenum)
+{
+    int rate;
+
+    if (sscanf(value, "%d", &rate) != 1 || rate < 0) {
+        debug(LOG_ERR, "Bad syntax for Parameter: %s on line %d " "in %s."
+              "The syntax is a number of kbit/s.", token, linenum, filename);
+        exit(-1);
+    }
+    return rate;
+}
+
 /**
  * Parse possiblemac to see if it is valid MAC address format */
 int
@@ -868,6 +1013,50 @@ check_mac_format(char *possiblemac)
                hex2, hex2, hex2, hex2, hex2, hex2) == 6;
 }
 
+/** Adds a MAC address to the trusted list, unless it is already on it.
+ * The caller must hold the config lock once the gateway is running.
+ * @param mac MAC address, in the aa:bb:cc:dd:ee:ff form
+ * @return 1 if it was added, 0 if it was already trusted
+ */
+int
+add_trusted_mac(const char *mac)
+{
+    t_trusted_mac **p;
+
+    for (p = &config.trustedmaclist; *p != NULL; p = &(*p)->next) {
+        if (0 == strcasecmp((*p)->mac, mac))
+            return 0;
+    }
+
+    debug(LOG_DEBUG, "Adding MAC address [%s] to trusted list", mac);
+    *p = safe_malloc(sizeof(t_trusted_mac));
+    (*p)->mac = safe_strdup(mac);
+    return 1;
+}
+
+/** Removes a MAC address from the trusted list.
+ * The caller must hold the config lock.
+ * @param mac MAC address, in the aa:bb:cc:dd:ee:ff form
+ * @return 1 if it was removed, 0 if it was not trusted
+ */
+int
+remove_trusted_mac(const char *mac)
+{
+    t_trusted_mac **p, *found;
+
+    for (p = &config.trustedmaclist; *p != NULL; p = &(*p)->next) {
+        if (0 == strcasecmp((*p)->mac, mac)) {
+            found = *p;
+            *p = found->next;
+            debug(LOG_DEBUG, "Removing MAC address [%s] from trusted list", found->mac);
+            free(found->mac);
+            free(found);
+            return 1;
+        }
+    }
+    return 0;
+}
+
 /** @internal
  * Parse the trusted mac list.
  */
@@ -877,7 +1066,6 @@ parse_trusted_mac_list(const char *ptr)
     char *ptrcopy = NULL;
     char *possiblemac = NULL;
     char *mac = NULL;
-    t_trusted_mac *p = NULL;
 
     debug(LOG_DEBUG, "Parsing string [%s] for trusted MAC addresses", ptr);
 
@@ -896,43 +1084,10 @@ parse_trusted_mac_list(const char *ptr)
             free(mac);
             return;
         } else {
-            if (sscanf(possiblemac, " %17[A-Fa-f0-9:]", mac) == 1) {
-                /* Copy mac to the list */
-
-                debug(LOG_DEBUG, "Adding MAC address [%s] to trusted list", mac);
-
-                if (config.trustedmaclist == NULL) {
-                    config.trustedmaclist = safe_malloc(sizeof(t_trusted_mac));
-                    config.trustedmaclist->mac = safe_strdup(mac);
-                    config.trustedmaclist->next = NULL;
-                } else {
-                    int skipmac;
-                    /* Advance to the last entry */
-                    p = config.trustedmaclist;
-                    skipmac = 0;
-                    /* Check before loop to handle case were mac is a duplicate
-                     * of the first and only item in the list so far.
-                     */
-                    if (0 == strcmp(p->mac, mac)) {
-                        skipmac = 1;
-                    }
-                    while (p->next != NULL) {
-                        if (0 == strcmp(p->mac, mac)) {
-                            skipmac = 1;
-                        }
-                        p = p->next;
-                    }
-                    if (!skipmac) {
-                        p->next = safe_malloc(sizeof(t_trusted_mac));
-                        p = p->next;
-                        p->mac = safe_strdup(mac);
-                        p->next = NULL;
-                    } else {
-                        debug(LOG_ERR,
-                              "MAC address [%s] already on trusted list. See option TrustedMACList in wifidog.conf file ",
-                              mac);
-                    }
-                }
+            if (sscanf(possiblemac, " %17[A-Fa-f0-9:]", mac) == 1 && !add_trusted_mac(mac)) {
+                debug(LOG_ERR,
+                      "MAC address [%s] already on trusted list. See option TrustedMACList in wifidog.conf file ",
+                      mac);
             }
         }
     }
@@ -46,6 +46,7 @@
 #define DEFAULT_GATEWAYPORT 2060
 #define DEFAULT_HTTPDNAME "WiFiDog"
 #define DEFAULT_CLIENTTIMEOUT 5
+#define DEFAULT_CLIENT_STATE_FILE "/tmp/wifidog-clients.state"
 #define DEFAULT_CHECKINTERVAL 60
 #define DEFAULT_LOG_SYSLOG 0
 #define DEFAULT_SYSLOG_FACILITY LOG_DAEMON
@@ -68,6 +69,16 @@
 #define DEFAULT_DELTATRAFFIC 0    /* 0 means: Enable peer verification */
 #define DEFAULT_ARPTABLE "/proc/net/arp"
 #define DEFAULT_AUTHSERVSSLSNI 0  /* 0 means: Disable SNI */
+#define DEFAULT_FW_BACKEND FW_BACKEND_IPTABLES
+#define DEFAULT_FW_ACCOUNTING FW_ACCOUNTING_RULES
+#define DEFAULT_FW_QUEUE_DELAY 100
+#define DEFAULT_FW_FANOUT_BITS 0
+/** Largest FirewallFanoutBits: 256 leaf chains per direction */
+#define FW_FANOUT_MAX_BITS 8
+#define DEFAULT_FW_CONNMARK 0
+#define DEFAULT_ALLOWED_HOST_TIMEOUT 3600
+#define DEFAULT_DNS_SNOOPING 0
+#define DEFAULT_DNS_SNOOPING_GROUP 53
 /*@}*/
 
 /*@{*/
@@ -105,6 +116,23 @@ typedef struct _auth_serv_t {
     struct _auth_serv_t *next;
 } t_auth_serv;
 
+/**
+ * How authenticated clients are let through the firewall
+ */
+typedef enum {
+    FW_BACKEND_IPTABLES,        /**< @brief One mangle rule per client and direction */
+    FW_BACKEND_IPSET,           /**< @brief Clients are members of ipsets matched by fixed rules */
+    FW_BACKEND_NFTABLES         /**< @brief One nftables table, clients are elements of its sets */
+} t_fw_backend;
+
+/**
+ * Where the iptables backend counts the traffic of each client
+ */
+typedef enum {
+    FW_ACCOUNTING_RULES,        /**< @brief In the per-client rules, read with iptables -L */
+    FW_ACCOUNTING_NFACCT        /**< @brief In nfnetlink_acct objects, read over netlink */
+} t_fw_accounting;
+
 /**
  * Firewall targets
  */
@@ -185,6 +213,8 @@ typedef struct {
 				     must be re-authenticated */
     int checkinterval;          /**< @brief Frequency the the client timeout check
 				     thread will run. */
+    char *client_state_file;    /**< @brief File the client list is persisted to,
+				     NULL to disable */
     int proxy_port;             /**< @brief Transparent proxy port (0 to disable) */
     char *ssl_certs;            /**< @brief Path to SSL certs for auth server
 		verification */
@@ -193,6 +223,18 @@ typedef struct {
     char *ssl_cipher_list;  /**< @brief List of SSL ciphers allowed. Optional. */
     int ssl_use_sni;            /**< @brief boolean, whether to enable
     auth server for server name indication, the TLS extension */
+    t_fw_backend fw_backend;    /**< @brief How clients are let through the firewall */
+    t_fw_accounting fw_accounting;      /**< @brief Where the iptables backend counts client traffic */
+    int fw_queue_delay;         /**< @brief Milliseconds client firewall changes are queued, 0 to apply them at once */
+    int fw_fanout_bits;         /**< @brief Address bits the iptables rules of the clients are spread over sub-chains by */
+    int fw_connmark;            /**< @brief boolean, whether the iptables marks are kept with the connections */
+    int allowed_host_timeout;   /**< @brief Seconds a host allowed at run time stays allowed, 0 for ever */
+    int dns_snooping;           /**< @brief boolean, whether addresses in DNS answers for whitelisted hosts are allowed */
+    int dns_snooping_group;     /**< @brief nfnetlink_log group the DNS answers are copied to */
+    int download_bandwidth;     /**< @brief kbit/s the clients are shaped to in all, 0 not to shape their downloads */
+    int upload_bandwidth;       /**< @brief kbit/s the clients are shaped to in all, 0 not to shape their uploads */
+    int client_download_rate;   /**< @brief kbit/s each client may download at, unless the auth server says, 0 for no limit */
+    int client_upload_rate;     /**< @brief kbit/s each client may upload at, unless the auth server says, 0 for no limit */
     t_firewall_ruleset *rulesets;       /**< @brief firewall rules */
     t_trusted_mac *trustedmaclist; /**< @brief list of trusted macs */
     char *arp_table_path; /**< @brief Path to custom ARP table, formatted
@@ -224,6 +266,12 @@ void mark_auth_server_bad(t_auth_serv *);
 /** @brief Fetch a firewall rule set. */
 t_firewall_rule *get_ruleset(const char *);
 
+/** @brief Add a MAC address to the trusted list */
+int add_trusted_mac(const char *);
+
+/** @brief Remove a MAC address from the trusted list */
+int remove_trusted_mac(const char *);
+
 
 #define LOCK_CONFIG() do { \
 	debug(LOG_DEBUG, "Locking config"); \
@@ -0,0 +1,258 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file dns_snoop.c
+    @brief Addresses of whitelisted hosts learnt from DNS answers
+
+    A host of the global rule set is only reachable at the addresses it
+    resolved to when the firewall was set up, or once a client asked the
+    captive portal for it, see fw_hosts.c. Connections to any other address
+    of the host, like those of HTTPS sites or of CDNs rotating their
+    addresses, are rejected until then.
+
+    With DnsSnooping, the firewall copies the answers of the resolver of the
+    gateway to its clients to an nfnetlink_log group, and thread_dns_snoop()
+    reads them. The A records of each answer to a question for a
+    whitelisted host go to the DNS set of the firewall for as long as their
+    time to live, so that they are allowed before the client that asked gets
+    the answer. Only the answers of the gateway itself are trusted: a client
+    could send itself anything from a server of its own.
+
+    dnsmasq can fill the same set instead, with its ipset or nftset option,
+    see DnsSnooping in wifidog.conf.
+
+    To try it out, run the gateway in a network namespace with a stub
+    resolver listening on the gateway address, e.g. dnsmasq with
+    address=/example.com/192.0.2.1, and a client in another namespace
+    connected through a veth pair:
+
+      ip netns exec client dig @<gateway address> www.example.com
+
+    then look for 192.0.2.1 in the DNS set, with ipset list or nft list set.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "firewall.h"
+#include "fw_netlink.h"
+#include "whitelist.h"
+#include "dns_snoop.h"
+
+/** Size of the receive buffer, large enough for any packet */
+#define DNS_SNOOP_RECV_SIZE (68 * 1024)
+
+/** Longest name of a question, as text */
+#define DNS_SNOOP_NAME_MAX 256
+
+static int dns_snoop_name(const unsigned char *, size_t, size_t, char *);
+static int dns_snoop_skip_name(const unsigned char *, size_t, size_t *);
+static void dns_snoop_packet(const unsigned char *, size_t, void *);
+
+/** @internal
+ * Statistics, protected by stats_mutex
+ */
+static t_dns_snoop_stats snoop_stats;
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Reads a possibly compressed name of a DNS message as dotted text.
+ * @param msg Message
+ * @param len Length of the message
+ * @param off Offset of the name
+ * @param name Receives the name, DNS_SNOOP_NAME_MAX bytes
+ * @return 0 on success, -1 if the name is malformed
+ */
+static int
+dns_snoop_name(const unsigned char *msg, size_t len, size_t off, char *name)
+{
+    size_t n = 0;
+    int jumps = 0;
+    unsigned int label;
+
+    while (off < len) {
+        label = msg[off];
+        if (0 == label) {
+            name[n] = '\0';
+            return 0;
+        }
+        if ((label & 0xc0) == 0xc0) {
+            /* A pointer, followed a bounded number of times against loops */
+            if (off + 1 >= len || ++jumps > 32)
+                return -1;
+            off = (label & 0x3f) << 8 | msg[off + 1];
+            continue;
+        }
+        if ((label & 0xc0) != 0 || off + 1 + label > len || n + label + 1 >= DNS_SNOOP_NAME_MAX)
+            return -1;
+        if (n > 0)
+            name[n++] = '.';
+        memcpy(name + n, msg + off + 1, label);
+        n += label;
+        off += 1 + label;
+    }
+    return -1;
+}
+
+/** @internal
+ * Moves past a name of a DNS message, which ends with either an empty
+ * label or a pointer.
+ * @return 0 on success, -1 if the message ends first
+ */
+static int
+dns_snoop_skip_name(const unsigned char *msg, size_t len, size_t * off)
+{
+    while (*off < len) {
+        if (0 == msg[*off]) {
+            *off += 1;
+            return 0;
+        }
+        if ((msg[*off] & 0xc0) == 0xc0) {
+            *off += 2;
+            return *off <= len ? 0 : -1;
+        }
+        *off += 1 + msg[*off];
+    }
+    return -1;
+}
+
+/** @internal
+ * Allows the addresses of an answer of the resolver to an A question for a
+ * whitelisted host. Called by nl_log_recv() with each packet copied to the
+ * group, from its IP header.
+ */
+static void
+dns_snoop_packet(const unsigned char *pkt, size_t len, void *arg)
+{
+    const unsigned char *msg;
+    char name[DNS_SNOOP_NAME_MAX];
+    uint32_t addrs[DNS_SNOOP_MAX_ADDRS], ttl, min_ttl = DNS_SNOOP_MAX_TTL;
+    size_t hlen, mlen, off;
+    unsigned int answers, type, class, rdlen;
+    int count = 0, rc;
+
+    /* An unfragmented UDP datagram from port 53 */
+    if (len < 20 || (pkt[0] >> 4) != 4 || pkt[9] != IPPROTO_UDP || (pkt[6] & 0x3f) != 0 || pkt[7] != 0)
+        return;
+    hlen = (pkt[0] & 0x0f) * 4;
+    if (hlen < 20 || len < hlen + 8 || (pkt[hlen] << 8 | pkt[hlen + 1]) != 53)
+        return;
+    msg = pkt + hlen + 8;
+    mlen = len - hlen - 8;
+
+    /* A successful answer to a single question */
+    if (mlen < 12 || !(msg[2] & 0x80) || (msg[3] & 0x0f) != 0 || (msg[4] << 8 | msg[5]) != 1)
+        return;
+    answers = msg[6] << 8 | msg[7];
+
+    pthread_mutex_lock(&stats_mutex);
+    snoop_stats.answers++;
+    pthread_mutex_unlock(&stats_mutex);
+
+    off = 12;
+    if (dns_snoop_name(msg, mlen, off, name) == -1 || dns_snoop_skip_name(msg, mlen, &off) == -1 || off + 4 > mlen)
+        return;
+    type = msg[off] << 8 | msg[off + 1];
+    class = msg[off + 2] << 8 | msg[off + 3];
+    off += 4;
+    if (type != 1 || class != 1 || whitelist_match(name) == WHITELIST_NONE)
+        return;
+
+    /* The records of the host, and of the names it is an alias of */
+    while (answers-- > 0 && count < DNS_SNOOP_MAX_ADDRS) {
+        if (dns_snoop_skip_name(msg, mlen, &off) == -1 || off + 10 > mlen)
+            break;
+        type = msg[off] << 8 | msg[off + 1];
+        class = msg[off + 2] << 8 | msg[off + 3];
+        ttl = (uint32_t)msg[off + 4] << 24 | msg[off + 5] << 16 | msg[off + 6] << 8 | msg[off + 7];
+        rdlen = msg[off + 8] << 8 | msg[off + 9];
+        off += 10;
+        if (off + rdlen > mlen)
+            break;
+        if (type == 1 && class == 1 && rdlen == 4) {
+            memcpy(&addrs[count++], msg + off, 4);
+            if (ttl < min_ttl)
+                min_ttl = ttl;
+        }
+        off += rdlen;
+    }
+    if (0 == count)
+        return;
+    if (min_ttl < DNS_SNOOP_MIN_TTL)
+        min_ttl = DNS_SNOOP_MIN_TTL;
+
+    rc = fw_allow_dns(addrs, count, min_ttl);
+    debug(LOG_DEBUG, "Allowed %d addresses of %s for %u seconds from a DNS answer", count, name, min_ttl);
+
+    pthread_mutex_lock(&stats_mutex);
+    snoop_stats.whitelisted++;
+    if (0 == rc)
+        snoop_stats.addresses += count;
+    else
+        snoop_stats.failures++;
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/** Copies the statistics of the DNS snooping
+ * @param stats Receives them
+ */
+void
+dns_snoop_get_stats(t_dns_snoop_stats * stats)
+{
+    pthread_mutex_lock(&stats_mutex);
+    memcpy(stats, &snoop_stats, sizeof(*stats));
+    pthread_mutex_unlock(&stats_mutex);
+}
+
+/** Reads the DNS answers the firewall copies to the DnsSnoopingGroup
+ * nfnetlink_log group and allows the addresses of the whitelisted hosts
+ * in them. Exits if the group cannot be bound.
+ * @param arg Unused
+ */
+void
+thread_dns_snoop(const void *arg)
+{
+    int group = config_get_config()->dns_snooping_group;
+    unsigned char *buf;
+    int fd;
+
+    if ((fd = nl_log_open(group)) < 0) {
+        debug(LOG_ERR, "Could not read DNS answers from nfnetlink_log group %d, DNS snooping disabled", group);
+        return;
+    }
+    debug(LOG_INFO, "Reading DNS answers from nfnetlink_log group %d", group);
+
+    buf = safe_malloc(DNS_SNOOP_RECV_SIZE);
+    while (1) {
+        if (nl_log_recv(fd, buf, DNS_SNOOP_RECV_SIZE, dns_snoop_packet, NULL) < 0) {
+            debug(LOG_ERR, "Could not read DNS answers from nfnetlink_log group %d", group);
+            sleep(1);
+        }
+    }
+}
@@ -0,0 +1,52 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file dns_snoop.h
+    @brief Addresses of whitelisted hosts learnt from DNS answers
+*/
+
+#ifndef _DNS_SNOOP_H_
+#define _DNS_SNOOP_H_
+
+/** Shortest time, in seconds, an address from a DNS answer is allowed for */
+#define DNS_SNOOP_MIN_TTL 60
+
+/** Longest time, in seconds, an address from a DNS answer is allowed for */
+#define DNS_SNOOP_MAX_TTL 86400
+
+/** Most addresses taken from one answer */
+#define DNS_SNOOP_MAX_ADDRS 32
+
+/** Statistics of the DNS snooping, see dns_snoop_get_stats() */
+typedef struct _t_dns_snoop_stats {
+    unsigned long answers;      /**< @brief DNS answers read */
+    unsigned long whitelisted;  /**< @brief Answers for whitelisted hosts */
+    unsigned long addresses;    /**< @brief Addresses allowed, counted once per answer */
+    unsigned long failures;     /**< @brief Answers whose addresses the firewall did not take */
+} t_dns_snoop_stats;
+
+/** @brief Thread allowing the addresses of whitelisted hosts found in DNS answers */
+void thread_dns_snoop(const void *);
+
+/** @brief Get the statistics of the DNS snooping */
+void dns_snoop_get_stats(t_dns_snoop_stats *);
+
+#endif                          /* _DNS_SNOOP_H_ */
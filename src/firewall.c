@@ -52,84 +52,203 @@
 #include "debug.h"
 #include "conf.h"
 #include "firewall.h"
+#include "fw_queue.h"
+#include "fw_hosts.h"
+#include "fw_shaping.h"
 #include "fw_iptables.h"
+#include "fw_nftables.h"
 #include "auth.h"
 #include "centralserver.h"
 #include "client_list.h"
 #include "commandline.h"
 
-static int _fw_deny_raw(const char *, const char *, const int);
+static int *fw_counters_slot(t_fw_counters *, uint32_t);
+static void fw_init_clients(void);
+
+/** @internal
+ * Whether the nftables backend is in use. Set by fw_init() according to
+ * FirewallBackend, if the nftables table could be loaded; the iptables
+ * backend is used otherwise.
+ */
+static int use_nftables = 0;
+
+/** @internal
+ * Set by fw_handover(): fw_destroy() then leaves the rules in place.
+ */
+static int handed_over = 0;
 
 /**
  * Allow a client access through the firewall by adding a rule in the firewall to MARK the user's packets with the proper
- * rule by providing his IP and MAC address
- * @param ip IP address to allow
- * @param mac MAC address to allow
- * @param fw_connection_state fw_connection_state Tag
- * @return Return code of the command
+ * rule by providing his IP and MAC address. The change is queued, see fw_queue_push(); call fw_queue_flush() when it
+ * must be in place before going on, once the shard lock is released.
+ * Call this on the client on the list, with its shard lock held, so that
+ * changes of the same client are queued in the order they are made.
+ * @param client Client to allow, its fw_connection_state is the mark it has in the firewall
+ * @param new_fw_connection_state fw_connection_state Tag
+ * @return 0
  */
 int
 fw_allow(t_client * client, int new_fw_connection_state)
 {
-    int result;
-    int old_state = client->fw_connection_state;
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
 
-    debug(LOG_DEBUG, "Allowing %s %s with fw_connection_state %d", client->ip, client->mac, new_fw_connection_state);
+    debug(LOG_DEBUG, "Allowing %s %s with fw_connection_state %d", format_ip(client->ip, ip),
+          format_mac(&client->mac, mac), new_fw_connection_state);
+    fw_queue_push(client->ip, &client->mac, client->fw_connection_state, new_fw_connection_state);
     client->fw_connection_state = new_fw_connection_state;
 
-    /* Grant first */
-    result = iptables_fw_access(FW_ACCESS_ALLOW, client->ip, client->mac, new_fw_connection_state);
-
-    /* Deny after if needed. */
-    if (old_state != FW_MARK_NONE) {
-        debug(LOG_DEBUG, "Clearing previous fw_connection_state %d", old_state);
-        _fw_deny_raw(client->ip, client->mac, old_state);
-    }
-
-    return result;
+    return 0;
 }
 
 /**
- * Allow a host through the firewall by adding a rule in the firewall
+ * Allow a host through the firewall until AllowedHostTimeout seconds after
+ * it was last asked for, see fw_hosts_allow()
  * @param host IP address, domain or hostname to allow
- * @return Return code of the command
+ * @return 0 on success, -1 otherwise
  */
 int
 fw_allow_host(const char *host)
 {
     debug(LOG_DEBUG, "Allowing %s", host);
 
-    return iptables_fw_access_host(FW_ACCESS_ALLOW, host);
+    return fw_hosts_allow(host);
+}
+
+/**
+ * Trust a MAC address, or stop trusting it, while the gateway runs. The
+ * trusted list of the configuration is updated with the firewall, so that
+ * a firewall rebuilt later keeps the change.
+ * @param mac MAC address
+ * @param trusted 1 to trust it, 0 to stop trusting it
+ * @return 1 if it was changed, 0 if it already was (or was not) trusted,
+ * -1 if the MAC address is invalid or the firewall could not be changed
+ */
+int
+fw_set_trusted_mac(const char *mac, int trusted)
+{
+    fw_access_t type = trusted ? FW_ACCESS_ALLOW : FW_ACCESS_DENY;
+    char str[MAC_STR_LEN];
+    t_mac hwaddr;
+    int rc;
+
+    if (!parse_mac(mac, &hwaddr))
+        return -1;
+    format_mac(&hwaddr, str);
+
+    debug(LOG_DEBUG, "%s MAC address %s", trusted ? "Trusting" : "No longer trusting", str);
+
+    /* Held throughout, so that a firewall being rebuilt sees the list
+     * either before or after the change */
+    LOCK_CONFIG();
+    if (!(trusted ? add_trusted_mac(str) : remove_trusted_mac(str))) {
+        UNLOCK_CONFIG();
+        return 0;
+    }
+    if (use_nftables)
+        rc = nftables_fw_access_trusted(type, str);
+    else
+        rc = iptables_fw_access_trusted(type, str);
+    if (rc != 0) {
+        /* Keep the list as the firewall has it */
+        if (trusted)
+            remove_trusted_mac(str);
+        else
+            add_trusted_mac(str);
+    }
+    UNLOCK_CONFIG();
+
+    if (rc != 0) {
+        debug(LOG_ERR, "Could not change the trust of MAC address %s in the firewall", str);
+        return -1;
+    }
+    return 1;
 }
 
 /**
  * @brief Deny a client access through the firewall by removing the rule in the firewall that was fw_connection_stateging the user's traffic
- * @param ip IP address to deny
- * @param mac MAC address to deny
- * @param fw_connection_state fw_connection_state Tag
- * @return Return code of the command
+ * The change is queued, see fw_queue_push().
+ * Call this with the shard lock of the client held: on the client on the
+ * list, or right after taking it off the list with client_list_remove().
+ * @param client Client to deny, its fw_connection_state is the mark it has in the firewall
+ * @return 0
  */
 int
 fw_deny(t_client * client)
 {
-    int fw_connection_state = client->fw_connection_state;
-    debug(LOG_DEBUG, "Denying %s %s with fw_connection_state %d", client->ip, client->mac, client->fw_connection_state);
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
 
+    debug(LOG_DEBUG, "Denying %s %s with fw_connection_state %d", format_ip(client->ip, ip),
+          format_mac(&client->mac, mac), client->fw_connection_state);
+    fw_queue_push(client->ip, &client->mac, client->fw_connection_state, FW_MARK_NONE);
     client->fw_connection_state = FW_MARK_NONE; /* Clear */
-    return _fw_deny_raw(client->ip, client->mac, fw_connection_state);
+
+    return 0;
 }
 
-/** @internal
- * Actually does the clearing, so fw_allow can call it to clear previous mark.
- * @param ip IP address to deny
- * @param mac MAC address to deny
- * @param mark fw_connection_state Tag
- * @return Return code of the command
+/**
+ * Applies a batch of changes of client marks with the backend in use.
+ * Each client is granted its new mark before its previous one is cleared,
+ * so that it keeps access while its mark changes.
+ * @param ops Changes, at most one per client
+ * @param count Number of changes
+ * @return Return code of the backend
  */
-static int
-_fw_deny_raw(const char *ip, const char *mac, const int mark)
+int
+fw_apply(const t_fw_op * ops, int count)
 {
-    return iptables_fw_access(FW_ACCESS_DENY, ip, mac, mark);
+    int rc;
+
+    if (use_nftables)
+        rc = nftables_fw_access_batch(ops, count);
+    else
+        rc = iptables_fw_access_batch(ops, count);
+    fw_shaping_apply(ops, count);
+    return rc;
+}
+
+/**
+ * Mark carried by the packets of the clients with a t_fw_marks value, as
+ * written by the backend in use: the iptables rules write some of them
+ * in hex.
+ * @param tag t_fw_marks value
+ * @return Value of the mark on the packets
+ */
+uint32_t
+fw_mark_value(int tag)
+{
+    return use_nftables ? (uint32_t) tag : iptables_fw_mark_value(tag);
+}
+
+/**
+ * Adds addresses of allowed hosts to the firewall, or removes them, in one
+ * batch with the backend in use.
+ * @param type FW_ACCESS_ALLOW or FW_ACCESS_DENY
+ * @param addrs Addresses, network byte order
+ * @param count Number of addresses
+ * @return Return code of the backend
+ */
+int
+fw_apply_hosts(fw_access_t type, const uint32_t * addrs, int count)
+{
+    if (use_nftables)
+        return nftables_fw_access_hosts(type, addrs, count);
+    return iptables_fw_access_hosts(type, addrs, count);
+}
+
+/**
+ * Allows addresses found in DNS answers for whitelisted hosts until their
+ * time to live runs out, in the DNS set of the backend in use.
+ * @param addrs Addresses, network byte order
+ * @param count Number of addresses
+ * @param ttl Seconds they stay allowed, unless they are seen again
+ * @return Return code of the backend
+ */
+int
+fw_allow_dns(const uint32_t * addrs, int count, unsigned int ttl)
+{
+    if (use_nftables)
+        return nftables_fw_access_dns(addrs, count, ttl);
+    return iptables_fw_access_dns(addrs, count, ttl);
 }
 
 /** Passthrough for clients when auth server is down */
@@ -138,6 +257,8 @@ fw_set_authdown(void)
 {
     debug(LOG_DEBUG, "Marking auth server down");
 
+    if (use_nftables)
+        return nftables_fw_auth_unreachable(FW_MARK_AUTH_IS_DOWN);
     return iptables_fw_auth_unreachable(FW_MARK_AUTH_IS_DOWN);
 }
 
@@ -147,85 +268,342 @@ fw_set_authup(void)
 {
     debug(LOG_DEBUG, "Marking auth server up again");
 
+    if (use_nftables)
+        return nftables_fw_auth_reachable();
     return iptables_fw_auth_reachable();
 }
 
+/** @internal
+ * Slot of the index of a sweep holding an IP address, or the free slot
+ * where it goes
+ */
+static int *
+fw_counters_slot(t_fw_counters * sweep, uint32_t ip)
+{
+    unsigned int mask = sweep->slot_count - 1;
+    uint32_t h = ip;
+    unsigned int i;
+
+    /* Mix all the bytes in, addresses of a subnet differ in one end only */
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    i = h & mask;
+
+    while (0 != sweep->slots[i] && sweep->counters[sweep->slots[i] - 1].ip != ip)
+        i = (i + 1) & mask;
+    return &sweep->slots[i];
+}
+
+/** Adds a byte counter read from the firewall to a sweep. The counters of
+ * both directions of a client end up in the same t_fw_counter, so that
+ * fw_counters_record() looks each client up once.
+ * @param sweep Sweep, zeroed before the first call
+ * @param ip IP address of the client, network byte order
+ * @param direction FW_COUNTER_OUTGOING or FW_COUNTER_INCOMING
+ * @param bytes Bytes counted since the client was allowed
+ * @param entry Backend's entry holding the counter, kept for the removal of orphans
+ */
+void
+fw_counters_add(t_fw_counters * sweep, uint32_t ip, int direction, unsigned long long int bytes, const void *entry)
+{
+    t_fw_counter *counter;
+    int *slot, i;
+
+    /* Keep the index at most half full */
+    if (2 * (sweep->count + 1) > sweep->slot_count) {
+        free(sweep->slots);
+        sweep->slot_count = sweep->slot_count ? sweep->slot_count * 2 : 256;
+        sweep->slots = safe_malloc(sweep->slot_count * sizeof(int));
+        for (i = 0; i < sweep->count; i++)
+            *fw_counters_slot(sweep, sweep->counters[i].ip) = i + 1;
+    }
+
+    slot = fw_counters_slot(sweep, ip);
+    if (0 == *slot) {
+        if (sweep->count == sweep->size) {
+            sweep->size = sweep->size ? sweep->size * 2 : 128;
+            sweep->counters = safe_realloc(sweep->counters, sweep->size * sizeof(t_fw_counter));
+        }
+        counter = &sweep->counters[sweep->count++];
+        memset(counter, 0, sizeof(*counter));
+        counter->ip = ip;
+        *slot = sweep->count;
+    } else {
+        counter = &sweep->counters[*slot - 1];
+    }
+
+    counter->directions |= direction;
+    if (FW_COUNTER_INCOMING == direction) {
+        counter->incoming = bytes;
+        counter->incoming_entry = entry;
+    } else {
+        counter->outgoing = bytes;
+        counter->outgoing_entry = entry;
+    }
+}
+
+/** Adds the MAC address and mark of the outgoing entry of a client to a
+ * sweep, for the backends that can read them, once fw_counters_add() added
+ * its counter. fw_init() needs them to tell whether an entry is still right.
+ * @param sweep Sweep
+ * @param ip IP address of the client, network byte order
+ * @param mac MAC address of the entry
+ * @param mark Mark the entry gives the client
+ */
+void
+fw_counters_mark(t_fw_counters * sweep, uint32_t ip, const t_mac * mac, int mark)
+{
+    int *slot;
+
+    if (0 == sweep->count || 0 == *(slot = fw_counters_slot(sweep, ip)))
+        return;
+    memcpy(&sweep->counters[*slot - 1].mac, mac, sizeof(*mac));
+    sweep->counters[*slot - 1].mark = mark;
+}
+
+/** Records the byte counters of a sweep for the clients, in one pass over
+ * the client list under a single lock.
+ * @param sweep Counters read from the firewall
+ * @return Number of counters whose client is not on the list, each flagged
+ *         as an orphan so that its firewall entries can be removed
+ */
+int
+fw_counters_record(t_fw_counters * sweep)
+{
+    t_fw_counter *counter;
+    t_client *p1;
+    time_t now = time(NULL);
+    int i, orphans = 0, updated = 0, changed;
+
+    LOCK_CLIENT_LIST();
+    for (i = 0; i < sweep->count; i++) {
+        counter = &sweep->counters[i];
+        counter->orphan = 0;
+        if (NULL == (p1 = client_list_find_by_ip(counter->ip))) {
+            counter->orphan = 1;
+            orphans++;
+            continue;
+        }
+        changed = 0;
+        if ((counter->directions & FW_COUNTER_OUTGOING)
+            && (p1->counters.outgoing - p1->counters.outgoing_history) < counter->outgoing) {
+            p1->counters.outgoing_delta = p1->counters.outgoing_history + counter->outgoing - p1->counters.outgoing;
+            p1->counters.outgoing = p1->counters.outgoing_history + counter->outgoing;
+            p1->counters.last_updated = now;
+            client_list_reschedule(p1);
+            changed = 1;
+        }
+        if ((counter->directions & FW_COUNTER_INCOMING)
+            && (p1->counters.incoming - p1->counters.incoming_history) < counter->incoming) {
+            p1->counters.incoming_delta = p1->counters.incoming_history + counter->incoming - p1->counters.incoming;
+            p1->counters.incoming = p1->counters.incoming_history + counter->incoming;
+            if (sweep->incoming_activity) {
+                p1->counters.last_updated = now;
+                client_list_reschedule(p1);
+            }
+            changed = 1;
+        }
+        if (changed) {
+            client_list_publish(p1);
+            updated++;
+        }
+    }
+    UNLOCK_CLIENT_LIST();
+
+    debug(LOG_DEBUG, "Read the counters of %d clients, %d updated, %d orphans", sweep->count, updated, orphans);
+    return orphans;
+}
+
+/** Frees the counters of a sweep, leaving it ready for another one */
+void
+fw_counters_free(t_fw_counters * sweep)
+{
+    free(sweep->counters);
+    free(sweep->slots);
+    memset(sweep, 0, sizeof(*sweep));
+}
+
 /* XXX DCY */
 /**
  * Get an IP's MAC address from the ARP cache.
  * Go through all the entries in config->arp_table_path until we find the
  * requested IP address and return the MAC address bound to it.
  * @todo Make this function portable (using shell scripts?)
+ * @param req_ip IP address to look for, network byte order
+ * @param mac Receives the MAC address
+ * @return 1 if the IP address was found, 0 otherwise
  */
-char *
-arp_get(const char *req_ip)
+int
+arp_get(uint32_t req_ip, t_mac * mac)
 {
     FILE *proc;
     char ip[16];
-    char mac[18];
-    char *reply;
+    char macstr[18];
+    uint32_t addr;
+    int found = 0;
     s_config *config = config_get_config();
 
     if (!(proc = fopen(config->arp_table_path, "r"))) {
-        return NULL;
+        return 0;
     }
 
     /* Skip first line */
     while (!feof(proc) && fgetc(proc) != '\n') ;
 
-    /* Find ip, copy mac in reply */
-    reply = NULL;
-    while (!feof(proc) && (fscanf(proc, " %15[0-9.] %*s %*s %17[A-Fa-f0-9:] %*s %*s", ip, mac) == 2)) {
-        if (strcmp(ip, req_ip) == 0) {
-            reply = safe_strdup(mac);
+    /* Find ip, parse its mac */
+    while (!feof(proc) && (fscanf(proc, " %15[0-9.] %*s %*s %17[A-Fa-f0-9:] %*s %*s", ip, macstr) == 2)) {
+        if (parse_ip(ip, &addr) && addr == req_ip) {
+            found = parse_mac(macstr, mac);
             break;
         }
     }
 
     fclose(proc);
 
-    return reply;
+    return found;
 }
 
-/** Initialize the firewall rules
+/** Initialize the firewall rules. Rules left by a previous gateway, on
+ * restart or after a crash, are brought in line with the configuration
+ * and the client list in place rather than removed and added again, so
+ * that traffic keeps flowing meanwhile.
  */
 int
 fw_init(void)
 {
     int result = 0;
-    int new_fw_state;
-    t_client *client = NULL;
 
     if (!init_icmp_socket()) {
         return 0;
     }
 
     debug(LOG_INFO, "Initializing Firewall");
-    result = iptables_fw_init();
-
-    if (restart_orig_pid) {
-        debug(LOG_INFO, "Restoring firewall rules for clients inherited from parent");
-        LOCK_CLIENT_LIST();
-        client = client_get_first_client();
-        while (client) {
-            new_fw_state = client->fw_connection_state;
-            client->fw_connection_state = FW_MARK_NONE;
-            fw_allow(client, new_fw_state);
-            client = client->next;
-        }
-        UNLOCK_CLIENT_LIST();
+    /* The hosts allowed at run time are not kept */
+    fw_hosts_clear();
+    use_nftables = 0;
+    if (config_get_config()->fw_backend == FW_BACKEND_NFTABLES) {
+        if ((result = nftables_fw_init()))
+            use_nftables = 1;
+        else
+            debug(LOG_ERR, "Could not load the nftables table, using iptables instead");
+    }
+    if (!use_nftables)
+        result = iptables_fw_init();
+
+    if (result) {
+        fw_shaping_init();
+        fw_init_clients();
     }
 
     return result;
 }
 
+/** @internal
+ * Brings the client entries of the firewall in line with the client list:
+ * the clients inherited from a parent on restart or loaded from the state
+ * file, and the entries left by the gateway this one replaces. Entries
+ * that are right are kept with their counters, the others are changed in
+ * one batch through the queue. Entries with the right mark that miss a
+ * direction are cleared and added again apart from it, as the queue would
+ * take the two changes for none.
+ */
+static void
+fw_init_clients(void)
+{
+    t_fw_counters sweep;
+    t_fw_counter *counter;
+    t_client *client;
+    t_fw_op *repairs = NULL;
+    int *slot, i, rc, kept = 0, changes = 0, repair_count = 0;
+
+    memset(&sweep, 0, sizeof(sweep));
+    rc = use_nftables ? nftables_fw_clients_read(&sweep) : iptables_fw_clients_read(&sweep);
+    if (rc != 1) {
+        debug(LOG_WARNING, "Could not read the clients in the firewall, adding them all");
+        fw_counters_free(&sweep);
+    }
+    /* Flags the entries no client claims */
+    for (i = 0; i < sweep.count; i++)
+        sweep.counters[i].orphan = 1;
+
+    LOCK_CLIENT_LIST();
+    for (client = client_get_first_client(); NULL != client; client = client_get_next_client(client)) {
+        counter = NULL;
+        if (sweep.count > 0 && 0 != *(slot = fw_counters_slot(&sweep, client->ip))) {
+            counter = &sweep.counters[*slot - 1];
+            counter->orphan = 0;
+        }
+        if (NULL != counter && (FW_COUNTER_OUTGOING | FW_COUNTER_INCOMING) == counter->directions
+            && counter->mark == client->fw_connection_state
+            && memcmp(counter->mac.addr, client->mac.addr, sizeof(client->mac.addr)) == 0) {
+            /* The entries keep counting from where they are */
+            client->counters.outgoing_history =
+                client->counters.outgoing > counter->outgoing ? client->counters.outgoing - counter->outgoing : 0;
+            client->counters.incoming_history =
+                client->counters.incoming > counter->incoming ? client->counters.incoming - counter->incoming : 0;
+            client_list_publish(client);
+            kept++;
+            continue;
+        }
+        if (NULL != counter && FW_MARK_NONE != counter->mark && counter->mark == client->fw_connection_state
+            && memcmp(counter->mac.addr, client->mac.addr, sizeof(client->mac.addr)) == 0) {
+            repairs = safe_realloc(repairs, (repair_count + 1) * sizeof(t_fw_op));
+            repairs[repair_count].ip = client->ip;
+            memcpy(&repairs[repair_count].mac, &client->mac, sizeof(client->mac));
+            repairs[repair_count].from = client->fw_connection_state;
+            repairs[repair_count].to = FW_MARK_NONE;
+            repair_count++;
+            changes++;
+            continue;
+        }
+        if (NULL != counter && FW_MARK_NONE != counter->mark)
+            fw_queue_push(counter->ip, &counter->mac, counter->mark, FW_MARK_NONE);
+        if (FW_MARK_NONE != client->fw_connection_state)
+            fw_queue_push(client->ip, &client->mac, FW_MARK_NONE, client->fw_connection_state);
+        changes++;
+    }
+    UNLOCK_CLIENT_LIST();
+
+    /* The entries whose mark is unknown go with the next sweep of orphans */
+    for (i = 0; i < sweep.count; i++) {
+        counter = &sweep.counters[i];
+        if (counter->orphan && FW_MARK_NONE != counter->mark) {
+            fw_queue_push(counter->ip, &counter->mac, counter->mark, FW_MARK_NONE);
+            changes++;
+        }
+    }
+    fw_counters_free(&sweep);
+
+    /* All of them in one batch */
+    fw_queue_flush();
+
+    /* The entries missing a direction, cleared in one batch then added in another */
+    if (repair_count > 0) {
+        fw_apply(repairs, repair_count);
+        for (i = 0; i < repair_count; i++) {
+            repairs[i].to = repairs[i].from;
+            repairs[i].from = FW_MARK_NONE;
+        }
+        fw_apply(repairs, repair_count);
+        free(repairs);
+    }
+
+    debug(LOG_INFO, "Kept %d clients in the firewall, changed %d", kept, changes);
+}
+
 /** Remove all auth server firewall whitelist rules
  */
 void
 fw_clear_authservers(void)
 {
     debug(LOG_INFO, "Clearing the authservers list");
-    iptables_fw_clear_authservers();
+    if (use_nftables)
+        nftables_fw_clear_authservers();
+    else
+        iptables_fw_clear_authservers();
 }
 
 /** Add the necessary firewall rules to whitelist the authservers
@@ -234,48 +612,81 @@ void
 fw_set_authservers(void)
 {
     debug(LOG_INFO, "Setting the authservers list");
-    iptables_fw_set_authservers();
+    if (use_nftables)
+        nftables_fw_set_authservers();
+    else
+        iptables_fw_set_authservers();
 }
 
 /** Remove the firewall rules
- * This is used when we do a clean shutdown of WiFiDog.
+ * This is used when we do a clean shutdown of WiFiDog, unless fw_handover()
+ * was called.
  * @return Return code of the fw.destroy script
  */
 int
 fw_destroy(void)
 {
     close_icmp_socket();
+    if (handed_over) {
+        debug(LOG_INFO, "Leaving the firewall rules to the restarted gateway");
+        return 1;
+    }
+    /* Whatever they would have changed goes away with the rest */
+    fw_queue_discard();
+    fw_hosts_clear();
+    fw_shaping_destroy();
     debug(LOG_INFO, "Removing Firewall rules");
+    if (use_nftables)
+        return nftables_fw_destroy();
     return iptables_fw_destroy();
 }
 
+/** Leaves the firewall rules in place when this gateway exits, for the one
+ * it is restarting as, which takes them over in fw_init(). The queued
+ * changes are applied first, so that the rules match the client list the
+ * new gateway gets.
+ */
+void
+fw_handover(void)
+{
+    fw_queue_flush();
+    handed_over = 1;
+}
+
 /**Probably a misnomer, this function actually refreshes the entire client list's traffic counter, re-authenticates every client with the central server and update's the central servers traffic counters and notifies it if a client has logged-out.
+ * Inactive clients are not handled here but by thread_client_expiry().
  * @todo Make this function smaller and use sub-fonctions
  */
 void
 fw_sync_with_authserver(void)
 {
     t_authresponse authresponse;
-    t_client *p1, *p2, *worklist, *tmp;
+    t_client_snapshot *snapshot;
+    t_client *p1, *tmp, *removed;
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
+    int i;
     s_config *config = config_get_config();
 
-    if (-1 == iptables_fw_counters_update()) {
+    /* Clients removed since the last flush must be out of the firewall, or
+     * their entries would be read as orphans */
+    fw_queue_flush();
+
+    fw_hosts_expire();
+
+    if (-1 == (use_nftables ? nftables_fw_counters_update() : iptables_fw_counters_update())) {
         debug(LOG_ERR, "Could not get counters from firewall!");
         return;
     }
 
-    LOCK_CLIENT_LIST();
-
-    /* XXX Ideally, from a thread safety PoV, this function should build a list of client pointers,
-     * iterate over the list and have an explicit "client still valid" check while list is locked.
-     * That way clients can disappear during the cycle with no risk of trashing the heap or getting
-     * a SIGSEGV.
+    /* Work on a read-only snapshot; clients can disappear during the cycle, so
+     * each one is looked up again by id under the lock before acting on it.
      */
-    client_list_dup(&worklist);
-    UNLOCK_CLIENT_LIST();
+    snapshot = client_list_snapshot();
 
-    for (p1 = p2 = worklist; NULL != p1; p1 = p2) {
-        p2 = p1->next;
+    for (i = 0; i < snapshot->count; i++) {
+        p1 = &snapshot->clients[i];
+        format_ip(p1->ip, ip);
+        format_mac(&p1->mac, mac);
 
         /* Ping the client, if he responds it'll keep activity on the link.
          * However, if the firewall blocks it, it will not help.  The suggested
@@ -283,104 +694,97 @@ fw_sync_with_authserver(void)
          * short:  Shorter than config->checkinterval * config->clienttimeout */
         icmp_ping(p1->ip);
         /* Update the counters on the remote server only if we have an auth server */
-        if (config->auth_servers != NULL) {
-            auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, p1->ip, p1->mac, p1->token, p1->counters.incoming,
-                                p1->counters.outgoing, p1->counters.incoming_delta, p1->counters.outgoing_delta);
+        if (config->auth_servers == NULL) {
+            continue;
+        }
+        auth_server_request(&authresponse, REQUEST_TYPE_COUNTERS, ip, mac, p1->token, p1->counters.incoming,
+                            p1->counters.outgoing, p1->counters.incoming_delta, p1->counters.outgoing_delta);
+
+        /*
+         * This handles any change in
+         * the status this allows us
+         * to change the status of a
+         * user while he's connected
+         *
+         * The change of firewall mark is queued under the lock, with
+         * the change of state, and applied once it is released.
+         */
+
+        /* The auth server may change the rates of a client at any time */
+        if (AUTH_ALLOWED == authresponse.authcode || AUTH_VALIDATION == authresponse.authcode)
+            fw_shaping_set_rates(p1->ip, authresponse.download_rate, authresponse.upload_rate);
+
+        LOCK_CLIENT_SHARD(&p1->mac);
+        tmp = client_list_find_by_client(p1);
+        if (NULL == tmp) {
+            UNLOCK_CLIENT_SHARD(&p1->mac);
+            debug(LOG_NOTICE, "Client was already removed. Skipping auth processing");
+            continue;       /* Next client please */
         }
 
-        time_t current_time = time(NULL);
-        debug(LOG_INFO,
-              "Checking client %s for timeout:  Last updated %ld (%ld seconds ago), timeout delay %ld seconds, current time %ld, ",
-              p1->ip, p1->counters.last_updated, current_time - p1->counters.last_updated,
-              config->checkinterval * config->clienttimeout, current_time);
-        if (p1->counters.last_updated + (config->checkinterval * config->clienttimeout) <= current_time) {
-            /* Timing out user */
-            debug(LOG_INFO, "%s - Inactive for more than %ld seconds, removing client and denying in firewall",
-                  p1->ip, config->checkinterval * config->clienttimeout);
-            LOCK_CLIENT_LIST();
-            tmp = client_list_find_by_client(p1);
-            if (NULL != tmp) {
-                logout_client(tmp);
-            } else {
-                debug(LOG_NOTICE, "Client was already removed. Not logging out.");
+        removed = NULL;
+        switch (authresponse.authcode) {
+        case AUTH_DENIED:
+            debug(LOG_NOTICE, "%s - Denied. Removing client and firewall rules", ip);
+            client_list_remove(tmp);
+            fw_deny(tmp);
+            removed = tmp;
+            break;
+
+        case AUTH_VALIDATION_FAILED:
+            debug(LOG_NOTICE, "%s - Validation timeout, now denied. Removing client and firewall rules",
+                  ip);
+            client_list_remove(tmp);
+            fw_deny(tmp);
+            removed = tmp;
+            break;
+
+        case AUTH_ALLOWED:
+            if (tmp->fw_connection_state != FW_MARK_KNOWN) {
+                debug(LOG_INFO, "%s - Access has changed to allowed, refreshing firewall and clearing counters",
+                      ip);
+                //WHY did we deny, then allow!?!? benoitg 2007-06-21
+                //fw_deny(tmp->ip, tmp->mac, tmp->fw_connection_state); /* XXX this was possibly to avoid dupes. */
+
+                if (tmp->fw_connection_state != FW_MARK_PROBATION) {
+                    tmp->counters.incoming_delta =
+                     tmp->counters.outgoing_delta =
+                     tmp->counters.incoming =
+                     tmp->counters.outgoing = 0;
+                } else {
+                    //We don't want to clear counters if the user was in validation, it probably already transmitted data..
+                    debug(LOG_INFO,
+                          "%s - Skipped clearing counters after all, the user was previously in validation",
+                          ip);
+                }
+                fw_allow(tmp, FW_MARK_KNOWN);
+                client_list_publish(tmp);
             }
-            UNLOCK_CLIENT_LIST();
-        } else {
+            break;
+
+        case AUTH_VALIDATION:
             /*
-             * This handles any change in
-             * the status this allows us
-             * to change the status of a
-             * user while he's connected
-             *
-             * Only run if we have an auth server
-             * configured!
+             * Do nothing, user
+             * is in validation
+             * period
              */
-            LOCK_CLIENT_LIST();
-            tmp = client_list_find_by_client(p1);
-            if (NULL == tmp) {
-                UNLOCK_CLIENT_LIST();
-                debug(LOG_NOTICE, "Client was already removed. Skipping auth processing");
-                continue;       /* Next client please */
-            }
+            debug(LOG_INFO, "%s - User in validation period", ip);
+            break;
 
-            if (config->auth_servers != NULL) {
-                switch (authresponse.authcode) {
-                case AUTH_DENIED:
-                    debug(LOG_NOTICE, "%s - Denied. Removing client and firewall rules", tmp->ip);
-                    fw_deny(tmp);
-                    client_list_delete(tmp);
-                    break;
-
-                case AUTH_VALIDATION_FAILED:
-                    debug(LOG_NOTICE, "%s - Validation timeout, now denied. Removing client and firewall rules",
-                          tmp->ip);
-                    fw_deny(tmp);
-                    client_list_delete(tmp);
-                    break;
-
-                case AUTH_ALLOWED:
-                    if (tmp->fw_connection_state != FW_MARK_KNOWN) {
-                        debug(LOG_INFO, "%s - Access has changed to allowed, refreshing firewall and clearing counters",
-                              tmp->ip);
-                        //WHY did we deny, then allow!?!? benoitg 2007-06-21
-                        //fw_deny(tmp->ip, tmp->mac, tmp->fw_connection_state); /* XXX this was possibly to avoid dupes. */
-
-                        if (tmp->fw_connection_state != FW_MARK_PROBATION) {
-                            tmp->counters.incoming_delta =
-                             tmp->counters.outgoing_delta =
-                             tmp->counters.incoming =
-                             tmp->counters.outgoing = 0;
-                        } else {
-                            //We don't want to clear counters if the user was in validation, it probably already transmitted data..
-                            debug(LOG_INFO,
-                                  "%s - Skipped clearing counters after all, the user was previously in validation",
-                                  tmp->ip);
-                        }
-                        fw_allow(tmp, FW_MARK_KNOWN);
-                    }
-                    break;
-
-                case AUTH_VALIDATION:
-                    /*
-                     * Do nothing, user
-                     * is in validation
-                     * period
-                     */
-                    debug(LOG_INFO, "%s - User in validation period", tmp->ip);
-                    break;
-
-                case AUTH_ERROR:
-                    debug(LOG_WARNING, "Error communicating with auth server - leaving %s as-is for now", tmp->ip);
-                    break;
-
-                default:
-                    debug(LOG_ERR, "I do not know about authentication code %d", authresponse.authcode);
-                    break;
-                }
-            }
-            UNLOCK_CLIENT_LIST();
+        case AUTH_ERROR:
+            debug(LOG_WARNING, "Error communicating with auth server - leaving %s as-is for now", ip);
+            break;
+
+        default:
+            debug(LOG_ERR, "I do not know about authentication code %d", authresponse.authcode);
+            break;
         }
+        UNLOCK_CLIENT_SHARD(&p1->mac);
+
+        if (NULL != removed)
+            client_free_node(removed);
     }
 
-    client_list_destroy(worklist);
+    client_list_snapshot_release(snapshot);
+    fw_queue_flush();
 }
@@ -40,6 +40,52 @@ typedef enum _t_fw_marks {
     FW_MARK_LOCKED = 254 /**< @brief The client has been locked out */
 } t_fw_marks;
 
+/** Used by the backends' fw_access functions to select if the client should be granted of denied access */
+typedef enum fw_access_t_ {
+    FW_ACCESS_ALLOW,
+    FW_ACCESS_DENY
+} fw_access_t;
+
+/** One change of the firewall mark of a client, see fw_queue_push() */
+typedef struct _t_fw_op {
+    uint32_t ip;                /**< @brief IP address of the client, network byte order */
+    t_mac mac;                  /**< @brief MAC address of the client */
+    int from;                   /**< @brief Mark the client has in the firewall, FW_MARK_NONE if it has none */
+    int to;                     /**< @brief Mark it must have, FW_MARK_NONE to deny it */
+} t_fw_op;
+
+/** Seconds addresses stay in the DNS set when they are added without a
+ * time to live, as dnsmasq does */
+#define FW_DNS_TIMEOUT 600
+
+/** Directions a t_fw_counter was read for */
+#define FW_COUNTER_OUTGOING 1
+#define FW_COUNTER_INCOMING 2
+
+/** Byte counters of one client, as read by a backend */
+typedef struct _t_fw_counter {
+    uint32_t ip;                /**< @brief IP address of the client, network byte order */
+    int directions;             /**< @brief FW_COUNTER_* flags of the counters read */
+    unsigned long long int outgoing;    /**< @brief Bytes sent since the client was allowed */
+    unsigned long long int incoming;    /**< @brief Bytes received since the client was allowed */
+    const void *outgoing_entry; /**< @brief Backend's entry counting outgoing traffic, to remove orphans */
+    const void *incoming_entry; /**< @brief Backend's entry counting incoming traffic */
+    t_mac mac;                  /**< @brief MAC address of the outgoing entry, see fw_counters_mark() */
+    int mark;                   /**< @brief Mark of the outgoing entry, FW_MARK_NONE if not read */
+    int orphan;                 /**< @brief Set by fw_counters_record() if the client is not on the list */
+} t_fw_counter;
+
+/** Counters read in one sweep, joined by IP address */
+typedef struct _t_fw_counters {
+    t_fw_counter *counters;     /**< @brief One per client */
+    int count;                  /**< @brief Number of counters */
+    int size;                   /**< @brief Allocated counters */
+    int *slots;                 /**< @brief Index by IP address: position in counters + 1, 0 when free */
+    int slot_count;             /**< @brief Number of slots, a power of two */
+    int incoming_activity;      /**< @brief Set by the backend when the outgoing counters miss most packets,
+                                     so that incoming traffic keeps the clients from timing out */
+} t_fw_counters;
+
 /** @brief Initialize the firewall */
 int fw_init(void);
 
@@ -52,15 +98,33 @@ void fw_set_authservers(void);
 /** @brief Destroy the firewall */
 int fw_destroy(void);
 
+/** @brief Leave the firewall to the gateway this one is restarting as */
+void fw_handover(void);
+
 /** @brief Allow a user through the firewall*/
 int fw_allow(t_client *, int);
 
 /** @brief Allow a host through the firewall*/
 int fw_allow_host(const char *);
 
+/** @brief Trust a MAC address or stop trusting it */
+int fw_set_trusted_mac(const char *, int);
+
 /** @brief Deny a client access through the firewall*/
 int fw_deny(t_client *);
 
+/** @brief Apply a batch of client mark changes */
+int fw_apply(const t_fw_op *, int);
+
+/** @brief Add or remove addresses of allowed hosts in one batch */
+int fw_apply_hosts(fw_access_t, const uint32_t *, int);
+
+/** @brief Allow addresses found in DNS answers for a while */
+int fw_allow_dns(const uint32_t *, int, unsigned int);
+
+/** @brief Mark the packets with a t_fw_marks value carry */
+uint32_t fw_mark_value(int);
+
 /** @brief Passthrough for clients when auth server is down */
 int fw_set_authdown(void);
 
@@ -70,7 +134,19 @@ int fw_set_authup(void);
 /** @brief Refreshes the entire client list */
 void fw_sync_with_authserver(void);
 
+/** @brief Add a byte counter read from the firewall to a sweep */
+void fw_counters_add(t_fw_counters *, uint32_t, int, unsigned long long int, const void *);
+
+/** @brief Add the MAC address and mark of a client to a sweep */
+void fw_counters_mark(t_fw_counters *, uint32_t, const t_mac *, int);
+
+/** @brief Record the byte counters of a sweep for the clients */
+int fw_counters_record(t_fw_counters *);
+
+/** @brief Free the counters of a sweep */
+void fw_counters_free(t_fw_counters *);
+
 /** @brief Get an IP's MAC address from the ARP cache.*/
-char *arp_get(const char *);
+int arp_get(uint32_t, t_mac *);
 
 #endif                          /* _FIREWALL_H_ */
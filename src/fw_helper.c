@@ -0,0 +1,531 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_helper.c
+    @brief Helper process running the firewall commands
+
+    Forking wifidog for every iptables command means duplicating a large
+    multi-threaded process, then starting /bin/sh to parse the command.
+    Instead, one small helper is forked by main_loop() before any thread is
+    started, and the firewall commands are sent to it over a pipe. It
+    splits each command into words with split_command(), forks, execs the
+    program directly, feeds it the input that came with the command if
+    any, and writes its exit status back. Commands using shell syntax are
+    still run by /bin/sh.
+
+    The helper exits when wifidog closes the pipe. If it dies, it is
+    started again by the next command: wifidog has threads by then, so
+    rather than being forked, its executable is started again with
+    posix_spawn() and FW_HELPER_ARG, which makes gw_main() run the helper.
+    When it cannot be started at all, fw_helper_run() returns -1 and the
+    callers run the command themselves.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <spawn.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "util.h"
+#include "fw_helper.h"
+#include "commandline.h"
+
+/** Longest command line the helper takes */
+#define FW_HELPER_CMD_MAX 4096
+/** Descriptors closed by the helper when /proc/self/fd cannot be read */
+#define FW_HELPER_FD_MAX 1024
+
+/** @internal
+ * A command sent to the helper, followed by its command line, then by the
+ * input to feed it
+ */
+typedef struct _t_fw_helper_request {
+    uint32_t cmd_len;           /**< @brief Length of the command line */
+    uint32_t input_len;         /**< @brief Length of the input, 0 to let it inherit stdin */
+    int32_t quiet;              /**< @brief Whether to send its stderr to /dev/null */
+} t_fw_helper_request;
+
+static int fw_helper_pipes(int[2], int[2]);
+static void fw_helper_connect(int[2], int[2], pid_t);
+static int fw_helper_fork(void);
+static int fw_helper_spawn(void);
+static void fw_helper_close_fds(int, int);
+static int fw_helper_exec(int, const t_fw_helper_request *, char *);
+static int fw_helper_read(int, void *, size_t);
+static int fw_helper_write(int, const void *, size_t);
+static void fw_helper_record(const char *, int, const struct timeval *, const struct timeval *);
+
+/** @internal
+ * Our ends of the pipes to the helper, -1 when it is not running. Used
+ * with helper_mutex held, which also protects the statistics.
+ */
+static int helper_in = -1, helper_out = -1;
+static int helper_started = 0;
+static t_fw_helper_stats helper_stats;
+
+static pthread_mutex_t helper_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** Starts the helper. To be called before any thread is, so that only one
+ * thread gets duplicated.
+ * @return 0 on success, -1 if the commands will be run by wifidog itself
+ */
+int
+fw_helper_start(void)
+{
+    int rc;
+
+    pthread_mutex_lock(&helper_mutex);
+    helper_started = 1;
+    rc = (-1 == helper_out) ? fw_helper_fork() : 0;
+    pthread_mutex_unlock(&helper_mutex);
+
+    return rc;
+}
+
+/** @internal
+ * Creates the pipes to the helper, which neither the commands nor a
+ * restarted wifidog may keep open.
+ * @return 0 on success, -1 on error
+ */
+static int
+fw_helper_pipes(int requests[2], int replies[2])
+{
+    if (pipe(requests) == -1) {
+        debug(LOG_ERR, "Could not create the pipes to the firewall helper: %s", strerror(errno));
+        return -1;
+    }
+    if (pipe(replies) == -1) {
+        debug(LOG_ERR, "Could not create the pipes to the firewall helper: %s", strerror(errno));
+        close(requests[0]);
+        close(requests[1]);
+        return -1;
+    }
+    fcntl(requests[0], F_SETFD, FD_CLOEXEC);
+    fcntl(requests[1], F_SETFD, FD_CLOEXEC);
+    fcntl(replies[0], F_SETFD, FD_CLOEXEC);
+    fcntl(replies[1], F_SETFD, FD_CLOEXEC);
+    return 0;
+}
+
+/** @internal
+ * Keeps our ends of the pipes to a helper just started. helper_mutex must
+ * be held.
+ */
+static void
+fw_helper_connect(int requests[2], int replies[2], pid_t pid)
+{
+    close(requests[0]);
+    close(replies[1]);
+    helper_out = requests[1];
+    helper_in = replies[0];
+    helper_stats.pid = pid;
+    helper_stats.spawns++;
+    debug(LOG_INFO, "Started firewall helper, PID %d", (int)pid);
+}
+
+/** @internal
+ * Forks the helper, which only fw_helper_start() does, before any thread
+ * is started. helper_mutex must be held.
+ */
+static int
+fw_helper_fork(void)
+{
+    int requests[2], replies[2];
+    pid_t pid;
+
+    if (fw_helper_pipes(requests, replies) == -1)
+        return -1;
+
+    pid = safe_fork();
+    if (0 == pid) {
+        close(requests[1]);
+        close(replies[0]);
+        fw_helper_main(requests[0], replies[1]);
+    }
+
+    fw_helper_connect(requests, replies, pid);
+    return 0;
+}
+
+/** @internal
+ * Starts the helper again, from a process which has threads by then: this
+ * executable is run with FW_HELPER_ARG, the pipes being its descriptors
+ * FW_HELPER_FD_REQUESTS and FW_HELPER_FD_REPLIES. helper_mutex must be
+ * held.
+ * @return 0 on success, -1 if the commands will be run by wifidog itself
+ */
+static int
+fw_helper_spawn(void)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t none;
+    char *argv[3];
+    int requests[2], replies[2], from[2] = { -1, -1 }, rc;
+    pid_t pid;
+
+    if (fw_helper_pipes(requests, replies) == -1)
+        return -1;
+
+    /* Out of the way of the descriptors they are moved to */
+    if (-1 == (from[0] = fcntl(requests[0], F_DUPFD_CLOEXEC, FW_HELPER_FD_REPLIES + 1))
+        || -1 == (from[1] = fcntl(replies[1], F_DUPFD_CLOEXEC, FW_HELPER_FD_REPLIES + 1))) {
+        rc = errno;
+    } else {
+        argv[0] = restartargv ? restartargv[0] : "wifidog";
+        argv[1] = FW_HELPER_ARG;
+        argv[2] = NULL;
+
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_adddup2(&actions, from[0], FW_HELPER_FD_REQUESTS);
+        posix_spawn_file_actions_adddup2(&actions, from[1], FW_HELPER_FD_REPLIES);
+        /* The calling thread may have blocked some */
+        posix_spawnattr_init(&attr);
+        sigemptyset(&none);
+        posix_spawnattr_setsigmask(&attr, &none);
+        posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+        rc = posix_spawn(&pid, "/proc/self/exe", &actions, &attr, argv, environ);
+        if (ENOENT == rc && NULL != restartargv)
+            rc = posix_spawnp(&pid, argv[0], &actions, &attr, argv, environ);
+
+        posix_spawnattr_destroy(&attr);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    if (-1 != from[0])
+        close(from[0]);
+    if (-1 != from[1])
+        close(from[1]);
+
+    if (rc != 0) {
+        debug(LOG_ERR, "Could not start the firewall helper: %s", strerror(rc));
+        close(requests[0]);
+        close(requests[1]);
+        close(replies[0]);
+        close(replies[1]);
+        return -1;
+    }
+
+    fw_helper_connect(requests, replies, pid);
+    return 0;
+}
+
+/** @internal
+ * Closes every descriptor of the helper but stdin, stdout, stderr and its
+ * pipes, through /proc/self/fd rather than trying them all: the limit may
+ * be over a million.
+ */
+static void
+fw_helper_close_fds(int requests, int replies)
+{
+    struct dirent *entry;
+    DIR *dir;
+    int fd;
+
+    if (NULL != (dir = opendir("/proc/self/fd"))) {
+        while (NULL != (entry = readdir(dir))) {
+            fd = atoi(entry->d_name);
+            if (fd > 2 && fd != requests && fd != replies && fd != dirfd(dir))
+                close(fd);
+        }
+        closedir(dir);
+        return;
+    }
+    for (fd = 3; fd < FW_HELPER_FD_MAX; fd++)
+        if (fd != requests && fd != replies)
+            close(fd);
+}
+
+/** Body of the helper: runs the commands read from one pipe and writes
+ * their status to the other, until wifidog closes the first one. It does
+ * not log.
+ * @param requests Pipe the commands come from
+ * @param replies Pipe their status goes to
+ */
+void
+fw_helper_main(int requests, int replies)
+{
+    static char cmd[FW_HELPER_CMD_MAX];
+    t_fw_helper_request request;
+    int32_t status;
+    long fd;
+
+    /* wifidog's handlers must not run here, its SIGCHLD one would steal the
+     * status of the commands */
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* Nor may it keep the sockets of the clients open, nor the commands
+     * the pipes, which lost FD_CLOEXEC if they were moved by fw_helper_spawn() */
+    fw_helper_close_fds(requests, replies);
+    fcntl(requests, F_SETFD, FD_CLOEXEC);
+    fcntl(replies, F_SETFD, FD_CLOEXEC);
+
+    while (fw_helper_read(requests, &request, sizeof(request))) {
+        if (request.cmd_len >= sizeof(cmd)) {
+            /* Too long, skip it whole */
+            while (request.cmd_len > 0) {
+                fd = request.cmd_len < sizeof(cmd) ? request.cmd_len : sizeof(cmd);
+                if (!fw_helper_read(requests, cmd, fd))
+                    _exit(0);
+                request.cmd_len -= fd;
+            }
+            request.cmd_len = 0;
+            status = fw_helper_exec(requests, &request, NULL);
+        } else {
+            if (!fw_helper_read(requests, cmd, request.cmd_len))
+                break;
+            cmd[request.cmd_len] = '\0';
+            status = fw_helper_exec(requests, &request, cmd);
+        }
+        if (!fw_helper_write(replies, &status, sizeof(status)))
+            break;
+    }
+    _exit(0);
+}
+
+/** @internal
+ * Runs one command in the helper, feeding it the input that follows on the
+ * pipe, which is consumed whatever happens.
+ * @param requests Pipe the input comes from
+ * @param request The command
+ * @param cmd Its command line, NULL to only consume the input
+ * @return Its exit status, 1 if it was killed, 127 if it could not be run
+ */
+static int
+fw_helper_exec(int requests, const t_fw_helper_request * request, char *cmd)
+{
+    static char buf[FW_HELPER_CMD_MAX], line[FW_HELPER_CMD_MAX];
+    char *argv[COMMAND_ARGS_MAX + 1];
+    int input[2] = { -1, -1 }, argc = 0, status, fd;
+    uint32_t left;
+    size_t chunk;
+    pid_t pid = -1;
+
+    if (NULL != cmd) {
+        strcpy(line, cmd);
+        argc = split_command(cmd, argv);
+    }
+
+    if (argc > 0 && (0 == request->input_len || pipe(input) == 0)) {
+        pid = fork();
+        if (0 == pid) {
+            if (-1 != input[0]) {
+                dup2(input[0], 0);
+                close(input[0]);
+                close(input[1]);
+            }
+            if (request->quiet && -1 != (fd = open("/dev/null", O_WRONLY))) {
+                dup2(fd, 2);
+                close(fd);
+            }
+            execvp(argv[0], argv);
+            /* Maybe a builtin of the shell */
+            if (ENOENT == errno && strcmp(argv[0], WD_SHELL_PATH) != 0)
+                execl(WD_SHELL_PATH, WD_SHELL_PATH, "-c", line, (char *)NULL);
+            _exit(127);
+        }
+        if (-1 != input[0])
+            close(input[0]);
+    }
+
+    /* Pass the input on, or drop it if there is nobody to take it */
+    for (left = request->input_len; left > 0; left -= chunk) {
+        chunk = left < sizeof(buf) ? left : sizeof(buf);
+        if (!fw_helper_read(requests, buf, chunk))
+            _exit(0);
+        if (-1 != input[1] && !fw_helper_write(input[1], buf, chunk)) {
+            close(input[1]);
+            input[1] = -1;
+        }
+    }
+    if (-1 != input[1])
+        close(input[1]);
+
+    if (pid <= 0)
+        return 127;
+    while (waitpid(pid, &status, 0) == -1)
+        if (EINTR != errno)
+            return 1;
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 1;
+}
+
+/** @internal
+ * Reads exactly len bytes.
+ * @return 1 on success, 0 on end of file or error
+ */
+static int
+fw_helper_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = read(fd, buf, len);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf = (char *)buf + n;
+        len -= n;
+    }
+    return 1;
+}
+
+/** @internal
+ * Writes exactly len bytes.
+ * @return 1 on success, 0 on error
+ */
+static int
+fw_helper_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while (len > 0) {
+        n = write(fd, buf, len);
+        if (n < 0 && EINTR == errno)
+            continue;
+        if (n <= 0)
+            return 0;
+        buf = (const char *)buf + n;
+        len -= n;
+    }
+    return 1;
+}
+
+/** Runs a command through the helper, starting it again if it died.
+ * @param cmd Command line, run without the shell unless it uses its syntax
+ * @param input Input to feed the command, NULL to let it inherit stdin
+ * @param input_len Length of the input
+ * @param quiet Whether to hide what the command prints on stderr
+ * @return Exit status of the command, or -1 if the helper is not running,
+ *         in which case the caller has to run the command itself
+ */
+int
+fw_helper_run(const char *cmd, const char *input, size_t input_len, int quiet)
+{
+    t_fw_helper_request request;
+    struct timeval start, end;
+    int32_t status;
+    int attempt, rc = -1;
+
+    request.cmd_len = strlen(cmd);
+    request.input_len = input ? input_len : 0;
+    request.quiet = quiet;
+
+    pthread_mutex_lock(&helper_mutex);
+    if (!helper_started) {
+        pthread_mutex_unlock(&helper_mutex);
+        return -1;
+    }
+
+    gettimeofday(&start, NULL);
+    for (attempt = 0; attempt < 2 && -1 == rc; attempt++) {
+        if (-1 == helper_out && fw_helper_spawn() != 0)
+            break;
+        if (!fw_helper_write(helper_out, &request, sizeof(request))) {
+            /* It was gone before it got the command: start it again and retry */
+            debug(LOG_WARNING, "Firewall helper PID %d is gone, starting it again", (int)helper_stats.pid);
+        } else if (!fw_helper_write(helper_out, cmd, request.cmd_len)
+                   || !fw_helper_write(helper_out, input, request.input_len)
+                   || !fw_helper_read(helper_in, &status, sizeof(status))) {
+            /* It may have run the command, which must not be run twice */
+            debug(LOG_ERR, "Firewall helper PID %d died running: %s", (int)helper_stats.pid, cmd);
+            rc = 1;
+        } else {
+            rc = status;
+            break;
+        }
+        close(helper_out);
+        close(helper_in);
+        helper_out = helper_in = -1;
+        helper_stats.pid = 0;
+    }
+    gettimeofday(&end, NULL);
+
+    if (-1 != rc)
+        fw_helper_record(cmd, rc, &start, &end);
+    pthread_mutex_unlock(&helper_mutex);
+
+    return rc;
+}
+
+/** @internal
+ * Adds a command to the histogram of its program. helper_mutex must be held.
+ */
+static void
+fw_helper_record(const char *cmd, int rc, const struct timeval *start, const struct timeval *end)
+{
+    t_fw_helper_histogram *histogram = NULL;
+    unsigned long ms;
+    size_t len;
+    int i;
+
+    len = strcspn(cmd, " ");
+    if (len >= sizeof(histogram->program))
+        len = sizeof(histogram->program) - 1;
+    for (i = 0; i < FW_HELPER_PROGRAMS; i++) {
+        histogram = &helper_stats.programs[i];
+        if ('\0' == histogram->program[0]) {
+            memcpy(histogram->program, cmd, len);
+            break;
+        }
+        if (strncmp(histogram->program, cmd, len) == 0 && '\0' == histogram->program[len])
+            break;
+    }
+    if (FW_HELPER_PROGRAMS == i)
+        return;
+
+    ms = (end->tv_sec - start->tv_sec) * 1000L + (end->tv_usec - start->tv_usec) / 1000;
+    for (i = 0; i < FW_HELPER_BUCKETS - 1 && ms >= (1UL << i); i++) ;
+    histogram->buckets[i]++;
+    histogram->runs++;
+    if (rc != 0)
+        histogram->failures++;
+}
+
+/** Copies the statistics of the helper
+ * @param stats Receives them
+ */
+void
+fw_helper_get_stats(t_fw_helper_stats * stats)
+{
+    pthread_mutex_lock(&helper_mutex);
+    memcpy(stats, &helper_stats, sizeof(*stats));
+    pthread_mutex_unlock(&helper_mutex);
+}
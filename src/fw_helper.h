@@ -0,0 +1,72 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_helper.h
+    @brief Helper process running the firewall commands
+*/
+
+#ifndef _FW_HELPER_H_
+#define _FW_HELPER_H_
+
+#include <sys/types.h>
+
+/** Buckets of the latency histograms: under 1 ms, then one per power of
+ * two of milliseconds, the last one for 1024 ms and more */
+#define FW_HELPER_BUCKETS 12
+
+/** Programs a latency histogram is kept for */
+#define FW_HELPER_PROGRAMS 8
+
+/** Latency histogram of the commands of one program */
+typedef struct _t_fw_helper_histogram {
+    char program[32];           /**< @brief Name of the program, empty if the slot is unused */
+    unsigned long runs;         /**< @brief Commands run */
+    unsigned long failures;     /**< @brief Commands which did not exit with 0 */
+    unsigned long buckets[FW_HELPER_BUCKETS];   /**< @brief Commands by time taken */
+} t_fw_helper_histogram;
+
+/** Statistics of the helper, see fw_helper_get_stats() */
+typedef struct _t_fw_helper_stats {
+    pid_t pid;                  /**< @brief Process id of the helper, 0 if it is not running */
+    unsigned long spawns;       /**< @brief Times the helper was started */
+    t_fw_helper_histogram programs[FW_HELPER_PROGRAMS]; /**< @brief Latencies by program */
+} t_fw_helper_stats;
+
+/** Argument which makes wifidog run as the helper, see fw_helper_spawn() */
+#define FW_HELPER_ARG "--fw-helper"
+/** Descriptor of the helper the commands come from, when run with FW_HELPER_ARG */
+#define FW_HELPER_FD_REQUESTS 3
+/** Descriptor of the helper their status goes to, when run with FW_HELPER_ARG */
+#define FW_HELPER_FD_REPLIES 4
+
+/** @brief Start the helper, before any thread is */
+int fw_helper_start(void);
+
+/** @brief Run a command through the helper */
+int fw_helper_run(const char *, const char *, size_t, int);
+
+/** @brief Run the commands sent to the helper, in the helper */
+void fw_helper_main(int, int) __attribute__ ((noreturn));
+
+/** @brief Get the statistics of the helper */
+void fw_helper_get_stats(t_fw_helper_stats *);
+
+#endif                          /* _FW_HELPER_H_ */
@@ -0,0 +1,363 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_hosts.c
+    @brief Hosts allowed through the firewall at run time
+
+    fw_allow_host() is called each time a client asks for a subdomain of a
+    host of the global rule set, or for one of its hosts whose address
+    changed. The host name is resolved each time, but each address it
+    resolves to goes into the firewall only once: addresses are counted by
+    the host names referring to them, and asking for a host again only
+    pushes back the time it expires and the last time each address was
+    seen. A host that has FW_HOST_MAX_ADDRS addresses already gives up
+    the one seen longest ago for each new one, so that the addresses of
+    the last lookup are always allowed.
+
+    Hosts not asked for within AllowedHostTimeout seconds expire in
+    fw_hosts_expire(), run with each counter update, as do the addresses
+    of the others not seen within that time, and the addresses no other
+    host refers to are removed from the firewall in one batch.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "firewall.h"
+#include "fw_hosts.h"
+
+/** @internal
+ * A host allowed at run time
+ */
+typedef struct _t_fw_host {
+    char *name;                 /**< @brief Host name, as asked for */
+    uint32_t addrs[FW_HOST_MAX_ADDRS];  /**< @brief Addresses it was allowed with, network byte order */
+    time_t seen[FW_HOST_MAX_ADDRS];     /**< @brief When it last resolved to each of them */
+    int count;                  /**< @brief Number of addresses */
+    time_t expires;             /**< @brief When it expires, 0 never */
+} t_fw_host;
+
+/** @internal
+ * An address in the firewall, with the number of hosts allowed with it
+ */
+typedef struct _t_fw_host_addr {
+    uint32_t ip;                /**< @brief Address, network byte order */
+    int refs;                   /**< @brief Hosts allowed with it */
+} t_fw_host_addr;
+
+static t_fw_host_addr *fw_hosts_addr(uint32_t);
+static void fw_hosts_unref(uint32_t, uint32_t *, int *);
+static void fw_hosts_release(const t_fw_host *, uint32_t *, int *);
+static int fw_hosts_resolve(const char *, uint32_t *);
+
+/** @internal
+ * Hosts and addresses, few enough to be searched linearly. All of it and
+ * the statistics are protected by hosts_mutex, held while the firewall is
+ * changed so that changes are applied in the order they are made.
+ */
+static t_fw_host *hosts = NULL;
+static int host_count = 0;
+static int host_size = 0;
+static t_fw_host_addr *addrs = NULL;
+static int addr_count = 0;
+static int addr_size = 0;
+static t_fw_hosts_stats hosts_stats;
+
+static pthread_mutex_t hosts_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Address in the firewall, NULL if it is not. hosts_mutex must be held.
+ */
+static t_fw_host_addr *
+fw_hosts_addr(uint32_t ip)
+{
+    int i;
+
+    for (i = 0; i < addr_count; i++)
+        if (addrs[i].ip == ip)
+            return &addrs[i];
+    return NULL;
+}
+
+/** @internal
+ * Drops the reference of a host to an address. hosts_mutex must be held.
+ * @param ip Address
+ * @param gone Receives the address if no host refers to it any more
+ * @param count Number of addresses in gone, incremented
+ */
+static void
+fw_hosts_unref(uint32_t ip, uint32_t * gone, int *count)
+{
+    t_fw_host_addr *addr;
+
+    if (NULL != (addr = fw_hosts_addr(ip)) && 0 == --addr->refs) {
+        gone[(*count)++] = addr->ip;
+        *addr = addrs[--addr_count];
+    }
+}
+
+/** @internal
+ * Drops the references of a host to its addresses. hosts_mutex must be held.
+ * @param host Host
+ * @param gone Receives the addresses no host refers to any more
+ * @param count Number of addresses in gone, incremented
+ */
+static void
+fw_hosts_release(const t_fw_host * host, uint32_t * gone, int *count)
+{
+    int i;
+
+    for (i = 0; i < host->count; i++)
+        fw_hosts_unref(host->addrs[i], gone, count);
+}
+
+/** @internal
+ * Resolves a host name to its IPv4 addresses, as iptables would.
+ * @param name Host name or address
+ * @param result Receives at most FW_HOST_MAX_ADDRS addresses, network byte order
+ * @return Number of addresses, -1 if the name could not be resolved
+ */
+static int
+fw_hosts_resolve(const char *name, uint32_t * result)
+{
+    struct addrinfo hints, *res, *ai;
+    int count = 0, i, rc;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if ((rc = getaddrinfo(name, NULL, &hints, &res)) != 0) {
+        debug(LOG_ERR, "Could not resolve %s: %s", name, gai_strerror(rc));
+        return -1;
+    }
+    for (ai = res; NULL != ai && count < FW_HOST_MAX_ADDRS; ai = ai->ai_next) {
+        result[count] = ((struct sockaddr_in *)ai->ai_addr)->sin_addr.s_addr;
+        for (i = 0; i < count && result[i] != result[count]; i++) ;
+        if (i == count)
+            count++;
+    }
+    freeaddrinfo(res);
+    return count;
+}
+
+/** Allows a host through the firewall until it expires. The addresses it
+ * resolves to that are not in the firewall yet are added in one batch;
+ * when all of them are, nothing but the times the host and its addresses
+ * were seen changes. The addresses a full host gives up for them are
+ * removed in another batch if no other host refers to them.
+ * @param name Host name or address
+ * @return 0 on success, -1 if the name could not be resolved or the
+ * firewall could not be changed
+ */
+int
+fw_hosts_allow(const char *name)
+{
+    uint32_t resolved[FW_HOST_MAX_ADDRS], added[FW_HOST_MAX_ADDRS], gone[FW_HOST_MAX_ADDRS];
+    int timeout = config_get_config()->allowed_host_timeout;
+    time_t now = time(NULL);
+    t_fw_host *host = NULL;
+    t_fw_host_addr *addr;
+    int count, n = 0, gone_count = 0, i, j, k, l, rc = 0;
+
+    /* Outside the lock, this may wait for the DNS */
+    if ((count = fw_hosts_resolve(name, resolved)) < 0)
+        return -1;
+
+    pthread_mutex_lock(&hosts_mutex);
+
+    hosts_stats.requests++;
+    for (i = 0; i < host_count; i++) {
+        if (strcasecmp(hosts[i].name, name) == 0) {
+            host = &hosts[i];
+            break;
+        }
+    }
+    if (NULL == host) {
+        if (host_count == host_size) {
+            host_size = host_size ? host_size * 2 : 16;
+            hosts = safe_realloc(hosts, host_size * sizeof(t_fw_host));
+        }
+        host = &hosts[host_count++];
+        memset(host, 0, sizeof(*host));
+        host->name = safe_strdup(name);
+    }
+    host->expires = timeout ? now + timeout : 0;
+
+    /* Addresses the host did not resolve to before are kept with the old
+     * ones, which clients may still have cached, unless the host is full:
+     * then the one seen longest ago that this lookup did not return makes
+     * room, there is always one. */
+    for (i = 0; i < count; i++) {
+        for (j = 0; j < host->count && host->addrs[j] != resolved[i]; j++) ;
+        if (j < host->count) {
+            host->seen[j] = now;
+            continue;
+        }
+        if (host->count < FW_HOST_MAX_ADDRS) {
+            j = host->count++;
+        } else {
+            j = -1;
+            for (k = 0; k < host->count; k++) {
+                for (l = 0; l < count && resolved[l] != host->addrs[k]; l++) ;
+                if (l < count)
+                    continue;
+                if (j < 0 || host->seen[k] < host->seen[j])
+                    j = k;
+            }
+            fw_hosts_unref(host->addrs[j], gone, &gone_count);
+        }
+        host->addrs[j] = resolved[i];
+        host->seen[j] = now;
+        if (NULL != (addr = fw_hosts_addr(resolved[i]))) {
+            addr->refs++;
+            continue;
+        }
+        if (addr_count == addr_size) {
+            addr_size = addr_size ? addr_size * 2 : 32;
+            addrs = safe_realloc(addrs, addr_size * sizeof(t_fw_host_addr));
+        }
+        addrs[addr_count].ip = resolved[i];
+        addrs[addr_count].refs = 1;
+        addr_count++;
+        added[n++] = resolved[i];
+    }
+
+    if (n > 0) {
+        debug(LOG_INFO, "Allowing %d new addresses of %s", n, name);
+        if ((rc = fw_apply_hosts(FW_ACCESS_ALLOW, added, n)) != 0) {
+            /* Forget them, for the next request to try again */
+            for (i = 0; i < n; i++) {
+                addr = fw_hosts_addr(added[i]);
+                *addr = addrs[--addr_count];
+                for (j = 0; host->addrs[j] != added[i]; j++) ;
+                host->count--;
+                host->addrs[j] = host->addrs[host->count];
+                host->seen[j] = host->seen[host->count];
+            }
+            debug(LOG_ERR, "Could not allow %s through the firewall", name);
+            rc = -1;
+        } else {
+            hosts_stats.added += n;
+        }
+    }
+
+    /* Once the new ones are in */
+    if (gone_count > 0) {
+        debug(LOG_INFO, "Removing %d old addresses of %s from the firewall", gone_count, name);
+        if (fw_apply_hosts(FW_ACCESS_DENY, gone, gone_count) != 0)
+            debug(LOG_ERR, "Could not remove the old addresses of %s from the firewall", name);
+        hosts_stats.expired += gone_count;
+    }
+
+    pthread_mutex_unlock(&hosts_mutex);
+
+    return rc;
+}
+
+/** Removes the hosts not asked for within AllowedHostTimeout seconds, and
+ * the addresses of the others not seen within that time, then the
+ * addresses no host refers to any more from the firewall in one batch.
+ */
+void
+fw_hosts_expire(void)
+{
+    int timeout = config_get_config()->allowed_host_timeout;
+    time_t now = time(NULL);
+    t_fw_host *host;
+    uint32_t *gone;
+    int count = 0, i, j;
+
+    pthread_mutex_lock(&hosts_mutex);
+
+    gone = safe_malloc((addr_count + 1) * sizeof(uint32_t));
+    for (i = 0; i < host_count;) {
+        host = &hosts[i];
+        if (0 == host->expires || host->expires > now) {
+            for (j = 0; j < host->count;) {
+                if (0 == timeout || host->seen[j] + timeout > now) {
+                    j++;
+                    continue;
+                }
+                fw_hosts_unref(host->addrs[j], gone, &count);
+                host->count--;
+                host->addrs[j] = host->addrs[host->count];
+                host->seen[j] = host->seen[host->count];
+            }
+            i++;
+            continue;
+        }
+        debug(LOG_DEBUG, "Allowed host %s expired", hosts[i].name);
+        fw_hosts_release(&hosts[i], gone, &count);
+        free(hosts[i].name);
+        hosts[i] = hosts[--host_count];
+    }
+
+    if (count > 0) {
+        debug(LOG_INFO, "Removing %d expired addresses of allowed hosts from the firewall", count);
+        if (fw_apply_hosts(FW_ACCESS_DENY, gone, count) != 0)
+            debug(LOG_ERR, "Could not remove the expired addresses of allowed hosts from the firewall");
+        hosts_stats.expired += count;
+    }
+
+    pthread_mutex_unlock(&hosts_mutex);
+
+    free(gone);
+}
+
+/** Forgets the allowed hosts, when the firewall was set up without them */
+void
+fw_hosts_clear(void)
+{
+    int i;
+
+    pthread_mutex_lock(&hosts_mutex);
+    for (i = 0; i < host_count; i++)
+        free(hosts[i].name);
+    free(hosts);
+    free(addrs);
+    hosts = NULL;
+    addrs = NULL;
+    host_count = host_size = addr_count = addr_size = 0;
+    pthread_mutex_unlock(&hosts_mutex);
+}
+
+/** Copies the statistics of the allowed hosts
+ * @param stats Receives them
+ */
+void
+fw_hosts_get_stats(t_fw_hosts_stats * stats)
+{
+    pthread_mutex_lock(&hosts_mutex);
+    memcpy(stats, &hosts_stats, sizeof(*stats));
+    stats->hosts = host_count;
+    stats->addresses = addr_count;
+    pthread_mutex_unlock(&hosts_mutex);
+}
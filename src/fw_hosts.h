@@ -0,0 +1,53 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_hosts.h
+    @brief Hosts allowed through the firewall at run time
+*/
+
+#ifndef _FW_HOSTS_H_
+#define _FW_HOSTS_H_
+
+/** Most addresses a host is allowed with */
+#define FW_HOST_MAX_ADDRS 16
+
+/** Statistics of the allowed hosts, see fw_hosts_get_stats() */
+typedef struct _t_fw_hosts_stats {
+    unsigned int hosts;         /**< @brief Host names allowed */
+    unsigned int addresses;     /**< @brief Addresses they resolve to, each in the firewall once */
+    unsigned long requests;     /**< @brief Times a host was allowed */
+    unsigned long added;        /**< @brief Addresses added to the firewall */
+    unsigned long expired;      /**< @brief Addresses removed from the firewall as they or their hosts expired */
+} t_fw_hosts_stats;
+
+/** @brief Allow a host through the firewall until it expires */
+int fw_hosts_allow(const char *);
+
+/** @brief Remove the hosts not asked for within AllowedHostTimeout */
+void fw_hosts_expire(void);
+
+/** @brief Forget the allowed hosts, the firewall having none */
+void fw_hosts_clear(void);
+
+/** @brief Get the statistics of the allowed hosts */
+void fw_hosts_get_stats(t_fw_hosts_stats *);
+
+#endif                          /* _FW_HOSTS_H_ */
@@ -34,10 +34,15 @@
 #include <syslog.h>
 #include <errno.h>
 #include <string.h>
+#include <ctype.h>
 #include <pthread.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/wait.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <netdb.h>
 
 #include "common.h"
 
@@ -48,8 +53,42 @@
 #include "debug.h"
 #include "util.h"
 #include "client_list.h"
+#include "pstring.h"
+#include "fw_netlink.h"
+#include "fw_helper.h"
 
 static int iptables_do_command(const char *format, ...);
+static int iptables_run_command(const char *);
+static void iptables_batch_begin(void);
+static void iptables_batch_commit(void);
+static void iptables_acct_del(const char *);
+static int iptables_restore(const char *, const char *);
+static const char *ipset_name(int);
+static int ipset_client_set(int, int);
+static int ipset_trusted_sync(const t_trusted_mac *);
+static const char *acct_prefix(void);
+static void acct_name(char *, uint32_t, int);
+static unsigned int fanout_leaf(uint32_t);
+static char *fanout_chain(char *, int, unsigned int);
+static unsigned int fanout_index(const char *, size_t, int *);
+static uint32_t connmark_value(int);
+static int connmark_ours(const t_nl_ct *, void *);
+static int connmark_equals(const t_nl_ct *, void *);
+static int connmark_clients(const t_nl_ct *, void *);
+static int connmark_ip_cmp(const void *, const void *);
+static void connmark_clear(int (*)(const t_nl_ct *, void *), void *, const char *);
+static int iptables_fw_counters_ipset(void);
+static int iptables_fw_counters_nfacct(t_fw_counters *);
+static int iptables_scan_ip(const char *, uint32_t *);
+static int iptables_fw_counters_save(t_fw_counters *, char **);
+static int iptables_fw_counters_list(t_fw_counters *, const char *, int);
+static void iptables_fw_counters_record(t_fw_counters *, int);
+static int iptables_client_rule(const char *, int, unsigned int);
+static int iptables_fw_scan(const char *, const char *const[], int[], int);
+static void iptables_fw_scan_failed(unsigned int);
+static void iptables_fw_chain(const char *, const char *, int);
+static int iptables_ipset_read(t_fw_counters *, t_nl_ipset_entry *[], int[]);
+static long iptables_elapsed_ms(const struct timeval *);
 static char *iptables_compile(const char *, const char *, const t_firewall_rule *);
 static void iptables_load_ruleset(const char *, const char *, const char *);
 
@@ -57,6 +96,173 @@ static void iptables_load_ruleset(const char *, const char *, const char *);
 Used to supress the error output of the firewall during destruction */
 static int fw_quiet = 0;
 
+/** @internal
+ * Tables a batch can hold commands for, in the order they are committed
+ */
+static const char *const batch_tables[] = { "mangle", "nat", "filter" };
+
+#define BATCH_TABLES (sizeof(batch_tables) / sizeof(batch_tables[0]))
+
+/** @internal
+ * Our chains in each table, and the built-in chains jumping to them, same
+ * order as batch_tables
+ */
+static const char *const mangle_chains[] = {
+    CHAIN_TRUSTED, CHAIN_OUTGOING, CHAIN_INCOMING, CHAIN_AUTH_IS_DOWN, CHAIN_DNS, CHAIN_CT_RESTORE,
+    CHAIN_CT_SAVE, NULL
+};
+static const char *const nat_chains[] = {
+    CHAIN_OUTGOING, CHAIN_TO_ROUTER, CHAIN_TO_INTERNET, CHAIN_GLOBAL, CHAIN_UNKNOWN,
+    CHAIN_AUTHSERVERS, CHAIN_AUTH_IS_DOWN, NULL
+};
+static const char *const filter_chains[] = {
+    CHAIN_TO_INTERNET, CHAIN_AUTHSERVERS, CHAIN_LOCKED, CHAIN_GLOBAL, CHAIN_VALIDATE,
+    CHAIN_KNOWN, CHAIN_UNKNOWN, CHAIN_AUTH_IS_DOWN, NULL
+};
+static const char *const *const table_chains[BATCH_TABLES] = { mangle_chains, nat_chains, filter_chains };
+static const char *const table_hooks[BATCH_TABLES][3] = {
+    {"PREROUTING", "POSTROUTING", NULL}, {"PREROUTING", NULL}, {"FORWARD", NULL}
+};
+
+#define TABLE_CHAINS_MAX 9
+
+/** @internal
+ * Which of our chains exist, as found by iptables_fw_scan(), and which of
+ * them iptables_fw_init() asked for with iptables_fw_chain(); by table,
+ * then position in table_chains.
+ */
+static int chain_exists[BATCH_TABLES][TABLE_CHAINS_MAX];
+static int chain_wanted[BATCH_TABLES][TABLE_CHAINS_MAX];
+
+/** @internal
+ * Commands queued between iptables_batch_begin() and iptables_batch_commit()
+ * by the thread that began the batch, one newline separated list per table.
+ * Other threads keep running their commands right away.
+ */
+static pstr_t *batch[BATCH_TABLES];
+static int batching = 0;
+static pthread_t batch_owner;
+
+/** @internal
+ * Accounting objects to delete once the batch removing the rules that refer
+ * to them is committed, one newline separated list.
+ */
+static pstr_t *batch_acct_del;
+
+/** @internal
+ * Held from iptables_batch_begin() to iptables_batch_commit(), so that one
+ * thread batches at a time.
+ */
+static pthread_mutex_t batch_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Number of processes started to change the firewall, for timing output
+ */
+static int fw_processes = 0;
+
+/** @internal
+ * Whether clients are kept in ipsets rather than in per-client rules. Set by
+ * iptables_fw_init() according to FirewallBackend, if the sets could be
+ * created.
+ */
+static int use_ipset = 0;
+
+/** @internal
+ * Whether the per-client rules count traffic in nfnetlink_acct objects. Set
+ * by iptables_fw_init() according to FirewallAccounting, unless the ipset
+ * backend is in use or the objects cannot be read.
+ */
+static int use_nfacct = 0;
+
+/** @internal
+ * Whether the trusted MAC addresses are matched by one rule against a
+ * hash:mac set rather than by a rule each. Set by iptables_fw_init() if the
+ * set could be created, whatever the backend.
+ */
+static int use_trusted_set = 0;
+
+/** @internal
+ * Whether the addresses of the hosts allowed at run time are members of a
+ * hash:ip set matched by one rule rather than rules of their own. Set by
+ * iptables_fw_init() if the set could be created, whatever the backend.
+ */
+static int use_hosts_set = 0;
+
+/** @internal
+ * Whether the addresses found in DNS answers are allowed through the DNS
+ * set. Set by iptables_fw_init() if the set could be created, whatever the
+ * backend; there is no fallback, as rules do not expire.
+ */
+static int use_dns_set = 0;
+
+/** @internal
+ * Without sets, the rules of the clients are spread over a tree of
+ * sub-chains by the lowest fanout_bits bits of their address, see
+ * fanout_leaf(). Set by iptables_fw_init() from FirewallFanoutBits, 0
+ * keeps them all in CHAIN_OUTGOING and CHAIN_INCOMING.
+ */
+static int fanout_bits = 0;
+
+/** @internal
+ * Whether connections keep the mark their first packets got from the
+ * client rules, restored for the packets that follow so that they skip
+ * those rules. Set by iptables_fw_init() from FirewallConnmark if the
+ * conntrack entries can be read; the marks are then cleared whenever the
+ * rules that gave them change, see connmark_clear().
+ */
+static int use_connmark = 0;
+
+/** @internal
+ * Addresses of the clients whose connections connmark_clients() picks
+ */
+typedef struct _t_connmark_clients {
+    uint32_t *ips;              /**< @brief Addresses, network byte order, sorted by connmark_ip_cmp() */
+    size_t count;               /**< @brief Number of addresses */
+} t_connmark_clients;
+
+/** @internal
+ * Sub-chains there are of each direction, as found by iptables_fw_scan(),
+ * by index
+ */
+#define FANOUT_INDEXES (2 << FW_FANOUT_MAX_BITS)
+/** @internal Size of the name of a chain of the tree, with $ID$ */
+#define FANOUT_CHAIN_LEN 32
+static unsigned char fanout_exists[2][FANOUT_INDEXES];
+
+/** @internal
+ * Client sets of the ipset backend, then the sets used with either
+ * backend: allowed hosts, trusted MAC addresses and addresses from DNS
+ * answers. The first half of the client sets count outgoing traffic, the
+ * second half incoming traffic.
+ */
+enum {
+    IPSET_PROBATION_OUT,
+    IPSET_KNOWN_OUT,
+    IPSET_PROBATION_IN,
+    IPSET_KNOWN_IN,
+    IPSET_HOSTS,
+    IPSET_TRUSTED,
+    IPSET_DNS,
+    IPSET_COUNT
+};
+
+#define IPSET_CLIENT_SETS IPSET_HOSTS
+
+static const struct {
+    const char *name;
+    const char *type;
+    int counters;
+    unsigned int timeout;
+} ipset_sets[IPSET_COUNT] = {
+    {SET_PROBATION_OUT, "hash:ip,mac", 1, 0},
+    {SET_KNOWN_OUT, "hash:ip,mac", 1, 0},
+    {SET_PROBATION_IN, "hash:ip", 1, 0},
+    {SET_KNOWN_IN, "hash:ip", 1, 0},
+    {SET_HOSTS, "hash:ip", 0, 0},
+    {SET_TRUSTED, "hash:mac", 0, 0},
+    {SET_DNS, "hash:ip", 0, FW_DNS_TIMEOUT}
+};
+
 /** @internal
  * @brief Insert $ID$ with the gateway's id in a string.
  *
@@ -92,28 +298,64 @@ iptables_insert_gateway_id(char **input)
     *input = buffer;
 }
 
-/** @internal 
- * */
+/** @internal
+ * Runs an iptables command, or queues it in the current batch if the calling
+ * thread began one. Queued commands always succeed here; see
+ * iptables_batch_commit().
+ */
 static int
 iptables_do_command(const char *format, ...)
 {
     va_list vlist;
     char *fmt_cmd;
-    char *cmd;
+    char *args;
+    unsigned int i;
+    size_t len;
     int rc;
 
     va_start(vlist, format);
     safe_vasprintf(&fmt_cmd, format, vlist);
     va_end(vlist);
 
-    safe_asprintf(&cmd, "iptables %s", fmt_cmd);
+    if (batching && pthread_equal(batch_owner, pthread_self()) && strncmp(fmt_cmd, "-t ", 3) == 0) {
+        for (i = 0; i < BATCH_TABLES; i++) {
+            len = strlen(batch_tables[i]);
+            if (strncmp(fmt_cmd + 3, batch_tables[i], len) == 0 && fmt_cmd[3 + len] == ' ') {
+                args = safe_strdup(fmt_cmd + 3 + len + 1);
+                iptables_insert_gateway_id(&args);
+                pstr_cat(batch[i], args);
+                pstr_cat(batch[i], "\n");
+                free(args);
+                free(fmt_cmd);
+                return 0;
+            }
+        }
+    }
+
+    rc = iptables_run_command(fmt_cmd);
     free(fmt_cmd);
 
+    return rc;
+}
+
+/** @internal
+ * Runs "iptables <args>" right away.
+ */
+static int
+iptables_run_command(const char *args)
+{
+    char *cmd;
+    int rc;
+
+    safe_asprintf(&cmd, "iptables %s", args);
+
     iptables_insert_gateway_id(&cmd);
 
     debug(LOG_DEBUG, "Executing command: %s", cmd);
 
-    rc = execute(cmd, fw_quiet);
+    fw_processes++;
+    if ((rc = fw_helper_run(cmd, NULL, 0, fw_quiet)) == -1)
+        rc = execute(cmd, fw_quiet);
 
     if (rc != 0) {
         // If quiet, do not display the error
@@ -128,6 +370,421 @@ iptables_do_command(const char *format, ...)
     return rc;
 }
 
+/** @internal
+ * Starts queueing the iptables commands of the calling thread, so that they
+ * are applied with one iptables-restore per table by iptables_batch_commit().
+ */
+static void
+iptables_batch_begin(void)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&batch_mutex);
+    for (i = 0; i < BATCH_TABLES; i++)
+        batch[i] = pstr_new();
+    batch_acct_del = pstr_new();
+    batch_owner = pthread_self();
+    batching = 1;
+}
+
+/** @internal
+ * Applies the queued commands, each table in a single iptables-restore
+ * --noflush transaction. If a transaction fails, nothing of it was applied
+ * and its commands are run one at a time instead, so that a single bad rule
+ * (or a missing iptables-restore) only costs time.
+ */
+static void
+iptables_batch_commit(void)
+{
+    char *commands, *line, *next;
+    unsigned int i;
+    int rc;
+
+    batching = 0;
+
+    for (i = 0; i < BATCH_TABLES; i++) {
+        commands = pstr_to_string(batch[i]);
+        batch[i] = NULL;
+        if ('\0' == *commands) {
+            free(commands);
+            continue;
+        }
+
+        rc = iptables_restore(batch_tables[i], commands);
+        if (rc != 0) {
+            debug(fw_quiet ? LOG_DEBUG : LOG_WARNING,
+                  "iptables-restore failed(%d) for table %s, running its commands one at a time", rc, batch_tables[i]);
+            for (line = commands; '\0' != *line; line = next) {
+                next = strchr(line, '\n');
+                *next++ = '\0';
+                iptables_do_command("-t %s %s", batch_tables[i], line);
+            }
+        }
+        free(commands);
+    }
+
+    commands = pstr_to_string(batch_acct_del);
+    batch_acct_del = NULL;
+    for (line = commands; '\0' != *line; line = next) {
+        next = strchr(line, '\n');
+        *next++ = '\0';
+        nl_acct_del(line);
+    }
+    free(commands);
+
+    pthread_mutex_unlock(&batch_mutex);
+}
+
+/** @internal
+ * Deletes an accounting object, after the current batch of the calling
+ * thread is committed if there is one: the kernel refuses to delete an
+ * object while a rule refers to it.
+ */
+static void
+iptables_acct_del(const char *name)
+{
+    if (batching && pthread_equal(batch_owner, pthread_self())) {
+        pstr_cat(batch_acct_del, name);
+        pstr_cat(batch_acct_del, "\n");
+    } else {
+        nl_acct_del(name);
+    }
+}
+
+/** @internal
+ * Feeds commands for one table to iptables-restore --noflush.
+ * @param table Table the commands apply to
+ * @param commands Newline terminated iptables arguments, without -t and
+ *                 with the gateway id already inserted
+ * @return Exit status of iptables-restore, 0 on success
+ */
+static int
+iptables_restore(const char *table, const char *commands)
+{
+    pstr_t *input = pstr_new();
+    char *script;
+    FILE *p;
+    int rc;
+
+    pstr_append_sprintf(input, "*%s\n", table);
+    pstr_cat(input, commands);
+    pstr_cat(input, "COMMIT\n");
+    script = pstr_to_string(input);
+
+    debug(LOG_DEBUG, "Executing iptables-restore --noflush:\n%s", script);
+
+    fw_processes++;
+    if ((rc = fw_helper_run("iptables-restore --noflush", script, strlen(script), fw_quiet)) != -1) {
+        free(script);
+        return rc;
+    }
+    /* pclose() needs the exit status, the SIGCHLD handler must not take it */
+    child_wait_begin();
+    if (NULL == (p = popen(fw_quiet ? "iptables-restore --noflush 2>/dev/null" : "iptables-restore --noflush", "w"))) {
+        child_wait_end();
+        debug(LOG_ERR, "popen(): %s", strerror(errno));
+        free(script);
+        return -1;
+    }
+    fputs(script, p);
+    free(script);
+
+    rc = pclose(p);
+    child_wait_end();
+    if (-1 == rc) {
+        debug(LOG_ERR, "Could not get the exit status of iptables-restore (%s)", strerror(errno));
+        return 1;
+    }
+    return WIFEXITED(rc) ? WEXITSTATUS(rc) : 1;
+}
+
+/** @internal
+ * Name of one of the sets of the ipset backend, with the gateway id.
+ * @param set IPSET_* index
+ */
+static const char *
+ipset_name(int set)
+{
+    /* Filled the first time, by iptables_fw_init() */
+    static char *names[IPSET_COUNT];
+
+    if (NULL == names[set]) {
+        names[set] = safe_strdup(ipset_sets[set].name);
+        iptables_insert_gateway_id(&names[set]);
+    }
+    return names[set];
+}
+
+/** @internal
+ * Set holding the clients with a given mark
+ * @param tag Mark of the clients
+ * @param incoming 0 for the hash:ip,mac set matching their traffic to the
+ *                 internet, 1 for the hash:ip set matching the way back
+ * @return IPSET_* index, or -1 if there is no set for that mark
+ */
+static int
+ipset_client_set(int tag, int incoming)
+{
+    switch (tag) {
+    case FW_MARK_PROBATION:
+        return incoming ? IPSET_PROBATION_IN : IPSET_PROBATION_OUT;
+    case FW_MARK_KNOWN:
+        return incoming ? IPSET_KNOWN_IN : IPSET_KNOWN_OUT;
+    default:
+        return -1;
+    }
+}
+
+/** @internal
+ * Makes the members of the trusted set the MAC addresses of a list. Those
+ * missing are added before the others are deleted, so that a MAC address
+ * trusted all along never stops matching.
+ * @param list Trusted MAC addresses
+ * @return 0 on success, a negative error code otherwise
+ */
+static int
+ipset_trusted_sync(const t_trusted_mac * list)
+{
+    const t_trusted_mac *p;
+    t_nl_ipset_entry *entries;
+    t_mac mac;
+    int count, i, rc = 0;
+
+    for (p = list; NULL != p && 0 == rc; p = p->next) {
+        if (parse_mac(p->mac, &mac))
+            rc = nl_ipset_add(ipset_name(IPSET_TRUSTED), 0, &mac);
+    }
+    if (0 != rc)
+        return rc;
+
+    if ((count = nl_ipset_list(ipset_name(IPSET_TRUSTED), &entries)) < 0)
+        return count;
+    for (i = 0; i < count && 0 == rc; i++) {
+        for (p = list; NULL != p; p = p->next) {
+            if (parse_mac(p->mac, &mac) && memcmp(mac.addr, entries[i].mac.addr, sizeof(mac.addr)) == 0)
+                break;
+        }
+        if (NULL == p)
+            rc = nl_ipset_del(ipset_name(IPSET_TRUSTED), 0, &entries[i].mac);
+    }
+    free(entries);
+    return rc;
+}
+
+/** @internal
+ * Prefix of our accounting objects, with the gateway id
+ */
+static const char *
+acct_prefix(void)
+{
+    /* Filled the first time, by iptables_fw_init() */
+    static char *prefix;
+
+    if (NULL == prefix) {
+        prefix = safe_strdup(ACCT_PREFIX);
+        iptables_insert_gateway_id(&prefix);
+    }
+    return prefix;
+}
+
+/** @internal
+ * Name of the accounting object counting the traffic of a client in one
+ * direction, e.g. WD_br0_o_c0a80164. It fits NL_ACCT_NAME_MAX as the id is
+ * at most CHAIN_NAME_MAX_LEN characters.
+ * @param name Buffer of NL_ACCT_NAME_MAX bytes
+ * @param ip IP address of the client, network byte order
+ * @param incoming 0 for its traffic to the internet, 1 for the way back
+ */
+static void
+acct_name(char *name, uint32_t ip, int incoming)
+{
+    snprintf(name, NL_ACCT_NAME_MAX, "%s%c_%08x", acct_prefix(), incoming ? 'i' : 'o', ntohl(ip));
+}
+
+/** @internal
+ * Index of the sub-chain holding the rules of a client. The chains form a
+ * binary tree: chain i jumps to chain 2i + 1 when the address has bit d
+ * set, d being its depth, and to chain 2i otherwise, so that a packet goes
+ * through at most two rules per level before the rules of the clients
+ * sharing its lowest fanout_bits bits. Index 1 is CHAIN_OUTGOING or
+ * CHAIN_INCOMING themselves, the leaves are 1 << fanout_bits and up.
+ * @param ip IP address of the client, network byte order
+ */
+static unsigned int
+fanout_leaf(uint32_t ip)
+{
+    uint32_t addr = ntohl(ip);
+    unsigned int index = 1;
+    int d;
+
+    for (d = 0; d < fanout_bits; d++)
+        index = index << 1 | ((addr >> d) & 1);
+    return index;
+}
+
+/** @internal
+ * Name of a chain of the tree, with $ID$ for the gateway id
+ * @param name Buffer of FANOUT_CHAIN_LEN bytes
+ * @param incoming 0 for the tree of CHAIN_OUTGOING, 1 for CHAIN_INCOMING
+ * @param index Index of the chain, see fanout_leaf()
+ * @return name
+ */
+static char *
+fanout_chain(char *name, int incoming, unsigned int index)
+{
+    if (1 == index)
+        strcpy(name, incoming ? CHAIN_INCOMING : CHAIN_OUTGOING);
+    else
+        snprintf(name, FANOUT_CHAIN_LEN, "%s%u", incoming ? CHAIN_INCOMING_FANOUT : CHAIN_OUTGOING_FANOUT, index);
+    return name;
+}
+
+/** @internal
+ * Index of a chain of the trees from its name, as iptables-save writes it
+ * @param chain Name of the chain, with the gateway id
+ * @param len Length of the name
+ * @param incoming Set to 0 for the tree of CHAIN_OUTGOING, 1 for CHAIN_INCOMING
+ * @return Index of the chain, 0 if it is not one of them
+ */
+static unsigned int
+fanout_index(const char *chain, size_t len, int *incoming)
+{
+    /* Filled the first time, by iptables_fw_init() */
+    static char *names[4];
+    static size_t name_len[4];
+    unsigned int index;
+    size_t i;
+    int n;
+
+    if (NULL == names[0]) {
+        names[0] = safe_strdup(CHAIN_OUTGOING);
+        names[1] = safe_strdup(CHAIN_INCOMING);
+        names[2] = safe_strdup(CHAIN_OUTGOING_FANOUT);
+        names[3] = safe_strdup(CHAIN_INCOMING_FANOUT);
+        for (n = 0; n < 4; n++) {
+            iptables_insert_gateway_id(&names[n]);
+            name_len[n] = strlen(names[n]);
+        }
+    }
+
+    for (n = 0; n < 2; n++) {
+        if (len == name_len[n] && strncmp(chain, names[n], len) == 0) {
+            *incoming = n;
+            return 1;
+        }
+    }
+    for (n = 2; n < 4; n++) {
+        if (len <= name_len[n] || len > name_len[n] + 3 || strncmp(chain, names[n], name_len[n]) != 0
+            || '0' == chain[name_len[n]])
+            continue;
+        for (i = name_len[n], index = 0; i < len && isdigit((unsigned char)chain[i]); i++)
+            index = index * 10 + (chain[i] - '0');
+        if (i == len && index >= 2 && index < FANOUT_INDEXES) {
+            *incoming = n - 2;
+            return index;
+        }
+    }
+    return 0;
+}
+
+/** @internal
+ * Mark a t_fw_marks value stands for in the rules that write it with
+ * "0x%u": FW_MARK_AUTH_IS_DOWN is 0x253
+ */
+static uint32_t
+connmark_value(int tag)
+{
+    char buf[16];
+
+    snprintf(buf, sizeof(buf), "%u", tag);
+    return strtoul(buf, NULL, 16);
+}
+
+/** Mark carried by the packets of the clients with a t_fw_marks value,
+ * which is not always the value itself, see connmark_value()
+ * @param tag t_fw_marks value
+ */
+uint32_t
+iptables_fw_mark_value(int tag)
+{
+    return connmark_value(tag);
+}
+
+/** @internal
+ * Picks the connections marked by our rules, as an earlier run left them
+ */
+static int
+connmark_ours(const t_nl_ct *ct, void *arg)
+{
+    return ct->mark == FW_MARK_PROBATION || ct->mark == FW_MARK_KNOWN || ct->mark == FW_MARK_LOCKED
+        || ct->mark == connmark_value(FW_MARK_AUTH_IS_DOWN) || ct->mark == connmark_value(FW_MARK_LOCKED);
+}
+
+/** @internal
+ * Picks the connections with one mark
+ * @param arg Pointer to the mark, a uint32_t
+ */
+static int
+connmark_equals(const t_nl_ct *ct, void *arg)
+{
+    return ct->mark == *(const uint32_t *)arg;
+}
+
+/** @internal
+ * Picks the connections of some clients, in either direction
+ * @param arg The clients, a t_connmark_clients
+ */
+static int
+connmark_clients(const t_nl_ct *ct, void *arg)
+{
+    const t_connmark_clients *clients = arg;
+
+    return bsearch(&ct->src, clients->ips, clients->count, sizeof(uint32_t), connmark_ip_cmp) != NULL
+        || bsearch(&ct->reply_src, clients->ips, clients->count, sizeof(uint32_t), connmark_ip_cmp) != NULL;
+}
+
+/** @internal
+ * Orders addresses for connmark_clients()
+ */
+static int
+connmark_ip_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/** @internal
+ * Clears the mark of the connections a callback picks, once the rules that
+ * marked them changed, so that their next packet goes through the rules
+ * again. Does nothing unless use_connmark.
+ * @param what Whose connections they are, for the log
+ */
+static void
+connmark_clear(int (*match)(const t_nl_ct *, void *), void *arg, const char *what)
+{
+    int rc;
+
+    if (!use_connmark)
+        return;
+    if ((rc = nl_ct_clear_marks(match, arg)) < 0)
+        debug(LOG_ERR, "Could not clear the marks of the connections of %s: %s", what, strerror(-rc));
+    else if (rc > 0)
+        debug(LOG_DEBUG, "Cleared the marks of %d connections of %s", rc, what);
+}
+
+/** @internal
+ * Milliseconds elapsed since a point in time, for timing output
+ */
+static long
+iptables_elapsed_ms(const struct timeval *start)
+{
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_usec - start->tv_usec) / 1000;
+}
+
 /**
  * @internal
  * Compiles a struct definition of a firewall rule into a valid iptables
@@ -245,7 +902,11 @@ iptables_fw_set_authservers(void)
 
 }
 
-/** Initialize the firewall rules
+/** Initialize the firewall rules. Chains left by a previous gateway are
+ * flushed and filled again in the transaction that fills the new ones, and
+ * the jumps to them replaced in it too, so that traffic never goes through
+ * half a firewall. The rules of the clients are kept, for fw_init() to
+ * check against the client list.
 */
 int
 iptables_fw_init(void)
@@ -257,6 +918,15 @@ iptables_fw_init(void)
     int proxy_port;
     fw_quiet = 0;
     int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
+    struct timeval start;
+    t_nl_acct *accts;
+    char chain[FANOUT_CHAIN_LEN], child[FANOUT_CHAIN_LEN], mask[IP_STR_LEN];
+    const char *connmark;
+    unsigned int t, index, depth;
+    int i, d, rc;
+
+    gettimeofday(&start, NULL);
+    fw_processes = 0;
 
     LOCK_CONFIG();
     config = config_get_config();
@@ -272,6 +942,82 @@ iptables_fw_init(void)
         debug(LOG_ERR, "FATAL: no external interface");
         return 0;
     }
+
+    /* The sets must exist before rules refer to them. The members of the
+     * client sets are kept like the rules of the clients. */
+    use_ipset = 0;
+    if (config->fw_backend == FW_BACKEND_IPSET) {
+        for (i = 0; i < IPSET_CLIENT_SETS; i++) {
+            if (nl_ipset_create(ipset_name(i), ipset_sets[i].type, ipset_sets[i].counters, ipset_sets[i].timeout) != 0)
+                break;
+        }
+        if (i == IPSET_CLIENT_SETS)
+            use_ipset = 1;
+        else
+            debug(LOG_ERR, "Could not create the client ipsets, using one iptables rule per client instead");
+    }
+
+    /* Hosts are allowed again as clients ask for them, see fw_hosts.c */
+    use_hosts_set = nl_ipset_create(ipset_name(IPSET_HOSTS), ipset_sets[IPSET_HOSTS].type, 0, 0) == 0
+        && nl_ipset_flush(ipset_name(IPSET_HOSTS)) == 0;
+    if (!use_hosts_set)
+        debug(LOG_WARNING, "Could not create the allowed hosts ipset, using one iptables rule per address instead");
+
+    /* Whatever the backend, trusted MAC addresses are looked up in a set
+     * when the kernel has hash:mac sets, so that their number does not
+     * slow down every packet */
+    use_trusted_set = nl_ipset_create(ipset_name(IPSET_TRUSTED), ipset_sets[IPSET_TRUSTED].type, 0, 0) == 0
+        && ipset_trusted_sync(config->trustedmaclist) == 0;
+    if (!use_trusted_set && NULL != config->trustedmaclist)
+        debug(LOG_WARNING, "Could not fill the trusted MAC ipset, using one iptables rule per MAC address instead");
+
+    /* Addresses from DNS answers are kept until they expire */
+    use_dns_set = nl_ipset_create(ipset_name(IPSET_DNS), ipset_sets[IPSET_DNS].type, 0,
+                                  ipset_sets[IPSET_DNS].timeout) == 0;
+    if (!use_dns_set && config->dns_snooping)
+        debug(LOG_ERR, "Could not create the DNS ipset, addresses from DNS answers will not be allowed");
+
+    /* Objects left over are kept with the rules referring to them */
+    use_nfacct = 0;
+    if (!use_ipset && config->fw_accounting == FW_ACCOUNTING_NFACCT) {
+        if (nl_acct_list(acct_prefix(), &accts) >= 0) {
+            free(accts);
+            use_nfacct = 1;
+        } else {
+            debug(LOG_ERR, "Could not read nfnetlink_acct objects, counting traffic in the rules instead");
+        }
+    }
+
+    /* Marks left on connections by an earlier run would be restored for
+     * clients that may be gone since */
+    use_connmark = 0;
+    if (config->fw_connmark) {
+        if ((rc = nl_ct_clear_marks(connmark_ours, NULL)) >= 0)
+            use_connmark = 1;
+        else
+            debug(LOG_ERR, "Could not read the conntrack entries (%s), marking every packet instead", strerror(-rc));
+    }
+
+    /* The rules of clients in the wrong chain for the layout are removed
+     * by iptables_fw_scan(), and added again by fw_init() */
+    fanout_bits = use_ipset ? 0 : config->fw_fanout_bits;
+    memset(fanout_exists, 0, sizeof(fanout_exists));
+
+    /* Everything below is applied with one iptables-restore per table */
+    iptables_batch_begin();
+
+    /* Removes the jumps to our chains, which are inserted again below */
+    memset(chain_wanted, 0, sizeof(chain_wanted));
+    for (t = 0; t < BATCH_TABLES; t++) {
+        memset(chain_exists[t], 0, sizeof(chain_exists[t]));
+        if (!iptables_fw_scan(batch_tables[t], table_chains[t], chain_exists[t], 0 == t && !use_ipset)) {
+            /* Start from scratch instead */
+            fw_quiet = 1;
+            iptables_fw_scan_failed(t);
+            fw_quiet = 0;
+        }
+    }
+
     /*
      *
      * Everything in the MANGLE table
@@ -279,38 +1025,93 @@ iptables_fw_init(void)
      */
 
     /* Create new chains */
-    iptables_do_command("-t mangle -N " CHAIN_TRUSTED);
-    iptables_do_command("-t mangle -N " CHAIN_OUTGOING);
-    iptables_do_command("-t mangle -N " CHAIN_INCOMING);
+    iptables_fw_chain("mangle", CHAIN_TRUSTED, 0);
+    /* Without sets, these only hold the rules of the clients */
+    iptables_fw_chain("mangle", CHAIN_OUTGOING, !use_ipset);
+    iptables_fw_chain("mangle", CHAIN_INCOMING, !use_ipset);
     if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -N " CHAIN_AUTH_IS_DOWN);
+        iptables_fw_chain("mangle", CHAIN_AUTH_IS_DOWN, 0);
+    if (use_dns_set && config->dns_snooping)
+        iptables_fw_chain("mangle", CHAIN_DNS, 0);
+    if (use_connmark) {
+        iptables_fw_chain("mangle", CHAIN_CT_RESTORE, 0);
+        iptables_fw_chain("mangle", CHAIN_CT_SAVE, 0);
+    }
 
-    /* Assign links and rules to these new chains */
-    iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_OUTGOING, config->gw_interface);
-    iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_TRUSTED, config->gw_interface);     //this rule will be inserted before the prior one
+    /* Assign links and rules to these new chains. With connection marks,
+     * only the packets of connections without one go through the rules,
+     * and the mark they get is saved for the packets that follow. */
+    connmark = use_connmark ? " -m connmark --mark 0" : "";
+    if (use_connmark)
+        iptables_do_command("-t mangle -I PREROUTING 1 -i %s%s -j " CHAIN_CT_SAVE, config->gw_interface, connmark);
+    iptables_do_command("-t mangle -I PREROUTING 1 -i %s%s -j " CHAIN_OUTGOING, config->gw_interface, connmark);
+    iptables_do_command("-t mangle -I PREROUTING 1 -i %s%s -j " CHAIN_TRUSTED, config->gw_interface, connmark); //this rule will be inserted before the prior one
     if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_AUTH_IS_DOWN, config->gw_interface);    //this rule must be last in the chain
+        iptables_do_command("-t mangle -I PREROUTING 1 -i %s%s -j " CHAIN_AUTH_IS_DOWN, config->gw_interface, connmark);        //this rule must be last in the chain
+    if (use_connmark) {
+        iptables_do_command("-t mangle -I PREROUTING 1 -i %s -j " CHAIN_CT_RESTORE, config->gw_interface);
+        iptables_do_command("-t mangle -A " CHAIN_CT_RESTORE " -j CONNMARK --restore-mark");
+        iptables_do_command("-t mangle -A " CHAIN_CT_SAVE " -j CONNMARK --save-mark");
+    }
     iptables_do_command("-t mangle -I POSTROUTING 1 -o %s -j " CHAIN_INCOMING, config->gw_interface);
 
-    for (p = config->trustedmaclist; p != NULL; p = p->next)
-        iptables_do_command("-t mangle -A " CHAIN_TRUSTED " -m mac --mac-source %s -j MARK --set-mark %d", p->mac,
-                            FW_MARK_KNOWN);
+    /* Answers of our resolver to the clients, read by thread_dns_snoop() */
+    if (use_dns_set && config->dns_snooping) {
+        iptables_do_command("-t mangle -I POSTROUTING 1 -o %s -j " CHAIN_DNS, config->gw_interface);
+        iptables_do_command("-t mangle -A " CHAIN_DNS " -s %s -p udp --sport 53 -j NFLOG --nflog-group %d",
+                            config->gw_address, config->dns_snooping_group);
+    }
 
-    /*
-     *
-     * Everything in the NAT table
-     *
+    if (use_trusted_set) {
+        iptables_do_command("-t mangle -A " CHAIN_TRUSTED " -m set --match-set " SET_TRUSTED
+                            " src -j MARK --set-mark %d", FW_MARK_KNOWN);
+    } else {
+        for (p = config->trustedmaclist; p != NULL; p = p->next)
+            iptables_do_command("-t mangle -A " CHAIN_TRUSTED " -m mac --mac-source %s -j MARK --set-mark %d", p->mac,
+                                FW_MARK_KNOWN);
+    }
+
+    /* Sub-chains of the tree and the rules jumping down it, see fanout_leaf() */
+    for (d = 0; d < 2; d++) {
+        for (index = 2; index < 2U << fanout_bits; index++) {
+            if (!fanout_exists[d][index])
+                iptables_do_command("-t mangle -N %s", fanout_chain(chain, d, index));
+        }
+        for (index = 1; index < 1U << fanout_bits; index++) {
+            for (depth = 0; index >> (depth + 1); depth++) ;
+            format_ip(htonl(1U << depth), mask);
+            fanout_chain(chain, d, index);
+            iptables_do_command("-t mangle -A %s %s %s/%s -g %s", chain, d ? "-d" : "-s", mask, mask,
+                                fanout_chain(child, d, 2 * index + 1));
+            iptables_do_command("-t mangle -A %s -g %s", chain, fanout_chain(child, d, 2 * index));
+        }
+    }
+
+    /* Clients are matched by set membership instead of a rule each */
+    if (use_ipset) {
+        iptables_do_command("-t mangle -A " CHAIN_OUTGOING " -m set --match-set " SET_PROBATION_OUT
+                            " src,src -j MARK --set-mark %d", FW_MARK_PROBATION);
+        iptables_do_command("-t mangle -A " CHAIN_OUTGOING " -m set --match-set " SET_KNOWN_OUT
+                            " src,src -j MARK --set-mark %d", FW_MARK_KNOWN);
+        iptables_do_command("-t mangle -A " CHAIN_INCOMING " -m set --match-set " SET_PROBATION_IN " dst -j ACCEPT");
+        iptables_do_command("-t mangle -A " CHAIN_INCOMING " -m set --match-set " SET_KNOWN_IN " dst -j ACCEPT");
+    }
+
+    /*
+     *
+     * Everything in the NAT table
+     *
      */
 
     /* Create new chains */
-    iptables_do_command("-t nat -N " CHAIN_OUTGOING);
-    iptables_do_command("-t nat -N " CHAIN_TO_ROUTER);
-    iptables_do_command("-t nat -N " CHAIN_TO_INTERNET);
-    iptables_do_command("-t nat -N " CHAIN_GLOBAL);
-    iptables_do_command("-t nat -N " CHAIN_UNKNOWN);
-    iptables_do_command("-t nat -N " CHAIN_AUTHSERVERS);
+    iptables_fw_chain("nat", CHAIN_OUTGOING, 0);
+    iptables_fw_chain("nat", CHAIN_TO_ROUTER, 0);
+    iptables_fw_chain("nat", CHAIN_TO_INTERNET, 0);
+    iptables_fw_chain("nat", CHAIN_GLOBAL, 0);
+    iptables_fw_chain("nat", CHAIN_UNKNOWN, 0);
+    iptables_fw_chain("nat", CHAIN_AUTHSERVERS, 0);
     if (got_authdown_ruleset)
-        iptables_do_command("-t nat -N " CHAIN_AUTH_IS_DOWN);
+        iptables_fw_chain("nat", CHAIN_AUTH_IS_DOWN, 0);
 
     /* Assign links and rules to these new chains */
     iptables_do_command("-t nat -A PREROUTING -i %s -j " CHAIN_OUTGOING, config->gw_interface);
@@ -349,15 +1150,15 @@ iptables_fw_init(void)
      */
 
     /* Create new chains */
-    iptables_do_command("-t filter -N " CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -N " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t filter -N " CHAIN_LOCKED);
-    iptables_do_command("-t filter -N " CHAIN_GLOBAL);
-    iptables_do_command("-t filter -N " CHAIN_VALIDATE);
-    iptables_do_command("-t filter -N " CHAIN_KNOWN);
-    iptables_do_command("-t filter -N " CHAIN_UNKNOWN);
+    iptables_fw_chain("filter", CHAIN_TO_INTERNET, 0);
+    iptables_fw_chain("filter", CHAIN_AUTHSERVERS, 0);
+    iptables_fw_chain("filter", CHAIN_LOCKED, 0);
+    iptables_fw_chain("filter", CHAIN_GLOBAL, 0);
+    iptables_fw_chain("filter", CHAIN_VALIDATE, 0);
+    iptables_fw_chain("filter", CHAIN_KNOWN, 0);
+    iptables_fw_chain("filter", CHAIN_UNKNOWN, 0);
     if (got_authdown_ruleset)
-        iptables_do_command("-t filter -N " CHAIN_AUTH_IS_DOWN);
+        iptables_fw_chain("filter", CHAIN_AUTH_IS_DOWN, 0);
 
     /* Assign links and rules to these new chains */
 
@@ -386,6 +1187,15 @@ iptables_fw_init(void)
     iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -j " CHAIN_GLOBAL);
     iptables_load_ruleset("filter", FWRULESET_GLOBAL, CHAIN_GLOBAL);
     iptables_load_ruleset("nat", FWRULESET_GLOBAL, CHAIN_GLOBAL);
+    if (use_hosts_set) {
+        /* Hosts allowed at run time, where fw_allow_host() used to append rules */
+        iptables_do_command("-t filter -A " CHAIN_GLOBAL " -m set --match-set " SET_HOSTS " dst -j ACCEPT");
+        iptables_do_command("-t nat -A " CHAIN_GLOBAL " -m set --match-set " SET_HOSTS " dst -j ACCEPT");
+    }
+    if (use_dns_set) {
+        iptables_do_command("-t filter -A " CHAIN_GLOBAL " -m set --match-set " SET_DNS " dst -j ACCEPT");
+        iptables_do_command("-t nat -A " CHAIN_GLOBAL " -m set --match-set " SET_DNS " dst -j ACCEPT");
+    }
 
     iptables_do_command("-t filter -A " CHAIN_TO_INTERNET " -m mark --mark 0x%u -j " CHAIN_VALIDATE, FW_MARK_PROBATION);
     iptables_load_ruleset("filter", FWRULESET_VALIDATING_USERS, CHAIN_VALIDATE);
@@ -403,141 +1213,350 @@ iptables_fw_init(void)
     iptables_load_ruleset("filter", FWRULESET_UNKNOWN_USERS, CHAIN_UNKNOWN);
     iptables_do_command("-t filter -A " CHAIN_UNKNOWN " -j REJECT --reject-with icmp-port-unreachable");
 
+    /* Chains left by a previous gateway that are not used any more, such as
+     * the one of a rule set removed from the configuration */
+    for (t = 0; t < BATCH_TABLES; t++) {
+        for (i = 0; NULL != table_chains[t][i]; i++) {
+            if (chain_exists[t][i] && !chain_wanted[t][i]) {
+                iptables_do_command("-t %s -F %s", batch_tables[t], table_chains[t][i]);
+                iptables_do_command("-t %s -X %s", batch_tables[t], table_chains[t][i]);
+            }
+        }
+    }
+    /* And sub-chains of a larger tree */
+    for (d = 0; d < 2; d++) {
+        for (index = 2U << fanout_bits; index < FANOUT_INDEXES; index++) {
+            if (fanout_exists[d][index]) {
+                iptables_do_command("-t mangle -F %s", fanout_chain(chain, d, index));
+                iptables_do_command("-t mangle -X %s", chain);
+            }
+        }
+    }
+
+    iptables_batch_commit();
+
     UNLOCK_CONFIG();
 
+    debug(LOG_INFO, "Firewall rules installed in %ld ms using %d processes", iptables_elapsed_ms(&start), fw_processes);
+
     free(ext_interface);
     return 1;
 }
 
 /** Remove the firewall rules
- * This is used when we do a clean shutdown of WiFiDog and when it starts to make
- * sure there are no rules left over
+ * This is used when we do a clean shutdown of WiFiDog
  */
 int
 iptables_fw_destroy(void)
 {
-    int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
+    int exists[BATCH_TABLES][TABLE_CHAINS_MAX];
+    struct timeval start;
+    t_nl_acct *accts;
+    char chain[FANOUT_CHAIN_LEN];
+    unsigned int t, i;
+    int count, d;
+
     fw_quiet = 1;
+    gettimeofday(&start, NULL);
+    fw_processes = 0;
 
     debug(LOG_DEBUG, "Destroying our iptables entries");
 
-    /*
-     *
-     * Everything in the MANGLE table
-     *
-     */
-    debug(LOG_DEBUG, "Destroying chains in the MANGLE table");
-    iptables_fw_destroy_mention("mangle", "PREROUTING", CHAIN_TRUSTED);
-    iptables_fw_destroy_mention("mangle", "PREROUTING", CHAIN_OUTGOING);
-    if (got_authdown_ruleset)
-        iptables_fw_destroy_mention("mangle", "PREROUTING", CHAIN_AUTH_IS_DOWN);
-    iptables_fw_destroy_mention("mangle", "POSTROUTING", CHAIN_INCOMING);
-    iptables_do_command("-t mangle -F " CHAIN_TRUSTED);
-    iptables_do_command("-t mangle -F " CHAIN_OUTGOING);
-    if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -F " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t mangle -F " CHAIN_INCOMING);
-    iptables_do_command("-t mangle -X " CHAIN_TRUSTED);
-    iptables_do_command("-t mangle -X " CHAIN_OUTGOING);
-    if (got_authdown_ruleset)
-        iptables_do_command("-t mangle -X " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t mangle -X " CHAIN_INCOMING);
+    memset(fanout_exists, 0, sizeof(fanout_exists));
+    iptables_batch_begin();
 
-    /*
-     *
-     * Everything in the NAT table
-     *
-     */
-    debug(LOG_DEBUG, "Destroying chains in the NAT table");
-    iptables_fw_destroy_mention("nat", "PREROUTING", CHAIN_OUTGOING);
-    iptables_do_command("-t nat -F " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t nat -F " CHAIN_OUTGOING);
-    if (got_authdown_ruleset)
-        iptables_do_command("-t nat -F " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t nat -F " CHAIN_TO_ROUTER);
-    iptables_do_command("-t nat -F " CHAIN_TO_INTERNET);
-    iptables_do_command("-t nat -F " CHAIN_GLOBAL);
-    iptables_do_command("-t nat -F " CHAIN_UNKNOWN);
-    iptables_do_command("-t nat -X " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t nat -X " CHAIN_OUTGOING);
-    if (got_authdown_ruleset)
-        iptables_do_command("-t nat -X " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t nat -X " CHAIN_TO_ROUTER);
-    iptables_do_command("-t nat -X " CHAIN_TO_INTERNET);
-    iptables_do_command("-t nat -X " CHAIN_GLOBAL);
-    iptables_do_command("-t nat -X " CHAIN_UNKNOWN);
+    for (t = 0; t < BATCH_TABLES; t++) {
+        debug(LOG_DEBUG, "Destroying chains in the %s table", batch_tables[t]);
+        memset(exists[t], 0, sizeof(exists[t]));
 
-    /*
-     *
-     * Everything in the FILTER table
-     *
-     */
-    debug(LOG_DEBUG, "Destroying chains in the FILTER table");
-    iptables_fw_destroy_mention("filter", "FORWARD", CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -F " CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -F " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t filter -F " CHAIN_LOCKED);
-    iptables_do_command("-t filter -F " CHAIN_GLOBAL);
-    iptables_do_command("-t filter -F " CHAIN_VALIDATE);
-    iptables_do_command("-t filter -F " CHAIN_KNOWN);
-    iptables_do_command("-t filter -F " CHAIN_UNKNOWN);
-    if (got_authdown_ruleset)
-        iptables_do_command("-t filter -F " CHAIN_AUTH_IS_DOWN);
-    iptables_do_command("-t filter -X " CHAIN_TO_INTERNET);
-    iptables_do_command("-t filter -X " CHAIN_AUTHSERVERS);
-    iptables_do_command("-t filter -X " CHAIN_LOCKED);
-    iptables_do_command("-t filter -X " CHAIN_GLOBAL);
-    iptables_do_command("-t filter -X " CHAIN_VALIDATE);
-    iptables_do_command("-t filter -X " CHAIN_KNOWN);
-    iptables_do_command("-t filter -X " CHAIN_UNKNOWN);
-    if (got_authdown_ruleset)
-        iptables_do_command("-t filter -X " CHAIN_AUTH_IS_DOWN);
+        if (!iptables_fw_scan(batch_tables[t], table_chains[t], exists[t], 0)) {
+            iptables_fw_scan_failed(t);
+            continue;
+        }
+
+        /* Flush first, as our chains jump to each other */
+        for (i = 0; NULL != table_chains[t][i]; i++)
+            if (exists[t][i])
+                iptables_do_command("-t %s -F %s", batch_tables[t], table_chains[t][i]);
+        for (i = 0; NULL != table_chains[t][i]; i++)
+            if (exists[t][i])
+                iptables_do_command("-t %s -X %s", batch_tables[t], table_chains[t][i]);
+    }
+    /* The sub-chains of the trees, found in the mangle table */
+    for (d = 0; d < 2; d++)
+        for (i = 2; i < FANOUT_INDEXES; i++)
+            if (fanout_exists[d][i])
+                iptables_do_command("-t mangle -F %s", fanout_chain(chain, d, i));
+    for (d = 0; d < 2; d++)
+        for (i = 2; i < FANOUT_INDEXES; i++)
+            if (fanout_exists[d][i])
+                iptables_do_command("-t mangle -X %s", fanout_chain(chain, d, i));
+
+    iptables_batch_commit();
+
+    /* Only once no rule refers to them */
+    if (config_get_config()->fw_backend == FW_BACKEND_IPSET) {
+        for (i = 0; i < IPSET_CLIENT_SETS; i++)
+            nl_ipset_destroy(ipset_name(i));
+    }
+    nl_ipset_destroy(ipset_name(IPSET_HOSTS));
+    nl_ipset_destroy(ipset_name(IPSET_TRUSTED));
+    nl_ipset_destroy(ipset_name(IPSET_DNS));
+    use_ipset = 0;
+    use_hosts_set = 0;
+    use_trusted_set = 0;
+    use_dns_set = 0;
+    use_connmark = 0;
+    fanout_bits = 0;
+    if (config_get_config()->fw_accounting == FW_ACCOUNTING_NFACCT) {
+        if ((count = nl_acct_list(acct_prefix(), &accts)) > 0) {
+            for (i = 0; i < (unsigned int)count; i++)
+                nl_acct_del(accts[i].name);
+            debug(LOG_DEBUG, "Deleted %d accounting objects", count);
+        }
+        if (count >= 0)
+            free(accts);
+    }
+    use_nfacct = 0;
+
+    debug(LOG_INFO, "Firewall rules removed in %ld ms using %d processes", iptables_elapsed_ms(&start), fw_processes);
 
     return 1;
 }
 
-/*
- * Helper for iptables_fw_destroy
+/** @internal
+ * Whether a rule of the client chains, as iptables-save writes it after the
+ * name of the chain, is the rule of a client as iptables_fw_access() adds
+ * them now, in the chain it adds it to
+ * @param body The rule
+ * @param incoming Whether the chain is in the tree of CHAIN_INCOMING
+ * @param index Index of the chain in its tree, see fanout_leaf()
+ */
+static int
+iptables_client_rule(const char *body, int incoming, unsigned int index)
+{
+    uint32_t ip;
+
+    if ((NULL != strstr(body, " --nfacct-name ")) != use_nfacct)
+        return 0;
+    if (strncmp(body, incoming ? " -d " : " -s ", 4) != 0 || !iptables_scan_ip(body + 4, &ip)
+        || fanout_leaf(ip) != index)
+        return 0;
+    if (!incoming)
+        return NULL != strstr(body, " --mac-source ") && NULL != strstr(body, " -j MARK ");
+    return NULL != strstr(body, " -j ACCEPT");
+}
+
+/** @internal
+ * Helper for iptables_fw_init and iptables_fw_destroy. Lists a table once
+ * with iptables-save, notes which of our chains exist and queues the
+ * removal of every rule of another chain that jumps to one of them.
+ * @param table The table to search
+ * @param chains NULL terminated names of our chains in that table
+ * @param exists Set to 1 for each of the chains that exists
+ * In the mangle table, the sub-chains of the client trees are noted in
+ * fanout_exists.
  * @param table The table to search
- * @param chain The chain in that table to search
- * @param mention A word to find and delete in rules in the given table+chain
+ * @param chains NULL terminated names of our chains in that table
+ * @param exists Set to 1 for each of the chains that exists
+ * @param clients Whether the client chains of the mangle table are kept
+ *                for the rules of the clients, in which case their other
+ *                rules are removed too, and rules of clients in the wrong
+ *                chain for the layout of fanout_bits
+ * @return 1 if the table could be listed, 0 otherwise
+ */
+static int
+iptables_fw_scan(const char *table, const char *const chains[], int exists[], int clients)
+{
+    char *names[16];
+    char *command;
+    char line[MAX_BUF];
+    char *chain, *end, *jump;
+    FILE *p;
+    int listed = 0, mangle = strcmp(table, "mangle") == 0, ours, incoming;
+    unsigned int i, count, len, index;
+
+    for (count = 0; NULL != chains[count] && count < sizeof(names) / sizeof(names[0]); count++) {
+        names[count] = safe_strdup(chains[count]);
+        iptables_insert_gateway_id(&names[count]);
+    }
+
+    safe_asprintf(&command, "iptables-save -t %s 2>/dev/null", table);
+    fw_processes++;
+    if ((p = popen(command, "r"))) {
+        while (fgets(line, sizeof(line), p)) {
+            line[strcspn(line, "\n")] = '\0';
+            if ('*' == line[0]) {
+                listed = strcmp(line + 1, table) == 0;
+            } else if (':' == line[0]) {
+                /* ":<chain> <policy> [<packets>:<bytes>]" */
+                len = strcspn(line + 1, " ");
+                for (i = 0; i < count; i++)
+                    if (strlen(names[i]) == len && strncmp(line + 1, names[i], len) == 0)
+                        exists[i] = 1;
+                if (mangle && (index = fanout_index(line + 1, len, &incoming)) >= 2)
+                    fanout_exists[incoming][index] = 1;
+            } else if (strncmp(line, "-A ", 3) == 0) {
+                /* "-A <chain> <rule>", deleted by rule specification */
+                chain = line + 3;
+                end = chain + strcspn(chain, " ");
+                if (mangle && (index = fanout_index(chain, end - chain, &incoming)) > 0) {
+                    if (clients && !iptables_client_rule(end, incoming, index)) {
+                        debug(LOG_DEBUG, "Deleting rule \"%s\" from %s, it is not the rule of a client", line, table);
+                        iptables_do_command("-t %s -D %s", table, chain);
+                    }
+                    continue;
+                }
+                ours = 0;
+                for (i = 0; i < count && !ours; i++)
+                    if ((size_t) (end - chain) == strlen(names[i]) && strncmp(chain, names[i], end - chain) == 0)
+                        ours = i + 1;
+                if (ours)
+                    continue;
+                for (i = 0; i < count; i++) {
+                    len = strlen(names[i]);
+                    for (jump = strstr(end, " -j "); NULL != jump; jump = strstr(jump + 1, " -j ")) {
+                        if (strncmp(jump + 4, names[i], len) == 0 && (jump[4 + len] == '\0' || jump[4 + len] == ' '))
+                            break;
+                    }
+                    if (NULL != jump) {
+                        debug(LOG_DEBUG, "Deleting rule \"%s\" from %s because it mentions %s", line, table, names[i]);
+                        iptables_do_command("-t %s -D %s", table, chain);
+                        break;
+                    }
+                }
+            }
+        }
+        pclose(p);
+    }
+
+    free(command);
+    for (i = 0; i < count; i++)
+        free(names[i]);
+
+    return listed;
+}
+
+/** @internal
+ * Helper for iptables_fw_init and iptables_fw_destroy, when a table could
+ * not be listed: finds the jumps to our chains rule by rule, then tries to
+ * remove every one of our chains.
+ * @param t Index of the table in batch_tables
+ */
+static void
+iptables_fw_scan_failed(unsigned int t)
+{
+    const char *const *hook;
+    char chain[FANOUT_CHAIN_LEN];
+    unsigned int index;
+    int i, d;
+
+    for (hook = table_hooks[t]; NULL != *hook; hook++)
+        iptables_fw_destroy_mention(batch_tables[t], *hook, "WD_$ID$_");
+    /* Flush first, as our chains jump to each other. Sub-chains of the
+     * trees are only looked for up to the size of the current ones. */
+    for (i = 0; NULL != table_chains[t][i]; i++)
+        iptables_do_command("-t %s -F %s", batch_tables[t], table_chains[t][i]);
+    for (d = 0; 0 == t && d < 2; d++)
+        for (index = 2; index < 2U << fanout_bits; index++)
+            iptables_do_command("-t mangle -F %s", fanout_chain(chain, d, index));
+    for (i = 0; NULL != table_chains[t][i]; i++)
+        iptables_do_command("-t %s -X %s", batch_tables[t], table_chains[t][i]);
+    for (d = 0; 0 == t && d < 2; d++)
+        for (index = 2; index < 2U << fanout_bits; index++)
+            iptables_do_command("-t mangle -X %s", fanout_chain(chain, d, index));
+}
+
+/** @internal
+ * Helper for iptables_fw_init. Creates one of our chains, or flushes it if
+ * iptables_fw_scan() found it: in the same transaction as the rules added
+ * to it, so that it is never seen empty.
+ * @param table Table of the chain
+ * @param chain Name of the chain, from table_chains
+ * @param keep Whether an existing chain keeps its rules
+ */
+static void
+iptables_fw_chain(const char *table, const char *chain, int keep)
+{
+    unsigned int t;
+    int i;
+
+    for (t = 0; t < BATCH_TABLES && strcmp(batch_tables[t], table) != 0; t++) ;
+    for (i = 0; NULL != table_chains[t][i] && strcmp(table_chains[t][i], chain) != 0; i++) ;
+
+    chain_wanted[t][i] = 1;
+    if (!chain_exists[t][i])
+        iptables_do_command("-t %s -N %s", table, chain);
+    else if (!keep)
+        iptables_do_command("-t %s -F %s", table, chain);
+}
+
+/** Deletes every rule of a chain mentioning a string, see
+ * iptables_fw_destroy_mentions().
+ * @return 1 if a rule was deleted, 0 otherwise
  */
 int
 iptables_fw_destroy_mention(const char *table, const char *chain, const char *mention)
 {
-    FILE *p = NULL;
-    char *command = NULL;
-    char *command2 = NULL;
-    char line[MAX_BUF];
-    char rulenum[10];
-    char *victim = safe_strdup(mention);
-    int deleted = 0;
+    return iptables_fw_destroy_mentions(table, chain, &mention, 1) > 0;
+}
 
-    iptables_insert_gateway_id(&victim);
+/** Deletes every rule of a chain mentioning one of a list of strings: IP
+ * addresses, or names of chains. The chain is listed once, and the rules
+ * are deleted by specification in one batch, the current one of the
+ * calling thread if it has one. Since they are deleted by specification,
+ * rules added to the chain meanwhile do not matter.
+ * @param table Table of the chain
+ * @param chain Chain, may hold $ID$
+ * @param mentions Strings, may hold $ID$
+ * @param count Number of strings
+ * @return Number of rules deleted
+ */
+int
+iptables_fw_destroy_mentions(const char *table, const char *chain, const char *const mentions[], int count)
+{
+    FILE *p;
+    char *command, *rule, *body, *found;
+    char line[MAX_BUF];
+    char **victims;
+    size_t *victim_len;
+    int i, own, deleted = 0;
+
+    victims = safe_malloc(count * sizeof(char *));
+    victim_len = safe_malloc(count * sizeof(size_t));
+    for (i = 0; i < count; i++) {
+        victims[i] = safe_strdup(mentions[i]);
+        iptables_insert_gateway_id(&victims[i]);
+        victim_len[i] = strlen(victims[i]);
+    }
 
-    debug(LOG_DEBUG, "Attempting to destroy all mention of %s from %s.%s", victim, table, chain);
+    own = !(batching && pthread_equal(batch_owner, pthread_self()));
+    if (own)
+        iptables_batch_begin();
 
-    safe_asprintf(&command, "iptables -t %s -L %s -n --line-numbers -v", table, chain);
+    safe_asprintf(&command, "iptables -t %s -S %s 2>/dev/null", table, chain);
     iptables_insert_gateway_id(&command);
+    debug(LOG_DEBUG, "Destroying all mention of %d names from %s.%s", count, table, chain);
+    fw_processes++;
 
     if ((p = popen(command, "r"))) {
-        /* Skip first 2 lines */
-        while (!feof(p) && fgetc(p) != '\n') ;
-        while (!feof(p) && fgetc(p) != '\n') ;
-        /* Loop over entries */
         while (fgets(line, sizeof(line), p)) {
-            /* Look for victim */
-            if (strstr(line, victim)) {
-                /* Found victim - Get the rule number into rulenum */
-                if (sscanf(line, "%9[0-9]", rulenum) == 1) {
-                    /* Delete the rule: */
-                    debug(LOG_DEBUG, "Deleting rule %s from %s.%s because it mentions %s", rulenum, table, chain,
-                          victim);
-                    safe_asprintf(&command2, "-t %s -D %s %s", table, chain, rulenum);
-                    iptables_do_command(command2);
-                    free(command2);
-                    deleted = 1;
-                    /* Do not keep looping - the captured rulenums will no longer be accurate */
+            line[strcspn(line, "\n")] = '\0';
+            /* "-A <chain> <rule>" */
+            if (strncmp(line, "-A ", 3) != 0)
+                continue;
+            rule = line + 3;
+            body = rule + strcspn(rule, " ");
+            for (i = 0; i < count; i++) {
+                /* A whole word or the start of one, but 10.0.0.1 is not in 10.0.0.10 */
+                for (found = strstr(body, victims[i]); NULL != found; found = strstr(found + 1, victims[i]))
+                    if (' ' == found[-1] && !isdigit((unsigned char)found[victim_len[i]])
+                        && '.' != found[victim_len[i]])
+                        break;
+                if (NULL != found) {
+                    debug(LOG_DEBUG, "Deleting rule \"%s\" from %s because it mentions %s", rule, table, victims[i]);
+                    iptables_do_command("-t %s -D %s", table, rule);
+                    deleted++;
                     break;
                 }
             }
@@ -545,15 +1564,16 @@ iptables_fw_destroy_mention(const char *table, const char *chain, const char *me
         pclose(p);
     }
 
-    free(command);
-    free(victim);
+    if (own)
+        iptables_batch_commit();
 
-    if (deleted) {
-        /* Recurse just in case there are more in the same table+chain */
-        iptables_fw_destroy_mention(table, chain, mention);
-    }
+    free(command);
+    for (i = 0; i < count; i++)
+        free(victims[i]);
+    free(victims);
+    free(victim_len);
 
-    return (deleted);
+    return deleted;
 }
 
 /** Set if a specific client has access through the firewall */
@@ -561,20 +1581,87 @@ int
 iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
 {
     int rc;
+    uint32_t addr;
+    t_mac hwaddr;
+    char acct_out[NL_ACCT_NAME_MAX], acct_in[NL_ACCT_NAME_MAX];
+    char chain_out[FANOUT_CHAIN_LEN], chain_in[FANOUT_CHAIN_LEN];
 
     fw_quiet = 0;
 
+    /* Two netlink round trips instead of two iptables processes */
+    if (use_ipset && -1 != ipset_client_set(tag, 0)) {
+        if (!parse_ip(ip, &addr) || !parse_mac(mac, &hwaddr)) {
+            debug(LOG_ERR, "Invalid client address %s %s", ip, mac);
+            return -1;
+        }
+        switch (type) {
+        case FW_ACCESS_ALLOW:
+            if ((rc = nl_ipset_add(ipset_name(ipset_client_set(tag, 0)), addr, &hwaddr)) == 0)
+                rc = nl_ipset_add(ipset_name(ipset_client_set(tag, 1)), addr, NULL);
+            break;
+        case FW_ACCESS_DENY:
+            if ((rc = nl_ipset_del(ipset_name(ipset_client_set(tag, 0)), addr, &hwaddr)) == 0)
+                rc = nl_ipset_del(ipset_name(ipset_client_set(tag, 1)), addr, NULL);
+            break;
+        default:
+            return -1;
+        }
+        if (rc != 0)
+            debug(LOG_ERR, "Could not update the sets of %s %s (error %d)", ip, mac, rc);
+        return rc;
+    }
+
+    /* The rules go in the leaves of the trees for the address */
+    if (!parse_ip(ip, &addr)) {
+        debug(LOG_ERR, "Invalid client address %s", ip);
+        return -1;
+    }
+    fanout_chain(chain_out, 0, fanout_leaf(addr));
+    fanout_chain(chain_in, 1, fanout_leaf(addr));
+
+    /* The same rules, counting in the client's accounting objects */
+    if (use_nfacct) {
+        acct_name(acct_out, addr, 0);
+        acct_name(acct_in, addr, 1);
+        switch (type) {
+        case FW_ACCESS_ALLOW:
+            /* Fresh counters, as for new rules */
+            if ((rc = nl_acct_new(acct_out)) != 0 || (rc = nl_acct_new(acct_in)) != 0) {
+                debug(LOG_ERR, "Could not create the accounting objects of %s (error %d)", ip, rc);
+                return rc;
+            }
+            iptables_do_command("-t mangle -A %s -s %s -m mac --mac-source %s -m nfacct --nfacct-name %s "
+                                "-j MARK --set-mark %d", chain_out, ip, mac, acct_out, tag);
+            rc = iptables_do_command("-t mangle -A %s -d %s -m nfacct --nfacct-name %s -j ACCEPT", chain_in, ip,
+                                     acct_in);
+            break;
+        case FW_ACCESS_DENY:
+            iptables_do_command("-t mangle -D %s -s %s -m mac --mac-source %s -m nfacct --nfacct-name %s "
+                                "-j MARK --set-mark %d", chain_out, ip, mac, acct_out, tag);
+            rc = iptables_do_command("-t mangle -D %s -d %s -m nfacct --nfacct-name %s -j ACCEPT", chain_in, ip,
+                                     acct_in);
+            /* Only possible once no rule refers to them */
+            iptables_acct_del(acct_out);
+            iptables_acct_del(acct_in);
+            break;
+        default:
+            rc = -1;
+            break;
+        }
+        return rc;
+    }
+
     switch (type) {
     case FW_ACCESS_ALLOW:
-        iptables_do_command("-t mangle -A " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark %d", ip,
+        iptables_do_command("-t mangle -A %s -s %s -m mac --mac-source %s -j MARK --set-mark %d", chain_out, ip,
                             mac, tag);
-        rc = iptables_do_command("-t mangle -A " CHAIN_INCOMING " -d %s -j ACCEPT", ip);
+        rc = iptables_do_command("-t mangle -A %s -d %s -j ACCEPT", chain_in, ip);
         break;
     case FW_ACCESS_DENY:
         /* XXX Add looping to really clear? */
-        iptables_do_command("-t mangle -D " CHAIN_OUTGOING " -s %s -m mac --mac-source %s -j MARK --set-mark %d", ip,
+        iptables_do_command("-t mangle -D %s -s %s -m mac --mac-source %s -j MARK --set-mark %d", chain_out, ip,
                             mac, tag);
-        rc = iptables_do_command("-t mangle -D " CHAIN_INCOMING " -d %s -j ACCEPT", ip);
+        rc = iptables_do_command("-t mangle -D %s -d %s -j ACCEPT", chain_in, ip);
         break;
     default:
         rc = -1;
@@ -584,27 +1671,137 @@ iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
     return rc;
 }
 
+/** Applies changes of client marks, with one iptables-restore per table
+ * @param ops Changes, at most one per client
+ * @param count Number of changes
+ * @return 0, or the return code of the first change that failed
+ */
+int
+iptables_fw_access_batch(const t_fw_op * ops, int count)
+{
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
+    t_connmark_clients marked;
+    int i, r, rc = 0;
+
+    iptables_batch_begin();
+    for (i = 0; i < count; i++) {
+        format_ip(ops[i].ip, ip);
+        format_mac(&ops[i].mac, mac);
+        r = 0;
+        if (FW_MARK_NONE != ops[i].to)
+            r = iptables_fw_access(FW_ACCESS_ALLOW, ip, mac, ops[i].to);
+        if (0 == r && FW_MARK_NONE != ops[i].from)
+            r = iptables_fw_access(FW_ACCESS_DENY, ip, mac, ops[i].from);
+        if (0 == rc)
+            rc = r;
+    }
+    iptables_batch_commit();
+
+    /* Connections of clients that had a mark keep it until cleared. Those
+     * of new clients have none yet. */
+    if (use_connmark) {
+        marked.ips = safe_malloc(count * sizeof(uint32_t));
+        marked.count = 0;
+        for (i = 0; i < count; i++)
+            if (FW_MARK_NONE != ops[i].from)
+                marked.ips[marked.count++] = ops[i].ip;
+        qsort(marked.ips, marked.count, sizeof(uint32_t), connmark_ip_cmp);
+        if (marked.count > 0)
+            connmark_clear(connmark_clients, &marked, "clients changing marks");
+        free(marked.ips);
+    }
+
+    return rc;
+}
+
+/** Adds addresses of allowed hosts to the firewall, or removes them: as
+ * members of the hosts set, or with a rule each in the nat and filter
+ * tables, applied in one batch.
+ */
+int
+iptables_fw_access_hosts(fw_access_t type, const uint32_t * addrs, int count)
+{
+    char ip[IP_STR_LEN];
+    int i, rc = 0;
+
+    fw_quiet = 0;
+
+    if (FW_ACCESS_ALLOW != type && FW_ACCESS_DENY != type)
+        return -1;
+
+    if (use_hosts_set) {
+        for (i = 0; i < count && 0 == rc; i++) {
+            if (FW_ACCESS_ALLOW == type)
+                rc = nl_ipset_add(ipset_name(IPSET_HOSTS), addrs[i], NULL);
+            else
+                rc = nl_ipset_del(ipset_name(IPSET_HOSTS), addrs[i], NULL);
+        }
+        return rc;
+    }
+
+    iptables_batch_begin();
+    for (i = 0; i < count; i++) {
+        format_ip(addrs[i], ip);
+        iptables_do_command("-t nat -%c " CHAIN_GLOBAL " -d %s -j ACCEPT", FW_ACCESS_ALLOW == type ? 'A' : 'D', ip);
+        iptables_do_command("-t filter -%c " CHAIN_GLOBAL " -d %s -j ACCEPT", FW_ACCESS_ALLOW == type ? 'A' : 'D',
+                            ip);
+    }
+    iptables_batch_commit();
+
+    return 0;
+}
+
+/** Allows addresses found in DNS answers until their time to live runs
+ * out, as members of the DNS set.
+ */
+int
+iptables_fw_access_dns(const uint32_t * addrs, int count, unsigned int ttl)
+{
+    int i, rc = 0;
+
+    if (!use_dns_set)
+        return -1;
+
+    for (i = 0; i < count && 0 == rc; i++)
+        rc = nl_ipset_add_timeout(ipset_name(IPSET_DNS), addrs[i], NULL, ttl);
+    return rc;
+}
+
+/** Set if a MAC address is trusted: a member of the trusted set, or the
+ * source of a rule of its own when there is no set.
+ */
 int
-iptables_fw_access_host(fw_access_t type, const char *host)
+iptables_fw_access_trusted(fw_access_t type, const char *mac)
 {
+    t_mac hwaddr;
+    uint32_t mark;
     int rc;
 
     fw_quiet = 0;
 
-    switch (type) {
-    case FW_ACCESS_ALLOW:
-        iptables_do_command("-t nat -A " CHAIN_GLOBAL " -d %s -j ACCEPT", host);
-        rc = iptables_do_command("-t filter -A " CHAIN_GLOBAL " -d %s -j ACCEPT", host);
-        break;
-    case FW_ACCESS_DENY:
-        iptables_do_command("-t nat -D " CHAIN_GLOBAL " -d %s -j ACCEPT", host);
-        rc = iptables_do_command("-t filter -D " CHAIN_GLOBAL " -d %s -j ACCEPT", host);
-        break;
-    default:
-        rc = -1;
-        break;
+    if (FW_ACCESS_ALLOW != type && FW_ACCESS_DENY != type)
+        return -1;
+
+    if (use_trusted_set) {
+        if (!parse_mac(mac, &hwaddr)) {
+            debug(LOG_ERR, "Invalid MAC address %s", mac);
+            return -1;
+        }
+        if (FW_ACCESS_ALLOW == type)
+            rc = nl_ipset_add(ipset_name(IPSET_TRUSTED), 0, &hwaddr);
+        else
+            rc = nl_ipset_del(ipset_name(IPSET_TRUSTED), 0, &hwaddr);
+    } else {
+        rc = iptables_do_command("-t mangle -%c " CHAIN_TRUSTED " -m mac --mac-source %s -j MARK --set-mark %d",
+                                 FW_ACCESS_ALLOW == type ? 'A' : 'D', mac, FW_MARK_KNOWN);
     }
 
+    /* Connections are not tied to MAC addresses: those of all the clients
+     * on probation, or all the known ones, get marked again */
+    if (0 == rc) {
+        mark = FW_ACCESS_ALLOW == type ? FW_MARK_PROBATION : FW_MARK_KNOWN;
+        connmark_clear(connmark_equals, &mark, "the trusted MAC addresses");
+    }
     return rc;
 }
 
@@ -624,24 +1821,174 @@ int
 iptables_fw_auth_reachable(void)
 {
     int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
-    if (got_authdown_ruleset)
-        return iptables_do_command("-t mangle -F " CHAIN_AUTH_IS_DOWN);
-    else
+    uint32_t mark = connmark_value(FW_MARK_AUTH_IS_DOWN);
+    int rc;
+
+    if (got_authdown_ruleset) {
+        rc = iptables_do_command("-t mangle -F " CHAIN_AUTH_IS_DOWN);
+        connmark_clear(connmark_equals, &mark, "the auth servers being down");
+        return rc;
+    } else
         return 1;
 }
 
 /** Update the counters of all the clients in the client list */
 int
 iptables_fw_counters_update(void)
+{
+    t_fw_counters sweep;
+    char *snapshot = NULL;
+    char chain[FANOUT_CHAIN_LEN];
+    unsigned int index;
+    int rc;
+
+    if (use_ipset)
+        return iptables_fw_counters_ipset();
+
+    memset(&sweep, 0, sizeof(sweep));
+    if (use_nfacct) {
+        rc = iptables_fw_counters_nfacct(&sweep);
+    } else if ((rc = iptables_fw_counters_save(&sweep, &snapshot)) == 0) {
+        /* No iptables-save: list each chain */
+        fw_counters_free(&sweep);
+        for (index = 1U << fanout_bits, rc = 1; rc == 1 && index < 2U << fanout_bits; index++) {
+            rc = iptables_fw_counters_list(&sweep, fanout_chain(chain, 0, index), FW_COUNTER_OUTGOING);
+            if (rc == 1)
+                rc = iptables_fw_counters_list(&sweep, fanout_chain(chain, 1, index), FW_COUNTER_INCOMING);
+        }
+    }
+    if (rc == 1) {
+        /* Only the first packets of a connection reach the outgoing rules */
+        sweep.incoming_activity = use_connmark;
+        iptables_fw_counters_record(&sweep, NULL != snapshot);
+    }
+    free(snapshot);
+    fw_counters_free(&sweep);
+
+    return rc;
+}
+
+/** @internal
+ * Reads an IPv4 address ending with a prefix length or a space, as
+ * iptables-save writes them, in place.
+ * @param p Text to read
+ * @param ip Receives the address, network byte order
+ * @return 1 on success, 0 if p does not start with an address
+ */
+static int
+iptables_scan_ip(const char *p, uint32_t * ip)
+{
+    unsigned int octet, value = 0;
+    int i, digits;
+
+    for (i = 0; i < 4; i++) {
+        for (octet = 0, digits = 0; *p >= '0' && *p <= '9' && digits < 3; p++, digits++)
+            octet = octet * 10 + (*p - '0');
+        if (0 == digits || octet > 255 || (i < 3 && '.' != *p++))
+            return 0;
+        value = (value << 8) | octet;
+    }
+    if ('/' != *p && ' ' != *p && '\0' != *p)
+        return 0;
+    *ip = htonl(value);
+    return 1;
+}
+
+/** @internal
+ * Reads the counters of all the clients from one iptables-save -c snapshot
+ * of the mangle table, with the MAC address and mark of their outgoing
+ * rule. The snapshot is scanned in place: the entry of each counter is its
+ * rule, "<chain> <specification>", so that orphans can be deleted by
+ * specification.
+ * @param sweep Sweep to fill
+ * @param snapshot Set to the snapshot, to be freed by the caller once the sweep is done
+ * @return 1 on success, 0 if iptables-save gave no mangle table
+ */
+static int
+iptables_fw_counters_save(t_fw_counters * sweep, char **snapshot)
+{
+    static const int directions[2] = { FW_COUNTER_OUTGOING, FW_COUNTER_INCOMING };
+    static const char *const match[2] = { " -s ", " -d " };
+    unsigned long long int bytes;
+    uint32_t ip;
+    t_mac mac;
+    char mac_str[MAC_STR_LEN];
+    size_t len = 0, size = 0;
+    char *buf = NULL, *line, *next, *rule, *p;
+    unsigned int index;
+    int listed = 0, d;
+    FILE *output;
+
+    fw_processes++;
+    if (!(output = popen("iptables-save -c -t mangle 2>/dev/null", "r"))) {
+        debug(LOG_ERR, "popen(): %s", strerror(errno));
+        return 0;
+    }
+    do {
+        if (size - len < MAX_BUF) {
+            size = size ? size * 2 : 65536;
+            buf = safe_realloc(buf, size + 1);
+        }
+        len += fread(buf + len, 1, size - len, output);
+    } while (!feof(output) && !ferror(output));
+    pclose(output);
+    if (NULL == buf)
+        return 0;
+    buf[len] = '\0';
+    *snapshot = buf;
+
+    for (line = buf; '\0' != *line; line = next) {
+        if (NULL != (next = strchr(line, '\n')))
+            *next++ = '\0';
+        else
+            next = line + strlen(line);
+
+        if ('*' == line[0]) {
+            listed = strcmp(line + 1, "mangle") == 0;
+            continue;
+        }
+        /* "[<packets>:<bytes>] -A <chain> <specification>" */
+        if ('[' != line[0] || NULL == (p = strchr(line, ':')))
+            continue;
+        bytes = strtoull(p + 1, &p, 10);
+        if (strncmp(p, "] -A ", 5) != 0)
+            continue;
+        rule = p + 5;
+        /* Only the leaves of the trees hold rules of clients */
+        p = rule + strcspn(rule, " ");
+        if ((index = fanout_index(rule, p - rule, &d)) >> fanout_bits != 1)
+            continue;
+        if (NULL != (p = strstr(p, match[d])) && iptables_scan_ip(p + 4, &ip)) {
+            fw_counters_add(sweep, ip, directions[d], bytes, rule);
+            /* "-m mac --mac-source <mac> ... -j MARK --set-xmark <mark>/<mask>" */
+            if (0 == d && NULL != (p = strstr(rule, " --mac-source ")) && sscanf(p + 14, "%17s", mac_str) == 1
+                && parse_mac(mac_str, &mac)
+                && (NULL != (p = strstr(rule, " --set-xmark ")) || NULL != (p = strstr(rule, " --set-mark "))))
+                fw_counters_mark(sweep, ip, &mac, (int)strtol(strchr(p + 1, ' ') + 1, NULL, 0));
+        }
+    }
+
+    return listed;
+}
+
+/** @internal
+ * Reads the counters of all the clients for one direction from the rules
+ * of its chain, as listed by iptables -L. Used when iptables-save is
+ * missing.
+ * @param sweep Sweep to fill
+ * @param chain A leaf of the tree of CHAIN_OUTGOING or CHAIN_INCOMING
+ * @param direction FW_COUNTER_OUTGOING or FW_COUNTER_INCOMING
+ * @return 1 on success, -1 if iptables could not be run
+ */
+static int
+iptables_fw_counters_list(t_fw_counters * sweep, const char *chain, int direction)
 {
     FILE *output;
     char *script, ip[16], rc;
     unsigned long long int counter;
-    t_client *p1;
     struct in_addr tempaddr;
 
-    /* Look for outgoing traffic */
-    safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_OUTGOING);
+    safe_asprintf(&script, "%s -v -n -x -t mangle -L %s", "iptables", chain);
     iptables_insert_gateway_id(&script);
     output = popen(script, "r");
     free(script);
@@ -654,80 +2001,233 @@ iptables_fw_counters_update(void)
     while (('\n' != fgetc(output)) && !feof(output)) ;
     while (('\n' != fgetc(output)) && !feof(output)) ;
     while (output && !(feof(output))) {
-        rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %15[0-9.] %*s %*s %*s %*s %*s %*s", &counter, ip);
-        //rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %15[0-9.] %*s %*s %*s %*s %*s 0x%*u", &counter, ip);
+        /* Outgoing rules match the source address, incoming ones the destination */
+        if (FW_COUNTER_INCOMING == direction)
+            rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %*s %15[0-9.]", &counter, ip);
+        else
+            rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %15[0-9.] %*s %*s %*s %*s %*s %*s", &counter, ip);
         if (2 == rc && EOF != rc) {
             /* Sanity */
             if (!inet_aton(ip, &tempaddr)) {
                 debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
                 continue;
             }
-            debug(LOG_DEBUG, "Read outgoing traffic for %s: Bytes=%llu", ip, counter);
-            LOCK_CLIENT_LIST();
-            if ((p1 = client_list_find_by_ip(ip))) {
-                if ((p1->counters.outgoing - p1->counters.outgoing_history) < counter) {
-                    p1->counters.outgoing_delta = p1->counters.outgoing_history + counter - p1->counters.outgoing;
-                    p1->counters.outgoing = p1->counters.outgoing_history + counter;
-                    p1->counters.last_updated = time(NULL);
-                    debug(LOG_DEBUG, "%s - Outgoing traffic %llu bytes, updated counter.outgoing to %llu bytes.  Updated last_updated to %d", ip,
-                          counter, p1->counters.outgoing, p1->counters.last_updated);
-                }
-            } else {
-                debug(LOG_ERR,
-                      "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
-                      ip);
-                debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_OUTGOING);
-                iptables_fw_destroy_mention("mangle", CHAIN_OUTGOING, ip);
-                debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_INCOMING);
-                iptables_fw_destroy_mention("mangle", CHAIN_INCOMING, ip);
-            }
-            UNLOCK_CLIENT_LIST();
+            fw_counters_add(sweep, tempaddr.s_addr, direction, counter, NULL);
         }
     }
     pclose(output);
 
-    /* Look for incoming traffic */
-    safe_asprintf(&script, "%s %s", "iptables", "-v -n -x -t mangle -L " CHAIN_INCOMING);
-    iptables_insert_gateway_id(&script);
-    output = popen(script, "r");
-    free(script);
-    if (!output) {
-        debug(LOG_ERR, "popen(): %s", strerror(errno));
+    return 1;
+}
+
+/** @internal
+ * Reads the counters of all the clients from their accounting objects, in
+ * one netlink dump.
+ * @param sweep Sweep to fill
+ * @return 1 on success, -1 if the objects could not be listed
+ */
+static int
+iptables_fw_counters_nfacct(t_fw_counters * sweep)
+{
+    t_nl_acct *accts;
+    const char *prefix = acct_prefix();
+    size_t prefix_len = strlen(prefix);
+    unsigned int hostip;
+    char dir;
+    int total, i;
+
+    if ((total = nl_acct_list(prefix, &accts)) < 0) {
+        debug(LOG_ERR, "Could not list the accounting objects (error %d)", total);
         return -1;
     }
+    for (i = 0; i < total; i++) {
+        if (sscanf(accts[i].name + prefix_len, "%c_%8x", &dir, &hostip) != 2 || (dir != 'o' && dir != 'i'))
+            continue;
+        fw_counters_add(sweep, htonl(hostip), 'i' == dir ? FW_COUNTER_INCOMING : FW_COUNTER_OUTGOING,
+                        accts[i].bytes, NULL);
+    }
+    free(accts);
 
-    /* skip the first two lines */
-    while (('\n' != fgetc(output)) && !feof(output)) ;
-    while (('\n' != fgetc(output)) && !feof(output)) ;
-    while (output && !(feof(output))) {
-        rc = fscanf(output, "%*s %llu %*s %*s %*s %*s %*s %*s %15[0-9.]", &counter, ip);
-        if (2 == rc && EOF != rc) {
-            /* Sanity */
-            if (!inet_aton(ip, &tempaddr)) {
-                debug(LOG_WARNING, "I was supposed to read an IP address but instead got [%s] - ignoring it", ip);
+    return 1;
+}
+
+/** @internal
+ * Records a sweep of the per-client rules and removes the rules, and the
+ * accounting objects, of the clients that are not on the list any more,
+ * all in one batch. Rules read from a snapshot are deleted by their
+ * specification; the others are found by listing each chain once.
+ * @param sweep Counters read
+ * @param by_spec Whether the entries of the counters are rules from iptables-save
+ */
+static void
+iptables_fw_counters_record(t_fw_counters * sweep, int by_spec)
+{
+    static const int directions[2] = { FW_COUNTER_OUTGOING, FW_COUNTER_INCOMING };
+    static const char *const chains[2] = { CHAIN_OUTGOING, CHAIN_INCOMING };
+    t_fw_counter *counter;
+    char ip[IP_STR_LEN], name[NL_ACCT_NAME_MAX], chain[FANOUT_CHAIN_LEN];
+    char *ips[2] = { NULL, NULL };
+    const char **victims[2] = { NULL, NULL };
+    const void *entries[2];
+    int orphans, i, d, n[2] = { 0, 0 };
+
+    if ((orphans = fw_counters_record(sweep)) == 0)
+        return;
+
+    if (!by_spec) {
+        for (d = 0; d < 2; d++) {
+            ips[d] = safe_malloc(orphans * IP_STR_LEN);
+            victims[d] = safe_malloc(orphans * sizeof(char *));
+        }
+    }
+
+    iptables_batch_begin();
+    for (i = 0; i < sweep->count; i++) {
+        counter = &sweep->counters[i];
+        if (!counter->orphan)
+            continue;
+        format_ip(counter->ip, ip);
+        debug(LOG_ERR,
+              "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
+              ip);
+        entries[0] = counter->outgoing_entry;
+        entries[1] = counter->incoming_entry;
+        for (d = 0; d < 2; d++) {
+            if (!(counter->directions & directions[d]))
                 continue;
-            }
-            debug(LOG_DEBUG, "Read incoming traffic for %s: Bytes=%llu", ip, counter);
-            LOCK_CLIENT_LIST();
-            if ((p1 = client_list_find_by_ip(ip))) {
-                if ((p1->counters.incoming - p1->counters.incoming_history) < counter) {
-                    p1->counters.incoming_delta = p1->counters.incoming_history + counter - p1->counters.incoming;
-                    p1->counters.incoming = p1->counters.incoming_history + counter;
-                    debug(LOG_DEBUG, "%s - Incoming traffic %llu bytes, Updated counter.incoming to %llu bytes", ip, counter, p1->counters.incoming);
-                }
+            debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, chains[d]);
+            if (by_spec) {
+                iptables_do_command("-t mangle -D %s", (const char *)entries[d]);
+            } else if (fanout_bits > 0) {
+                /* Each in its own leaf */
+                iptables_fw_destroy_mention("mangle", fanout_chain(chain, d, fanout_leaf(counter->ip)), ip);
             } else {
-                debug(LOG_ERR,
-                      "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
-                      ip);
-                debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_OUTGOING);
-                iptables_fw_destroy_mention("mangle", CHAIN_OUTGOING, ip);
-                debug(LOG_ERR, "Preventively deleting firewall rules for %s in table %s", ip, CHAIN_INCOMING);
-                iptables_fw_destroy_mention("mangle", CHAIN_INCOMING, ip);
+                victims[d][n[d]] = strcpy(ips[d] + n[d] * IP_STR_LEN, ip);
+                n[d]++;
+            }
+            if (use_nfacct) {
+                acct_name(name, counter->ip, d);
+                iptables_acct_del(name);
             }
-            UNLOCK_CLIENT_LIST();
         }
     }
-    pclose(output);
+    for (d = 0; d < 2; d++) {
+        if (n[d] > 0)
+            iptables_fw_destroy_mentions("mangle", chains[d], victims[d], n[d]);
+        free(ips[d]);
+        free(victims[d]);
+    }
+    iptables_batch_commit();
+}
 
-    return 1;
+/** @internal
+ * Reads the members of the client sets, each listed in one netlink dump,
+ * with their counters, into a sweep. The entry of each counter is its
+ * member.
+ * @param sweep Sweep to fill
+ * @param entries Set to the members of each set, to be freed by the caller
+ *                once the sweep is done
+ * @param count Set to the number of members of each set
+ * @return 0 on success, -1 if a set could not be listed
+ */
+static int
+iptables_ipset_read(t_fw_counters * sweep, t_nl_ipset_entry * entries[], int count[])
+{
+    int set, i;
+
+    memset(entries, 0, IPSET_CLIENT_SETS * sizeof(entries[0]));
+    for (set = 0; set < IPSET_CLIENT_SETS; set++) {
+        if ((count[set] = nl_ipset_list(ipset_name(set), &entries[set])) < 0) {
+            debug(LOG_ERR, "Could not list set %s (error %d)", ipset_name(set), count[set]);
+            return -1;
+        }
+        for (i = 0; i < count[set]; i++) {
+            fw_counters_add(sweep, entries[set][i].ip,
+                            set < IPSET_CLIENT_SETS / 2 ? FW_COUNTER_OUTGOING : FW_COUNTER_INCOMING,
+                            entries[set][i].bytes, &entries[set][i]);
+            if (IPSET_PROBATION_OUT == set || IPSET_KNOWN_OUT == set)
+                fw_counters_mark(sweep, entries[set][i].ip, &entries[set][i].mac,
+                                 IPSET_PROBATION_OUT == set ? FW_MARK_PROBATION : FW_MARK_KNOWN);
+        }
+    }
+    return 0;
+}
+
+/** @internal
+ * Update the counters of all the clients from the per-member counters of the
+ * client sets, and delete the members of clients that are not on the list
+ * any more.
+ */
+static int
+iptables_fw_counters_ipset(void)
+{
+    t_nl_ipset_entry *entries[IPSET_CLIENT_SETS];
+    int count[IPSET_CLIENT_SETS];
+    t_fw_counters sweep;
+    t_fw_counter *counter;
+    const t_nl_ipset_entry *entry;
+    char ip[IP_STR_LEN];
+    int set, i, rc = 1;
+
+    memset(&sweep, 0, sizeof(sweep));
+    if (iptables_ipset_read(&sweep, entries, count) == -1) {
+        rc = -1;
+        goto done;
+    }
+
+    sweep.incoming_activity = use_connmark;
+    if (fw_counters_record(&sweep) == 0)
+        goto done;
+
+    for (i = 0; i < sweep.count; i++) {
+        counter = &sweep.counters[i];
+        if (!counter->orphan)
+            continue;
+        format_ip(counter->ip, ip);
+        debug(LOG_ERR,
+              "iptables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
+              ip);
+        /* A client is in one set per direction; find it from the entry */
+        for (set = 0; set < IPSET_CLIENT_SETS; set++) {
+            entry = set < IPSET_CLIENT_SETS / 2 ? counter->outgoing_entry : counter->incoming_entry;
+            if (NULL == entry || entry < entries[set] || entry >= entries[set] + count[set])
+                continue;
+            debug(LOG_ERR, "Preventively deleting %s from set %s", ip, ipset_name(set));
+            nl_ipset_del(ipset_name(set), entry->ip, set < IPSET_CLIENT_SETS / 2 ? &entry->mac : NULL);
+        }
+    }
+
+ done:
+    fw_counters_free(&sweep);
+    for (set = 0; set < IPSET_CLIENT_SETS; set++)
+        free(entries[set]);
+    return rc;
+}
+
+/** Reads the entries of the clients the firewall has into a sweep, with
+ * the MAC address and mark of each, for fw_init() to check them against the
+ * client list. The entries of the counters are not kept.
+ * @param sweep Sweep to fill
+ * @return 1 on success, -1 if the entries could not be read
+ */
+int
+iptables_fw_clients_read(t_fw_counters * sweep)
+{
+    t_nl_ipset_entry *entries[IPSET_CLIENT_SETS];
+    int count[IPSET_CLIENT_SETS];
+    char *snapshot = NULL;
+    int i, rc;
+
+    if (use_ipset) {
+        rc = iptables_ipset_read(sweep, entries, count) == 0 ? 1 : -1;
+        for (i = 0; i < IPSET_CLIENT_SETS; i++)
+            free(entries[i]);
+    } else {
+        rc = iptables_fw_counters_save(sweep, &snapshot) ? 1 : -1;
+        free(snapshot);
+    }
+    for (i = 0; i < sweep->count; i++)
+        sweep->counters[i].outgoing_entry = sweep->counters[i].incoming_entry = NULL;
+
+    return rc;
 }
@@ -46,13 +46,39 @@
 #define CHAIN_LOCKED    "WD_$ID$_Locked"
 #define CHAIN_TRUSTED    "WD_$ID$_Trusted"
 #define CHAIN_AUTH_IS_DOWN "WD_$ID$_AuthDown"
+#define CHAIN_DNS "WD_$ID$_Dns"
+#define CHAIN_CT_RESTORE "WD_$ID$_CtRestore"
+#define CHAIN_CT_SAVE "WD_$ID$_CtSave"
 /*@}*/
 
-/** Used by iptables_fw_access to select if the client should be granted of denied access */
-typedef enum fw_access_t_ {
-    FW_ACCESS_ALLOW,
-    FW_ACCESS_DENY
-} fw_access_t;
+/*@{*/
+/** Prefixes of the sub-chains CHAIN_OUTGOING and CHAIN_INCOMING spread the
+ * rules of the clients over with FirewallFanoutBits, followed by the index
+ * of the sub-chain in decimal, 2 to 511 */
+#define CHAIN_OUTGOING_FANOUT "WD_$ID$_Out"
+#define CHAIN_INCOMING_FANOUT "WD_$ID$_In"
+/*@}*/
+
+/*@{*/
+/**ipset names used by the ipset backend, at most 31 characters with the ID */
+#define SET_PROBATION_OUT "WD_$ID$_ProbationOut"
+#define SET_PROBATION_IN "WD_$ID$_ProbationIn"
+#define SET_KNOWN_OUT "WD_$ID$_KnownOut"
+#define SET_KNOWN_IN "WD_$ID$_KnownIn"
+#define SET_HOSTS "WD_$ID$_Hosts"
+/*@}*/
+
+/** hash:mac ipset of the trusted MAC addresses, used with either backend
+ * when the kernel has the type */
+#define SET_TRUSTED "WD_$ID$_TrustedMACs"
+
+/** hash:ip ipset, with timeouts, of the addresses of whitelisted hosts
+ * found in DNS answers, used with either backend. dnsmasq can fill it too. */
+#define SET_DNS "WD_$ID$_DnsHosts"
+
+/** Prefix of the nfnetlink_acct objects counting the traffic of each client,
+ * followed by o_ or i_ and the IP address in hex */
+#define ACCT_PREFIX "WD_$ID$_"
 
 /** @brief Initialize the firewall */
 int iptables_fw_init(void);
@@ -66,14 +92,26 @@ void iptables_fw_clear_authservers(void);
 /** @brief Destroy the firewall */
 int iptables_fw_destroy(void);
 
-/** @brief Helper function for iptables_fw_destroy */
+/** @brief Delete the rules of a chain mentioning a string */
 int iptables_fw_destroy_mention(const char *table, const char *chain, const char *mention);
 
+/** @brief Delete the rules of a chain mentioning one of a list of strings */
+int iptables_fw_destroy_mentions(const char *table, const char *chain, const char *const mentions[], int count);
+
 /** @brief Define the access of a specific client */
 int iptables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag);
 
-/** @brief Define the access of a host */
-int iptables_fw_access_host(fw_access_t type, const char *host);
+/** @brief Apply a batch of client mark changes */
+int iptables_fw_access_batch(const t_fw_op * ops, int count);
+
+/** @brief Define the access of addresses of allowed hosts */
+int iptables_fw_access_hosts(fw_access_t type, const uint32_t * addrs, int count);
+
+/** @brief Allow addresses found in DNS answers for a while */
+int iptables_fw_access_dns(const uint32_t * addrs, int count, unsigned int ttl);
+
+/** @brief Define whether a MAC address is trusted */
+int iptables_fw_access_trusted(fw_access_t type, const char *mac);
 
 /** @brief Set a mark when auth server is not reachable */
 int iptables_fw_auth_unreachable(int tag);
@@ -84,4 +122,10 @@ int iptables_fw_auth_reachable(void);
 /** @brief All counters in the client list */
 int iptables_fw_counters_update(void);
 
+/** @brief Read the client entries the firewall has */
+int iptables_fw_clients_read(t_fw_counters * sweep);
+
+/** @brief Mark the packets with a t_fw_marks value carry */
+uint32_t iptables_fw_mark_value(int tag);
+
 #endif                          /* _IPTABLES_H_ */
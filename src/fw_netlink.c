@@ -0,0 +1,1373 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_netlink.c
+    @brief In-process ipset, nftables set, accounting object and conntrack mark changes over nfnetlink
+
+    Talks the kernel ipset protocol (the one the ipset tool uses) over a
+    NETLINK_NETFILTER socket, so that adding a client to a set costs one
+    system call round trip instead of a fork and exec. Only what the ipset
+    firewall backend needs is implemented: IPv4 sets keyed by IP address,
+    optionally with a MAC address.
+
+    The nftables backend changes the elements of its sets and maps the same
+    way, with the nf_tables protocol. Changes to nf_tables are only accepted
+    in batches, which the kernel applies as one transaction: either all of
+    the changes of a batch are made or none is. Sets, chains and rules are
+    loaded by nft itself, see fw_nftables.c.
+
+    The iptables backend can count the traffic of each client in
+    nfnetlink_acct objects, matched with iptables -m nfacct, rather than in
+    its rules. Those objects are created and deleted here, and all of them
+    are read in a single dump.
+
+    With FirewallConnmark, the connections of clients keep the mark they
+    got from the firewall rules. When those rules change, the marks are
+    cleared again: conntrack entries are dumped and the matching ones
+    updated, one by one, with the ctnetlink protocol.
+
+    All requests share one socket and are serialized by a mutex; each one
+    waits for the kernel's answer before returning. Packets copied to an
+    nfnetlink_log group, see nl_log_open(), come on a socket of their own,
+    read by the thread that opened it.
+*/
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+#include <endian.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <linux/netlink.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/ipset/ip_set.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nfnetlink_acct.h>
+#include <linux/netfilter/nfnetlink_log.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "fw_netlink.h"
+
+#ifndef IPSET_PROTOCOL_MIN
+#define IPSET_PROTOCOL_MIN 6
+#endif
+
+/** Size of a request, large enough for any message built here */
+#define NL_REQUEST_SIZE 512
+/** Size of the receive buffer, large enough for a dump message */
+#define NL_RECV_SIZE 65536
+/** How long to wait for an answer of the kernel, in seconds */
+#define NL_TIMEOUT 2
+/** Receive buffer asked for the sockets of nfnetlink_log groups, so that
+ * bursts of packets are not dropped */
+#define NL_LOG_RCVBUF (1024 * 1024)
+
+#define NLA_PAYLOAD_DATA(nla) ((const void *)((const char *)(nla) + NLA_HDRLEN))
+#define NLA_PAYLOAD_LEN(nla) ((int)(nla)->nla_len - NLA_HDRLEN)
+
+static int nl_open(void);
+static struct nlmsghdr *nl_ipset_request(char *, int, int);
+static struct nlattr *nl_attr_put(struct nlmsghdr *, int, const void *, size_t);
+static struct nlattr *nl_nest_start(struct nlmsghdr *, int);
+static void nl_nest_end(struct nlmsghdr *, struct nlattr *);
+static void nl_attr_parse(const struct nlattr **, int, const void *, int);
+static int nl_talk(struct nlmsghdr *, int (*)(const struct nlmsghdr *, void *), void *);
+static int nl_ipset_adt(int, const char *, uint32_t, const t_mac *, unsigned int);
+static int nl_ipset_type_cb(const struct nlmsghdr *, void *);
+static int nl_ipset_list_cb(const struct nlmsghdr *, void *);
+static struct nlmsghdr *nl_nft_request(char *, int, int);
+static void nl_nft_put_elem(struct nlmsghdr *, const char *, const char *, const t_nl_nft_change *);
+static int nl_nft_batch(const char *, const t_nl_nft_change *, int);
+static int nl_nft_elem_cb(const struct nlmsghdr *, void *);
+static void nl_nft_parse_counter(t_nl_nft_elem *, const struct nlattr *);
+static struct nlmsghdr *nl_acct_request(char *, int, int);
+static int nl_acct_list_cb(const struct nlmsghdr *, void *);
+static struct nlmsghdr *nl_ct_request(char *, int, int);
+static uint32_t nl_ct_tuple_src(const struct nlattr *);
+static int nl_ct_list_cb(const struct nlmsghdr *, void *);
+static struct nlmsghdr *nl_log_request(char *, uint16_t);
+static int nl_log_talk(int, struct nlmsghdr *);
+
+/** @internal
+ * Socket, sequence number and receive buffer, protected by nl_mutex
+ */
+static int nl_fd = -1;
+static uint32_t nl_seq = 0;
+static char *nl_recv_buf = NULL;
+static pthread_mutex_t nl_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Listing in progress, see nl_ipset_list()
+ */
+typedef struct _t_nl_list {
+    t_nl_ipset_entry *entries;
+    int count;
+    int size;
+} t_nl_list;
+
+/** @internal
+ * Listing of nftables elements in progress, see nl_nft_list()
+ */
+typedef struct _t_nl_nft_list {
+    t_nl_nft_elem *elems;
+    int count;
+    int size;
+} t_nl_nft_list;
+
+/** @internal
+ * Listing of accounting objects in progress, see nl_acct_list()
+ */
+typedef struct _t_nl_acct_list {
+    const char *prefix;
+    size_t prefix_len;
+    t_nl_acct *accts;
+    int count;
+    int size;
+} t_nl_acct_list;
+
+/** @internal
+ * Longest original tuple of an IPv4 conntrack entry kept by nl_ct_list_cb()
+ */
+#define NL_CT_TUPLE_MAX 128
+
+typedef struct _t_nl_ct_found {
+    unsigned char tuple[NL_CT_TUPLE_MAX];       /* CTA_TUPLE_ORIG payload */
+    int tuple_len;
+    uint16_t zone;              /* CTA_ZONE, network byte order */
+    int has_zone;
+} t_nl_ct_found;
+
+typedef struct _t_nl_ct_list {
+    int (*match)(const t_nl_ct *, void *);
+    void *arg;
+    t_nl_ct_found *found;
+    int count;
+    int size;
+} t_nl_ct_list;
+
+/** @internal
+ * Opens the socket the first time. nl_mutex must be held.
+ * @return 0 on success, -1 on error
+ */
+static int
+nl_open(void)
+{
+    struct timeval timeout;
+
+    if (nl_fd >= 0)
+        return 0;
+
+    if ((nl_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) == -1) {
+        debug(LOG_ERR, "socket(NETLINK_NETFILTER): %s", strerror(errno));
+        return -1;
+    }
+    timeout.tv_sec = NL_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(nl_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if (NULL == nl_recv_buf)
+        nl_recv_buf = safe_malloc(NL_RECV_SIZE);
+    return 0;
+}
+
+/** @internal
+ * Starts an ipset request in a buffer of NL_REQUEST_SIZE bytes.
+ * @param buf Buffer
+ * @param cmd IPSET_CMD_* command
+ * @param flags NLM_F_* flags besides NLM_F_REQUEST
+ * @return The message, holding the protocol version attribute
+ */
+static struct nlmsghdr *
+nl_ipset_request(char *buf, int cmd, int flags)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct nfgenmsg *nfg;
+    unsigned char protocol = IPSET_PROTOCOL_MIN;
+
+    memset(buf, 0, NL_REQUEST_SIZE);
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_IPSET << 8) | cmd;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = NFPROTO_IPV4;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(0);
+
+    nl_attr_put(nlh, IPSET_ATTR_PROTOCOL, &protocol, sizeof(protocol));
+    return nlh;
+}
+
+/** @internal
+ * Appends an attribute to a message
+ */
+static struct nlattr *
+nl_attr_put(struct nlmsghdr *nlh, int type, const void *data, size_t len)
+{
+    struct nlattr *nla = (struct nlattr *)((char *)nlh + NLMSG_ALIGN(nlh->nlmsg_len));
+
+    nla->nla_type = type;
+    nla->nla_len = NLA_HDRLEN + len;
+    if (len > 0)
+        memcpy((char *)nla + NLA_HDRLEN, data, len);
+    nlh->nlmsg_len = NLMSG_ALIGN(nlh->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+    return nla;
+}
+
+/** @internal
+ * Opens a nested attribute, closed by nl_nest_end()
+ */
+static struct nlattr *
+nl_nest_start(struct nlmsghdr *nlh, int type)
+{
+    return nl_attr_put(nlh, type | NLA_F_NESTED, NULL, 0);
+}
+
+/** @internal
+ * Closes a nested attribute once everything it holds has been appended
+ */
+static void
+nl_nest_end(struct nlmsghdr *nlh, struct nlattr *nest)
+{
+    nest->nla_len = (char *)nlh + nlh->nlmsg_len - (char *)nest;
+}
+
+/** @internal
+ * Indexes a stream of attributes by type.
+ * @param tb Array of max + 1 entries, set to NULL for missing attributes
+ * @param max Highest attribute type of interest
+ * @param data First attribute
+ * @param len Length of the stream
+ */
+static void
+nl_attr_parse(const struct nlattr **tb, int max, const void *data, int len)
+{
+    const struct nlattr *nla = data;
+    int type;
+
+    memset(tb, 0, (max + 1) * sizeof(*tb));
+    while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len) {
+        type = nla->nla_type & NLA_TYPE_MASK;
+        if (type <= max)
+            tb[type] = nla;
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+}
+
+/** @internal
+ * Sends a request and processes the answer of the kernel. nl_mutex must be
+ * held. Requests must either ask for an acknowledgment or be dumps.
+ * @param nlh Request
+ * @param cb Called for each message of the answer that is not an
+ *           acknowledgment; returns non-zero to report an error. May be NULL.
+ * @param arg Passed to cb
+ * @return 0 on success, a negative errno or ipset error code otherwise
+ */
+static int
+nl_talk(struct nlmsghdr *nlh, int (*cb)(const struct nlmsghdr *, void *), void *arg)
+{
+    struct sockaddr_nl addr;
+    struct nlmsghdr *rep;
+    ssize_t len;
+    int rc = 0;
+
+    if (nl_open() == -1)
+        return -ENOTCONN;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    nlh->nlmsg_seq = ++nl_seq;
+    if (sendto(nl_fd, nlh, nlh->nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        return -errno;
+
+    for (;;) {
+        len = recv(nl_fd, nl_recv_buf, NL_RECV_SIZE, 0);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        for (rep = (struct nlmsghdr *)nl_recv_buf; NLMSG_OK(rep, len); rep = NLMSG_NEXT(rep, len)) {
+            /* Left over from a request that timed out */
+            if (rep->nlmsg_seq != nlh->nlmsg_seq)
+                continue;
+            if (rep->nlmsg_type == NLMSG_ERROR)
+                return rc ? rc : ((struct nlmsgerr *)NLMSG_DATA(rep))->error;
+            if (rep->nlmsg_type == NLMSG_DONE)
+                return rc;
+            if (NULL != cb && 0 == rc)
+                rc = cb(rep, arg);
+        }
+    }
+}
+
+/** @internal
+ * Reads the highest revision of a set type from an IPSET_CMD_TYPE answer
+ */
+static int
+nl_ipset_type_cb(const struct nlmsghdr *nlh, void *arg)
+{
+    const struct nlattr *tb[IPSET_ATTR_CMD_MAX + 1];
+    int hdrlen = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+
+    nl_attr_parse(tb, IPSET_ATTR_CMD_MAX, (const char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+    if (NULL == tb[IPSET_ATTR_REVISION])
+        return -EPROTO;
+    *(unsigned char *)arg = *(const unsigned char *)NLA_PAYLOAD_DATA(tb[IPSET_ATTR_REVISION]);
+    return 0;
+}
+
+/** Creates an IPv4 set with the newest revision of its type the kernel
+ * knows. A set of the same name and type that already exists is kept as is.
+ * @param name Set name
+ * @param type Set type, e.g. "hash:ip,mac"
+ * @param counters Whether members count the packets and bytes they match
+ * @param timeout Seconds members added without a timeout of their own
+ *                stay in the set, 0 for a set whose members never expire
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_ipset_create(const char *name, const char *type, int counters, unsigned int timeout)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    struct nlattr *data;
+    unsigned char family = NFPROTO_IPV4, revision = 0;
+    uint32_t flags = htonl(counters ? IPSET_FLAG_WITH_COUNTERS : 0);
+    uint32_t seconds = htonl(timeout);
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+
+    nlh = nl_ipset_request(buf, IPSET_CMD_TYPE, NLM_F_ACK);
+    nl_attr_put(nlh, IPSET_ATTR_TYPENAME, type, strlen(type) + 1);
+    nl_attr_put(nlh, IPSET_ATTR_FAMILY, &family, sizeof(family));
+    if ((rc = nl_talk(nlh, nl_ipset_type_cb, &revision)) != 0) {
+        pthread_mutex_unlock(&nl_mutex);
+        debug(LOG_ERR, "Set type %s is not supported by the kernel (error %d)", type, rc);
+        return rc;
+    }
+
+    nlh = nl_ipset_request(buf, IPSET_CMD_CREATE, NLM_F_ACK);
+    nl_attr_put(nlh, IPSET_ATTR_SETNAME, name, strlen(name) + 1);
+    nl_attr_put(nlh, IPSET_ATTR_TYPENAME, type, strlen(type) + 1);
+    nl_attr_put(nlh, IPSET_ATTR_REVISION, &revision, sizeof(revision));
+    nl_attr_put(nlh, IPSET_ATTR_FAMILY, &family, sizeof(family));
+    data = nl_nest_start(nlh, IPSET_ATTR_DATA);
+    nl_attr_put(nlh, IPSET_ATTR_CADT_FLAGS | NLA_F_NET_BYTEORDER, &flags, sizeof(flags));
+    if (timeout > 0)
+        nl_attr_put(nlh, IPSET_ATTR_TIMEOUT | NLA_F_NET_BYTEORDER, &seconds, sizeof(seconds));
+    nl_nest_end(nlh, data);
+    rc = nl_talk(nlh, NULL, NULL);
+
+    pthread_mutex_unlock(&nl_mutex);
+
+    if (rc != 0)
+        debug(LOG_ERR, "Could not create set %s of type %s (error %d)", name, type, rc);
+    return rc;
+}
+
+/** Removes all members of a set
+ * @param name Set name
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_ipset_flush(const char *name)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_ipset_request(buf, IPSET_CMD_FLUSH, NLM_F_ACK);
+    nl_attr_put(nlh, IPSET_ATTR_SETNAME, name, strlen(name) + 1);
+    rc = nl_talk(nlh, NULL, NULL);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** Destroys a set. Fails if a rule still refers to it.
+ * @param name Set name
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_ipset_destroy(const char *name)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_ipset_request(buf, IPSET_CMD_DESTROY, NLM_F_ACK);
+    nl_attr_put(nlh, IPSET_ATTR_SETNAME, name, strlen(name) + 1);
+    rc = nl_talk(nlh, NULL, NULL);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** @internal
+ * Adds or deletes a member. Without NLM_F_EXCL the kernel does not report
+ * adding an existing member or deleting a missing one as an error; adding
+ * an existing member with a timeout sets its timeout again.
+ */
+static int
+nl_ipset_adt(int cmd, const char *name, uint32_t ip, const t_mac * mac, unsigned int timeout)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    struct nlattr *data, *addr;
+    uint32_t seconds = htonl(timeout);
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_ipset_request(buf, cmd, NLM_F_ACK);
+    nl_attr_put(nlh, IPSET_ATTR_SETNAME, name, strlen(name) + 1);
+    data = nl_nest_start(nlh, IPSET_ATTR_DATA);
+    /* hash:mac members have no address */
+    if (0 != ip || NULL == mac) {
+        addr = nl_nest_start(nlh, IPSET_ATTR_IP);
+        nl_attr_put(nlh, IPSET_ATTR_IPADDR_IPV4 | NLA_F_NET_BYTEORDER, &ip, sizeof(ip));
+        nl_nest_end(nlh, addr);
+    }
+    if (NULL != mac)
+        nl_attr_put(nlh, IPSET_ATTR_ETHER, mac->addr, sizeof(mac->addr));
+    if (timeout > 0)
+        nl_attr_put(nlh, IPSET_ATTR_TIMEOUT | NLA_F_NET_BYTEORDER, &seconds, sizeof(seconds));
+    nl_nest_end(nlh, data);
+    rc = nl_talk(nlh, NULL, NULL);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** Adds a member to a set. Adding an existing member is not an error.
+ * @param name Set name
+ * @param ip IP address, network byte order, 0 for hash:mac sets
+ * @param mac MAC address for hash:ip,mac and hash:mac sets, NULL for hash:ip sets
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_ipset_add(const char *name, uint32_t ip, const t_mac * mac)
+{
+    return nl_ipset_adt(IPSET_CMD_ADD, name, ip, mac, 0);
+}
+
+/** Adds a member to a set created with a timeout, or sets the timeout of
+ * an existing member again.
+ * @param name Set name
+ * @param ip IP address, network byte order, 0 for hash:mac sets
+ * @param mac MAC address for hash:ip,mac and hash:mac sets, NULL for hash:ip sets
+ * @param timeout Seconds the member stays in the set, 0 for the default
+ *                timeout of the set
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_ipset_add_timeout(const char *name, uint32_t ip, const t_mac * mac, unsigned int timeout)
+{
+    return nl_ipset_adt(IPSET_CMD_ADD, name, ip, mac, timeout);
+}
+
+/** Deletes a member from a set. Deleting a missing member is not an error.
+ * @param name Set name
+ * @param ip IP address, network byte order, 0 for hash:mac sets
+ * @param mac MAC address for hash:ip,mac and hash:mac sets, NULL for hash:ip sets
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_ipset_del(const char *name, uint32_t ip, const t_mac * mac)
+{
+    return nl_ipset_adt(IPSET_CMD_DEL, name, ip, mac, 0);
+}
+
+/** @internal
+ * Collects the members found in one message of a set listing
+ */
+static int
+nl_ipset_list_cb(const struct nlmsghdr *nlh, void *arg)
+{
+    t_nl_list *list = arg;
+    const struct nlattr *tb[IPSET_ATTR_CMD_MAX + 1];
+    const struct nlattr *adt[IPSET_ATTR_ADT_MAX + 1];
+    const struct nlattr *ip[IPSET_ATTR_IPADDR_MAX + 1];
+    const struct nlattr *nla;
+    t_nl_ipset_entry *entry;
+    uint64_t value;
+    int hdrlen = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    int len;
+
+    nl_attr_parse(tb, IPSET_ATTR_CMD_MAX, (const char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+    if (NULL == tb[IPSET_ATTR_ADT])
+        return 0;
+
+    /* IPSET_ATTR_ADT holds one IPSET_ATTR_DATA per member */
+    nla = NLA_PAYLOAD_DATA(tb[IPSET_ATTR_ADT]);
+    len = NLA_PAYLOAD_LEN(tb[IPSET_ATTR_ADT]);
+    while (len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len) {
+        nl_attr_parse(adt, IPSET_ATTR_ADT_MAX, NLA_PAYLOAD_DATA(nla), NLA_PAYLOAD_LEN(nla));
+        if (NULL != adt[IPSET_ATTR_IP] || NULL != adt[IPSET_ATTR_ETHER]) {
+            if (list->count == list->size) {
+                list->size = list->size ? list->size * 2 : 64;
+                list->entries = safe_realloc(list->entries, list->size * sizeof(t_nl_ipset_entry));
+            }
+            entry = &list->entries[list->count++];
+            memset(entry, 0, sizeof(*entry));
+
+            if (NULL != adt[IPSET_ATTR_IP])
+                nl_attr_parse(ip, IPSET_ATTR_IPADDR_MAX, NLA_PAYLOAD_DATA(adt[IPSET_ATTR_IP]),
+                              NLA_PAYLOAD_LEN(adt[IPSET_ATTR_IP]));
+            if (NULL != adt[IPSET_ATTR_IP] && NULL != ip[IPSET_ATTR_IPADDR_IPV4])
+                memcpy(&entry->ip, NLA_PAYLOAD_DATA(ip[IPSET_ATTR_IPADDR_IPV4]), sizeof(entry->ip));
+            if (NULL != adt[IPSET_ATTR_ETHER] && NLA_PAYLOAD_LEN(adt[IPSET_ATTR_ETHER]) >= (int)sizeof(entry->mac.addr))
+                memcpy(entry->mac.addr, NLA_PAYLOAD_DATA(adt[IPSET_ATTR_ETHER]), sizeof(entry->mac.addr));
+            if (NULL != adt[IPSET_ATTR_PACKETS]) {
+                memcpy(&value, NLA_PAYLOAD_DATA(adt[IPSET_ATTR_PACKETS]), sizeof(value));
+                entry->packets = be64toh(value);
+            }
+            if (NULL != adt[IPSET_ATTR_BYTES]) {
+                memcpy(&value, NLA_PAYLOAD_DATA(adt[IPSET_ATTR_BYTES]), sizeof(value));
+                entry->bytes = be64toh(value);
+            }
+        }
+        len -= NLA_ALIGN(nla->nla_len);
+        nla = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len));
+    }
+    return 0;
+}
+
+/** Lists the members of a set, with their counters.
+ * @param name Set name
+ * @param entries Set to an array of the members, to be freed by the caller
+ * @return Number of members, or a negative error code
+ */
+int
+nl_ipset_list(const char *name, t_nl_ipset_entry ** entries)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    t_nl_list list;
+    int rc;
+
+    memset(&list, 0, sizeof(list));
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_ipset_request(buf, IPSET_CMD_LIST, NLM_F_DUMP);
+    nl_attr_put(nlh, IPSET_ATTR_SETNAME, name, strlen(name) + 1);
+    rc = nl_talk(nlh, nl_ipset_list_cb, &list);
+    pthread_mutex_unlock(&nl_mutex);
+
+    if (rc != 0) {
+        free(list.entries);
+        *entries = NULL;
+        return rc;
+    }
+    *entries = list.entries;
+    return list.count;
+}
+
+/** @internal
+ * Starts an nf_tables request for IPv4 in a buffer of NL_REQUEST_SIZE bytes.
+ * The sequence number is allocated here, as several requests can be sent
+ * at once in a batch. nl_mutex must be held.
+ * @param buf Buffer
+ * @param cmd NFT_MSG_* command
+ * @param flags NLM_F_* flags besides NLM_F_REQUEST
+ */
+static struct nlmsghdr *
+nl_nft_request(char *buf, int cmd, int flags)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct nfgenmsg *nfg;
+
+    memset(buf, 0, NL_REQUEST_SIZE);
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_NFTABLES << 8) | cmd;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+    nlh->nlmsg_seq = ++nl_seq;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = NFPROTO_IPV4;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(0);
+    return nlh;
+}
+
+/** @internal
+ * Appends the table, the set and, unless there is no change or its key is
+ * NULL, the element changed to an element request
+ */
+static void
+nl_nft_put_elem(struct nlmsghdr *nlh, const char *table, const char *set, const t_nl_nft_change * change)
+{
+    struct nlattr *elems, *elem, *nest;
+    uint64_t timeout;
+
+    nl_attr_put(nlh, NFTA_SET_ELEM_LIST_TABLE, table, strlen(table) + 1);
+    nl_attr_put(nlh, NFTA_SET_ELEM_LIST_SET, set, strlen(set) + 1);
+    if (NULL == change || NULL == change->key)
+        return;
+
+    elems = nl_nest_start(nlh, NFTA_SET_ELEM_LIST_ELEMENTS);
+    elem = nl_nest_start(nlh, NFTA_LIST_ELEM);
+    nest = nl_nest_start(nlh, NFTA_SET_ELEM_KEY);
+    nl_attr_put(nlh, NFTA_DATA_VALUE, change->key, change->key_len);
+    nl_nest_end(nlh, nest);
+    if (change->add && NULL != change->data) {
+        nest = nl_nest_start(nlh, NFTA_SET_ELEM_DATA);
+        nl_attr_put(nlh, NFTA_DATA_VALUE, change->data, sizeof(*change->data));
+        nl_nest_end(nlh, nest);
+    }
+    if (change->add && change->timeout > 0) {
+        timeout = htobe64(change->timeout * 1000ULL);
+        nl_attr_put(nlh, NFTA_SET_ELEM_TIMEOUT, &timeout, sizeof(timeout));
+    }
+    if (change->add && change->counter) {
+        nest = nl_nest_start(nlh, NFTA_SET_ELEM_EXPR);
+        nl_attr_put(nlh, NFTA_EXPR_NAME, "counter", sizeof("counter"));
+        nl_nest_end(nlh, nest);
+    }
+    nl_nest_end(nlh, elem);
+    nl_nest_end(nlh, elems);
+}
+
+/** @internal
+ * Sends changes to the elements of the sets of a table as one batch, so one
+ * transaction, and waits for the kernel to acknowledge every one of them.
+ * nl_mutex must be held.
+ * @param table Table name, or NULL to delete the table named by the only
+ *              change instead
+ * @return 0 if the transaction was committed, the first error otherwise
+ */
+static int
+nl_nft_batch(const char *table, const t_nl_nft_change * changes, int count)
+{
+    struct sockaddr_nl addr;
+    struct nlmsghdr *nlh, *rep;
+    struct nfgenmsg *nfg;
+    char *batch;
+    size_t len = 0;
+    uint32_t begin_seq, last_seq;
+    ssize_t received;
+    int i, rc = 0;
+
+    if (nl_open() == -1)
+        return -ENOTCONN;
+
+    batch = safe_malloc((count + 2) * NL_REQUEST_SIZE);
+
+    nlh = nl_nft_request(batch, NFNL_MSG_BATCH_BEGIN, 0);
+    nlh->nlmsg_type = NFNL_MSG_BATCH_BEGIN;
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->res_id = htons(NFNL_SUBSYS_NFTABLES);
+    begin_seq = nlh->nlmsg_seq;
+    len += NLMSG_ALIGN(nlh->nlmsg_len);
+
+    for (i = 0; i < count; i++) {
+        if (NULL == table) {
+            nlh = nl_nft_request(batch + len, NFT_MSG_DELTABLE, NLM_F_ACK);
+            nl_attr_put(nlh, NFTA_TABLE_NAME, changes[i].set, strlen(changes[i].set) + 1);
+        } else {
+            /* Deleting without an element flushes the set */
+            nlh = nl_nft_request(batch + len, changes[i].add ? NFT_MSG_NEWSETELEM : NFT_MSG_DELSETELEM,
+                                 changes[i].add ? NLM_F_CREATE | NLM_F_ACK : NLM_F_ACK);
+            nl_nft_put_elem(nlh, table, changes[i].set, &changes[i]);
+        }
+        len += NLMSG_ALIGN(nlh->nlmsg_len);
+    }
+    last_seq = nl_seq;
+
+    nlh = nl_nft_request(batch + len, NFNL_MSG_BATCH_END, 0);
+    nlh->nlmsg_type = NFNL_MSG_BATCH_END;
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->res_id = htons(NFNL_SUBSYS_NFTABLES);
+    len += NLMSG_ALIGN(nlh->nlmsg_len);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    if (sendto(nl_fd, batch, len, 0, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        free(batch);
+        return -errno;
+    }
+    free(batch);
+
+    /* One acknowledgment per change, in order, or one error for the whole
+     * batch if the kernel could not even start it */
+    for (;;) {
+        received = recv(nl_fd, nl_recv_buf, NL_RECV_SIZE, 0);
+        if (received == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        for (rep = (struct nlmsghdr *)nl_recv_buf; NLMSG_OK(rep, received); rep = NLMSG_NEXT(rep, received)) {
+            if (rep->nlmsg_type != NLMSG_ERROR || rep->nlmsg_seq < begin_seq || rep->nlmsg_seq > last_seq)
+                continue;
+            if (0 == rc)
+                rc = ((struct nlmsgerr *)NLMSG_DATA(rep))->error;
+            if (rep->nlmsg_seq == begin_seq || rep->nlmsg_seq == last_seq)
+                return rc;
+        }
+    }
+}
+
+/** Applies changes to the elements of nftables sets and maps as one
+ * transaction: if any of them fails, none is made.
+ * @param table Name of the IPv4 table holding the sets
+ * @param changes Changes, applied in order
+ * @param count Number of changes
+ * @return 0 on success, the negative error code of the first failed change
+ *         otherwise. Adding an element that exists with the same value is
+ *         not an error, with another value it is (-EBUSY); so is deleting a
+ *         missing element (-ENOENT).
+ */
+int
+nl_nft_commit(const char *table, const t_nl_nft_change * changes, int count)
+{
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+    rc = nl_nft_batch(table, changes, count);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** Deletes an IPv4 nftables table, with everything it holds
+ * @param table Table name
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_nft_delete_table(const char *table)
+{
+    t_nl_nft_change change;
+    int rc;
+
+    memset(&change, 0, sizeof(change));
+    change.set = table;
+
+    pthread_mutex_lock(&nl_mutex);
+    rc = nl_nft_batch(NULL, &change, 1);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** @internal
+ * Reads the counter expression of an element, given as NFTA_SET_ELEM_EXPR
+ */
+static void
+nl_nft_parse_counter(t_nl_nft_elem * elem, const struct nlattr *expr)
+{
+    const struct nlattr *tb[NFTA_EXPR_MAX + 1];
+    const struct nlattr *counter[NFTA_COUNTER_MAX + 1];
+    uint64_t value;
+
+    nl_attr_parse(tb, NFTA_EXPR_MAX, NLA_PAYLOAD_DATA(expr), NLA_PAYLOAD_LEN(expr));
+    if (NULL == tb[NFTA_EXPR_NAME] || NULL == tb[NFTA_EXPR_DATA]
+        || strncmp(NLA_PAYLOAD_DATA(tb[NFTA_EXPR_NAME]), "counter", NLA_PAYLOAD_LEN(tb[NFTA_EXPR_NAME])) != 0)
+        return;
+
+    nl_attr_parse(counter, NFTA_COUNTER_MAX, NLA_PAYLOAD_DATA(tb[NFTA_EXPR_DATA]), NLA_PAYLOAD_LEN(tb[NFTA_EXPR_DATA]));
+    if (NULL != counter[NFTA_COUNTER_PACKETS]) {
+        memcpy(&value, NLA_PAYLOAD_DATA(counter[NFTA_COUNTER_PACKETS]), sizeof(value));
+        elem->packets = be64toh(value);
+    }
+    if (NULL != counter[NFTA_COUNTER_BYTES]) {
+        memcpy(&value, NLA_PAYLOAD_DATA(counter[NFTA_COUNTER_BYTES]), sizeof(value));
+        elem->bytes = be64toh(value);
+    }
+}
+
+/** @internal
+ * Collects the elements found in one NFT_MSG_NEWSETELEM message, the answer
+ * to both a dump and a single element query
+ */
+static int
+nl_nft_elem_cb(const struct nlmsghdr *nlh, void *arg)
+{
+    t_nl_nft_list *list = arg;
+    const struct nlattr *tb[NFTA_SET_ELEM_LIST_MAX + 1];
+    const struct nlattr *attr[NFTA_SET_ELEM_MAX + 1];
+    const struct nlattr *value[NFTA_DATA_MAX + 1];
+    const struct nlattr *nla, *expr;
+    t_nl_nft_elem *elem;
+    int hdrlen = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    int len, exprs_len;
+
+    if ((nlh->nlmsg_type & 0xff) != NFT_MSG_NEWSETELEM)
+        return 0;
+    nl_attr_parse(tb, NFTA_SET_ELEM_LIST_MAX, (const char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+    if (NULL == tb[NFTA_SET_ELEM_LIST_ELEMENTS])
+        return 0;
+
+    nla = NLA_PAYLOAD_DATA(tb[NFTA_SET_ELEM_LIST_ELEMENTS]);
+    len = NLA_PAYLOAD_LEN(tb[NFTA_SET_ELEM_LIST_ELEMENTS]);
+    for (; len >= NLA_HDRLEN && nla->nla_len >= NLA_HDRLEN && nla->nla_len <= len;
+         len -= NLA_ALIGN(nla->nla_len), nla = (const struct nlattr *)((const char *)nla + NLA_ALIGN(nla->nla_len))) {
+        nl_attr_parse(attr, NFTA_SET_ELEM_MAX, NLA_PAYLOAD_DATA(nla), NLA_PAYLOAD_LEN(nla));
+        if (NULL == attr[NFTA_SET_ELEM_KEY])
+            continue;
+
+        if (list->count == list->size) {
+            list->size = list->size ? list->size * 2 : 64;
+            list->elems = safe_realloc(list->elems, list->size * sizeof(t_nl_nft_elem));
+        }
+        elem = &list->elems[list->count++];
+        memset(elem, 0, sizeof(*elem));
+
+        nl_attr_parse(value, NFTA_DATA_MAX, NLA_PAYLOAD_DATA(attr[NFTA_SET_ELEM_KEY]),
+                      NLA_PAYLOAD_LEN(attr[NFTA_SET_ELEM_KEY]));
+        if (NULL != value[NFTA_DATA_VALUE]) {
+            elem->key_len = NLA_PAYLOAD_LEN(value[NFTA_DATA_VALUE]);
+            if (elem->key_len > sizeof(elem->key))
+                elem->key_len = sizeof(elem->key);
+            memcpy(elem->key, NLA_PAYLOAD_DATA(value[NFTA_DATA_VALUE]), elem->key_len);
+        }
+        if (NULL != attr[NFTA_SET_ELEM_DATA]) {
+            nl_attr_parse(value, NFTA_DATA_MAX, NLA_PAYLOAD_DATA(attr[NFTA_SET_ELEM_DATA]),
+                          NLA_PAYLOAD_LEN(attr[NFTA_SET_ELEM_DATA]));
+            if (NULL != value[NFTA_DATA_VALUE] && NLA_PAYLOAD_LEN(value[NFTA_DATA_VALUE]) == sizeof(elem->data))
+                memcpy(&elem->data, NLA_PAYLOAD_DATA(value[NFTA_DATA_VALUE]), sizeof(elem->data));
+        }
+
+        /* A single expression comes alone, several as a list */
+        if (NULL != attr[NFTA_SET_ELEM_EXPR])
+            nl_nft_parse_counter(elem, attr[NFTA_SET_ELEM_EXPR]);
+        if (NULL != attr[NFTA_SET_ELEM_EXPRESSIONS]) {
+            expr = NLA_PAYLOAD_DATA(attr[NFTA_SET_ELEM_EXPRESSIONS]);
+            exprs_len = NLA_PAYLOAD_LEN(attr[NFTA_SET_ELEM_EXPRESSIONS]);
+            while (exprs_len >= NLA_HDRLEN && expr->nla_len >= NLA_HDRLEN && expr->nla_len <= exprs_len) {
+                nl_nft_parse_counter(elem, expr);
+                exprs_len -= NLA_ALIGN(expr->nla_len);
+                expr = (const struct nlattr *)((const char *)expr + NLA_ALIGN(expr->nla_len));
+            }
+        }
+    }
+    return 0;
+}
+
+/** Looks up the value of an element of an nftables map.
+ * @param table Name of the IPv4 table holding the map
+ * @param set Map name
+ * @param key Key of the element
+ * @param key_len Length of the key
+ * @param data Receives the value of the element
+ * @return 0 if the element was found, -ENOENT if not, another negative
+ *         error code otherwise
+ */
+int
+nl_nft_get(const char *table, const char *set, const void *key, size_t key_len, uint32_t * data)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    t_nl_nft_change change;
+    t_nl_nft_list list;
+    int rc;
+
+    memset(&list, 0, sizeof(list));
+    memset(&change, 0, sizeof(change));
+    change.key = key;
+    change.key_len = key_len;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_nft_request(buf, NFT_MSG_GETSETELEM, NLM_F_ACK);
+    nl_nft_put_elem(nlh, table, set, &change);
+    rc = nl_talk(nlh, nl_nft_elem_cb, &list);
+    pthread_mutex_unlock(&nl_mutex);
+
+    if (0 == rc && 0 == list.count)
+        rc = -ENOENT;
+    if (0 == rc)
+        *data = list.elems[0].data;
+    free(list.elems);
+    return rc;
+}
+
+/** Lists the elements of an nftables set or map, with their counters, in
+ * a single dump.
+ * @param table Name of the IPv4 table holding the set
+ * @param set Set or map name
+ * @param elems Set to an array of the elements, to be freed by the caller
+ * @return Number of elements, or a negative error code
+ */
+int
+nl_nft_list(const char *table, const char *set, t_nl_nft_elem ** elems)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    t_nl_nft_list list;
+    int rc;
+
+    memset(&list, 0, sizeof(list));
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_nft_request(buf, NFT_MSG_GETSETELEM, NLM_F_DUMP);
+    nl_nft_put_elem(nlh, table, set, NULL);
+    rc = nl_talk(nlh, nl_nft_elem_cb, &list);
+    pthread_mutex_unlock(&nl_mutex);
+
+    if (rc != 0) {
+        free(list.elems);
+        *elems = NULL;
+        return rc;
+    }
+    *elems = list.elems;
+    return list.count;
+}
+
+/** @internal
+ * Starts an nfnetlink_acct request in a buffer of NL_REQUEST_SIZE bytes.
+ * @param buf Buffer
+ * @param cmd NFNL_MSG_ACCT_* command
+ * @param flags NLM_F_* flags besides NLM_F_REQUEST
+ */
+static struct nlmsghdr *
+nl_acct_request(char *buf, int cmd, int flags)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct nfgenmsg *nfg;
+
+    memset(buf, 0, NL_REQUEST_SIZE);
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_ACCT << 8) | cmd;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(0);
+    return nlh;
+}
+
+/** Creates an accounting object, as matched by iptables -m nfacct. An
+ * object of the same name that already exists has its counters reset.
+ * @param name Object name, shorter than NL_ACCT_NAME_MAX
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_acct_new(const char *name)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_acct_request(buf, NFNL_MSG_ACCT_NEW, NLM_F_ACK | NLM_F_CREATE | NLM_F_REPLACE);
+    nl_attr_put(nlh, NFACCT_NAME, name, strlen(name) + 1);
+    rc = nl_talk(nlh, NULL, NULL);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** Deletes an accounting object. The kernel refuses with -EBUSY while a
+ * rule still refers to it.
+ * @param name Object name
+ * @return 0 on success, a negative error code otherwise
+ */
+int
+nl_acct_del(const char *name)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    int rc;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_acct_request(buf, NFNL_MSG_ACCT_DEL, NLM_F_ACK);
+    nl_attr_put(nlh, NFACCT_NAME, name, strlen(name) + 1);
+    rc = nl_talk(nlh, NULL, NULL);
+    pthread_mutex_unlock(&nl_mutex);
+
+    return rc;
+}
+
+/** @internal
+ * Collects the object found in one message of an accounting dump, if its
+ * name starts with the prefix asked for
+ */
+static int
+nl_acct_list_cb(const struct nlmsghdr *nlh, void *arg)
+{
+    t_nl_acct_list *list = arg;
+    const struct nlattr *tb[NFACCT_MAX + 1];
+    t_nl_acct *acct;
+    uint64_t value;
+    int hdrlen = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    int len;
+
+    nl_attr_parse(tb, NFACCT_MAX, (const char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+    if (NULL == tb[NFACCT_NAME])
+        return 0;
+    len = NLA_PAYLOAD_LEN(tb[NFACCT_NAME]);
+    if (len < (int)list->prefix_len || len > NL_ACCT_NAME_MAX
+        || strncmp(NLA_PAYLOAD_DATA(tb[NFACCT_NAME]), list->prefix, list->prefix_len) != 0)
+        return 0;
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->accts = safe_realloc(list->accts, list->size * sizeof(t_nl_acct));
+    }
+    acct = &list->accts[list->count++];
+    memset(acct, 0, sizeof(*acct));
+    memcpy(acct->name, NLA_PAYLOAD_DATA(tb[NFACCT_NAME]), len);
+    acct->name[NL_ACCT_NAME_MAX - 1] = '\0';
+    if (NULL != tb[NFACCT_PKTS]) {
+        memcpy(&value, NLA_PAYLOAD_DATA(tb[NFACCT_PKTS]), sizeof(value));
+        acct->packets = be64toh(value);
+    }
+    if (NULL != tb[NFACCT_BYTES]) {
+        memcpy(&value, NLA_PAYLOAD_DATA(tb[NFACCT_BYTES]), sizeof(value));
+        acct->bytes = be64toh(value);
+    }
+    return 0;
+}
+
+/** Lists the accounting objects whose name starts with a prefix, with their
+ * counters, in a single dump.
+ * @param prefix Name prefix
+ * @param accts Set to an array of the objects, to be freed by the caller
+ * @return Number of objects, or a negative error code
+ */
+int
+nl_acct_list(const char *prefix, t_nl_acct ** accts)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    t_nl_acct_list list;
+    int rc;
+
+    memset(&list, 0, sizeof(list));
+    list.prefix = prefix;
+    list.prefix_len = strlen(prefix);
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_acct_request(buf, NFNL_MSG_ACCT_GET, NLM_F_DUMP);
+    rc = nl_talk(nlh, nl_acct_list_cb, &list);
+    pthread_mutex_unlock(&nl_mutex);
+
+    if (rc != 0) {
+        free(list.accts);
+        *accts = NULL;
+        return rc;
+    }
+    *accts = list.accts;
+    return list.count;
+}
+
+/** @internal
+ * Starts a conntrack request for IPv4 entries in a buffer of
+ * NL_REQUEST_SIZE bytes
+ */
+static struct nlmsghdr *
+nl_ct_request(char *buf, int cmd, int flags)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct nfgenmsg *nfg;
+
+    memset(buf, 0, NL_REQUEST_SIZE);
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | cmd;
+    nlh->nlmsg_flags = NLM_F_REQUEST | flags;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_INET;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(0);
+    return nlh;
+}
+
+/** @internal
+ * Reads the source address of a CTA_TUPLE_ORIG or CTA_TUPLE_REPLY attribute
+ * @return The address, network byte order, or 0 if it has none
+ */
+static uint32_t
+nl_ct_tuple_src(const struct nlattr *tuple)
+{
+    const struct nlattr *tb[CTA_TUPLE_MAX + 1];
+    const struct nlattr *ip[CTA_IP_MAX + 1];
+    uint32_t src;
+
+    if (NULL == tuple)
+        return 0;
+    nl_attr_parse(tb, CTA_TUPLE_MAX, NLA_PAYLOAD_DATA(tuple), NLA_PAYLOAD_LEN(tuple));
+    if (NULL == tb[CTA_TUPLE_IP])
+        return 0;
+    nl_attr_parse(ip, CTA_IP_MAX, NLA_PAYLOAD_DATA(tb[CTA_TUPLE_IP]), NLA_PAYLOAD_LEN(tb[CTA_TUPLE_IP]));
+    if (NULL == ip[CTA_IP_V4_SRC] || NLA_PAYLOAD_LEN(ip[CTA_IP_V4_SRC]) != sizeof(src))
+        return 0;
+    memcpy(&src, NLA_PAYLOAD_DATA(ip[CTA_IP_V4_SRC]), sizeof(src));
+    return src;
+}
+
+/** @internal
+ * Keeps what identifies the entry found in one message of a conntrack dump,
+ * if it has a mark and the callback picks it
+ */
+static int
+nl_ct_list_cb(const struct nlmsghdr *nlh, void *arg)
+{
+    t_nl_ct_list *list = arg;
+    const struct nlattr *tb[CTA_MAX + 1];
+    t_nl_ct_found *found;
+    t_nl_ct ct;
+    uint32_t mark;
+    int hdrlen = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+
+    nl_attr_parse(tb, CTA_MAX, (const char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+    if (NULL == tb[CTA_TUPLE_ORIG] || NULL == tb[CTA_MARK] || NLA_PAYLOAD_LEN(tb[CTA_MARK]) != sizeof(mark)
+        || NLA_PAYLOAD_LEN(tb[CTA_TUPLE_ORIG]) > NL_CT_TUPLE_MAX)
+        return 0;
+    memcpy(&mark, NLA_PAYLOAD_DATA(tb[CTA_MARK]), sizeof(mark));
+    if (0 == (ct.mark = ntohl(mark)))
+        return 0;
+    ct.src = nl_ct_tuple_src(tb[CTA_TUPLE_ORIG]);
+    ct.reply_src = nl_ct_tuple_src(tb[CTA_TUPLE_REPLY]);
+    if (!list->match(&ct, list->arg))
+        return 0;
+
+    if (list->count == list->size) {
+        list->size = list->size ? list->size * 2 : 64;
+        list->found = safe_realloc(list->found, list->size * sizeof(t_nl_ct_found));
+    }
+    found = &list->found[list->count++];
+    memset(found, 0, sizeof(*found));
+    found->tuple_len = NLA_PAYLOAD_LEN(tb[CTA_TUPLE_ORIG]);
+    memcpy(found->tuple, NLA_PAYLOAD_DATA(tb[CTA_TUPLE_ORIG]), found->tuple_len);
+    if (NULL != tb[CTA_ZONE] && NLA_PAYLOAD_LEN(tb[CTA_ZONE]) == sizeof(found->zone)) {
+        memcpy(&found->zone, NLA_PAYLOAD_DATA(tb[CTA_ZONE]), sizeof(found->zone));
+        found->has_zone = 1;
+    }
+    return 0;
+}
+
+/** Clears the mark of the IPv4 conntrack entries a callback picks among the
+ * marked ones, so that the next packet of each connection is marked again
+ * by the firewall rules. The entries are read in a single dump, then
+ * updated one by one; the connections, and their NAT mappings, are kept.
+ * Entries gone in between are skipped.
+ * @param match Called for each marked entry, returns non-zero to clear it
+ * @param arg Passed to match
+ * @return Number of entries cleared, or a negative error code
+ */
+int
+nl_ct_clear_marks(int (*match)(const t_nl_ct *, void *), void *arg)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    struct nlattr *nest;
+    t_nl_ct_list list;
+    uint32_t mark = htonl(0);
+    int i, r, rc, cleared = 0;
+
+    memset(&list, 0, sizeof(list));
+    list.match = match;
+    list.arg = arg;
+
+    pthread_mutex_lock(&nl_mutex);
+    nlh = nl_ct_request(buf, IPCTNL_MSG_CT_GET, NLM_F_DUMP);
+    rc = nl_talk(nlh, nl_ct_list_cb, &list);
+    for (i = 0; i < list.count && 0 == rc; i++) {
+        /* Without NLM_F_CREATE, an existing entry is only updated */
+        nlh = nl_ct_request(buf, IPCTNL_MSG_CT_NEW, NLM_F_ACK);
+        nest = nl_nest_start(nlh, CTA_TUPLE_ORIG);
+        memcpy((char *)nlh + nlh->nlmsg_len, list.found[i].tuple, list.found[i].tuple_len);
+        nlh->nlmsg_len += NLA_ALIGN(list.found[i].tuple_len);
+        nl_nest_end(nlh, nest);
+        if (list.found[i].has_zone)
+            nl_attr_put(nlh, CTA_ZONE, &list.found[i].zone, sizeof(list.found[i].zone));
+        nl_attr_put(nlh, CTA_MARK, &mark, sizeof(mark));
+        r = nl_talk(nlh, NULL, NULL);
+        if (0 == r)
+            cleared++;
+        else if (-ENOENT != r)
+            rc = r;
+    }
+    pthread_mutex_unlock(&nl_mutex);
+
+    free(list.found);
+    return rc ? rc : cleared;
+}
+
+/** @internal
+ * Starts an nfnetlink_log configuration request for a group in a buffer of
+ * NL_REQUEST_SIZE bytes
+ */
+static struct nlmsghdr *
+nl_log_request(char *buf, uint16_t group)
+{
+    struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
+    struct nfgenmsg *nfg;
+
+    memset(buf, 0, NL_REQUEST_SIZE);
+    nlh->nlmsg_len = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    nlh->nlmsg_type = (NFNL_SUBSYS_ULOG << 8) | NFULNL_MSG_CONFIG;
+    nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+
+    nfg = NLMSG_DATA(nlh);
+    nfg->nfgen_family = AF_UNSPEC;
+    nfg->version = NFNETLINK_V0;
+    nfg->res_id = htons(group);
+    return nlh;
+}
+
+/** @internal
+ * Sends a configuration request on the socket of a group and waits for
+ * its acknowledgment. Packets already copied to the group are dropped.
+ * @return 0 on success, a negative errno otherwise
+ */
+static int
+nl_log_talk(int fd, struct nlmsghdr *nlh)
+{
+    static uint32_t seq = 0;
+    struct sockaddr_nl addr;
+    struct nlmsghdr *rep;
+    char buf[NL_REQUEST_SIZE];
+    ssize_t len;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.nl_family = AF_NETLINK;
+    nlh->nlmsg_seq = ++seq;
+    if (sendto(fd, nlh, nlh->nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        return -errno;
+
+    for (;;) {
+        /* Packets do not fit and are cut short, which does not matter */
+        len = recv(fd, buf, sizeof(buf), 0);
+        if (len == -1) {
+            if (errno == EINTR)
+                continue;
+            return -errno;
+        }
+        for (rep = (struct nlmsghdr *)buf; NLMSG_OK(rep, len); rep = NLMSG_NEXT(rep, len))
+            if (rep->nlmsg_type == NLMSG_ERROR && rep->nlmsg_seq == nlh->nlmsg_seq)
+                return ((struct nlmsgerr *)NLMSG_DATA(rep))->error;
+    }
+}
+
+/** Opens a socket receiving the packets the firewall copies to an
+ * nfnetlink_log group, the target of iptables -j NFLOG or nft log group.
+ * Whole packets are copied. Closing the socket releases the group.
+ * @param group Group number
+ * @return The socket, to be read with nl_log_recv(), or a negative error
+ *         code, -EPERM if another socket has the group
+ */
+int
+nl_log_open(uint16_t group)
+{
+    char buf[NL_REQUEST_SIZE];
+    struct nlmsghdr *nlh;
+    struct nfulnl_msg_config_cmd cmd;
+    struct nfulnl_msg_config_mode mode;
+    struct timeval timeout;
+    int fd, size = NL_LOG_RCVBUF, rc;
+
+    if ((fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER)) == -1) {
+        rc = -errno;
+        debug(LOG_ERR, "socket(NETLINK_NETFILTER): %s", strerror(errno));
+        return rc;
+    }
+    /* Past the limit of the system when we may */
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) == -1)
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    /* Until the group is set up */
+    timeout.tv_sec = NL_TIMEOUT;
+    timeout.tv_usec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    nlh = nl_log_request(buf, group);
+    cmd.command = NFULNL_CFG_CMD_BIND;
+    nl_attr_put(nlh, NFULA_CFG_CMD, &cmd, sizeof(cmd));
+    if ((rc = nl_log_talk(fd, nlh)) == 0) {
+        nlh = nl_log_request(buf, group);
+        memset(&mode, 0, sizeof(mode));
+        mode.copy_range = htonl(0xffff);
+        mode.copy_mode = NFULNL_COPY_PACKET;
+        nl_attr_put(nlh, NFULA_CFG_MODE, &mode, sizeof(mode));
+        rc = nl_log_talk(fd, nlh);
+    }
+    if (rc != 0) {
+        debug(LOG_ERR, "Could not bind to nfnetlink_log group %u (error %d)", group, rc);
+        close(fd);
+        return rc;
+    }
+
+    timeout.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return fd;
+}
+
+/** Waits for packets copied to an nfnetlink_log group and hands each of
+ * them to a callback. Packets the kernel dropped because the socket was
+ * full are not an error.
+ * @param fd Socket from nl_log_open()
+ * @param buf Receive buffer
+ * @param size Size of the buffer, packets longer than that are cut short
+ * @param cb Called with each packet, from its network header, its length
+ *           and arg
+ * @param arg Passed to cb
+ * @return Number of packets handed to cb, or a negative errno
+ */
+int
+nl_log_recv(int fd, void *buf, size_t size, void (*cb)(const unsigned char *, size_t, void *), void *arg)
+{
+    const struct nlattr *tb[NFULA_MAX + 1];
+    struct nlmsghdr *nlh;
+    ssize_t len;
+    int hdrlen = NLMSG_LENGTH(sizeof(struct nfgenmsg));
+    int count = 0;
+
+    len = recv(fd, buf, size, 0);
+    if (len == -1) {
+        if (errno == EINTR)
+            return 0;
+        if (errno == ENOBUFS) {
+            debug(LOG_WARNING, "Packets copied to nfnetlink_log were dropped");
+            return 0;
+        }
+        return -errno;
+    }
+
+    for (nlh = buf; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len)) {
+        if (nlh->nlmsg_type != ((NFNL_SUBSYS_ULOG << 8) | NFULNL_MSG_PACKET) || (int)nlh->nlmsg_len < hdrlen)
+            continue;
+        nl_attr_parse(tb, NFULA_MAX, (const char *)nlh + hdrlen, nlh->nlmsg_len - hdrlen);
+        if (NULL == tb[NFULA_PAYLOAD])
+            continue;
+        cb(NLA_PAYLOAD_DATA(tb[NFULA_PAYLOAD]), NLA_PAYLOAD_LEN(tb[NFULA_PAYLOAD]), arg);
+        count++;
+    }
+    return count;
+}
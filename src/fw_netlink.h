@@ -0,0 +1,128 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_netlink.h
+    @brief In-process ipset, nftables set, accounting object and conntrack mark changes over nfnetlink
+*/
+
+#ifndef _FW_NETLINK_H_
+#define _FW_NETLINK_H_
+
+#include "util.h"
+
+/** One member of a set, as listed by nl_ipset_list() */
+typedef struct _t_nl_ipset_entry {
+    uint32_t ip;                /**< @brief IP address, network byte order, zero for hash:mac sets */
+    t_mac mac;                  /**< @brief MAC address, zero for hash:ip sets */
+    unsigned long long packets; /**< @brief Packets matched, if the set has counters */
+    unsigned long long bytes;   /**< @brief Bytes matched, if the set has counters */
+} t_nl_ipset_entry;
+
+/** @brief Create an IPv4 set unless it already exists */
+int nl_ipset_create(const char *, const char *, int, unsigned int);
+
+/** @brief Remove all members of a set */
+int nl_ipset_flush(const char *);
+
+/** @brief Destroy a set */
+int nl_ipset_destroy(const char *);
+
+/** @brief Add a member to a set */
+int nl_ipset_add(const char *, uint32_t, const t_mac *);
+
+/** @brief Add a member to a set for a while */
+int nl_ipset_add_timeout(const char *, uint32_t, const t_mac *, unsigned int);
+
+/** @brief Delete a member from a set */
+int nl_ipset_del(const char *, uint32_t, const t_mac *);
+
+/** @brief List the members of a set */
+int nl_ipset_list(const char *, t_nl_ipset_entry **);
+
+/** One change to an nftables set or map, see nl_nft_commit() */
+typedef struct _t_nl_nft_change {
+    int add;                    /**< @brief 1 to add the element, 0 to delete it */
+    const char *set;            /**< @brief Set or map name */
+    const void *key;            /**< @brief Key of the element, NULL with add 0 to flush the set */
+    size_t key_len;             /**< @brief Length of the key */
+    const uint32_t *data;       /**< @brief Value of the element for maps, NULL for sets */
+    int counter;                /**< @brief Whether a new element counts the packets and bytes it matches */
+    unsigned int timeout;       /**< @brief Seconds a new element stays in a set with timeouts, 0 for the default */
+} t_nl_nft_change;
+
+/** One element of an nftables set or map, as listed by nl_nft_list() */
+typedef struct _t_nl_nft_elem {
+    unsigned char key[16];      /**< @brief Key, as stored by the kernel */
+    size_t key_len;             /**< @brief Length of the key */
+    uint32_t data;              /**< @brief Value, for maps of 32 bit values */
+    unsigned long long packets; /**< @brief Packets matched, if the set has counters */
+    unsigned long long bytes;   /**< @brief Bytes matched, if the set has counters */
+} t_nl_nft_elem;
+
+/** @brief Change elements of nftables sets in one transaction */
+int nl_nft_commit(const char *, const t_nl_nft_change *, int);
+
+/** @brief Delete an nftables table */
+int nl_nft_delete_table(const char *);
+
+/** @brief Look up the value of an element of an nftables map */
+int nl_nft_get(const char *, const char *, const void *, size_t, uint32_t *);
+
+/** @brief List the elements of an nftables set */
+int nl_nft_list(const char *, const char *, t_nl_nft_elem **);
+
+/** Longest name of an accounting object, with its terminating nul */
+#define NL_ACCT_NAME_MAX 32
+
+/** One accounting object, as listed by nl_acct_list() */
+typedef struct _t_nl_acct {
+    char name[NL_ACCT_NAME_MAX];    /**< @brief Object name */
+    unsigned long long packets; /**< @brief Packets counted */
+    unsigned long long bytes;   /**< @brief Bytes counted */
+} t_nl_acct;
+
+/** @brief Create an accounting object, or reset its counters */
+int nl_acct_new(const char *);
+
+/** @brief Delete an accounting object */
+int nl_acct_del(const char *);
+
+/** @brief List the accounting objects whose name starts with a prefix */
+int nl_acct_list(const char *, t_nl_acct **);
+
+/** One marked IPv4 conntrack entry, as nl_ct_clear_marks() hands it to its
+ * callback */
+typedef struct _t_nl_ct {
+    uint32_t src;               /**< @brief Source address of the original direction, network byte order */
+    uint32_t reply_src;         /**< @brief Source address of the reply direction, network byte order */
+    uint32_t mark;              /**< @brief Connection mark, never 0 */
+} t_nl_ct;
+
+/** @brief Clear the mark of the conntrack entries a callback picks */
+int nl_ct_clear_marks(int (*)(const t_nl_ct *, void *), void *);
+
+/** @brief Receive the packets copied to an nfnetlink_log group */
+int nl_log_open(uint16_t);
+
+/** @brief Hand the packets copied to an nfnetlink_log group to a callback */
+int nl_log_recv(int, void *, size_t, void (*)(const unsigned char *, size_t, void *), void *);
+
+#endif                          /* _FW_NETLINK_H_ */
@@ -0,0 +1,838 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+ \********************************************************************/
+
+/** @internal
+  @file fw_nftables.c
+  @brief Firewall nftables functions
+
+  Everything lives in one table of the ip family, loaded by a single
+  "nft -f -" transaction that replaces any table left over by a previous
+  run. It mirrors the chains of the iptables backend, but clients are not
+  rules: the mangle hook looks the source address and MAC address of a
+  packet up in the clients_out map, whose value is the mark of the client
+  (probation, known or locked), and the way back is matched against the
+  clients_in set. Every element of both carries its own counter.
+
+  Once the table is loaded, all changes are made to the elements of its
+  sets over netlink (see fw_netlink.c), each call being one transaction,
+  and the counters of all clients are read with one dump per direction.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <syslog.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <net/if.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#include "common.h"
+
+#include "safe.h"
+#include "conf.h"
+#include "fw_nftables.h"
+#include "firewall.h"
+#include "debug.h"
+#include "util.h"
+#include "client_list.h"
+#include "pstring.h"
+#include "fw_netlink.h"
+#include "fw_helper.h"
+
+/** Length of a key of clients_out: an IPv4 address, then a MAC address
+ * padded to 32 bits */
+#define NFT_CLIENT_KEY_LEN 12
+
+static const char *nftables_table(void);
+static void nftables_client_key(unsigned char *, uint32_t, const t_mac *);
+static void nftables_compile(pstr_t *, int, const t_firewall_rule *);
+static void nftables_load_ruleset(pstr_t *, const char *, const char *, int);
+static int nftables_apply(const char *);
+static int nftables_counters_set(t_fw_counters *, const char *, int, t_nl_nft_elem **);
+static void nftables_counters_orphan(t_nl_nft_change *, int *, const char *, const t_nl_nft_elem *);
+
+/** @internal
+ * Name of the table, with the gateway interface in it
+ */
+static const char *
+nftables_table(void)
+{
+    /* Filled the first time, by nftables_fw_init() */
+    static char *table = NULL;
+
+    if (NULL == table)
+        safe_asprintf(&table, NFT_TABLE_PREFIX "%s", config_get_config()->gw_interface);
+    return table;
+}
+
+/** @internal
+ * Builds the key of a client in clients_out
+ */
+static void
+nftables_client_key(unsigned char *key, uint32_t ip, const t_mac * mac)
+{
+    memset(key, 0, NFT_CLIENT_KEY_LEN);
+    memcpy(key, &ip, sizeof(ip));
+    memcpy(key + sizeof(ip), mac->addr, sizeof(mac->addr));
+}
+
+/** @internal
+ * Compiles a firewall rule of the configuration into an nft rule.
+ * @param script Script the rule is appended to
+ * @param nat Whether the rule goes into a chain of type nat
+ * @param rule Definition of a rule into a struct, from conf.c.
+ */
+static void
+nftables_compile(pstr_t * script, int nat, const t_firewall_rule * rule)
+{
+    const char *verdict;
+    char *port, *p;
+
+    switch (rule->target) {
+    case TARGET_DROP:
+        if (nat)
+            return;
+        verdict = "drop";
+        break;
+    case TARGET_REJECT:
+        if (nat)
+            return;
+        verdict = "reject";
+        break;
+    case TARGET_ACCEPT:
+        verdict = "accept";
+        break;
+    case TARGET_LOG:
+        verdict = "log";
+        break;
+    case TARGET_ULOG:
+        verdict = "log group 0";
+        break;
+    default:
+        return;
+    }
+
+    if (rule->mask != NULL && rule->mask_is_ipset) {
+        debug(LOG_WARNING, "nftables cannot match ipset %s, ignoring the rule", rule->mask);
+        return;
+    }
+
+    pstr_cat(script, "\t\t");
+    if (rule->mask != NULL)
+        pstr_append_sprintf(script, "ip daddr %s ", rule->mask);
+    if (rule->protocol != NULL && rule->port != NULL) {
+        /* iptables port ranges are first:last, nft ones first-last */
+        port = safe_strdup(rule->port);
+        for (p = port; *p; p++)
+            if (':' == *p)
+                *p = '-';
+        pstr_append_sprintf(script, "%s dport %s ", rule->protocol, port);
+        free(port);
+    } else if (rule->protocol != NULL) {
+        pstr_append_sprintf(script, "ip protocol %s ", rule->protocol);
+    }
+    pstr_append_sprintf(script, "%s\n", verdict);
+}
+
+/** @internal
+ * Appends a chain holding all the rules of a rule set.
+ * @param script Script the chain is appended to
+ * @param chain Name of the chain
+ * @param ruleset Name of the ruleset
+ * @param nat Whether the chain is jumped to from a chain of type nat
+ */
+static void
+nftables_load_ruleset(pstr_t * script, const char *chain, const char *ruleset, int nat)
+{
+    t_firewall_rule *rule;
+
+    debug(LOG_DEBUG, "Load ruleset %s into chain %s", ruleset, chain);
+
+    pstr_append_sprintf(script, "\tchain %s {\n", chain);
+    for (rule = get_ruleset(ruleset); rule != NULL; rule = rule->next)
+        nftables_compile(script, nat, rule);
+    /* Hosts allowed at run time come after the configured rules */
+    if (strcmp(ruleset, FWRULESET_GLOBAL) == 0)
+        pstr_cat(script, "\t\tip daddr @" NFT_SET_HOSTS " accept\n");
+    if (strcmp(ruleset, FWRULESET_GLOBAL) == 0)
+        pstr_cat(script, "\t\tip daddr @" NFT_SET_DNS " accept\n");
+    if (strcmp(ruleset, FWRULESET_UNKNOWN_USERS) == 0)
+        pstr_cat(script, "\t\treject with icmp type port-unreachable\n");
+    pstr_cat(script, "\t}\n");
+}
+
+/** @internal
+ * Feeds a script to nft, which applies it as one transaction.
+ * @return Exit status of nft, 0 on success
+ */
+static int
+nftables_apply(const char *script)
+{
+    FILE *p;
+    int rc;
+
+    debug(LOG_DEBUG, "Executing nft -f -:\n%s", script);
+
+    if ((rc = fw_helper_run("nft -f -", script, strlen(script), 0)) != -1)
+        return rc;
+
+    /* pclose() needs the exit status, the SIGCHLD handler must not take it */
+    child_wait_begin();
+    if (NULL == (p = popen("nft -f -", "w"))) {
+        child_wait_end();
+        debug(LOG_ERR, "popen(): %s", strerror(errno));
+        return -1;
+    }
+    fputs(script, p);
+
+    rc = pclose(p);
+    child_wait_end();
+    if (-1 == rc) {
+        debug(LOG_ERR, "Could not get the exit status of nft (%s)", strerror(errno));
+        return 1;
+    }
+    return WIFEXITED(rc) ? WEXITSTATUS(rc) : 1;
+}
+
+void
+nftables_fw_clear_authservers(void)
+{
+    t_nl_nft_change flush;
+    int rc;
+
+    memset(&flush, 0, sizeof(flush));
+    flush.set = NFT_SET_AUTHSERVERS;
+    if ((rc = nl_nft_commit(nftables_table(), &flush, 1)) != 0)
+        debug(LOG_ERR, "Could not flush set " NFT_SET_AUTHSERVERS " (error %d)", rc);
+}
+
+void
+nftables_fw_set_authservers(void)
+{
+    const s_config *config;
+    t_auth_serv *auth_server;
+    t_nl_nft_change *changes;
+    uint32_t *addrs;
+    int count = 0, servers = 0, i, rc;
+
+    config = config_get_config();
+
+    for (auth_server = config->auth_servers; auth_server != NULL; auth_server = auth_server->next)
+        servers++;
+    if (0 == servers)
+        return;
+    changes = safe_malloc(servers * sizeof(t_nl_nft_change));
+    addrs = safe_malloc(servers * sizeof(uint32_t));
+
+    for (auth_server = config->auth_servers; auth_server != NULL; auth_server = auth_server->next) {
+        if (!auth_server->last_ip || strcmp(auth_server->last_ip, "0.0.0.0") == 0
+            || !parse_ip(auth_server->last_ip, &addrs[count]))
+            continue;
+        /* Several servers may share an address */
+        for (i = 0; i < count && addrs[i] != addrs[count]; i++) ;
+        if (i < count)
+            continue;
+        changes[count].add = 1;
+        changes[count].set = NFT_SET_AUTHSERVERS;
+        changes[count].key = &addrs[count];
+        changes[count].key_len = sizeof(uint32_t);
+        count++;
+    }
+
+    if (count > 0 && (rc = nl_nft_commit(nftables_table(), changes, count)) != 0)
+        debug(LOG_ERR, "Could not add the auth servers to set " NFT_SET_AUTHSERVERS " (error %d)", rc);
+
+    free(changes);
+    free(addrs);
+}
+
+/** Initialize the firewall rules. A table left by a previous gateway is
+ * flushed and filled again in one transaction, keeping the elements of the
+ * client sets for fw_init() to check against the client list; it is only
+ * deleted and loaded again if that fails, e.g. because a set changed type.
+ * @return 1 on success, 0 if the table could not be loaded
+ */
+int
+nftables_fw_init(void)
+{
+    const s_config *config;
+    char *ext_interface = NULL;
+    t_trusted_mac *p;
+    pstr_t *script;
+    char *sets, *chains, *elements, *commands;
+    const char *table = nftables_table();
+    int got_authdown_ruleset = NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN) ? 0 : 1;
+    int rc;
+
+    LOCK_CONFIG();
+    config = config_get_config();
+    if (config->external_interface) {
+        ext_interface = safe_strdup(config->external_interface);
+    } else {
+        ext_interface = get_ext_iface();
+    }
+
+    if (ext_interface == NULL) {
+        UNLOCK_CONFIG();
+        debug(LOG_ERR, "FATAL: no external interface");
+        return 0;
+    }
+
+    script = pstr_new();
+    pstr_cat(script, "\tmap " NFT_SET_CLIENTS_OUT " {\n\t\ttype ipv4_addr . ether_addr : mark\n\t}\n");
+    pstr_cat(script, "\tset " NFT_SET_CLIENTS_IN " {\n\t\ttype ipv4_addr\n\t}\n");
+    pstr_cat(script, "\tset " NFT_SET_AUTHSERVERS " {\n\t\ttype ipv4_addr\n\t}\n");
+    pstr_cat(script, "\tset " NFT_SET_HOSTS " {\n\t\ttype ipv4_addr\n\t}\n");
+    pstr_append_sprintf(script, "\tset " NFT_SET_DNS " {\n\t\ttype ipv4_addr\n\t\tflags timeout\n\t\ttimeout %ds\n\t}\n",
+                        FW_DNS_TIMEOUT);
+    pstr_cat(script, "\tset " NFT_SET_AUTH_IS_DOWN " {\n\t\ttype ifname\n\t}\n");
+    pstr_cat(script, "\tset " NFT_SET_TRUSTED " {\n\t\ttype ether_addr\n\t}\n");
+    sets = pstr_to_string(script);
+
+    script = pstr_new();
+
+    /*
+     *
+     * Marking, where the mangle table of the iptables backend does it
+     *
+     */
+
+    pstr_cat(script, "\tchain mangle_prerouting {\n\t\ttype filter hook prerouting priority -150; policy accept;\n");
+    if (got_authdown_ruleset)
+        pstr_append_sprintf(script, "\t\tiifname \"%s\" iifname @" NFT_SET_AUTH_IS_DOWN " meta mark set %u\n",
+                            config->gw_interface, FW_MARK_AUTH_IS_DOWN);
+    pstr_append_sprintf(script, "\t\tiifname \"%s\" ether saddr @" NFT_SET_TRUSTED " meta mark set %u\n",
+                        config->gw_interface, FW_MARK_KNOWN);
+    pstr_append_sprintf(script, "\t\tiifname \"%s\" meta mark set ip saddr . ether saddr map @" NFT_SET_CLIENTS_OUT "\n",
+                        config->gw_interface);
+    pstr_cat(script, "\t}\n");
+
+    pstr_cat(script, "\tchain mangle_postrouting {\n\t\ttype filter hook postrouting priority -150; policy accept;\n");
+    /* Answers of our resolver to the clients, read by thread_dns_snoop() */
+    if (config->dns_snooping)
+        pstr_append_sprintf(script, "\t\toifname \"%s\" ip saddr %s udp sport 53 log group %d\n", config->gw_interface,
+                            config->gw_address, config->dns_snooping_group);
+    pstr_append_sprintf(script, "\t\toifname \"%s\" ip daddr @" NFT_SET_CLIENTS_IN " accept\n", config->gw_interface);
+    pstr_cat(script, "\t}\n");
+
+    /*
+     *
+     * Redirection of unknown users, where the nat table of the iptables backend does it
+     *
+     */
+
+    pstr_cat(script, "\tchain nat_prerouting {\n\t\ttype nat hook prerouting priority -100; policy accept;\n");
+    pstr_append_sprintf(script, "\t\tiifname \"%s\" jump nat_outgoing\n", config->gw_interface);
+    pstr_cat(script, "\t}\n");
+
+    pstr_cat(script, "\tchain nat_outgoing {\n");
+    pstr_append_sprintf(script, "\t\tip daddr %s accept\n", config->gw_address);
+    if (config->proxy_port != 0) {
+        debug(LOG_DEBUG, "Proxy port set, setting proxy rule");
+        pstr_append_sprintf(script, "\t\tmeta mark { %u, %u } tcp dport 80 redirect to :%d\n", FW_MARK_KNOWN,
+                            FW_MARK_PROBATION, config->proxy_port);
+    }
+    pstr_append_sprintf(script, "\t\tmeta mark { %u, %u } accept\n", FW_MARK_KNOWN, FW_MARK_PROBATION);
+    pstr_cat(script, "\t\tip daddr @" NFT_SET_AUTHSERVERS " accept\n");
+    pstr_cat(script, "\t\tjump nat_global\n");
+    if (got_authdown_ruleset)
+        pstr_append_sprintf(script, "\t\tmeta mark %u accept\n", FW_MARK_AUTH_IS_DOWN);
+    pstr_append_sprintf(script, "\t\ttcp dport 80 redirect to :%d\n", config->gw_port);
+    pstr_cat(script, "\t}\n");
+    nftables_load_ruleset(script, "nat_global", FWRULESET_GLOBAL, 1);
+
+    /*
+     *
+     * Filtering, where the filter table of the iptables backend does it
+     *
+     */
+
+    pstr_cat(script, "\tchain forward {\n\t\ttype filter hook forward priority 0; policy accept;\n");
+    pstr_append_sprintf(script, "\t\tiifname \"%s\" jump to_internet\n", config->gw_interface);
+    pstr_cat(script, "\t}\n");
+
+    pstr_cat(script, "\tchain to_internet {\n");
+    pstr_cat(script, "\t\tct state invalid drop\n");
+    /* TCPMSS rule for PPPoE */
+    pstr_append_sprintf(script, "\t\toifname \"%s\" tcp flags & (syn | rst) == syn tcp option maxseg size set rt mtu\n",
+                        ext_interface);
+    pstr_cat(script, "\t\tip daddr @" NFT_SET_AUTHSERVERS " accept\n");
+    pstr_append_sprintf(script, "\t\tmeta mark %u jump locked_users\n", FW_MARK_LOCKED);
+    pstr_cat(script, "\t\tjump global\n");
+    pstr_append_sprintf(script, "\t\tmeta mark %u jump validating_users\n", FW_MARK_PROBATION);
+    pstr_append_sprintf(script, "\t\tmeta mark %u jump known_users\n", FW_MARK_KNOWN);
+    if (got_authdown_ruleset)
+        pstr_append_sprintf(script, "\t\tmeta mark %u jump auth_down_users\n", FW_MARK_AUTH_IS_DOWN);
+    pstr_cat(script, "\t\tjump unknown_users\n");
+    pstr_cat(script, "\t}\n");
+
+    nftables_load_ruleset(script, "locked_users", FWRULESET_LOCKED_USERS, 0);
+    nftables_load_ruleset(script, "global", FWRULESET_GLOBAL, 0);
+    nftables_load_ruleset(script, "validating_users", FWRULESET_VALIDATING_USERS, 0);
+    nftables_load_ruleset(script, "known_users", FWRULESET_KNOWN_USERS, 0);
+    if (got_authdown_ruleset)
+        nftables_load_ruleset(script, "auth_down_users", FWRULESET_AUTH_IS_DOWN, 0);
+    nftables_load_ruleset(script, "unknown_users", FWRULESET_UNKNOWN_USERS, 0);
+    chains = pstr_to_string(script);
+
+    script = pstr_new();
+    if (config->trustedmaclist) {
+        pstr_append_sprintf(script, "add element ip %s " NFT_SET_TRUSTED " { ", table);
+        for (p = config->trustedmaclist; p != NULL; p = p->next)
+            pstr_append_sprintf(script, "%s%s", p->mac, p->next ? ", " : "");
+        pstr_cat(script, " }\n");
+    }
+    elements = pstr_to_string(script);
+
+    /* Declaring the table and its sets first makes flushing them succeed on
+     * the first run. Flushing the table empties its chains but leaves the
+     * elements of its sets. */
+    script = pstr_new();
+    pstr_append_sprintf(script, "table ip %s {\n%s}\n", table, sets);
+    pstr_append_sprintf(script, "flush table ip %s\n", table);
+    pstr_append_sprintf(script, "flush set ip %s " NFT_SET_AUTHSERVERS "\n", table);
+    pstr_append_sprintf(script, "flush set ip %s " NFT_SET_HOSTS "\n", table);
+    pstr_append_sprintf(script, "flush set ip %s " NFT_SET_AUTH_IS_DOWN "\n", table);
+    pstr_append_sprintf(script, "flush set ip %s " NFT_SET_TRUSTED "\n", table);
+    if (!got_authdown_ruleset) {
+        /* Left over if the rule set was removed from the configuration */
+        pstr_append_sprintf(script, "add chain ip %s auth_down_users\n", table);
+        pstr_append_sprintf(script, "delete chain ip %s auth_down_users\n", table);
+    }
+    pstr_append_sprintf(script, "table ip %s {\n%s}\n%s", table, chains, elements);
+    commands = pstr_to_string(script);
+
+    if ((rc = nftables_apply(commands)) != 0) {
+        debug(LOG_WARNING, "nft failed(%d) to update table %s, loading it again", rc, table);
+        free(commands);
+        /* Creating the table first makes deleting it succeed on the first run */
+        safe_asprintf(&commands, "table ip %s\ndelete table ip %s\ntable ip %s {\n%s%s}\n%s", table, table, table, sets,
+                      chains, elements);
+        rc = nftables_apply(commands);
+    }
+    free(commands);
+    free(sets);
+    free(chains);
+    free(elements);
+    free(ext_interface);
+
+    if (rc != 0) {
+        UNLOCK_CONFIG();
+        debug(LOG_ERR, "nft failed(%d) to load table %s", rc, table);
+        return 0;
+    }
+
+    nftables_fw_set_authservers();
+
+    UNLOCK_CONFIG();
+
+    debug(LOG_INFO, "Firewall table %s loaded", nftables_table());
+    return 1;
+}
+
+/** Remove the firewall table
+ * This is used when we do a clean shutdown of WiFiDog.
+ */
+int
+nftables_fw_destroy(void)
+{
+    int rc;
+
+    debug(LOG_DEBUG, "Deleting table %s", nftables_table());
+    if ((rc = nl_nft_delete_table(nftables_table())) != 0 && rc != -ENOENT)
+        debug(LOG_ERR, "Could not delete table %s (error %d)", nftables_table(), rc);
+
+    return 1;
+}
+
+/** Set if a specific client has access through the firewall.
+ * Granting a client that already has another mark changes its mark in the
+ * same transaction, and clearing a mark the client no longer has does
+ * nothing, since fw_allow() grants the new mark before clearing the old one.
+ */
+int
+nftables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag)
+{
+    t_nl_nft_change changes[3];
+    unsigned char key[NFT_CLIENT_KEY_LEN];
+    uint32_t addr, mark = tag, current;
+    t_mac hwaddr;
+    int rc;
+
+    if (!parse_ip(ip, &addr) || !parse_mac(mac, &hwaddr)) {
+        debug(LOG_ERR, "Invalid client address %s %s", ip, mac);
+        return -1;
+    }
+    nftables_client_key(key, addr, &hwaddr);
+
+    memset(changes, 0, sizeof(changes));
+    switch (type) {
+    case FW_ACCESS_ALLOW:
+        changes[0].add = 1;
+        changes[0].set = NFT_SET_CLIENTS_OUT;
+        changes[0].key = key;
+        changes[0].key_len = sizeof(key);
+        changes[0].data = &mark;
+        changes[0].counter = 1;
+        changes[1].add = 1;
+        changes[1].set = NFT_SET_CLIENTS_IN;
+        changes[1].key = &addr;
+        changes[1].key_len = sizeof(addr);
+        changes[1].counter = 1;
+        rc = nl_nft_commit(nftables_table(), changes, 2);
+        if (-EEXIST == rc || -EBUSY == rc) {
+            /* Known with another mark: replace it */
+            memmove(&changes[1], &changes[0], 2 * sizeof(changes[0]));
+            changes[0].add = 0;
+            rc = nl_nft_commit(nftables_table(), changes, 3);
+        }
+        break;
+    case FW_ACCESS_DENY:
+        rc = nl_nft_get(nftables_table(), NFT_SET_CLIENTS_OUT, key, sizeof(key), &current);
+        if (-ENOENT == rc || (0 == rc && current != mark))
+            return 0;
+        if (0 == rc) {
+            changes[0].set = NFT_SET_CLIENTS_OUT;
+            changes[0].key = key;
+            changes[0].key_len = sizeof(key);
+            changes[1].set = NFT_SET_CLIENTS_IN;
+            changes[1].key = &addr;
+            changes[1].key_len = sizeof(addr);
+            rc = nl_nft_commit(nftables_table(), changes, 2);
+        }
+        break;
+    default:
+        return -1;
+    }
+
+    if (rc != 0)
+        debug(LOG_ERR, "Could not update the sets of %s %s (error %d)", ip, mac, rc);
+    return rc;
+}
+
+/** Applies changes of client marks in one transaction. A client changing
+ * mark has its element of clients_out replaced, and keeps the one of
+ * clients_in. If the transaction fails, because the firewall did not hold
+ * what the queue expected, the changes are applied one at a time by
+ * nftables_fw_access(), which copes with that.
+ * @param ops Changes, at most one per client
+ * @param count Number of changes
+ * @return 0, or the return code of the first change that failed
+ */
+int
+nftables_fw_access_batch(const t_fw_op * ops, int count)
+{
+    t_nl_nft_change *changes, *change;
+    unsigned char (*keys)[NFT_CLIENT_KEY_LEN];
+    uint32_t *marks;
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
+    int i, n = 0, r, rc;
+
+    changes = safe_malloc(3 * count * sizeof(t_nl_nft_change));
+    keys = safe_malloc(count * sizeof(*keys));
+    marks = safe_malloc(count * sizeof(uint32_t));
+
+    for (i = 0; i < count; i++) {
+        nftables_client_key(keys[i], ops[i].ip, &ops[i].mac);
+        marks[i] = ops[i].to;
+        if (FW_MARK_NONE != ops[i].from) {
+            change = &changes[n++];
+            change->set = NFT_SET_CLIENTS_OUT;
+            change->key = keys[i];
+            change->key_len = NFT_CLIENT_KEY_LEN;
+        }
+        if (FW_MARK_NONE != ops[i].to) {
+            change = &changes[n++];
+            change->add = 1;
+            change->set = NFT_SET_CLIENTS_OUT;
+            change->key = keys[i];
+            change->key_len = NFT_CLIENT_KEY_LEN;
+            change->data = &marks[i];
+            change->counter = 1;
+        }
+        if (FW_MARK_NONE == ops[i].from || FW_MARK_NONE == ops[i].to) {
+            change = &changes[n++];
+            change->add = FW_MARK_NONE == ops[i].from;
+            change->set = NFT_SET_CLIENTS_IN;
+            change->key = &ops[i].ip;
+            change->key_len = sizeof(ops[i].ip);
+            change->counter = change->add;
+        }
+    }
+
+    rc = nl_nft_commit(nftables_table(), changes, n);
+    if (rc != 0) {
+        debug(LOG_WARNING, "Could not apply %d client changes at once (error %d), applying them one at a time", count,
+              rc);
+        rc = 0;
+        for (i = 0; i < count; i++) {
+            format_ip(ops[i].ip, ip);
+            format_mac(&ops[i].mac, mac);
+            r = 0;
+            if (FW_MARK_NONE != ops[i].to)
+                r = nftables_fw_access(FW_ACCESS_ALLOW, ip, mac, ops[i].to);
+            if (0 == r && FW_MARK_NONE != ops[i].from)
+                r = nftables_fw_access(FW_ACCESS_DENY, ip, mac, ops[i].from);
+            if (0 == rc)
+                rc = r;
+        }
+    }
+
+    free(changes);
+    free(keys);
+    free(marks);
+
+    return rc;
+}
+
+/** Adds addresses of allowed hosts to the hosts set, or deletes them from
+ * it, in one transaction.
+ */
+int
+nftables_fw_access_hosts(fw_access_t type, const uint32_t * addrs, int count)
+{
+    t_nl_nft_change *changes;
+    int i, rc;
+
+    if (FW_ACCESS_ALLOW != type && FW_ACCESS_DENY != type)
+        return -1;
+
+    changes = safe_malloc(count * sizeof(t_nl_nft_change));
+    for (i = 0; i < count; i++) {
+        changes[i].add = FW_ACCESS_ALLOW == type;
+        changes[i].set = NFT_SET_HOSTS;
+        changes[i].key = &addrs[i];
+        changes[i].key_len = sizeof(uint32_t);
+    }
+    if ((rc = nl_nft_commit(nftables_table(), changes, count)) != 0)
+        debug(LOG_ERR, "Could not update set " NFT_SET_HOSTS " (error %d)", rc);
+    free(changes);
+    return rc;
+}
+
+/** Allows addresses found in DNS answers until their time to live runs
+ * out, as elements of the DNS set, in one transaction.
+ */
+int
+nftables_fw_access_dns(const uint32_t * addrs, int count, unsigned int ttl)
+{
+    t_nl_nft_change *changes;
+    int i, rc;
+
+    changes = safe_malloc(count * sizeof(t_nl_nft_change));
+    for (i = 0; i < count; i++) {
+        changes[i].add = 1;
+        changes[i].set = NFT_SET_DNS;
+        changes[i].key = &addrs[i];
+        changes[i].key_len = sizeof(uint32_t);
+        changes[i].timeout = ttl;
+    }
+    if ((rc = nl_nft_commit(nftables_table(), changes, count)) != 0)
+        debug(LOG_ERR, "Could not update set " NFT_SET_DNS " (error %d)", rc);
+    free(changes);
+    return rc;
+}
+
+/** Adds a MAC address to the trusted set, or deletes it from it */
+int
+nftables_fw_access_trusted(fw_access_t type, const char *mac)
+{
+    t_nl_nft_change change;
+    t_mac hwaddr;
+    int rc;
+
+    if (FW_ACCESS_ALLOW != type && FW_ACCESS_DENY != type)
+        return -1;
+    if (!parse_mac(mac, &hwaddr)) {
+        debug(LOG_ERR, "Invalid MAC address %s", mac);
+        return -1;
+    }
+
+    memset(&change, 0, sizeof(change));
+    change.add = FW_ACCESS_ALLOW == type;
+    change.set = NFT_SET_TRUSTED;
+    change.key = hwaddr.addr;
+    change.key_len = sizeof(hwaddr.addr);
+    if ((rc = nl_nft_commit(nftables_table(), &change, 1)) != 0)
+        debug(LOG_ERR, "Could not update set " NFT_SET_TRUSTED " for %s (error %d)", mac, rc);
+    return rc;
+}
+
+/** Set a mark when auth server is not reachable */
+int
+nftables_fw_auth_unreachable(int tag)
+{
+    t_nl_nft_change change;
+    char ifname[IFNAMSIZ];
+
+    if (NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN))
+        return 1;
+
+    /* The mark is set by the rule matching this set */
+    (void)tag;
+    memset(ifname, 0, sizeof(ifname));
+    strncpy(ifname, config_get_config()->gw_interface, sizeof(ifname) - 1);
+    memset(&change, 0, sizeof(change));
+    change.add = 1;
+    change.set = NFT_SET_AUTH_IS_DOWN;
+    change.key = ifname;
+    change.key_len = sizeof(ifname);
+    return nl_nft_commit(nftables_table(), &change, 1);
+}
+
+/** Remove mark when auth server is reachable again */
+int
+nftables_fw_auth_reachable(void)
+{
+    t_nl_nft_change flush;
+
+    if (NULL == get_ruleset(FWRULESET_AUTH_IS_DOWN))
+        return 1;
+
+    memset(&flush, 0, sizeof(flush));
+    flush.set = NFT_SET_AUTH_IS_DOWN;
+    return nl_nft_commit(nftables_table(), &flush, 1);
+}
+
+/** @internal
+ * Adds the elements of clients_out or clients_in, with their counters, to
+ * a sweep; and the MAC address and mark of those of clients_out.
+ * @param sweep Sweep
+ * @param set NFT_SET_CLIENTS_OUT or NFT_SET_CLIENTS_IN
+ * @param direction FW_COUNTER_OUTGOING or FW_COUNTER_INCOMING
+ * @param elems Set to the elements, to be freed once the sweep is done
+ * @return 0 on success, -1 if the set could not be read
+ */
+static int
+nftables_counters_set(t_fw_counters * sweep, const char *set, int direction, t_nl_nft_elem ** elems)
+{
+    uint32_t addr;
+    t_mac mac;
+    int count, i;
+
+    if ((count = nl_nft_list(nftables_table(), set, elems)) < 0) {
+        debug(LOG_ERR, "Could not list set %s (error %d)", set, count);
+        return -1;
+    }
+    for (i = 0; i < count; i++) {
+        memcpy(&addr, (*elems)[i].key, sizeof(addr));
+        fw_counters_add(sweep, addr, direction, (*elems)[i].bytes, &(*elems)[i]);
+        if (FW_COUNTER_OUTGOING == direction && NFT_CLIENT_KEY_LEN == (*elems)[i].key_len) {
+            memcpy(mac.addr, (*elems)[i].key + sizeof(addr), sizeof(mac.addr));
+            fw_counters_mark(sweep, addr, &mac, (int)(*elems)[i].data);
+        }
+    }
+    return 0;
+}
+
+/** @internal
+ * Queues the deletion of the element of an orphan client from one set
+ */
+static void
+nftables_counters_orphan(t_nl_nft_change * orphans, int *count, const char *set, const t_nl_nft_elem * elem)
+{
+    char ip[IP_STR_LEN];
+    uint32_t addr;
+
+    memcpy(&addr, elem->key, sizeof(addr));
+    format_ip(addr, ip);
+    debug(LOG_ERR, "Preventively deleting %s from set %s", ip, set);
+    orphans[*count].set = set;
+    orphans[*count].key = elem->key;
+    orphans[*count].key_len = elem->key_len;
+    (*count)++;
+}
+
+/** Update the counters of all the clients in the client list, from one
+ * dump of each client set, and delete the elements of clients that are not
+ * on the list any more in one transaction.
+ */
+int
+nftables_fw_counters_update(void)
+{
+    t_fw_counters sweep;
+    t_nl_nft_elem *out = NULL, *in = NULL;
+    t_nl_nft_change *orphans;
+    t_fw_counter *counter;
+    char ip[IP_STR_LEN];
+    int i, count = 0, rc = 1;
+
+    memset(&sweep, 0, sizeof(sweep));
+    if (nftables_counters_set(&sweep, NFT_SET_CLIENTS_OUT, FW_COUNTER_OUTGOING, &out) == -1
+        || nftables_counters_set(&sweep, NFT_SET_CLIENTS_IN, FW_COUNTER_INCOMING, &in) == -1) {
+        rc = -1;
+    } else if (fw_counters_record(&sweep) > 0) {
+        orphans = safe_malloc(2 * sweep.count * sizeof(t_nl_nft_change));
+        for (i = 0; i < sweep.count; i++) {
+            counter = &sweep.counters[i];
+            if (!counter->orphan)
+                continue;
+            format_ip(counter->ip, ip);
+            debug(LOG_ERR,
+                  "nftables_fw_counters_update(): Could not find %s in client list, this should not happen unless if the gateway crashed",
+                  ip);
+            if (counter->outgoing_entry)
+                nftables_counters_orphan(orphans, &count, NFT_SET_CLIENTS_OUT, counter->outgoing_entry);
+            if (counter->incoming_entry)
+                nftables_counters_orphan(orphans, &count, NFT_SET_CLIENTS_IN, counter->incoming_entry);
+        }
+        if ((i = nl_nft_commit(nftables_table(), orphans, count)) != 0)
+            debug(LOG_ERR, "Could not delete orphans from the client sets (error %d)", i);
+        free(orphans);
+    }
+
+    fw_counters_free(&sweep);
+    free(out);
+    free(in);
+    return rc;
+}
+
+/** Reads the elements of the clients the firewall has into a sweep, with
+ * the MAC address and mark of each, for fw_init() to check them against the
+ * client list. The entries of the counters are not kept.
+ * @param sweep Sweep to fill
+ * @return 1 on success, -1 if the sets could not be read
+ */
+int
+nftables_fw_clients_read(t_fw_counters * sweep)
+{
+    t_nl_nft_elem *out = NULL, *in = NULL;
+    int i, rc = 1;
+
+    if (nftables_counters_set(sweep, NFT_SET_CLIENTS_OUT, FW_COUNTER_OUTGOING, &out) == -1
+        || nftables_counters_set(sweep, NFT_SET_CLIENTS_IN, FW_COUNTER_INCOMING, &in) == -1)
+        rc = -1;
+    for (i = 0; i < sweep->count; i++)
+        sweep->counters[i].outgoing_entry = sweep->counters[i].incoming_entry = NULL;
+    free(out);
+    free(in);
+
+    return rc;
+}
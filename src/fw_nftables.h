@@ -0,0 +1,84 @@
+/* vim: set et ts=4 sts=4 sw=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_nftables.h
+    @brief Firewall nftables functions
+*/
+
+#ifndef _FW_NFTABLES_H_
+#define _FW_NFTABLES_H_
+
+#include "firewall.h"
+
+/** Table holding everything the nftables backend installs, followed by the gateway interface */
+#define NFT_TABLE_PREFIX "wifidog_"
+
+/*@{*/
+/** Sets and maps of the nftables table */
+#define NFT_SET_CLIENTS_OUT "clients_out"   /* ipv4_addr . ether_addr : mark, with counters */
+#define NFT_SET_CLIENTS_IN "clients_in"     /* ipv4_addr, with counters */
+#define NFT_SET_TRUSTED "trusted"           /* ether_addr */
+#define NFT_SET_AUTHSERVERS "authservers"   /* ipv4_addr */
+#define NFT_SET_HOSTS "hosts"               /* ipv4_addr */
+#define NFT_SET_DNS "dns_hosts"             /* ipv4_addr, with timeouts, addresses found in DNS answers */
+#define NFT_SET_AUTH_IS_DOWN "auth_is_down" /* ifname, holds the gateway interface while the auth servers are down */
+/*@}*/
+
+/** @brief Initialize the firewall */
+int nftables_fw_init(void);
+
+/** @brief Initializes the authservers set */
+void nftables_fw_set_authservers(void);
+
+/** @brief Clears the authservers set */
+void nftables_fw_clear_authservers(void);
+
+/** @brief Destroy the firewall */
+int nftables_fw_destroy(void);
+
+/** @brief Define the access of a specific client */
+int nftables_fw_access(fw_access_t type, const char *ip, const char *mac, int tag);
+
+/** @brief Apply a batch of client mark changes */
+int nftables_fw_access_batch(const t_fw_op * ops, int count);
+
+/** @brief Define the access of addresses of allowed hosts */
+int nftables_fw_access_hosts(fw_access_t type, const uint32_t * addrs, int count);
+
+/** @brief Allow addresses found in DNS answers for a while */
+int nftables_fw_access_dns(const uint32_t * addrs, int count, unsigned int ttl);
+
+/** @brief Define whether a MAC address is trusted */
+int nftables_fw_access_trusted(fw_access_t type, const char *mac);
+
+/** @brief Set a mark when auth server is not reachable */
+int nftables_fw_auth_unreachable(int tag);
+
+/** @brief Remove mark when auth server is reachable again */
+int nftables_fw_auth_reachable(void);
+
+/** @brief All counters in the client list */
+int nftables_fw_counters_update(void);
+
+/** @brief Read the client entries the firewall has */
+int nftables_fw_clients_read(t_fw_counters * sweep);
+
+#endif                          /* _FW_NFTABLES_H_ */
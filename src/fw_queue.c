@@ -0,0 +1,289 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_queue.c
+    @brief Queue of client firewall changes, applied in batches
+
+    fw_allow() and fw_deny() do not change the firewall themselves: they
+    queue the change of mark of the client. Changes of the same client are
+    merged as they come, so that a client allowed then denied before the
+    queue is flushed costs nothing, and one whose mark changes twice gets
+    the last mark directly.
+
+    The queue is flushed by thread_fw_queue() once its oldest change is
+    FirewallQueueDelay milliseconds old, or right away by fw_queue_flush()
+    when a caller needs the change applied before going on, like a login
+    about to redirect the client. A flush hands all the changes to
+    fw_apply(), which applies them in one batch: one iptables-restore, or
+    one nftables transaction.
+*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "fw_queue.h"
+
+static int *fw_queue_slot(uint32_t, const t_mac *);
+static unsigned long fw_queue_elapsed_us(const struct timeval *, const struct timeval *);
+
+/** @internal
+ * Queued changes, at most one per client, indexed by IP and MAC address in
+ * an open addressing table of slots holding their position + 1. All of it
+ * and the statistics are protected by queue_mutex.
+ */
+static t_fw_op *queue_ops = NULL;
+static int queue_count = 0;
+static int queue_size = 0;
+static int *queue_slots = NULL;
+static int queue_slot_count = 0;
+static struct timeval queue_oldest;
+static t_fw_queue_stats queue_stats;
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Signalled when a change is queued
+ */
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+
+/** @internal
+ * Held while a batch is applied, so that batches are applied in the order
+ * they were taken from the queue.
+ */
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Slot of the index holding a client, or the free slot where it goes.
+ * queue_mutex must be held.
+ */
+static int *
+fw_queue_slot(uint32_t ip, const t_mac * mac)
+{
+    unsigned int mask = queue_slot_count - 1;
+    uint32_t h = ip ^ ((uint32_t)mac->addr[2] << 24 | mac->addr[3] << 16 | mac->addr[4] << 8 | mac->addr[5]);
+    unsigned int i;
+    const t_fw_op *op;
+
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    for (i = h & mask; 0 != queue_slots[i]; i = (i + 1) & mask) {
+        op = &queue_ops[queue_slots[i] - 1];
+        if (op->ip == ip && memcmp(op->mac.addr, mac->addr, sizeof(mac->addr)) == 0)
+            break;
+    }
+    return &queue_slots[i];
+}
+
+/** @internal
+ * Microseconds from one time to another
+ */
+static unsigned long
+fw_queue_elapsed_us(const struct timeval *from, const struct timeval *to)
+{
+    return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_usec - from->tv_usec);
+}
+
+/** Queues a change of the firewall mark of a client. It is merged with the
+ * change already queued for the same client, if any, and applied by the
+ * next flush. With a FirewallQueueDelay of 0, thread_fw_queue() applies it
+ * as soon as it is woken up.
+ *
+ * Only queue_mutex is taken, so that callers can queue the change while
+ * still holding the shard lock under which they changed the client: the
+ * changes of a client are then queued in the order its state changed. The
+ * firewall is never changed from here.
+ * @param ip IP address of the client, network byte order
+ * @param mac MAC address of the client
+ * @param from Mark the client has in the firewall, FW_MARK_NONE if it has none
+ * @param to Mark it must have, FW_MARK_NONE to deny it
+ */
+void
+fw_queue_push(uint32_t ip, const t_mac * mac, int from, int to)
+{
+    t_fw_op *op;
+    int *slot, i, was_pending, pending;
+
+    pthread_mutex_lock(&queue_mutex);
+
+    /* Keep the index at most half full */
+    if (2 * (queue_count + 1) > queue_slot_count) {
+        free(queue_slots);
+        queue_slot_count = queue_slot_count ? queue_slot_count * 2 : 64;
+        queue_slots = safe_malloc(queue_slot_count * sizeof(int));
+        for (i = 0; i < queue_count; i++)
+            *fw_queue_slot(queue_ops[i].ip, &queue_ops[i].mac) = i + 1;
+    }
+
+    slot = fw_queue_slot(ip, mac);
+    if (0 == *slot) {
+        if (queue_count == queue_size) {
+            queue_size = queue_size ? queue_size * 2 : 32;
+            queue_ops = safe_realloc(queue_ops, queue_size * sizeof(t_fw_op));
+        }
+        if (0 == queue_count)
+            gettimeofday(&queue_oldest, NULL);
+        op = &queue_ops[queue_count++];
+        op->ip = ip;
+        memcpy(&op->mac, mac, sizeof(op->mac));
+        op->from = from;
+        *slot = queue_count;
+        was_pending = 0;
+    } else {
+        /* The firewall still has the mark the queued change started from */
+        op = &queue_ops[*slot - 1];
+        was_pending = op->from != op->to;
+    }
+    op->to = to;
+    pending = op->from != op->to;
+
+    /* Every change queued is either pending, applied or cancelled */
+    queue_stats.queued++;
+    queue_stats.cancelled += 1 + was_pending - pending;
+    queue_stats.depth += pending - was_pending;
+
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/** Applies the queued changes in one batch and waits until they are.
+ * @return Return code of fw_apply(), 0 if there was nothing to apply
+ */
+int
+fw_queue_flush(void)
+{
+    t_fw_op *ops;
+    struct timeval oldest, start, end;
+    unsigned long us;
+    int count, i, n, rc = 0;
+
+    pthread_mutex_lock(&flush_mutex);
+
+    pthread_mutex_lock(&queue_mutex);
+    ops = queue_ops;
+    count = queue_count;
+    oldest = queue_oldest;
+    queue_ops = NULL;
+    queue_count = queue_size = 0;
+    free(queue_slots);
+    queue_slots = NULL;
+    queue_slot_count = 0;
+    queue_stats.depth = 0;
+    pthread_mutex_unlock(&queue_mutex);
+
+    /* Drop the changes that cancelled out */
+    for (i = 0, n = 0; i < count; i++)
+        if (ops[i].from != ops[i].to)
+            ops[n++] = ops[i];
+
+    if (n > 0) {
+        gettimeofday(&start, NULL);
+        rc = fw_apply(ops, n);
+        gettimeofday(&end, NULL);
+        us = fw_queue_elapsed_us(&start, &end);
+        debug(LOG_DEBUG, "Applied %d firewall changes in %lu us", n, us);
+
+        pthread_mutex_lock(&queue_mutex);
+        queue_stats.applied += n;
+        queue_stats.flushes++;
+        queue_stats.last_flush_us = us;
+        queue_stats.total_flush_us += us;
+        if (us > queue_stats.max_flush_us)
+            queue_stats.max_flush_us = us;
+        us = fw_queue_elapsed_us(&oldest, &end);
+        if (us > queue_stats.max_wait_us)
+            queue_stats.max_wait_us = us;
+        pthread_mutex_unlock(&queue_mutex);
+    }
+    free(ops);
+
+    pthread_mutex_unlock(&flush_mutex);
+
+    return rc;
+}
+
+/** Drops the queued changes, when the firewall is being torn down anyway */
+void
+fw_queue_discard(void)
+{
+    pthread_mutex_lock(&queue_mutex);
+    queue_stats.cancelled += queue_stats.depth;
+    queue_stats.depth = 0;
+    free(queue_ops);
+    free(queue_slots);
+    queue_ops = NULL;
+    queue_slots = NULL;
+    queue_count = queue_size = queue_slot_count = 0;
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/** Copies the statistics of the queue
+ * @param stats Receives them
+ */
+void
+fw_queue_get_stats(t_fw_queue_stats * stats)
+{
+    pthread_mutex_lock(&queue_mutex);
+    memcpy(stats, &queue_stats, sizeof(*stats));
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+/** Flushes the queue each time its oldest change is FirewallQueueDelay
+ * milliseconds old.
+ * @param arg Unused
+ */
+void
+thread_fw_queue(const void *arg)
+{
+    struct timeval now;
+    struct timespec due;
+    long delay_us;
+
+    pthread_mutex_lock(&queue_mutex);
+    while (1) {
+        if (0 == queue_count) {
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+            continue;
+        }
+
+        delay_us = config_get_config()->fw_queue_delay * 1000L;
+        gettimeofday(&now, NULL);
+        if ((long)fw_queue_elapsed_us(&queue_oldest, &now) < delay_us) {
+            due.tv_sec = queue_oldest.tv_sec + (queue_oldest.tv_usec + delay_us) / 1000000;
+            due.tv_nsec = ((queue_oldest.tv_usec + delay_us) % 1000000) * 1000;
+            pthread_cond_timedwait(&queue_cond, &queue_mutex, &due);
+            continue;
+        }
+
+        pthread_mutex_unlock(&queue_mutex);
+        fw_queue_flush();
+        pthread_mutex_lock(&queue_mutex);
+    }
+}
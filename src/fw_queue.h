@@ -0,0 +1,59 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_queue.h
+    @brief Queue of client firewall changes, applied in batches
+*/
+
+#ifndef _FW_QUEUE_H_
+#define _FW_QUEUE_H_
+
+#include "firewall.h"
+
+/** Statistics of the queue, see fw_queue_get_stats() */
+typedef struct _t_fw_queue_stats {
+    unsigned int depth;         /**< @brief Changes waiting to be applied */
+    unsigned long queued;       /**< @brief Changes queued since startup */
+    unsigned long cancelled;    /**< @brief Changes undone by a later one before being applied */
+    unsigned long applied;      /**< @brief Changes applied */
+    unsigned long flushes;      /**< @brief Batches applied */
+    unsigned long last_flush_us;        /**< @brief Time taken to apply the last batch */
+    unsigned long max_flush_us; /**< @brief Longest time taken to apply a batch */
+    unsigned long long total_flush_us;  /**< @brief Time taken to apply all the batches */
+    unsigned long max_wait_us;  /**< @brief Longest time a change waited before its batch was applied */
+} t_fw_queue_stats;
+
+/** @brief Queue a change of the firewall mark of a client */
+void fw_queue_push(uint32_t, const t_mac *, int, int);
+
+/** @brief Apply the queued changes now */
+int fw_queue_flush(void);
+
+/** @brief Drop the queued changes */
+void fw_queue_discard(void);
+
+/** @brief Get the statistics of the queue */
+void fw_queue_get_stats(t_fw_queue_stats *);
+
+/** @brief Apply the queued changes once they are FirewallQueueDelay old */
+void thread_fw_queue(const void *arg);
+
+#endif                          /* _FW_QUEUE_H_ */
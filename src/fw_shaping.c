@@ -0,0 +1,566 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_shaping.c
+    @brief Traffic shaping of the clients with tc
+
+    With DownloadBandwidth and UploadBandwidth, the traffic of the clients
+    is shaped to a little less than the internet link, so that packets
+    queue here, where fq_codel keeps the queues short and shares them
+    between flows, rather than in the modem. Three HTB hierarchies are set
+    up, with fq_codel under each leaf class:
+
+    - Egress of the gateway interface, for downloads: a class for each
+      client with a download rate, matched by destination address, and one
+      for everything else.
+    - An ifb device the ingress of the gateway interface is redirected to,
+      for uploads: likewise, matched by source address. Upload rates are
+      enforced there, as the address of the client is gone once the packet
+      leaves through the external interface.
+    - Egress of the external interface, for uploads again: a class for each
+      firewall mark the clients get, so that known users keep half the link
+      when validating users, the auth-down ruleset and the gateway compete
+      with them.
+
+    A client has classes of its own when it has rates: ClientDownloadRate
+    and ClientUploadRate, unless the auth server gives others. Classes
+    follow the firewall: fw_apply() hands each batch of mark changes to
+    fw_shaping_apply(), which adds or removes classes with one batch of tc
+    commands, and fw_init() and fw_destroy() set up and remove everything
+    with one batch.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/wait.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "util.h"
+#include "pstring.h"
+#include "client_list.h"
+#include "fw_helper.h"
+#include "fw_shaping.h"
+
+/** Queueing discipline under each leaf class, fq_codel unless the build
+ * says otherwise for kernels without it */
+#ifndef SHAPING_LEAF_QDISC
+#define SHAPING_LEAF_QDISC "fq_codel"
+#endif
+
+/** Class numbers of the clients; u32 filter items go up to 0xfff */
+#define SHAPING_MINOR_FIRST 0x10
+#define SHAPING_MINOR_LAST 0xfff
+
+/** ifb device of the uploads, followed by the gateway interface */
+#define SHAPING_IFB_PREFIX "ifb-"
+
+/** @internal
+ * A client allowed through the firewall, or about to be
+ */
+typedef struct _t_fw_shaped {
+    uint32_t ip;                /**< @brief IP address, network byte order */
+    unsigned int download;      /**< @brief Download rate from the auth server, 0 for ClientDownloadRate */
+    unsigned int upload;        /**< @brief Upload rate from the auth server, 0 for ClientUploadRate */
+    int active;                 /**< @brief Whether it has a mark in the firewall */
+    unsigned int minor;         /**< @brief Number of its classes and filters, 0 if it has none */
+    unsigned int class_download;        /**< @brief Rate of its download class, 0 if it has none */
+    unsigned int class_upload;  /**< @brief Rate of its upload class, 0 if it has none */
+} t_fw_shaped;
+
+static int fw_shaping_run(const char *, const char *, int);
+static void fw_shaping_commit(pstr_t *);
+static t_fw_shaped *fw_shaping_find(uint32_t, int);
+static void fw_shaping_forget(t_fw_shaped *);
+static unsigned int fw_shaping_rate(unsigned int, int, int);
+static void fw_shaping_client(pstr_t *, t_fw_shaped *);
+static void fw_shaping_htb(pstr_t *, const char *, int);
+static void fw_shaping_teardown(int);
+
+/** @internal
+ * Clients, the class numbers in use, and what fw_shaping_init() set up,
+ * all protected by shaping_mutex. The link rates are 0 for a direction
+ * that is not shaped.
+ */
+static t_fw_shaped *shaped = NULL;
+static int shaped_count = 0;
+static int shaped_size = 0;
+static unsigned char minors_used[SHAPING_MINOR_LAST / 8 + 1];
+static int link_download = 0;
+static int link_upload = 0;
+static char *shaping_ifb = NULL;
+static char *shaping_ext = NULL;
+static t_fw_shaping_stats shaping_stats;
+
+static pthread_mutex_t shaping_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/** @internal
+ * Feeds a script to tc or ip, in batch mode. shaping_mutex must be held.
+ * @param cmd Command reading the script on its standard input
+ * @param script Commands, one per line
+ * @param quiet Whether commands are expected to fail, like deleting what
+ *              may not be there
+ * @return Exit status of the command, 0 if every command succeeded
+ */
+static int
+fw_shaping_run(const char *cmd, const char *script, int quiet)
+{
+    char *shell;
+    FILE *p;
+    int rc;
+
+    debug(LOG_DEBUG, "Executing %s:\n%s", cmd, script);
+
+    if ((rc = fw_helper_run(cmd, script, strlen(script), quiet)) == -1) {
+        safe_asprintf(&shell, "%s%s", cmd, quiet ? " 2>/dev/null" : "");
+        /* pclose() needs the exit status, the SIGCHLD handler must not take it */
+        child_wait_begin();
+        p = popen(shell, "w");
+        free(shell);
+        if (NULL == p) {
+            child_wait_end();
+            debug(LOG_ERR, "popen(): %s", strerror(errno));
+            return -1;
+        }
+        fputs(script, p);
+        rc = pclose(p);
+        child_wait_end();
+        rc = -1 == rc ? 1 : WIFEXITED(rc) ? WEXITSTATUS(rc) : 1;
+    }
+
+    shaping_stats.runs++;
+    if (rc != 0 && !quiet) {
+        shaping_stats.failures++;
+        debug(LOG_ERR, "Some of the traffic shaping commands failed (%s exited with %d)", cmd, rc);
+    }
+    return rc;
+}
+
+/** @internal
+ * Runs the tc commands of a script, if there are any, and frees it.
+ * shaping_mutex must be held.
+ */
+static void
+fw_shaping_commit(pstr_t * script)
+{
+    char *commands = pstr_to_string(script);
+
+    if ('\0' != commands[0])
+        fw_shaping_run("tc -force -batch -", commands, 0);
+    free(commands);
+}
+
+/** @internal
+ * Client with an IP address. shaping_mutex must be held.
+ * @param ip IP address, network byte order
+ * @param create Whether to add the client if it is not there
+ * @return The client, NULL if it is not there and create is 0
+ */
+static t_fw_shaped *
+fw_shaping_find(uint32_t ip, int create)
+{
+    t_fw_shaped *c;
+    int i;
+
+    for (i = 0; i < shaped_count; i++)
+        if (shaped[i].ip == ip)
+            return &shaped[i];
+    if (!create)
+        return NULL;
+
+    if (shaped_count == shaped_size) {
+        shaped_size = shaped_size ? shaped_size * 2 : 32;
+        shaped = safe_realloc(shaped, shaped_size * sizeof(t_fw_shaped));
+    }
+    c = &shaped[shaped_count++];
+    memset(c, 0, sizeof(*c));
+    c->ip = ip;
+    return c;
+}
+
+/** @internal
+ * Removes a client whose classes are gone. shaping_mutex must be held.
+ */
+static void
+fw_shaping_forget(t_fw_shaped * c)
+{
+    *c = shaped[--shaped_count];
+}
+
+/** @internal
+ * Rate a client is shaped to in one direction
+ * @param rate Rate from the auth server, 0 if it gave none
+ * @param fallback Rate of the configuration
+ * @param link Rate of the link, 0 if the direction is not shaped
+ * @return Rate in kbit/s, 0 for no class of its own
+ */
+static unsigned int
+fw_shaping_rate(unsigned int rate, int fallback, int link)
+{
+    if (0 == link)
+        return 0;
+    if (0 == rate)
+        rate = fallback;
+    return rate > (unsigned int)link ? (unsigned int)link : rate;
+}
+
+/** @internal
+ * Appends the tc commands bringing the classes of a client in line with
+ * its rates, or removing them once it is no longer active. shaping_mutex
+ * must be held.
+ */
+static void
+fw_shaping_client(pstr_t * script, t_fw_shaped * c)
+{
+    const s_config *config = config_get_config();
+    const char *gw = config->gw_interface;
+    unsigned int download = 0, upload = 0, minor;
+    char ip[IP_STR_LEN];
+
+    if (c->active) {
+        download = fw_shaping_rate(c->download, config->client_download_rate, link_download);
+        upload = fw_shaping_rate(c->upload, config->client_upload_rate, link_upload);
+    }
+    if (download == c->class_download && upload == c->class_upload)
+        return;
+
+    format_ip(c->ip, ip);
+    if (0 == c->minor) {
+        for (minor = SHAPING_MINOR_FIRST; minor <= SHAPING_MINOR_LAST; minor++)
+            if (!(minors_used[minor / 8] & (1 << minor % 8)))
+                break;
+        if (minor > SHAPING_MINOR_LAST) {
+            debug(LOG_WARNING, "No class left to shape the traffic of %s", ip);
+            return;
+        }
+        minors_used[minor / 8] |= 1 << minor % 8;
+        c->minor = minor;
+    }
+    minor = c->minor;
+
+    /* The u32 filters of prio 5 are the only ones of their qdisc, so
+     * their hash table is 800: */
+    if (download > 0) {
+        pstr_append_sprintf(script, "class replace dev %s parent 1:1 classid 1:%x htb rate %ukbit ceil %ukbit\n",
+                            gw, minor, download, download);
+        if (0 == c->class_download) {
+            pstr_append_sprintf(script, "qdisc replace dev %s parent 1:%x handle %x: " SHAPING_LEAF_QDISC "\n",
+                                gw, minor, minor);
+            pstr_append_sprintf(script, "filter replace dev %s parent 1: protocol ip prio 5 handle 800::%x "
+                                "u32 match ip dst %s/32 flowid 1:%x\n", gw, minor, ip, minor);
+        }
+    } else if (c->class_download > 0) {
+        pstr_append_sprintf(script, "filter del dev %s parent 1: protocol ip prio 5 handle 800::%x u32\n", gw, minor);
+        pstr_append_sprintf(script, "class del dev %s classid 1:%x\n", gw, minor);
+    }
+
+    if (upload > 0) {
+        pstr_append_sprintf(script, "class replace dev %s parent 1:1 classid 1:%x htb rate %ukbit ceil %ukbit\n",
+                            shaping_ifb, minor, upload, upload);
+        if (0 == c->class_upload) {
+            pstr_append_sprintf(script, "qdisc replace dev %s parent 1:%x handle %x: " SHAPING_LEAF_QDISC "\n",
+                                shaping_ifb, minor, minor);
+            pstr_append_sprintf(script, "filter replace dev %s parent 1: protocol ip prio 5 handle 800::%x "
+                                "u32 match ip src %s/32 flowid 1:%x\n", shaping_ifb, minor, ip, minor);
+        }
+    } else if (c->class_upload > 0) {
+        pstr_append_sprintf(script, "filter del dev %s parent 1: protocol ip prio 5 handle 800::%x u32\n",
+                            shaping_ifb, minor);
+        pstr_append_sprintf(script, "class del dev %s classid 1:%x\n", shaping_ifb, minor);
+    }
+
+    c->class_download = download;
+    c->class_upload = upload;
+    if (0 == download && 0 == upload) {
+        minors_used[minor / 8] &= ~(1 << minor % 8);
+        c->minor = 0;
+    }
+}
+
+/** @internal
+ * Appends the tc commands setting up the HTB hierarchy of a device whose
+ * clients do not have classes of their own yet: the link, and the class
+ * of everything else.
+ */
+static void
+fw_shaping_htb(pstr_t * script, const char *dev, int rate)
+{
+    pstr_append_sprintf(script, "qdisc add dev %s root handle 1: htb default 2\n", dev);
+    pstr_append_sprintf(script, "class add dev %s parent 1: classid 1:1 htb rate %dkbit ceil %dkbit\n", dev, rate,
+                        rate);
+    pstr_append_sprintf(script, "class add dev %s parent 1:1 classid 1:2 htb rate %dkbit ceil %dkbit\n", dev, rate,
+                        rate);
+    pstr_append_sprintf(script, "qdisc add dev %s parent 1:2 handle 2: " SHAPING_LEAF_QDISC "\n", dev);
+}
+
+/** @internal
+ * Removes the queueing disciplines of the devices, and the ifb device.
+ * shaping_mutex must be held.
+ * @param upload Whether the external interface and the ifb device were set up
+ */
+static void
+fw_shaping_teardown(int upload)
+{
+    const char *gw = config_get_config()->gw_interface;
+    pstr_t *script = pstr_new();
+    char *commands;
+
+    pstr_append_sprintf(script, "qdisc del dev %s root\n", gw);
+    pstr_append_sprintf(script, "qdisc del dev %s ingress\n", gw);
+    if (upload && NULL != shaping_ext)
+        pstr_append_sprintf(script, "qdisc del dev %s root\n", shaping_ext);
+    commands = pstr_to_string(script);
+    fw_shaping_run("tc -force -batch -", commands, 1);
+    free(commands);
+
+    if (upload && NULL != shaping_ifb) {
+        safe_asprintf(&commands, "link del dev %s\n", shaping_ifb);
+        fw_shaping_run("ip -force -batch -", commands, 1);
+        free(commands);
+    }
+}
+
+/** Sets up the queueing disciplines of the gateway and external interfaces,
+ * replacing any they had, and the classes of the clients with a mark in
+ * the firewall. Does nothing unless DownloadBandwidth or UploadBandwidth
+ * is set.
+ * @return 0 on success, -1 if some tc command failed
+ */
+int
+fw_shaping_init(void)
+{
+    const s_config *config = config_get_config();
+    const char *gw = config->gw_interface;
+    t_client_snapshot *snapshot;
+    t_fw_shaped *c;
+    pstr_t *script;
+    char *commands;
+    unsigned int i;
+    int rc = 0;
+    static const struct {
+        int mark;
+        int share;              /* Part of the link guaranteed, in eighths */
+    } marks[] = {
+        {FW_MARK_KNOWN, 4}, {FW_MARK_PROBATION, 2}, {FW_MARK_AUTH_IS_DOWN, 1}
+    };
+
+    if (0 == config->download_bandwidth && 0 == config->upload_bandwidth)
+        return 0;
+
+    snapshot = client_list_snapshot();
+    pthread_mutex_lock(&shaping_mutex);
+
+    link_download = config->download_bandwidth;
+    link_upload = config->upload_bandwidth;
+    if (link_upload > 0) {
+        free(shaping_ext);
+        free(shaping_ifb);
+        shaping_ext = config->external_interface ? safe_strdup(config->external_interface) : get_ext_iface();
+        safe_asprintf(&shaping_ifb, SHAPING_IFB_PREFIX "%.11s", gw);
+        if (NULL == shaping_ext) {
+            debug(LOG_ERR, "No external interface, uploads will not be shaped");
+            link_upload = 0;
+        }
+    }
+
+    /* From scratch, whatever the gateway this one replaces left */
+    fw_shaping_teardown(link_upload > 0);
+
+    script = pstr_new();
+    if (link_download > 0)
+        fw_shaping_htb(script, gw, link_download);
+    if (link_upload > 0) {
+        safe_asprintf(&commands, "link add name %s type ifb\nlink set dev %s up\n", shaping_ifb, shaping_ifb);
+        fw_shaping_run("ip -force -batch -", commands, 0);
+        free(commands);
+
+        pstr_append_sprintf(script, "qdisc add dev %s handle ffff: ingress\n", gw);
+        pstr_append_sprintf(script, "filter add dev %s parent ffff: protocol ip prio 1 u32 match u32 0 0 "
+                            "action mirred egress redirect dev %s\n", gw, shaping_ifb);
+        fw_shaping_htb(script, shaping_ifb, link_upload);
+
+        /* By mark, what is left going to class 1:100 */
+        pstr_append_sprintf(script, "qdisc add dev %s root handle 1: htb default 100\n", shaping_ext);
+        pstr_append_sprintf(script, "class add dev %s parent 1: classid 1:1 htb rate %dkbit ceil %dkbit\n",
+                            shaping_ext, link_upload, link_upload);
+        pstr_append_sprintf(script, "class add dev %s parent 1:1 classid 1:100 htb rate %dkbit ceil %dkbit\n",
+                            shaping_ext, link_upload / 8 > 0 ? link_upload / 8 : 1, link_upload);
+        pstr_append_sprintf(script, "qdisc add dev %s parent 1:100 handle 100: " SHAPING_LEAF_QDISC "\n", shaping_ext);
+        for (i = 0; i < sizeof(marks) / sizeof(marks[0]); i++) {
+            pstr_append_sprintf(script, "class add dev %s parent 1:1 classid 1:%x htb rate %dkbit ceil %dkbit\n",
+                                shaping_ext, 0x100 | marks[i].mark,
+                                link_upload * marks[i].share / 8 > 0 ? link_upload * marks[i].share / 8 : 1,
+                                link_upload);
+            pstr_append_sprintf(script, "qdisc add dev %s parent 1:%x handle %x: " SHAPING_LEAF_QDISC "\n",
+                                shaping_ext, 0x100 | marks[i].mark, 0x100 | marks[i].mark);
+            pstr_append_sprintf(script, "filter add dev %s parent 1: protocol ip prio 1 u32 match mark 0x%x 0xffffffff "
+                                "flowid 1:%x\n", shaping_ext, fw_mark_value(marks[i].mark), 0x100 | marks[i].mark);
+        }
+    }
+
+    /* The classes of the clients are gone with the qdiscs. Rates from the
+     * auth server are kept, for clients inherited on restart until it
+     * gives them again. */
+    memset(minors_used, 0, sizeof(minors_used));
+    for (i = 0; i < (unsigned int)shaped_count; i++) {
+        shaped[i].active = 0;
+        shaped[i].minor = shaped[i].class_download = shaped[i].class_upload = 0;
+    }
+    for (i = 0; i < (unsigned int)snapshot->count; i++)
+        if (FW_MARK_NONE != snapshot->clients[i].fw_connection_state)
+            fw_shaping_find(snapshot->clients[i].ip, 1)->active = 1;
+    for (i = 0; i < (unsigned int)shaped_count; i++) {
+        c = &shaped[i];
+        if (!c->active) {
+            fw_shaping_forget(c);
+            i--;
+            continue;
+        }
+        fw_shaping_client(script, c);
+    }
+
+    commands = pstr_to_string(script);
+    if (fw_shaping_run("tc -force -batch -", commands, 0) != 0)
+        rc = -1;
+    free(commands);
+
+    debug(LOG_INFO, "Shaping the clients to %d kbit/s down and %d kbit/s up", link_download, link_upload);
+
+    pthread_mutex_unlock(&shaping_mutex);
+    client_list_snapshot_release(snapshot);
+    return rc;
+}
+
+/** Removes the queueing disciplines set up by fw_shaping_init(), with the
+ * classes of the clients, and the ifb device.
+ */
+void
+fw_shaping_destroy(void)
+{
+    pthread_mutex_lock(&shaping_mutex);
+    if (link_download > 0 || link_upload > 0) {
+        debug(LOG_INFO, "Removing traffic shaping");
+        fw_shaping_teardown(link_upload > 0);
+    }
+    link_download = link_upload = 0;
+    free(shaped);
+    shaped = NULL;
+    shaped_count = shaped_size = 0;
+    memset(minors_used, 0, sizeof(minors_used));
+    pthread_mutex_unlock(&shaping_mutex);
+}
+
+/** Gives the clients allowed by a batch of mark changes classes of their
+ * own, and removes those of the clients denied, with one batch of tc
+ * commands. Changes between two marks leave the classes as they are,
+ * the mark classes of the external interface following the firewall by
+ * themselves.
+ * @param ops Changes, as applied by fw_apply()
+ * @param count Number of changes
+ */
+void
+fw_shaping_apply(const t_fw_op * ops, int count)
+{
+    t_fw_shaped *c;
+    pstr_t *script;
+    int i;
+
+    pthread_mutex_lock(&shaping_mutex);
+    if (0 == link_download && 0 == link_upload) {
+        pthread_mutex_unlock(&shaping_mutex);
+        return;
+    }
+
+    script = pstr_new();
+    /* Removals first, an address may go to another MAC address */
+    for (i = 0; i < count; i++) {
+        if (FW_MARK_NONE == ops[i].to && NULL != (c = fw_shaping_find(ops[i].ip, 0))) {
+            c->active = 0;
+            fw_shaping_client(script, c);
+            fw_shaping_forget(c);
+        }
+    }
+    for (i = 0; i < count; i++) {
+        if (FW_MARK_NONE != ops[i].to) {
+            c = fw_shaping_find(ops[i].ip, 1);
+            c->active = 1;
+            fw_shaping_client(script, c);
+        }
+    }
+    fw_shaping_commit(script);
+
+    pthread_mutex_unlock(&shaping_mutex);
+}
+
+/** Sets the rates of a client, as the auth server gives them. They apply
+ * right away to a client allowed already, or else once it is.
+ * @param ip IP address of the client, network byte order
+ * @param download Download rate in kbit/s, 0 for ClientDownloadRate
+ * @param upload Upload rate in kbit/s, 0 for ClientUploadRate
+ */
+void
+fw_shaping_set_rates(uint32_t ip, unsigned int download, unsigned int upload)
+{
+    t_fw_shaped *c;
+    pstr_t *script;
+
+    pthread_mutex_lock(&shaping_mutex);
+    if (0 == link_download && 0 == link_upload) {
+        pthread_mutex_unlock(&shaping_mutex);
+        return;
+    }
+
+    c = fw_shaping_find(ip, 1);
+    if (c->download != download || c->upload != upload) {
+        c->download = download;
+        c->upload = upload;
+        if (c->active) {
+            script = pstr_new();
+            fw_shaping_client(script, c);
+            fw_shaping_commit(script);
+        }
+    }
+
+    pthread_mutex_unlock(&shaping_mutex);
+}
+
+/** Copies the statistics of the traffic shaping
+ * @param stats Receives them
+ */
+void
+fw_shaping_get_stats(t_fw_shaping_stats * stats)
+{
+    int i;
+
+    pthread_mutex_lock(&shaping_mutex);
+    memcpy(stats, &shaping_stats, sizeof(*stats));
+    stats->enabled = link_download > 0 || link_upload > 0;
+    stats->clients = 0;
+    for (i = 0; i < shaped_count; i++)
+        if (0 != shaped[i].minor)
+            stats->clients++;
+    pthread_mutex_unlock(&shaping_mutex);
+}
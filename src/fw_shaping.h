@@ -0,0 +1,54 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file fw_shaping.h
+    @brief Traffic shaping of the clients with tc
+*/
+
+#ifndef _FW_SHAPING_H_
+#define _FW_SHAPING_H_
+
+#include "firewall.h"
+
+/** Statistics of the traffic shaping, see fw_shaping_get_stats() */
+typedef struct _t_fw_shaping_stats {
+    int enabled;                /**< @brief Whether the clients are shaped */
+    unsigned int clients;       /**< @brief Clients with a class of their own */
+    unsigned long runs;         /**< @brief Batches of tc commands run */
+    unsigned long failures;     /**< @brief Batches tc did not run entirely */
+} t_fw_shaping_stats;
+
+/** @brief Set up the queueing disciplines and the classes of the clients */
+int fw_shaping_init(void);
+
+/** @brief Remove the queueing disciplines */
+void fw_shaping_destroy(void);
+
+/** @brief Give clients whose mark changed a class, or remove theirs */
+void fw_shaping_apply(const t_fw_op *, int);
+
+/** @brief Set the rates of a client, as the auth server tells them */
+void fw_shaping_set_rates(uint32_t, unsigned int, unsigned int);
+
+/** @brief Get the statistics of the traffic shaping */
+void fw_shaping_get_stats(t_fw_shaping_stats *);
+
+#endif                          /* _FW_SHAPING_H_ */
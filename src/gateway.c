@@ -51,10 +51,14 @@
 #include "conf.h"
 #include "gateway.h"
 #include "firewall.h"
+#include "fw_queue.h"
+#include "fw_helper.h"
+#include "dns_snoop.h"
 #include "commandline.h"
 #include "auth.h"
 #include "http.h"
 #include "client_list.h"
+#include "client_state.h"
 #include "wdctl_thread.h"
 #include "ping_thread.h"
 #include "httpd_thread.h"
@@ -66,6 +70,8 @@
  */
 static pthread_t tid_fw_counter = 0;
 static pthread_t tid_ping = 0;
+static pthread_t tid_client_expiry = 0;
+static pthread_t tid_fw_queue = 0;
 
 time_t started_time = 0;
 
@@ -185,11 +191,13 @@ get_clients_from_parent(void)
                     if (strcmp(command, "CLIENT") == 0) {
                         /* Assign the key into the appropriate slot in the connection structure */
                         if (strcmp(key, "ip") == 0) {
-                            client->ip = safe_strdup(value);
+                            if (!parse_ip(value, &client->ip))
+                                debug(LOG_ERR, "Invalid client IP [%s] from parent", value);
                         } else if (strcmp(key, "mac") == 0) {
-                            client->mac = safe_strdup(value);
+                            if (!parse_mac(value, &client->mac))
+                                debug(LOG_ERR, "Invalid client MAC [%s] from parent", value);
                         } else if (strcmp(key, "token") == 0) {
-                            client->token = safe_strdup(value);
+                            client_set_token(client, value);
                         } else if (strcmp(key, "fw_connection_state") == 0) {
                             client->fw_connection_state = atoi(value);
                         } else if (strcmp(key, "fd") == 0) {
@@ -237,18 +245,30 @@ get_clients_from_parent(void)
  * When a child process exits, it causes a SIGCHLD to be sent to the
  * process. This handler catches it and reaps the child process so it
  * can exit. Otherwise we'd get zombie processes.
+ *
+ * While a thread waits for a child of its own (see child_wait_begin()) no
+ * child is reaped here, since it could be that one: the exited child is
+ * only looked at first, and reaped if no wait started before it exited.
+ * child_wait_end() raises SIGCHLD again for those left over.
  */
 void
 sigchld_handler(int s)
 {
+    siginfo_t info;
     int status;
     pid_t rc;
 
     debug(LOG_DEBUG, "Handler for SIGCHLD called. Trying to reap a child");
 
-    rc = waitpid(-1, &status, WNOHANG);
-
-    debug(LOG_DEBUG, "Handler for SIGCHLD reaped child PID %d", rc);
+    while (0 == child_wait_pending()) {
+        info.si_pid = 0;
+        if (waitid(P_ALL, 0, &info, WEXITED | WNOHANG | WNOWAIT) == -1 || 0 == info.si_pid)
+            break;
+        if (0 != child_wait_pending())
+            break;
+        rc = waitpid(info.si_pid, &status, WNOHANG);
+        debug(LOG_DEBUG, "Handler for SIGCHLD reaped child PID %d", rc);
+    }
 }
 
 /** Exits cleanly after cleaning up the firewall.  
@@ -287,6 +307,14 @@ termination_handler(int s)
         debug(LOG_INFO, "Explicitly killing the ping thread");
         pthread_kill(tid_ping, SIGKILL);
     }
+    if (tid_client_expiry && self != tid_client_expiry) {
+        debug(LOG_INFO, "Explicitly killing the client expiry thread");
+        pthread_kill(tid_client_expiry, SIGKILL);
+    }
+    if (tid_fw_queue && self != tid_fw_queue) {
+        debug(LOG_INFO, "Explicitly killing the fw_queue thread");
+        pthread_kill(tid_fw_queue, SIGKILL);
+    }
 
     debug(LOG_NOTICE, "Exiting...");
     exit(s == 0 ? 1 : 0);
@@ -409,14 +437,34 @@ main_loop(void)
 
     httpdSetErrorFunction(webserver, 404, http_callback_404);
 
-    /* Reset the firewall (if WiFiDog crashed) */
-    fw_destroy();
-    /* Then initialize it */
+    /* Fork the firewall helper while there is only this thread to duplicate */
+    fw_helper_start();
+
+    /* Initialize the firewall, taking over the rules of the gateway this one
+     * replaces on restart, or left over if WiFiDog crashed */
     if (!fw_init()) {
         debug(LOG_ERR, "FATAL: Failed to initialize firewall");
         exit(1);
     }
 
+    /* Start firewall queue thread */
+    result = pthread_create(&tid_fw_queue, NULL, (void *)thread_fw_queue, NULL);
+    if (result != 0) {
+        debug(LOG_ERR, "FATAL: Failed to create a new thread (fw_queue) - exiting");
+        termination_handler(0);
+    }
+    pthread_detach(tid_fw_queue);
+
+    /* Start DNS snooping thread */
+    if (config->dns_snooping) {
+        result = pthread_create(&tid, NULL, (void *)thread_dns_snoop, NULL);
+        if (result != 0) {
+            debug(LOG_ERR, "FATAL: Failed to create a new thread (dns_snoop) - exiting");
+            termination_handler(0);
+        }
+        pthread_detach(tid);
+    }
+
     /* Start clean up thread */
     result = pthread_create(&tid_fw_counter, NULL, (void *)thread_client_timeout_check, NULL);
     if (result != 0) {
@@ -425,6 +473,14 @@ main_loop(void)
     }
     pthread_detach(tid_fw_counter);
 
+    /* Start inactivity expiry thread */
+    result = pthread_create(&tid_client_expiry, NULL, (void *)thread_client_expiry, NULL);
+    if (result != 0) {
+        debug(LOG_ERR, "FATAL: Failed to create a new thread (client_expiry) - exiting");
+        termination_handler(0);
+    }
+    pthread_detach(tid_client_expiry);
+
     /* Start control thread */
     result = pthread_create(&tid, NULL, (void *)thread_wdctl, (void *)safe_strdup(config->wdctl_sock));
     if (result != 0) {
@@ -495,6 +551,11 @@ gw_main(int argc, char **argv)
 {
 
     s_config *config = config_get_config();
+
+    /* Started again as the firewall helper, see fw_helper_spawn() */
+    if (2 == argc && strcmp(argv[1], FW_HELPER_ARG) == 0)
+        fw_helper_main(FW_HELPER_FD_REQUESTS, FW_HELPER_FD_REPLIES);
+
     config_init();
 
     parse_commandline(argc, argv);
@@ -526,6 +587,10 @@ gw_main(int argc, char **argv)
         debug(LOG_INFO, "Parent PID %d seems to be dead. Continuing loading.");
     }
 
+    /* Persist the client list. A restarted gateway got its clients from the
+     * parent, otherwise pick up those left over by a previous run */
+    client_state_init(config->client_state_file, !restart_orig_pid);
+
     if (config->daemon) {
 
         debug(LOG_INFO, "Forking into background");
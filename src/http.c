@@ -54,6 +54,7 @@
 #include "centralserver.h"
 #include "util.h"
 #include "wd_util.h"
+#include "whitelist.h"
 
 #include "../config.h"
 
@@ -62,7 +63,9 @@
 void
 http_callback_404(httpd * webserver, request * r, int error_code)
 {
-    char tmp_url[MAX_BUF], *url, *mac;
+    char tmp_url[MAX_BUF], *url, mac[MAC_STR_LEN];
+    uint32_t ip;
+    t_mac client_mac;
     s_config *config = config_get_config();
     t_auth_serv *auth_server = get_auth_server();
 
@@ -106,7 +109,7 @@ http_callback_404(httpd * webserver, request * r, int error_code)
         /* Re-direct them to auth server */
         char *urlFragment;
 
-        if (!(mac = arp_get(r->clientAddr))) {
+        if (!parse_ip(r->clientAddr, &ip) || !arp_get(ip, &client_mac)) {
             /* We could not get their MAC address */
             debug(LOG_INFO, "Failed to retrieve MAC address for ip %s, so not putting in the login request",
                   r->clientAddr);
@@ -114,49 +117,34 @@ http_callback_404(httpd * webserver, request * r, int error_code)
                           auth_server->authserv_login_script_path_fragment, config->gw_address, config->gw_port,
                           config->gw_id, r->clientAddr, url);
         } else {
+            format_mac(&client_mac, mac);
             debug(LOG_INFO, "Got client MAC address for ip %s: %s", r->clientAddr, mac);
             safe_asprintf(&urlFragment, "%sgw_address=%s&gw_port=%d&gw_id=%s&ip=%s&mac=%s&url=%s",
                           auth_server->authserv_login_script_path_fragment,
                           config->gw_address, config->gw_port, config->gw_id, r->clientAddr, mac, url);
-            free(mac);
         }
 
         // if host is not in whitelist, maybe not in conf or domain'IP changed, it will go to here.
         debug(LOG_INFO, "Check host %s is in whitelist or not", r->request.host);       // e.g. www.example.com
-        t_firewall_rule *rule;
-        //e.g. example.com is in whitelist
-        // if request http://www.example.com/, it's not equal example.com.
-        for (rule = get_ruleset("global"); rule != NULL; rule = rule->next) {
-            debug(LOG_INFO, "rule mask %s", rule->mask);
-            if (strstr(r->request.host, rule->mask) == NULL) {
-                debug(LOG_INFO, "host %s is not in %s, continue", r->request.host, rule->mask);
-                continue;
-            }
-            int host_length = strlen(r->request.host);
-            int mask_length = strlen(rule->mask);
-            if (host_length != mask_length) {
-                char prefix[1024] = { 0 };
-                // must be *.example.com, if not have ".", maybe Phishing. e.g. phishingexample.com
-                strncpy(prefix, r->request.host, host_length - mask_length - 1);        // e.g. www
-                strcat(prefix, ".");    // www.
-                strcat(prefix, rule->mask);     // www.example.com
-                if (strcasecmp(r->request.host, prefix) == 0) {
-                    debug(LOG_INFO, "allow subdomain");
-                    fw_allow_host(r->request.host);
-                    http_send_redirect(r, tmp_url, "allow subdomain");
-                    free(url);
-                    free(urlFragment);
-                    return;
-                }
-            } else {
-                // e.g. "example.com" is in conf, so it had been parse to IP and added into "iptables allow" when wifidog start. but then its' A record(IP) changed, it will go to here.
-                debug(LOG_INFO, "allow domain again, because IP changed");
-                fw_allow_host(r->request.host);
-                http_send_redirect(r, tmp_url, "allow domain");
-                free(url);
-                free(urlFragment);
-                return;
-            }
+        switch (whitelist_match(r->request.host)) {
+        case WHITELIST_SUBDOMAIN:
+            // e.g. example.com is in whitelist and http://www.example.com/ was requested
+            debug(LOG_INFO, "allow subdomain");
+            fw_allow_host(r->request.host);
+            http_send_redirect(r, tmp_url, "allow subdomain");
+            free(url);
+            free(urlFragment);
+            return;
+        case WHITELIST_DOMAIN:
+            // e.g. "example.com" is in conf, so it had been parse to IP and added into "iptables allow" when wifidog start. but then its' A record(IP) changed, it will go to here.
+            debug(LOG_INFO, "allow domain again, because IP changed");
+            fw_allow_host(r->request.host);
+            http_send_redirect(r, tmp_url, "allow domain");
+            free(url);
+            free(urlFragment);
+            return;
+        default:
+            break;
         }
 
         debug(LOG_INFO, "Captured %s requesting [%s] and re-directing them to login page", r->clientAddr, url);
@@ -254,33 +242,39 @@ http_callback_auth(httpd * webserver, request * r)
 {
     t_client *client;
     httpVar *token;
-    char *mac;
+    uint32_t ip;
+    t_mac mac;
     httpVar *logout = httpdGetVariableByName(r, "logout");
 
     if ((token = httpdGetVariableByName(r, "token"))) {
         /* They supplied variable "token" */
-        if (!(mac = arp_get(r->clientAddr))) {
+        if (!parse_ip(r->clientAddr, &ip) || !arp_get(ip, &mac)) {
             /* We could not get their MAC address */
             debug(LOG_ERR, "Failed to retrieve MAC address for ip %s", r->clientAddr);
             send_http_page(r, "WiFiDog Error", "Failed to retrieve your MAC address");
         } else {
             /* We have their MAC address */
-            LOCK_CLIENT_LIST();
+            LOCK_CLIENT_SHARD(&mac);
 
-            if ((client = client_list_find(r->clientAddr, mac)) == NULL) {
+            if ((client = client_list_find(ip, &mac)) == NULL) {
                 debug(LOG_DEBUG, "New client for %s", r->clientAddr);
-                client_list_add(r->clientAddr, mac, token->value);
+                client_list_add(ip, &mac, token->value);
+                client = NULL;
             } else if (logout) {
-                logout_client(client);
+                client_list_remove(client);
+                fw_deny(client);
             } else {
-                debug(LOG_DEBUG, "Client for %s is already in the client list", client->ip);
+                debug(LOG_DEBUG, "Client for %s is already in the client list", r->clientAddr);
+                client = NULL;
             }
 
-            UNLOCK_CLIENT_LIST();
+            UNLOCK_CLIENT_SHARD(&mac);
+            if (client) {
+                logout_client(client);
+            }
             if (!logout) { /* applies for case 1 and 3 from above if */
-                authenticate_client(r);
+                authenticate_client(r, ip, &mac);
             }
-            free(mac);
         }
     } else {
         /* They did not supply variable "token" */
@@ -295,6 +289,7 @@ http_callback_disconnect(httpd * webserver, request * r)
     /* XXX How do you change the status code for the response?? */
     httpVar *token = httpdGetVariableByName(r, "token");
     httpVar *mac = httpdGetVariableByName(r, "mac");
+    t_mac client_mac;
 
     if (config->httpdusername &&
         (strcmp(config->httpdusername, r->request.authUser) ||
@@ -307,19 +302,28 @@ http_callback_disconnect(httpd * webserver, request * r)
     if (token && mac) {
         t_client *client;
 
-        LOCK_CLIENT_LIST();
-        client = client_list_find_by_mac(mac->value);
+        if (!parse_mac(mac->value, &client_mac)) {
+            debug(LOG_INFO, "Disconnect called with invalid MAC %s", mac->value);
+            httpdOutput(r, "Invalid MAC");
+            return;
+        }
+
+        LOCK_CLIENT_SHARD(&client_mac);
+        client = client_list_find_by_mac(&client_mac);
 
         if (!client || strcmp(client->token, token->value)) {
-            UNLOCK_CLIENT_LIST();
+            UNLOCK_CLIENT_SHARD(&client_mac);
             debug(LOG_INFO, "Disconnect %s with incorrect token %s", mac->value, token->value);
             httpdOutput(r, "Invalid token for MAC");
             return;
         }
 
+        client_list_remove(client);
+        fw_deny(client);
+        UNLOCK_CLIENT_SHARD(&client_mac);
+
         /* TODO: get current firewall counters */
         logout_client(client);
-        UNLOCK_CLIENT_LIST();
 
     } else {
         debug(LOG_INFO, "Disconnect called without both token and MAC given");
@@ -34,6 +34,8 @@
 #include <string.h>
 #include <errno.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <spawn.h>
 
 #include "safe.h"
 #include "debug.h"
@@ -199,3 +201,36 @@ safe_fork(void)
 
     return result;
 }
+
+/** Start a program without duplicating this process, the way safe_fork()
+ * followed by exec would: the registered file descriptors are closed in
+ * the child. The program is looked up in the PATH.
+ * @param argv Program and its arguments, NULL terminated
+ * @param quiet Whether to send its stderr to /dev/null
+ * @return pid of the child, -1 with errno set if it could not be started
+ */
+pid_t
+safe_spawn(char *const argv[], int quiet)
+{
+    posix_spawn_file_actions_t actions;
+    unsigned int i;
+    pid_t pid;
+    int rc;
+
+    posix_spawn_file_actions_init(&actions);
+    for (i = 0; i < sizeof(fd_list) / sizeof(int); i++) {
+        if (fd_list[i])
+            posix_spawn_file_actions_addclose(&actions, fd_list[i]);
+    }
+    if (quiet)
+        posix_spawn_file_actions_addopen(&actions, 2, "/dev/null", O_WRONLY, 0);
+
+    rc = posix_spawnp(&pid, argv[0], &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (rc != 0) {
+        errno = rc;
+        return -1;
+    }
+    return pid;
+}
@@ -55,4 +55,7 @@ int safe_vasprintf(char **, const char *, va_list);
 /* @brief Safe version of fork */
 pid_t safe_fork(void);
 
+/* @brief Start a program like safe_fork() and exec would */
+pid_t safe_spawn(char *const[], int);
+
 #endif                          /* _SAFE_H_ */
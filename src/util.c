@@ -35,6 +35,7 @@
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/wait.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/time.h>
 #include <netinet/in.h>
@@ -73,11 +74,6 @@
 } while (0)
 
 #include "../config.h"
-#ifdef __ANDROID__
-#define WD_SHELL_PATH "/system/bin/sh"
-#else
-#define WD_SHELL_PATH "/bin/sh"
-#endif
 
 /** @brief FD for icmp raw socket */
 static int icmp_fd;
@@ -85,40 +81,179 @@ static int icmp_fd;
 /** @brief Mutex to protect gethostbyname since not reentrant */
 static pthread_mutex_t ghbn_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+/** @internal
+ * Number of children some thread is about to wait for, see child_wait_begin()
+ */
+static volatile int child_waits = 0;
+
 static unsigned short rand16(void);
 
-/** Fork a child and execute a shell command, the parent
- * process waits for the child to return and returns the child's exit()
- * value.
+/** Parse a dotted quad IPv4 address
+ * @param str Address as text
+ * @param ip Receives the address in network byte order
+ * @return 1 on success, 0 if str is not an IPv4 address
+ */
+int
+parse_ip(const char *str, uint32_t * ip)
+{
+    struct in_addr addr;
+
+    if (inet_pton(AF_INET, str, &addr) != 1)
+        return 0;
+    *ip = addr.s_addr;
+    return 1;
+}
+
+/** Parse a colon separated MAC address, in either case
+ * @param str Address as text
+ * @param mac Receives the address
+ * @return 1 on success, 0 if str is not a MAC address
+ */
+int
+parse_mac(const char *str, t_mac * mac)
+{
+    unsigned int b[6];
+    int i, len = 0;
+
+    if (sscanf(str, "%2x:%2x:%2x:%2x:%2x:%2x%n", &b[0], &b[1], &b[2], &b[3], &b[4], &b[5], &len) != 6
+        || str[len] != '\0')
+        return 0;
+    for (i = 0; i < 6; i++)
+        mac->addr[i] = b[i];
+    return 1;
+}
+
+/** Format an IPv4 address as a dotted quad
+ * @param ip Address in network byte order
+ * @param buf Buffer of at least IP_STR_LEN bytes
+ * @return buf
+ */
+char *
+format_ip(uint32_t ip, char *buf)
+{
+    struct in_addr addr;
+
+    addr.s_addr = ip;
+    inet_ntop(AF_INET, &addr, buf, IP_STR_LEN);
+    return buf;
+}
+
+/** Format a MAC address as colon separated lowercase hex
+ * @param mac Address
+ * @param buf Buffer of at least MAC_STR_LEN bytes
+ * @return buf
+ */
+char *
+format_mac(const t_mac * mac, char *buf)
+{
+    snprintf(buf, MAC_STR_LEN, "%02x:%02x:%02x:%02x:%02x:%02x",
+             mac->addr[0], mac->addr[1], mac->addr[2], mac->addr[3], mac->addr[4], mac->addr[5]);
+    return buf;
+}
+
+/** Splits a command line into words, to run it without the shell. A
+ * command line using the syntax of the shell, quotes, variables,
+ * redirections and the like, is handed to the shell instead, and so is one
+ * of more than COMMAND_ARGS_MAX words.
+ * @param cmd_line Command line, cut into the words in place
+ * @param argv Receives the words, room for COMMAND_ARGS_MAX + 1
+ * @return Number of words, argv being NULL terminated
+ */
+int
+split_command(char *cmd_line, char **argv)
+{
+    char *word, *saveptr;
+    int argc = 0, words = 0;
+
+    for (word = cmd_line; '\0' != *word; word++)
+        if (' ' != *word && (word == cmd_line || ' ' == word[-1]))
+            words++;
+
+    if (words > COMMAND_ARGS_MAX || NULL != strpbrk(cmd_line, "'\"\\$`|&;<>()*?[]{}~\t\n")) {
+        argv[argc++] = WD_SHELL_PATH;
+        argv[argc++] = "-c";
+        argv[argc++] = cmd_line;
+    } else {
+        for (word = strtok_r(cmd_line, " ", &saveptr); NULL != word; word = strtok_r(NULL, " ", &saveptr))
+            argv[argc++] = word;
+    }
+    argv[argc] = NULL;
+
+    return argc;
+}
+
+/** Announces that the calling thread is about to start a child and wait
+ * for it, with waitpid() or pclose(). Until the matching child_wait_end(),
+ * the SIGCHLD handler leaves every child alone, so it cannot reap that one
+ * and lose its exit status.
+ */
+void
+child_wait_begin(void)
+{
+    __atomic_add_fetch(&child_waits, 1, __ATOMIC_SEQ_CST);
+}
+
+/** Ends what child_wait_begin() started, once the child was waited for.
+ * The last one raises SIGCHLD again, so that the children that exited in
+ * the meantime are reaped.
+ */
+void
+child_wait_end(void)
+{
+    if (0 == __atomic_sub_fetch(&child_waits, 1, __ATOMIC_SEQ_CST))
+        kill(getpid(), SIGCHLD);
+}
+
+/** Whether some thread is waiting for a child of its own. Async-signal-safe.
+ * @return Number of children being waited for
+ */
+int
+child_wait_pending(void)
+{
+    return __atomic_load_n(&child_waits, __ATOMIC_SEQ_CST);
+}
+
+/** Execute a command line and wait for it to exit. Unless it uses the
+ * syntax of the shell, its program is started directly, and with
+ * posix_spawn(), so this process is not duplicated. A program that cannot
+ * be found, like a builtin of the shell, is left to the shell.
+ * @param cmd_line Command line
+ * @param quiet Whether to hide what the command prints on stderr
  * @return Return code of the command
  */
 int
 execute(const char *cmd_line, int quiet)
 {
-    int pid, status, rc;
-
-    const char *new_argv[4];
-    new_argv[0] = WD_SHELL_PATH;
-    new_argv[1] = "-c";
-    new_argv[2] = cmd_line;
-    new_argv[3] = NULL;
-
-    pid = safe_fork();
-    if (pid == 0) {             /* for the child process:         */
-        /* We don't want to see any errors if quiet flag is on */
-        if (quiet)
-            close(2);
-        if (execvp(WD_SHELL_PATH, (char *const *)new_argv) == -1) { /* execute the command  */
-            debug(LOG_ERR, "execvp(): %s", strerror(errno));
-        } else {
-            debug(LOG_ERR, "execvp() failed");
-        }
-        exit(1);
+    char *cmd, *argv[COMMAND_ARGS_MAX + 1];
+    int status, rc;
+    pid_t pid;
+
+    cmd = safe_strdup(cmd_line);
+    if (0 == split_command(cmd, argv)) {
+        free(cmd);
+        return 1;
+    }
+    child_wait_begin();
+    pid = safe_spawn(argv, quiet);
+    if (-1 == pid && ENOENT == errno && strcmp(argv[0], WD_SHELL_PATH) != 0) {
+        argv[0] = WD_SHELL_PATH;
+        argv[1] = "-c";
+        argv[2] = (char *)cmd_line;
+        argv[3] = NULL;
+        pid = safe_spawn(argv, quiet);
+    }
+    free(cmd);
+    if (-1 == pid) {
+        child_wait_end();
+        debug(quiet ? LOG_DEBUG : LOG_ERR, "Could not execute %s: %s", cmd_line, strerror(errno));
+        return 127;
     }
 
-    /* for the parent:      */
     debug(LOG_DEBUG, "Waiting for PID %d to exit", pid);
-    rc = waitpid(pid, &status, 0);
+    do {
+        rc = waitpid(pid, &status, 0);
+    } while (-1 == rc && EINTR == errno);
+    child_wait_end();
     debug(LOG_DEBUG, "Process PID %d exited", rc);
     
     if (-1 == rc) {
@@ -318,10 +453,10 @@ close_icmp_socket(void)
 
 /**
  * Ping an IP.
- * @param IP/host as string, will be sent to gethostbyname
+ * @param ip IPv4 address in network byte order
  */
 void
-icmp_ping(const char *host)
+icmp_ping(uint32_t ip)
 {
     struct sockaddr_in saddr;
     struct {
@@ -334,7 +469,7 @@ icmp_ping(const char *host)
 
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family = AF_INET;
-    inet_aton(host, &saddr.sin_addr);
+    saddr.sin_addr.s_addr = ip;
 #if defined(HAVE_SOCKADDR_SA_LEN)
     saddr.sin_len = sizeof(struct sockaddr_in);
 #endif
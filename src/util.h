@@ -27,6 +27,8 @@
 #ifndef _UTIL_H_
 #define _UTIL_H_
 
+#include <stdint.h>
+
 /** How many times should we try detecting the interface with the default route
  * (in seconds).  If set to 0, it will keep retrying forever */
 #define NUM_EXT_INTERFACE_DETECT_RETRY 0
@@ -34,9 +36,53 @@
  *  if it isn't up yet (interval in seconds) */
 #define EXT_INTERFACE_DETECT_RETRY_INTERVAL 1
 
+/** Size of an IPv4 address formatted by format_ip(), with the terminator */
+#define IP_STR_LEN 16
+/** Size of a MAC address formatted by format_mac(), with the terminator */
+#define MAC_STR_LEN 18
+
+/** MAC address in binary form */
+typedef struct _t_mac {
+    unsigned char addr[6];
+} t_mac;
+
+/** @brief Parse a dotted quad IPv4 address into network byte order */
+int parse_ip(const char *, uint32_t *);
+
+/** @brief Parse a colon separated MAC address */
+int parse_mac(const char *, t_mac *);
+
+/** @brief Format an IPv4 address in network byte order as a dotted quad */
+char *format_ip(uint32_t, char *);
+
+/** @brief Format a MAC address as colon separated lowercase hex */
+char *format_mac(const t_mac *, char *);
+
+/** Shell running the command lines split_command() does not split */
+#ifdef __ANDROID__
+#define WD_SHELL_PATH "/system/bin/sh"
+#else
+#define WD_SHELL_PATH "/bin/sh"
+#endif
+
+/** Most words split_command() splits a command line into */
+#define COMMAND_ARGS_MAX 128
+
+/** @brief Split a command line into words, or hand it to the shell */
+int split_command(char *, char **);
+
 /** @brief Execute a shell command */
 int execute(const char *, int);
 
+/** @brief Keep the SIGCHLD handler off the children until child_wait_end() */
+void child_wait_begin(void);
+
+/** @brief Let the SIGCHLD handler reap the children again */
+void child_wait_end(void);
+
+/** @brief Number of children being waited for by their parent thread */
+int child_wait_pending(void);
+
 /** @brief Thread safe gethostbyname */
 struct in_addr *wd_gethostbyname(const char *);
 
@@ -56,7 +102,7 @@ int init_icmp_socket(void);
 void close_icmp_socket(void);
 
 /** @brief ICMP Ping an IP */
-void icmp_ping(const char *);
+void icmp_ping(uint32_t);
 
 /** @brief Save pid of this wifidog in pid file */
 void save_pid_file(const char *);
@@ -38,6 +38,11 @@
 #include "gateway.h"
 #include "commandline.h"
 #include "client_list.h"
+#include "fw_queue.h"
+#include "fw_hosts.h"
+#include "dns_snoop.h"
+#include "fw_shaping.h"
+#include "fw_helper.h"
 #include "conf.h"
 #include "safe.h"
 #include "util.h"
@@ -162,11 +167,21 @@ get_status_text()
     pstr_t *pstr = pstr_new();
     s_config *config;
     t_auth_serv *auth_server;
-    t_client *sublist, *current;
-    int count;
+    t_client_snapshot *snapshot;
+    t_client *current;
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
+    int i;
     time_t uptime = 0;
     unsigned int days = 0, hours = 0, minutes = 0, seconds = 0;
     t_trusted_mac *p;
+    t_client_pool_stats pool_stats;
+    t_fw_queue_stats queue_stats;
+    t_fw_hosts_stats hosts_stats;
+    t_dns_snoop_stats snoop_stats;
+    t_fw_shaping_stats shaping_stats;
+    t_fw_helper_stats helper_stats;
+    t_fw_helper_histogram *histogram;
+    int b;
 
     pstr_cat(pstr, "WiFiDog status\n\n");
 
@@ -193,31 +208,80 @@ get_status_text()
     pstr_append_sprintf(pstr, "Auth server reachable: %s\n", (is_auth_online()? "yes" : "no"));
     pstr_append_sprintf(pstr, "Clients served this session: %lu\n\n", served_this_session);
 
-    LOCK_CLIENT_LIST();
+    snapshot = client_list_snapshot();
 
-    count = client_list_dup(&sublist);
+    pstr_append_sprintf(pstr, "%d clients " "connected.\n", snapshot->count);
 
-    UNLOCK_CLIENT_LIST();
-
-    current = sublist;
-
-    pstr_append_sprintf(pstr, "%d clients " "connected.\n", count);
-
-    count = 1;
-    while (current != NULL) {
-        pstr_append_sprintf(pstr, "\nClient %d\n", count);
-        pstr_append_sprintf(pstr, "  IP: %s MAC: %s\n", current->ip, current->mac);
+    for (i = 0; i < snapshot->count; i++) {
+        current = &snapshot->clients[i];
+        pstr_append_sprintf(pstr, "\nClient %d\n", i + 1);
+        pstr_append_sprintf(pstr, "  IP: %s MAC: %s\n", format_ip(current->ip, ip), format_mac(&current->mac, mac));
         pstr_append_sprintf(pstr, "  Token: %s\n", current->token);
         pstr_append_sprintf(pstr, "  Downloaded: %llu\n  Uploaded: %llu\n", current->counters.incoming,
                             current->counters.outgoing);
-        count++;
-        current = current->next;
     }
 
-    client_list_destroy(sublist);
+    client_list_snapshot_release(snapshot);
+
+    client_pool_get_stats(&pool_stats);
+    pstr_append_sprintf(pstr, "\nClient pool: %lu in use, %lu free, %lu slabs (%lu bytes)\n",
+                        pool_stats.in_use, pool_stats.free, pool_stats.slabs, pool_stats.bytes);
+
+    fw_queue_get_stats(&queue_stats);
+    pstr_append_sprintf(pstr, "Firewall queue: %u pending, %lu queued, %lu cancelled, %lu applied in %lu batches\n",
+                        queue_stats.depth, queue_stats.queued, queue_stats.cancelled, queue_stats.applied,
+                        queue_stats.flushes);
+    pstr_append_sprintf(pstr, "  Batch time: %lu us last, %lu us max, %llu us average; longest wait %lu us\n",
+                        queue_stats.last_flush_us, queue_stats.max_flush_us,
+                        queue_stats.flushes ? queue_stats.total_flush_us / queue_stats.flushes : 0,
+                        queue_stats.max_wait_us);
+
+    fw_hosts_get_stats(&hosts_stats);
+    pstr_append_sprintf(pstr, "Allowed hosts: %u hosts on %u addresses; "
+                        "%lu requests, %lu addresses added, %lu expired\n",
+                        hosts_stats.hosts, hosts_stats.addresses, hosts_stats.requests, hosts_stats.added,
+                        hosts_stats.expired);
+
+    if (config_get_config()->dns_snooping) {
+        dns_snoop_get_stats(&snoop_stats);
+        pstr_append_sprintf(pstr, "DNS snooping: %lu answers, %lu for whitelisted hosts; "
+                            "%lu addresses allowed, %lu failures\n",
+                            snoop_stats.answers, snoop_stats.whitelisted, snoop_stats.addresses,
+                            snoop_stats.failures);
+    }
+
+    fw_shaping_get_stats(&shaping_stats);
+    if (shaping_stats.enabled)
+        pstr_append_sprintf(pstr, "Traffic shaping: %u clients with classes; %lu tc runs, %lu failures\n",
+                            shaping_stats.clients, shaping_stats.runs, shaping_stats.failures);
+
+    fw_helper_get_stats(&helper_stats);
+    if (helper_stats.spawns > 0) {
+        pstr_append_sprintf(pstr, "Firewall helper: PID %d, started %lu times\n", (int)helper_stats.pid,
+                            helper_stats.spawns);
+        for (i = 0; i < FW_HELPER_PROGRAMS && '\0' != helper_stats.programs[i].program[0]; i++) {
+            histogram = &helper_stats.programs[i];
+            pstr_append_sprintf(pstr, "  %s: %lu runs, %lu failed;", histogram->program, histogram->runs,
+                                histogram->failures);
+            for (b = 0; b < FW_HELPER_BUCKETS; b++) {
+                if (0 == histogram->buckets[b])
+                    continue;
+                if (0 == b)
+                    pstr_append_sprintf(pstr, " <1ms:%lu", histogram->buckets[b]);
+                else if (FW_HELPER_BUCKETS - 1 == b)
+                    pstr_append_sprintf(pstr, " >=%lums:%lu", 1UL << (b - 1), histogram->buckets[b]);
+                else
+                    pstr_append_sprintf(pstr, " %lu-%lums:%lu", 1UL << (b - 1), 1UL << b, histogram->buckets[b]);
+            }
+            pstr_cat(pstr, "\n");
+        }
+    }
 
     config = config_get_config();
 
+    /* wdctl trust and untrust change the list */
+    LOCK_CONFIG();
+
     if (config->trustedmaclist != NULL) {
         pstr_cat(pstr, "\nTrusted MAC addresses:\n");
 
@@ -228,8 +292,6 @@ get_status_text()
 
     pstr_cat(pstr, "\nAuthentication servers:\n");
 
-    LOCK_CONFIG();
-
     for (auth_server = config->auth_servers; auth_server != NULL; auth_server = auth_server->next) {
         pstr_append_sprintf(pstr, "  Host: %s (%s)\n", auth_server->authserv_hostname, auth_server->last_ip);
     }
@@ -51,6 +51,7 @@ static void wdctl_status(void);
 static void wdctl_stop(void);
 static void wdctl_reset(void);
 static void wdctl_restart(void);
+static void wdctl_trust(void);
 
 /** @internal
  * @brief Print usage
@@ -71,6 +72,8 @@ usage(void)
     fprintf(stdout, "  status            Obtain the status of wifidog\n");
     fprintf(stdout, "  stop              Stop the running wifidog\n");
     fprintf(stdout, "  restart           Re-start the running wifidog (without disconnecting active users!)\n");
+    fprintf(stdout, "  trust <mac>       Add a MAC address to the trusted list\n");
+    fprintf(stdout, "  untrust <mac>     Remove a MAC address from the trusted list\n");
     fprintf(stdout, "\n");
 }
 
@@ -136,6 +139,14 @@ parse_commandline(int argc, char **argv)
         config.param = strdup(*(argv + optind + 1));
     } else if (strcmp(*(argv + optind), "restart") == 0) {
         config.command = WDCTL_RESTART;
+    } else if (strcmp(*(argv + optind), "trust") == 0 || strcmp(*(argv + optind), "untrust") == 0) {
+        config.command = strcmp(*(argv + optind), "trust") == 0 ? WDCTL_TRUST : WDCTL_UNTRUST;
+        if ((argc - (optind + 1)) <= 0) {
+            fprintf(stderr, "wdctl: Error: You must specify a Mac address to %s\n", *(argv + optind));
+            usage();
+            exit(1);
+        }
+        config.param = strdup(*(argv + optind + 1));
     } else {
         fprintf(stderr, "wdctl: Error: Invalid command \"%s\"\n", *(argv + optind));
         usage();
@@ -291,6 +302,42 @@ wdctl_restart(void)
     close(sock);
 }
 
+static void
+wdctl_trust(void)
+{
+    int sock;
+    char buffer[4096];
+    char request[64];
+    const char *command = WDCTL_TRUST == config.command ? "trust" : "untrust";
+    size_t len;
+    ssize_t rlen;
+
+    sock = connect_to_server(config.socket);
+
+    snprintf(request, sizeof(request), "%s %s\r\n\r\n", command, config.param);
+
+    send_request(sock, request);
+
+    len = 0;
+    memset(buffer, 0, sizeof(buffer));
+    while ((len < sizeof(buffer)) && ((rlen = read(sock, (buffer + len), (sizeof(buffer) - len))) > 0)) {
+        len += (size_t) rlen;
+    }
+
+    if (strcmp(buffer, "Yes") == 0) {
+        fprintf(stdout, "MAC address %s is %s.\n", config.param,
+                WDCTL_TRUST == config.command ? "now trusted" : "no longer trusted");
+    } else if (strcmp(buffer, "No") == 0) {
+        fprintf(stdout, "MAC address %s %s.\n", config.param,
+                WDCTL_TRUST == config.command ? "was already trusted" : "was not trusted");
+    } else {
+        fprintf(stderr, "wdctl: Error: could not %s %s.\n", command, config.param);
+    }
+
+    shutdown(sock, 2);
+    close(sock);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -316,6 +363,11 @@ main(int argc, char **argv)
         wdctl_restart();
         break;
 
+    case WDCTL_TRUST:
+    case WDCTL_UNTRUST:
+        wdctl_trust();
+        break;
+
     default:
         /* XXX NEVER REACHED */
         fprintf(stderr, "Oops\n");
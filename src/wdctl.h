@@ -34,6 +34,8 @@
 #define WDCTL_STOP		2
 #define WDCTL_KILL		3
 #define WDCTL_RESTART	4
+#define WDCTL_TRUST		5
+#define WDCTL_UNTRUST	6
 
 typedef struct {
     char *socket;
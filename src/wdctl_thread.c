@@ -49,6 +49,7 @@
 #include "centralserver.h"
 #include "fw_iptables.h"
 #include "firewall.h"
+#include "fw_queue.h"
 #include "client_list.h"
 #include "wdctl_thread.h"
 #include "commandline.h"
@@ -63,6 +64,7 @@ static void wdctl_status(int);
 static void wdctl_stop(int);
 static void wdctl_reset(int, const char *);
 static void wdctl_restart(int);
+static void wdctl_trust(int, const char *, int);
 
 static int wdctl_socket_server;
 
@@ -208,6 +210,10 @@ thread_wdctl_handler(void *arg)
         wdctl_reset(fd, (request + 6));
     } else if (strncmp(request, "restart", 7) == 0) {
         wdctl_restart(fd);
+    } else if (strncmp(request, "trust", 5) == 0) {
+        wdctl_trust(fd, (request + 6), 1);
+    } else if (strncmp(request, "untrust", 7) == 0) {
+        wdctl_trust(fd, (request + 8), 0);
     } else {
         debug(LOG_ERR, "Request was not understood!");
     }
@@ -272,6 +278,7 @@ wdctl_restart(int afd)
     struct sockaddr_un sa_un;
     t_client *client;
     char *tempstring = NULL;
+    char ip[IP_STR_LEN], mac[MAC_STR_LEN];
     pid_t pid;
     socklen_t len;
 
@@ -310,6 +317,9 @@ wdctl_restart(int afd)
 
         debug(LOG_DEBUG, "Received connection from child.  Sending them all existing clients");
 
+        /* The child takes the firewall over as it is, see fw_init() */
+        fw_handover();
+
         /* The child is connected. Send them over the socket the existing clients */
         LOCK_CLIENT_LIST();
         client = client_get_first_client();
@@ -317,12 +327,12 @@ wdctl_restart(int afd)
             /* Send this client */
             safe_asprintf(&tempstring,
                           "CLIENT|ip=%s|mac=%s|token=%s|fw_connection_state=%u|fd=%d|counters_incoming=%llu|counters_outgoing=%llu|counters_last_updated=%lu\n",
-                          client->ip, client->mac, client->token, client->fw_connection_state, client->fd,
+                          format_ip(client->ip, ip), format_mac(&client->mac, mac), client->token, client->fw_connection_state, client->fd,
                           client->counters.incoming, client->counters.outgoing, client->counters.last_updated);
             debug(LOG_DEBUG, "Sending to child client data: %s", tempstring);
             write_to_socket(fd, tempstring, strlen(tempstring));        /* XXX Despicably not handling error. */
             free(tempstring);
-            client = client->next;
+            client = client_get_next_client(client);
         }
         UNLOCK_CLIENT_LIST();
 
@@ -356,6 +366,8 @@ static void
 wdctl_reset(int fd, const char *arg)
 {
     t_client *node;
+    uint32_t ip;
+    t_mac mac;
 
     debug(LOG_DEBUG, "Entering wdctl_reset...");
 
@@ -363,8 +375,8 @@ wdctl_reset(int fd, const char *arg)
     debug(LOG_DEBUG, "Argument: %s (@%x)", arg, arg);
 
     /* We get the node or return... */
-    if ((node = client_list_find_by_ip(arg)) != NULL) ;
-    else if ((node = client_list_find_by_mac(arg)) != NULL) ;
+    if (parse_ip(arg, &ip) && (node = client_list_find_by_ip(ip)) != NULL) ;
+    else if (parse_mac(arg, &mac) && (node = client_list_find_by_mac(&mac)) != NULL) ;
     else {
         debug(LOG_DEBUG, "Client not found.");
         UNLOCK_CLIENT_LIST();
@@ -375,12 +387,39 @@ wdctl_reset(int fd, const char *arg)
 
     debug(LOG_DEBUG, "Got node %x.", node);
 
+    client_list_remove(node);
     /* deny.... */
-    logout_client(node);
+    fw_deny(node);
 
     UNLOCK_CLIENT_LIST();
 
+    logout_client(node);
+    /* ...for real before answering */
+    fw_queue_flush();
+
     write_to_socket(fd, "Yes", 3);
 
     debug(LOG_DEBUG, "Exiting wdctl_reset...");
 }
+
+/** Trusts a MAC address or stops trusting it, answering "Yes" if that
+ * changed it, "No" if it already was (or was not) trusted and "Error" if it
+ * could not be changed.
+ */
+static void
+wdctl_trust(int fd, const char *arg, int trusted)
+{
+    int rc;
+
+    debug(LOG_DEBUG, "Entering wdctl_trust...");
+
+    rc = fw_set_trusted_mac(arg, trusted);
+    if (rc == 1)
+        write_to_socket(fd, "Yes", 3);
+    else if (rc == 0)
+        write_to_socket(fd, "No", 2);
+    else
+        write_to_socket(fd, "Error", 5);
+
+    debug(LOG_DEBUG, "Exiting wdctl_trust...");
+}
@@ -0,0 +1,172 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file whitelist.c
+    @brief Hosts of the global rule set, for the captive portal
+
+    A client asking for a host of the global rule set reaches the captive
+    portal only when the firewall does not have the address it resolved
+    the host to: a subdomain of a whitelisted domain, or a whitelisted
+    domain whose address changed. http_callback_404() then allows the host
+    instead of redirecting the client to the login page.
+
+    The destinations of the rule set are kept in a hash table of lower case
+    names. A host is looked up by hashing it from its last character
+    backwards: the hash of each suffix starting after a dot is known when
+    the dot is reached, so a single pass over the host looks up all the
+    domains it is a subdomain of, and the host itself.
+*/
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <syslog.h>
+
+#include "safe.h"
+#include "debug.h"
+#include "conf.h"
+#include "whitelist.h"
+
+/** @internal
+ * A whitelisted domain
+ */
+typedef struct _t_whitelist_domain {
+    char *name;                 /**< @brief Lower case name, NULL for a free slot */
+    size_t len;                 /**< @brief Length of the name */
+    uint32_t hash;              /**< @brief Hash of the name, see whitelist_hash() */
+} t_whitelist_domain;
+
+static uint32_t whitelist_hash(uint32_t, char);
+static const t_whitelist_domain *whitelist_find(const char *, size_t, uint32_t);
+
+/** @internal
+ * Open addressing table of the domains, at most half full. Filled by
+ * whitelist_load() while the configuration is read, before any thread
+ * looks it up.
+ */
+static t_whitelist_domain *domains = NULL;
+static unsigned int domain_slots = 0;
+
+/** @internal
+ * Hashes one more character of a name read backwards, FNV-1a style,
+ * ignoring case. The hash of a name starts from 2166136261.
+ */
+static uint32_t
+whitelist_hash(uint32_t hash, char c)
+{
+    return (hash ^ (unsigned char)tolower((unsigned char)c)) * 16777619u;
+}
+
+/** @internal
+ * Domain of the table equal to a name, NULL if there is none
+ * @param name Name, in any case
+ * @param len Length of the name
+ * @param hash Hash of the name
+ */
+static const t_whitelist_domain *
+whitelist_find(const char *name, size_t len, uint32_t hash)
+{
+    unsigned int mask = domain_slots - 1, i;
+
+    if (0 == domain_slots)
+        return NULL;
+    for (i = hash & mask; NULL != domains[i].name; i = (i + 1) & mask) {
+        if (domains[i].hash == hash && domains[i].len == len && strncasecmp(domains[i].name, name, len) == 0)
+            return &domains[i];
+    }
+    return NULL;
+}
+
+/** Builds the whitelist from the destinations of the rules of a rule set.
+ * Those that are ipsets are left out.
+ * @param rules First rule of the rule set, NULL for an empty whitelist
+ */
+void
+whitelist_load(const t_firewall_rule * rules)
+{
+    const t_firewall_rule *rule;
+    unsigned int count = 0, i;
+    uint32_t hash;
+    size_t len;
+    char *name;
+
+    for (i = 0; i < domain_slots; i++)
+        free(domains[i].name);
+    free(domains);
+    domains = NULL;
+    domain_slots = 0;
+
+    for (rule = rules; NULL != rule; rule = rule->next)
+        count++;
+    if (0 == count)
+        return;
+    for (domain_slots = 16; domain_slots < 2 * count; domain_slots *= 2) ;
+    domains = safe_malloc(domain_slots * sizeof(t_whitelist_domain));
+
+    count = 0;
+    for (rule = rules; NULL != rule; rule = rule->next) {
+        if (rule->mask_is_ipset)
+            continue;
+        len = strlen(rule->mask);
+        hash = 2166136261u;
+        for (i = len; i > 0; i--)
+            hash = whitelist_hash(hash, rule->mask[i - 1]);
+        if (NULL != whitelist_find(rule->mask, len, hash))
+            continue;
+
+        name = safe_strdup(rule->mask);
+        for (i = 0; i < len; i++)
+            name[i] = tolower((unsigned char)name[i]);
+        for (i = hash & (domain_slots - 1); NULL != domains[i].name; i = (i + 1) & (domain_slots - 1)) ;
+        domains[i].name = name;
+        domains[i].len = len;
+        domains[i].hash = hash;
+        count++;
+    }
+    debug(LOG_DEBUG, "Whitelist holds %u domains", count);
+}
+
+/** Tells whether a host is whitelisted, in one pass over it. A host both
+ * whitelisted and the subdomain of a whitelisted domain is a domain.
+ * @param host Host name the client asked for, in any case
+ * @return WHITELIST_DOMAIN, WHITELIST_SUBDOMAIN or WHITELIST_NONE
+ */
+t_whitelist_match
+whitelist_match(const char *host)
+{
+    size_t len = strlen(host), i;
+    uint32_t hash = 2166136261u;
+    int subdomain = 0;
+
+    if (0 == domain_slots)
+        return WHITELIST_NONE;
+
+    for (i = len; i > 0; i--) {
+        hash = whitelist_hash(hash, host[i - 1]);
+        /* host + i - 1 is a suffix starting after a dot */
+        if (i > 1 && '.' == host[i - 2] && !subdomain)
+            subdomain = NULL != whitelist_find(host + i - 1, len - i + 1, hash);
+    }
+    if (NULL != whitelist_find(host, len, hash))
+        return WHITELIST_DOMAIN;
+    return subdomain ? WHITELIST_SUBDOMAIN : WHITELIST_NONE;
+}
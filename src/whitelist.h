@@ -0,0 +1,44 @@
+/* vim: set et sw=4 ts=4 sts=4 : */
+/********************************************************************\
+ * This program is free software; you can redistribute it and/or    *
+ * modify it under the terms of the GNU General Public License as   *
+ * published by the Free Software Foundation; either version 2 of   *
+ * the License, or (at your option) any later version.              *
+ *                                                                  *
+ * This program is distributed in the hope that it will be useful,  *
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of   *
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the    *
+ * GNU General Public License for more details.                     *
+ *                                                                  *
+ * You should have received a copy of the GNU General Public License*
+ * along with this program; if not, contact:                        *
+ *                                                                  *
+ * Free Software Foundation           Voice:  +1-617-542-5942       *
+ * 59 Temple Place - Suite 330        Fax:    +1-617-542-2652       *
+ * Boston, MA  02111-1307,  USA       gnu@gnu.org                   *
+ *                                                                  *
+\********************************************************************/
+
+/** @file whitelist.h
+    @brief Hosts of the global rule set, for the captive portal
+*/
+
+#ifndef _WHITELIST_H_
+#define _WHITELIST_H_
+
+#include "conf.h"
+
+/** How a host relates to the whitelist, see whitelist_match() */
+typedef enum {
+    WHITELIST_NONE,             /**< Not whitelisted */
+    WHITELIST_DOMAIN,           /**< A whitelisted domain itself */
+    WHITELIST_SUBDOMAIN         /**< A subdomain of a whitelisted domain */
+} t_whitelist_match;
+
+/** @brief Build the whitelist from the destinations of a rule set */
+void whitelist_load(const t_firewall_rule *);
+
+/** @brief Tell whether a host is whitelisted */
+t_whitelist_match whitelist_match(const char *);
+
+#endif                          /* _WHITELIST_H_ */